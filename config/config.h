@@ -6,6 +6,13 @@
 /** Define the path where the files will be received */
 #define RECEIVING_PATH "/home/dpredusel/receive"
 
+/**
+ * The tree the peers may pull from and query (receive, list, stat, du): a
+ * requested path must be in it once its links and ".." are resolved, the
+ * others are refused. Without it nothing is served
+ */
+#define SERVE_ROOT "/home/dpredusel"
+
 /** The port used for TCP/IP conections */
 #define PORT 8899
 
@@ -14,3 +21,258 @@
 
 /** While sending a file, choose if the sending percentage is printed or not */
 #define PRINT_PERCENTAGE
+
+/** The bandwidth limits in bytes per second, 0 means unlimited (adjustable with the "rate" command) */
+#define PACING_GLOBAL_RATE      0
+#define PACING_INTERACTIVE_RATE 0
+#define PACING_BULK_RATE        0
+#define PACING_SCAVENGER_RATE   0
+
+/** The priority class of a transfer when none is given (QOS_INTERACTIVE, QOS_BULK or QOS_SCAVENGER) */
+#define DEFAULT_QOS_CLASS QOS_BULK
+
+/** The file where the submitted transfer jobs are kept until they are done */
+#define JOB_SPOOL_PATH "/home/dpredusel/.file_transfer.spool"
+
+/**
+ * Remember what was sent to each peer from each source tree (one index file per
+ * pair in SEND_INDEX_PATH): a file whose size, mtime and inode did not change
+ * since it was sent is not sent again. The files removed on the peer since are
+ * not restored, leave it undefined to send everything every time.
+ */
+/* #define SEND_INDEX_ENABLED */
+#define SEND_INDEX_PATH "/home/dpredusel/.file_transfer.index"
+
+/**
+ * The rules of what is left out of the sent trees, one per line: "- pattern"
+ * leaves out the entries it matches (a directory with all it has, it is not
+ * even read), "+ pattern" keeps them, the first matching rule wins. A pattern
+ * ending with '/' only matches directories, one with another '/' is matched
+ * against the path from the root of the sent tree. No file, no rules.
+ *   - .git/
+ *   - node_modules/
+ *   - *.o
+ */
+#define SEND_FILTER_PATH "/home/dpredusel/.file_transfer.filter"
+
+/** How many submitted jobs run at the same time */
+#define JOB_CONCURRENCY 4
+
+/**
+ * A queued job climbs a priority class every JOB_AGING seconds it waits, and
+ * once past the top one it goes before the fresh jobs, the oldest first: the
+ * large and the scavenger jobs are delayed, never starved
+ */
+#define JOB_AGING 300
+
+/**
+ * Serve the incoming transfers on the epoll event engine (non blocking sockets,
+ * a reactor per core) instead of a blocking transfer at a time.
+ * The engine accepts the pushes without asking for permission. It asks
+ * nothing for the pulls and the queries either, so it serves them only to
+ * the addresses of ENGINE_SERVE_ALLOW (comma separated, "" for nobody).
+ * The reactors never wait for the disk: opening and creating the files,
+ * mapping their extents, writing their data and walking a tree for a query
+ * are jobs of ENGINE_WORKERS threads, a connection sleeping until its job is
+ * done. Only sendfile(2) reads the disk on a reactor, a megabyte at most per
+ * connection and wakeup.
+ */
+/* #define EVENT_ENGINE_ENABLED */
+#define ENGINE_SERVE_ALLOW ""
+
+/** The number of engine reactor threads, 0 means one per online core */
+#define ENGINE_THREADS 0
+
+/** The number of engine threads doing the disk work of the reactors */
+#define ENGINE_WORKERS 4
+
+/**
+ * Keep one multiplexed session per peer for the transfers started here: the
+ * pushes and the pulls run concurrently on it as streams. A peer without
+ * sessions gets a connection per transfer, as before.
+ */
+#define SESSIONS_ENABLED
+
+/** The flow control window of a session stream, in bytes */
+#define SESSION_WINDOW_SIZE (4 * 1024 * 1024)
+
+/** The largest file data frame of a session, the streams take turns at this grain */
+#define SESSION_CHUNK_SIZE (256 * 1024)
+
+/** How long a closed session waits for the peer to finish what it was sent, in seconds */
+#define SESSION_CLOSE_TIMEOUT 10
+
+/**
+ * Tune every connection from the RTT measured by its TCP handshake: socket
+ * buffers of twice the bandwidth delay product and TUNE_CONGESTION on the
+ * long links, TCP_NOTSENT_LOWAT on all of them
+ */
+#define SOCKET_AUTOTUNE_ENABLED
+
+/** The bottleneck bandwidth expected on the links, bytes per second (10 Gbit/s) */
+#define TUNE_LINK_RATE 1250000000ULL
+
+/** From this RTT (microseconds) a link is a long one, shorter links keep the kernel autotuning */
+#define TUNE_LONG_RTT 5000
+
+/** The largest socket buffer set by the autotuner */
+#define TUNE_MAX_BUFFER (128 * 1024 * 1024)
+
+/** The unsent bytes kept in a socket */
+#define TUNE_NOTSENT_LOWAT (512 * 1024)
+
+/** The congestion control of the long links, when the kernel has it */
+#define TUNE_CONGESTION "bbr"
+
+/**
+ * Send the large packets built in memory and the batches of small files
+ * with MSG_ZEROCOPY from a pool of buffers, recycled once the kernel reports
+ * their completion. It turns itself off on a connection where the kernel
+ * copies them anyway (loopback)
+ */
+#define ZEROCOPY_ENABLED
+
+/** The smallest packet sent with MSG_ZEROCOPY, the page pinning costs more than copying a smaller one */
+#define ZEROCOPY_MIN_SIZE (32 * 1024)
+
+/** The free buffers kept by the zerocopy pool of a connection, in bytes */
+#define ZEROCOPY_POOL_SIZE (16 * 1024 * 1024)
+
+/** The capacity asked for the splice pipes of the receiver, capped by /proc/sys/fs/pipe-max-size */
+#define PIPE_SIZE (1024 * 1024)
+
+/** The free splice pipes kept by a connection */
+#define PIPE_POOL_SIZE 8
+
+/**
+ * The chunk size of the sendfile() calls of a connection, and the size of the
+ * receiver's splice pipes (so of its splice() calls), are chosen by their
+ * throughput: a power of two from CHUNK_TUNE_MIN_SIZE to CHUNK_TUNE_MAX_SIZE
+ * for the sender and up to PIPE_SIZE for the receiver, starting from the
+ * largest. A sample is CHUNK_TUNE_SAMPLE bytes and 4 chunks at least, a size
+ * must be CHUNK_TUNE_GAIN percent faster to be kept, and the settled size's
+ * neighbours are probed again every CHUNK_TUNE_REPROBE samples. Without
+ * CHUNK_TUNE_ENABLED the largest sizes are used
+ */
+#define CHUNK_TUNE_ENABLED
+#define CHUNK_TUNE_MIN_SIZE (64 * 1024)
+#define CHUNK_TUNE_MAX_SIZE (16 * 1024 * 1024)
+#define CHUNK_TUNE_SAMPLE   (32 * 1024 * 1024)
+#define CHUNK_TUNE_GAIN     5
+#define CHUNK_TUNE_REPROBE  16
+
+/**
+ * The writer threads of a received transfer: the connection's thread only
+ * reads the socket, the files are created, written and closed by them in
+ * parallel. 0 writes the files from the connection's thread
+ */
+#define RECV_WRITER_THREADS 4
+
+/** The pipes of file data queued for the writer threads, PIPE_SIZE bytes each at most */
+#define RECV_WRITER_QUEUE 16
+
+/**
+ * A peer on this host which sees the same files (the same boot and mount
+ * namespace, told by the hello) gets the files of LOCAL_CLONE_MIN_SIZE bytes
+ * and more as their path: it clones them (FICLONE, an instant reflink on a
+ * copy on write file system, else copy_file_range()) and nothing goes through
+ * the socket. It clones only the files below LOCAL_CLONE_PATH which the
+ * peer's user (the owner of its socket) may reach and read by the permission
+ * bits of their directories and their own, the others are sent, read by the
+ * peer itself.
+ */
+#define LOCAL_CLONE_ENABLED
+#define LOCAL_CLONE_PATH "/home/dpredusel"
+
+/** Below this size a file is sent anyway, cheaper than asking the peer to clone it */
+#define LOCAL_CLONE_MIN_SIZE (64 * 1024)
+
+/**
+ * The processes of this host also connect to this Unix socket (send <path>
+ * <socket path>): the open files are passed to the server instead of their
+ * data, it copies them with the kernel. The processes of another user are
+ * asked for like the network connections
+ */
+#define UNIX_SOCKET_PATH "/home/dpredusel/.file_transfer.sock"
+
+/**
+ * A send to several addresses of the peer (send <path> 10.0.0.2,10.0.1.2) or
+ * from several local ones (MULTIPATH_SOURCES, a comma separated list, "" for
+ * none) goes on a connection per pair of addresses, MULTIPATH_MAX_PATHS at
+ * most: the i-th goes from the i-th source to the i-th peer address, the
+ * shorter list going round again. Each path sends the next file as soon as it
+ * is free, the files spread by the paths' throughput. On a single host, the
+ * loopback aliases (127.0.0.2, ...) make several paths
+ */
+#define MULTIPATH_ENABLED
+#define MULTIPATH_SOURCES ""
+#define MULTIPATH_MAX_PATHS 8
+
+/** The directories a receiver keeps open, the files are created relative to them */
+#define DIR_CACHE_SIZE 256
+
+/**
+ * When the received files are on disk for sure. They are written under a
+ * staging name and renamed once complete, then: DURABILITY_NONE leaves the
+ * write back to the kernel, DURABILITY_BATCH syncs COMMIT_BATCH files at a
+ * time (two syncfs() each batch), DURABILITY_FILE fsyncs every file and its
+ * directory
+ */
+#define RECV_DURABILITY DURABILITY_BATCH
+
+/** The complete files waiting for a sync before they get their names */
+#define COMMIT_BATCH 1024
+
+/**
+ * The directories read by the remote queries (list, stat, du) are kept in
+ * memory until inotify reports a change, up to DIR_INDEX_SIZE directories
+ * (one inotify watch each, see fs.inotify.max_user_watches) and
+ * DIR_INDEX_ENTRIES entries
+ */
+#define DIR_INDEX_SIZE 65536
+#define DIR_INDEX_ENTRIES (4 * 1024 * 1024)
+
+/**
+ * A watched source tree (watch command) sends what changed every
+ * WATCH_INTERVAL seconds, the whole tree again when more than
+ * WATCH_MAX_CHANGES paths changed meanwhile
+ */
+#define WATCH_INTERVAL 60
+#define WATCH_MAX_CHANGES 65536
+
+/**
+ * The files up to SEND_BATCH_MAX_FILE bytes are not sendfile()d one by one:
+ * their packets and data are gathered and several files go out with one
+ * writev(). 0 sends every file with sendfile(). tests/batch_bench.c gives
+ * the sizes where it pays, about 4x the files per second at 4 KiB and even
+ * with sendfile() from 32-64 KiB on loopback
+ */
+#define SEND_BATCH_MAX_FILE (64 * 1024)
+
+/**
+ * From this size a batched file is mapped instead of read into the batch
+ * buffer: on loopback the read and the mapping are even from 48-64 KiB, the
+ * copy of a larger file costs more than its mapping
+ */
+#define SEND_BATCH_MMAP_MIN (48 * 1024)
+
+/** The bytes gathered before a writev() */
+#define SEND_BATCH_SIZE (1024 * 1024)
+
+/** The iovecs of a writev(), IOV_MAX at most */
+#define SEND_BATCH_IOV 1024
+
+/**
+ * The kernel TLS transport, built with `make KTLS=1`: the certificate and the
+ * key this peer shows, the CA the peer's certificate must come from (both
+ * sides show one, comment KTLS_CA_FILE out to skip the verification) and the
+ * TLS 1.2 suites offered, the AES-GCM ones the kernel can take
+ */
+#define KTLS_CERT_FILE "/home/dpredusel/.file_transfer/cert.pem"
+#define KTLS_KEY_FILE  "/home/dpredusel/.file_transfer/key.pem"
+#define KTLS_CA_FILE   "/home/dpredusel/.file_transfer/ca.pem"
+#define KTLS_CIPHERS   "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+                       "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+
+/** Refuse the peers which can't encrypt instead of falling back to plaintext */
+/* #define KTLS_REQUIRED */
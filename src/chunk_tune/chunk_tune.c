@@ -0,0 +1,181 @@
+/**
+ * @file chunk_tune.c
+ * @brief The adaptive chunk size: a hill climb over the powers of two. The
+ *        throughput is sampled at the size in use, then at the next one up
+ *        or down; a faster one is kept and the climb goes on that way, a
+ *        slower one turns it around, and it settles when neither neighbour
+ *        is faster. A settled size is sampled again all along, its
+ *        neighbours are probed every CHUNK_TUNE_REPROBE samples.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#define CHUNK_TUNE_C
+#include "config.h"
+#include "data_types.h"
+#include "chunk_tune.h"
+
+/* internal constants */
+#define CHUNK_TUNE_MIN_SHIFT        12      /* a page */
+#define CHUNK_TUNE_SAMPLE_CHUNKS    4       /* the chunks of a sample, at least */
+
+/* internal functions' prototypes */
+static uint32_t size_shift(uint32_t size);
+static void     probe_next(chunk_tune_t *tune);
+static void     settle(chunk_tune_t *tune);
+
+/**
+ * Starts at start, the nearest power of two not above it. Without
+ * CHUNK_TUNE_ENABLED it stays there
+ */
+void chunk_tune_init(chunk_tune_t *tune, uint32_t min, uint32_t max, uint32_t start)
+{
+    memset(tune, 0, sizeof(chunk_tune_t));
+    tune->min_shift = size_shift(min);
+    tune->max_shift = size_shift(max);
+    if (tune->max_shift < tune->min_shift)
+        tune->max_shift = tune->min_shift;
+    tune->shift = size_shift(start);
+    if (tune->shift < tune->min_shift)
+        tune->shift = tune->min_shift;
+    if (tune->shift > tune->max_shift)
+        tune->shift = tune->max_shift;
+#ifndef CHUNK_TUNE_ENABLED
+    tune->min_shift = tune->max_shift = tune->shift;
+#endif /* CHUNK_TUNE_ENABLED */
+    tune->best_shift = tune->shift;
+    tune->direction = tune->shift == tune->max_shift ? -1 : 1;
+}
+
+uint32_t chunk_tune_size(const chunk_tune_t *tune)
+{
+    return (uint32_t) 1 << tune->shift;
+}
+
+/** The size it settled on last, 0 until it does */
+uint32_t chunk_tune_best(const chunk_tune_t *tune)
+{
+    return tune->reported_shift ? (uint32_t) 1 << tune->reported_shift : 0;
+}
+
+/** Nothing above max any more: the system would not give more (a pipe size) */
+void chunk_tune_limit(chunk_tune_t *tune, uint32_t max)
+{
+    uint32_t shift = size_shift(max);
+
+    if (shift >= tune->max_shift)
+        return;
+    tune->max_shift = shift;
+    if (tune->min_shift > shift)
+        tune->min_shift = shift;
+    if (tune->best_shift > shift) {
+        tune->best_shift = shift;
+        tune->best_rate = 0;
+    }
+    if (tune->shift > shift) {
+        tune->shift = shift;
+        tune->bytes = tune->ns = 0;
+    }
+}
+
+/**
+ * The bytes moved by a call of the chunk size, since start (CLOCK_MONOTONIC).
+ * The calls cut short by the end of the data are better left out. Returns 1
+ * when the size settled on is a new one, 0 otherwise
+ */
+int8_t chunk_tune_record(chunk_tune_t *tune, uint64_t bytes, const struct timespec *start)
+{
+    struct timespec now;
+    double          rate;
+
+    if (tune->min_shift == tune->max_shift)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    tune->ns += (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+    tune->bytes += bytes;
+    if (tune->bytes < CHUNK_TUNE_SAMPLE || tune->bytes < ((uint64_t) CHUNK_TUNE_SAMPLE_CHUNKS << tune->shift))
+        return 0;
+    rate = tune->bytes * 1e9 / (tune->ns ? tune->ns : 1);
+    tune->bytes = tune->ns = 0;
+
+    if (tune->shift == tune->best_shift) {
+        /* the probes are compared to a fresh sample of the best one */
+        tune->best_rate = rate;
+        if (tune->settled && ++tune->samples < CHUNK_TUNE_REPROBE)
+            return 0;
+        tune->settled = 0;
+        tune->turned = 0;
+        probe_next(tune);
+    }
+    else if (rate > tune->best_rate * (1.0 + CHUNK_TUNE_GAIN / 100.0)) {
+        /* on that way, the one it came from is slower */
+        tune->best_shift = tune->shift;
+        tune->best_rate = rate;
+        tune->turned = 1;
+        probe_next(tune);
+    }
+    else if (!tune->turned) {
+        tune->turned = 1;
+        tune->direction = -tune->direction;
+        probe_next(tune);
+    }
+    else {
+        settle(tune);
+    }
+
+    if (tune->settled && tune->best_shift != tune->reported_shift) {
+        tune->reported_shift = tune->best_shift;
+        return 1;
+    }
+    return 0;
+}
+
+/** The throughput of the best size, bytes per second (0 before the first sample) */
+double chunk_tune_rate(const chunk_tune_t *tune)
+{
+    return tune->best_rate;
+}
+
+/** the largest power of two not above size, a page at least */
+static uint32_t size_shift(uint32_t size)
+{
+    uint32_t shift = CHUNK_TUNE_MIN_SHIFT;
+
+    while (shift < 31 && ((uint32_t) 1 << (shift + 1)) <= size)
+        ++shift;
+    return shift;
+}
+
+/** the neighbour of the best one on the way of the climb, or the other way at the end */
+static void probe_next(chunk_tune_t *tune)
+{
+    int32_t next = (int32_t) tune->best_shift + tune->direction;
+
+    if (next < (int32_t) tune->min_shift || next > (int32_t) tune->max_shift) {
+        if (tune->turned) {
+            settle(tune);
+            return;
+        }
+        tune->turned = 1;
+        tune->direction = -tune->direction;
+        next = (int32_t) tune->best_shift + tune->direction;
+        if (next < (int32_t) tune->min_shift || next > (int32_t) tune->max_shift) {
+            settle(tune);
+            return;
+        }
+    }
+    tune->shift = next;
+}
+
+static void settle(chunk_tune_t *tune)
+{
+    tune->shift = tune->best_shift;
+    tune->settled = 1;
+    tune->samples = 0;
+}
+
+#undef CHUNK_TUNE_C
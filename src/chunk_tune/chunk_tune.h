@@ -0,0 +1,49 @@
+/**
+ * @file chunk_tune.h
+ * @brief The adaptive chunk size header
+ */
+
+#ifndef CHUNK_TUNE_H
+#define CHUNK_TUNE_H
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "data_types.h"
+
+#ifdef CHUNK_TUNE_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* CHUNK_TUNE_C */
+
+/**
+ * The chunk size of a connection's sendfile() or splice() calls, a power of
+ * two between min and max: the throughput is sampled at a size and at its
+ * neighbours, it settles on the fastest and probes again from time to time
+ */
+typedef struct {
+    uint32_t    min_shift;
+    uint32_t    max_shift;
+    uint32_t    shift;              /* the size in use, 1 << shift */
+    uint32_t    best_shift;         /* the fastest one known */
+    double      best_rate;          /* bytes per second, sampled at best_shift */
+    int8_t      direction;          /* where the next probe goes, +1 or -1 */
+    int8_t      turned;             /* this round probed both ways already */
+    int8_t      settled;
+    uint32_t    samples;            /* at best_shift since it settled */
+    uint32_t    reported_shift;     /* the last settled size told, 0 for none */
+    uint64_t    bytes;              /* of the sample being taken */
+    uint64_t    ns;
+} chunk_tune_t;
+
+/* chunk tune functions */
+EXTERN void     chunk_tune_init(chunk_tune_t *tune, uint32_t min, uint32_t max, uint32_t start);
+EXTERN uint32_t chunk_tune_size(const chunk_tune_t *tune);
+EXTERN uint32_t chunk_tune_best(const chunk_tune_t *tune);
+EXTERN void     chunk_tune_limit(chunk_tune_t *tune, uint32_t max);
+EXTERN int8_t   chunk_tune_record(chunk_tune_t *tune, uint64_t bytes, const struct timespec *start);
+EXTERN double   chunk_tune_rate(const chunk_tune_t *tune);
+
+#undef EXTERN
+#endif /* CHUNK_TUNE_H */
@@ -0,0 +1,308 @@
+/**
+ * @file clone_file_linux.c
+ * @brief Duplicates a local file without a trip through user space:
+ *        hardlink, reflink (FICLONE) or in kernel copy (copy_file_range).
+ *        The paths are relative to directory descriptors (or AT_FDCWD),
+ *        the files of a local peer are opened confined to a directory
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+
+#include "config.h"
+#include "error.h"
+
+#define CLONE_FILE_C
+#include "clone_file_linux.h"
+
+/* internal functions' prototypes */
+static int32_t peer_uid(int32_t sock_desc, uid_t *uid);
+static int32_t tcp_owner(const char *table, const char *local, const char *peer, uid_t *uid);
+static int8_t  peer_may(const struct stat *stat_buf, uid_t uid, const gid_t *groups, int groups_cnt,
+                        mode_t user_bit, mode_t group_bit, mode_t other_bit);
+
+int32_t clone_file_linux(int32_t src_dir, const char *src_path, int32_t dst_dir, const char *dst_path)
+{
+    int32_t src_desc;
+    int32_t s;
+    
+    if ( (src_desc = openat(src_dir, src_path, O_RDONLY|O_CLOEXEC)) == -1) {
+        ERROR("open", src_path, ERROR_OS);
+        return -1;
+    }
+    s = clone_file_from_linux(src_desc, dst_dir, dst_path);
+    close(src_desc);
+    return s;
+}
+
+/** The same from an open file, src_desc is left open */
+int32_t clone_file_from_linux(int32_t src_desc, int32_t dst_dir, const char *dst_path)
+{
+    int32_t     dst_desc = -1;
+    struct stat stat_buf;
+    int64_t     copied;
+    uint64_t    remaining;
+    
+    if (fstat(src_desc, &stat_buf) == -1) {
+        ERROR("fstat", dst_path, ERROR_OS);
+        return -1;
+    }
+    if ( (dst_desc = openat(dst_dir, dst_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, stat_buf.st_mode & 0777)) == -1) {
+        ERROR("open", dst_path, ERROR_OS);
+        return -1;
+    }
+    
+    /* on a copy on write file system the copy is an instant reflink */
+    if (ioctl(dst_desc, FICLONE, src_desc) == 0)
+        goto success;
+    errno = 0;
+    
+    /* else the kernel copies the data (and may still share the blocks) */
+    remaining = stat_buf.st_size;
+    while (remaining > 0) {
+        copied = copy_file_range(src_desc, NULL, dst_desc, NULL, remaining, 0);
+        if (copied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            /* old kernels: copy_file_range works only inside a file system */
+            errno = 0;
+            copied = sendfile(dst_desc, src_desc, NULL, remaining);
+        }
+        if (copied == -1) {
+            ERROR("copy_file_range", dst_path, ERROR_OS);
+            goto error;
+        }
+        /* the source was truncated meanwhile, the copy is short */
+        if (copied == 0) {
+            ERROR("copy_file_range", "the source file was truncated", ERROR_APP);
+            goto error;
+        }
+        remaining -= copied;
+    }
+    
+ success:
+    close(dst_desc);
+    return 0;
+    
+ error:
+    close(dst_desc);
+    return -1;
+}
+
+/**
+ * Opens the absolute path for reading if it is below root, without following
+ * a link or a ".." out of it. Returns -1 (errno set, nothing printed) otherwise
+ */
+int32_t clone_file_open_beneath_linux(const char *root, const char *path)
+{
+    struct open_how how;
+    uint32_t        root_len = strlen(root);
+    int32_t         root_desc;
+    int32_t         file_desc;
+    
+    while (root_len > 1 && root[root_len - 1] == '/')
+        --root_len;
+    if (strncmp(path, root, root_len) || path[root_len] != '/') {
+        errno = EXDEV;
+        return -1;
+    }
+    if ( (root_desc = open(root, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1)
+        return -1;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NONBLOCK;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    file_desc = syscall(SYS_openat2, root_desc, &path[root_len + 1], &how, sizeof(how));
+    close(root_desc);
+    return file_desc;
+}
+
+/**
+ * Whether the user of the peer on this host (the owner of its end of the
+ * connection) may read the open file, by the permission bits: it must search
+ * each directory of the file's path and read the file. The server clones
+ * what the peer asks for with its own rights. 0 when it may not or can't be
+ * told, the peer sends the data it reads itself then
+ */
+int8_t clone_file_peer_may_read_linux(int32_t sock_desc, int32_t file_desc, const struct stat *stat_buf)
+{
+    struct passwd   pw;
+    struct passwd   *pw_found;
+    char            pw_buf[4096];
+    char            link[64];
+    char            path[PATH_MAX];
+    struct stat     dir_stat;
+    gid_t           *groups;
+    int             groups_cnt = 0;
+    ssize_t         len;
+    int8_t          s;
+    uid_t           uid;
+    
+    if (peer_uid(sock_desc, &uid) == -1)
+        return 0;
+    if (uid == 0)
+        return 1;
+    /* the path the file was opened by, the links resolved */
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", file_desc);
+    if ( (len = readlink(link, path, sizeof(path) - 1)) <= 0 || path[0] != '/')
+        return 0;
+    path[len] = '\0';
+    
+    /* the user's groups, the primary one included */
+    if (getpwuid_r(uid, &pw, pw_buf, sizeof(pw_buf), &pw_found) != 0 || !pw_found)
+        return 0;
+    getgrouplist(pw.pw_name, pw.pw_gid, NULL, &groups_cnt);
+    if (!(groups = (gid_t *) malloc((groups_cnt + 1) * sizeof(gid_t)))) {
+        ERROR("malloc", "", ERROR_OS);
+        return 0;
+    }
+    if (getgrouplist(pw.pw_name, pw.pw_gid, groups, &groups_cnt) == -1)
+        groups_cnt = 0;
+    
+    /* "/", "/a", "/a/b" ... down to the file's directory */
+    s = 1;
+    for (char *slash = path; s && slash; slash = strchr(slash + 1, '/')) {
+        char c = slash[slash == path];
+        
+        slash[slash == path] = '\0';
+        s = stat(path, &dir_stat) == 0 && S_ISDIR(dir_stat.st_mode) &&
+            peer_may(&dir_stat, uid, groups, groups_cnt, S_IXUSR, S_IXGRP, S_IXOTH);
+        slash[slash == path] = c;
+    }
+    if (s)
+        s = peer_may(stat_buf, uid, groups, groups_cnt, S_IRUSR, S_IRGRP, S_IROTH);
+    free(groups);
+    errno = 0;
+    return s;
+}
+
+int32_t link_or_clone_file_linux(int32_t src_dir, const char *src_path, int32_t dst_dir, const char *dst_path)
+{
+    struct stat src_stat;
+    struct stat dst_stat;
+    
+    if (linkat(src_dir, src_path, dst_dir, dst_path, 0) == 0)
+        return 0;
+    
+    if (errno == EEXIST) {
+        /* received before, nothing to do if it is already the same file */
+        if (fstatat(src_dir, src_path, &src_stat, 0) == 0 && fstatat(dst_dir, dst_path, &dst_stat, 0) == 0 &&
+            src_stat.st_dev == dst_stat.st_dev && src_stat.st_ino == dst_stat.st_ino) {
+            errno = 0;
+            return 0;
+        }
+        if (unlinkat(dst_dir, dst_path, 0) == -1) {
+            ERROR("unlink", dst_path, ERROR_OS);
+            return -1;
+        }
+        if (linkat(src_dir, src_path, dst_dir, dst_path, 0) == 0)
+            return 0;
+    }
+    /* the receiving file system can't link these two, copy the data locally */
+    if (errno == EXDEV || errno == EPERM || errno == EMLINK || errno == EOPNOTSUPP) {
+        errno = 0;
+        return clone_file_linux(src_dir, src_path, dst_dir, dst_path);
+    }
+    ERROR("link", dst_path, ERROR_OS);
+    return -1;
+}
+
+/** The bit of the class the user falls in, owner, group or the others */
+static int8_t peer_may(const struct stat *stat_buf, uid_t uid, const gid_t *groups, int groups_cnt,
+                       mode_t user_bit, mode_t group_bit, mode_t other_bit)
+{
+    if (stat_buf->st_uid == uid)
+        return (stat_buf->st_mode & user_bit) != 0;
+    for (int i = 0; i < groups_cnt; ++i)
+        if (groups[i] == stat_buf->st_gid)
+            return (stat_buf->st_mode & group_bit) != 0;
+    return (stat_buf->st_mode & other_bit) != 0;
+}
+
+/**
+ * The user owning the peer's end of the connection: told by the kernel on a
+ * Unix socket, found in /proc/net/tcp (tcp6) for a loopback connection
+ */
+static int32_t peer_uid(int32_t sock_desc, uid_t *uid)
+{
+    struct sockaddr_storage local_addr;
+    struct sockaddr_storage peer_addr;
+    socklen_t               len = sizeof(local_addr);
+    struct ucred            cred;
+    char                    local[64];
+    char                    peer[64];
+    
+    if (getsockname(sock_desc, (struct sockaddr *) &local_addr, &len) == -1)
+        return -1;
+    len = sizeof(peer_addr);
+    if (getpeername(sock_desc, (struct sockaddr *) &peer_addr, &len) == -1)
+        return -1;
+    if (peer_addr.ss_family == AF_UNIX) {
+        len = sizeof(cred);
+        if (getsockopt(sock_desc, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+            return -1;
+        *uid = cred.uid;
+        return 0;
+    }
+    /* the addresses as the kernel prints them, the words in host order */
+    if (peer_addr.ss_family == AF_INET) {
+        struct sockaddr_in *l = (struct sockaddr_in *) &local_addr;
+        struct sockaddr_in *p = (struct sockaddr_in *) &peer_addr;
+        
+        snprintf(local, sizeof(local), "%08X:%04X", l->sin_addr.s_addr, ntohs(l->sin_port));
+        snprintf(peer, sizeof(peer), "%08X:%04X", p->sin_addr.s_addr, ntohs(p->sin_port));
+        return tcp_owner("/proc/net/tcp", local, peer, uid);
+    }
+    if (peer_addr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *l = (struct sockaddr_in6 *) &local_addr;
+        struct sockaddr_in6 *p = (struct sockaddr_in6 *) &peer_addr;
+        
+        snprintf(local, sizeof(local), "%08X%08X%08X%08X:%04X", l->sin6_addr.s6_addr32[0],
+                 l->sin6_addr.s6_addr32[1], l->sin6_addr.s6_addr32[2], l->sin6_addr.s6_addr32[3],
+                 ntohs(l->sin6_port));
+        snprintf(peer, sizeof(peer), "%08X%08X%08X%08X:%04X", p->sin6_addr.s6_addr32[0],
+                 p->sin6_addr.s6_addr32[1], p->sin6_addr.s6_addr32[2], p->sin6_addr.s6_addr32[3],
+                 ntohs(p->sin6_port));
+        return tcp_owner("/proc/net/tcp6", local, peer, uid);
+    }
+    return -1;
+}
+
+/** The owner of the socket bound to peer and connected to local, in the table */
+static int32_t tcp_owner(const char *table, const char *local, const char *peer, uid_t *uid)
+{
+    FILE        *file;
+    char        line[512];
+    char        bound[64];
+    char        connected[64];
+    unsigned    owner;
+    int32_t     s = -1;
+    
+    if (!(file = fopen(table, "r")))
+        return -1;
+    while (s == -1 && fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "%*s %63s %63s %*s %*s %*s %*s %u", bound, connected, &owner) == 3 &&
+            !strcmp(bound, peer) && !strcmp(connected, local)) {
+            *uid = owner;
+            s = 0;
+        }
+    }
+    fclose(file);
+    return s;
+}
+
+#undef CLONE_FILE_C
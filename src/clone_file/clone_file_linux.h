@@ -0,0 +1,20 @@
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#ifndef CLONE_FILE_H
+#define CLONE_FILE_H
+
+#ifdef CLONE_FILE_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* CLONE_FILE_C */
+
+EXTERN int32_t clone_file_linux(int32_t src_dir, const char *src_path, int32_t dst_dir, const char *dst_path);
+EXTERN int32_t clone_file_from_linux(int32_t src_desc, int32_t dst_dir, const char *dst_path);
+EXTERN int32_t clone_file_open_beneath_linux(const char *root, const char *path);
+EXTERN int8_t  clone_file_peer_may_read_linux(int32_t sock_desc, int32_t file_desc, const struct stat *stat_buf);
+EXTERN int32_t link_or_clone_file_linux(int32_t src_dir, const char *src_path, int32_t dst_dir, const char *dst_path);
+
+#undef EXTERN
+#endif /* CLONE_FILE_H */
@@ -0,0 +1,311 @@
+/**
+ * @file commit.c
+ * @brief The received files are written under a staging name and renamed to
+ *        their own once complete: a crash or an aborted transfer never
+ *        leaves a half written file that looks complete. With the batch
+ *        durability the data of COMMIT_BATCH files is synced with one
+ *        syncfs(), they are renamed, and one more syncfs() makes the names
+ *        durable: two syncs for thousands of files instead of an fsync()
+ *        each.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif /* UNIX */
+
+#define COMMIT_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "commit.h"
+#ifdef LINUX
+#include "clone_file_linux.h"
+#endif /* LINUX */
+
+/* internal constants */
+#define COMMIT_MAX_DEVICES  8           /* the file systems synced one by one in a batch */
+
+/* internal functions' prototypes */
+static int32_t commit_batch(commit_t *commit);
+static int32_t stage_entry(commit_t *commit, dir_entry_t *dir, const char *staged, const char *name);
+static int32_t sync_devices(int32_t *descs, uint32_t cnt, int8_t all);
+static int32_t rename_entry(commit_entry_t *entry);
+static int32_t sync_file(int32_t dir_desc, const char *staged, int32_t file_desc);
+
+/* internal variables */
+static uint32_t staged_cnt;            /* the staging names of all the transfers */
+
+commit_t *commit_create(dir_cache_t *dirs)
+{
+    commit_t *commit = (commit_t *) calloc(1, sizeof(commit_t));
+
+    if (!commit) {
+        ERROR("calloc", "", ERROR_OS);
+        return NULL;
+    }
+    commit->dirs = dirs;
+    commit->mode = RECV_DURABILITY;
+    if (commit->mode == DURABILITY_BATCH &&
+        !(commit->entries = (commit_entry_t *) malloc(COMMIT_BATCH * sizeof(commit_entry_t)))) {
+        ERROR("malloc", "", ERROR_OS);
+        free(commit);
+        return NULL;
+    }
+    pthread_mutex_init(&commit->lock, NULL);
+    return commit;
+}
+
+void commit_stage_name(char staged[COMMIT_NAME_SIZE])
+{
+    /* hidden, and unique among the transfers of all the processes */
+    snprintf(staged, COMMIT_NAME_SIZE, ".ft-part.%d.%u", (int) getpid(), __sync_add_and_fetch(&staged_cnt, 1));
+}
+
+int32_t commit_file(commit_t *commit, dir_entry_t *dir, const char *staged, const char *name, int32_t file_desc)
+{
+    int32_t s = 0;
+
+    if (commit->mode == DURABILITY_NONE) {
+        if (renameat(dir->dir_desc, staged, dir->dir_desc, name) == -1) {
+            ERROR("renameat", name, ERROR_OS);
+            commit_discard(dir, staged);
+            return -1;
+        }
+        return 0;
+    }
+    if (commit->mode == DURABILITY_FILE) {
+        /* the data, the name, then the directory entry */
+        if (sync_file(dir->dir_desc, staged, file_desc) == -1) {
+            commit_discard(dir, staged);
+            return -1;
+        }
+        if (renameat(dir->dir_desc, staged, dir->dir_desc, name) == -1) {
+            ERROR("renameat", name, ERROR_OS);
+            commit_discard(dir, staged);
+            return -1;
+        }
+        if (fsync(dir->dir_desc) == -1) {
+            ERROR("fsync", name, ERROR_OS);
+            return -1;
+        }
+        return 0;
+    }
+
+    /* durability by batch: it waits under its staging name */
+    pthread_mutex_lock(&commit->lock);
+    if (commit->cnt == COMMIT_BATCH && commit_batch(commit) == -1)
+        s = -1;
+    if (stage_entry(commit, dir, staged, name) == -1) {
+        pthread_mutex_unlock(&commit->lock);
+        commit_discard(dir, staged);
+        return -1;
+    }
+    pthread_mutex_unlock(&commit->lock);
+    return s;
+}
+
+#ifdef LINUX
+int32_t commit_link(commit_t *commit, dir_entry_t *target_dir, const char *target_name,
+                    dir_entry_t *dir, const char *name)
+{
+    commit_entry_t  *entry = NULL;
+    char            staged[COMMIT_NAME_SIZE];
+    int32_t         s = 0;
+    uint32_t        i;
+
+    if (commit->mode != DURABILITY_BATCH)
+        return link_or_clone_file_linux(target_dir->dir_desc, target_name, dir->dir_desc, name);
+
+    pthread_mutex_lock(&commit->lock);
+    if (commit->cnt == COMMIT_BATCH && commit_batch(commit) == -1)
+        s = -1;
+    for (i = commit->cnt; i > 0 && !entry; --i)
+        if (commit->entries[i - 1].dir == target_dir && !strcmp(commit->entries[i - 1].name, target_name))
+            entry = &commit->entries[i - 1];
+    if (!entry) {
+        /* renamed already */
+        pthread_mutex_unlock(&commit->lock);
+        if (link_or_clone_file_linux(target_dir->dir_desc, target_name, dir->dir_desc, name) == -1)
+            return -1;
+        return s;
+    }
+
+    /* the target waits in the batch: the link waits with it, no sync for it */
+    commit_stage_name(staged);
+    if (link_or_clone_file_linux(target_dir->dir_desc, entry->staged, dir->dir_desc, staged) == -1) {
+        pthread_mutex_unlock(&commit->lock);
+        return -1;
+    }
+    if (stage_entry(commit, dir, staged, name) == -1) {
+        pthread_mutex_unlock(&commit->lock);
+        commit_discard(dir, staged);
+        return -1;
+    }
+    pthread_mutex_unlock(&commit->lock);
+    return s;
+}
+#endif /* LINUX */
+
+void commit_discard(dir_entry_t *dir, const char *staged)
+{
+    if (unlinkat(dir->dir_desc, staged, 0) == -1 && errno != ENOENT)
+        ERROR("unlinkat", staged, ERROR_OS);
+    errno = 0;
+}
+
+int32_t commit_flush(commit_t *commit)
+{
+    int32_t s;
+
+    if (!commit)
+        return 0;
+    pthread_mutex_lock(&commit->lock);
+    s = commit_batch(commit);
+    pthread_mutex_unlock(&commit->lock);
+    return s;
+}
+
+void commit_destroy(commit_t *commit)
+{
+    if (!commit)
+        return;
+    /* the complete files of an aborted transfer are kept */
+    commit_batch(commit);
+    pthread_mutex_destroy(&commit->lock);
+    free(commit->entries);
+    free(commit);
+}
+
+static int32_t commit_batch(commit_t *commit)
+{
+    int32_t     descs[COMMIT_MAX_DEVICES];
+    dev_t       devs[COMMIT_MAX_DEVICES];
+    uint32_t    devs_cnt = 0;
+    dir_entry_t *last = NULL;
+    struct stat stat_buf;
+    int8_t      all = 0;
+    int32_t     s = 0;
+    uint32_t    i, j;
+
+    if (commit->cnt == 0)
+        return 0;
+    /* a descriptor on each file system of the batch, nearly always the same one */
+    for (i = 0; i < commit->cnt && !all; ++i) {
+        if (commit->entries[i].dir == last)
+            continue;
+        last = commit->entries[i].dir;
+        if (fstat(last->dir_desc, &stat_buf) == -1) {
+            ERROR("fstat", last->path, ERROR_OS);
+            all = 1;
+            break;
+        }
+        for (j = 0; j < devs_cnt && devs[j] != stat_buf.st_dev; ++j)
+            ;
+        if (j == devs_cnt) {
+            /* too many of them, everything is synced */
+            if (devs_cnt == COMMIT_MAX_DEVICES)
+                all = 1;
+            else {
+                devs[devs_cnt] = stat_buf.st_dev;
+                descs[devs_cnt++] = last->dir_desc;
+            }
+        }
+    }
+
+    /* the data first, the names can't point to what is not on disk yet: none of them then */
+    if (sync_devices(descs, devs_cnt, all) == -1) {
+        for (i = 0; i < commit->cnt; ++i)
+            commit_discard(commit->entries[i].dir, commit->entries[i].staged);
+        commit->syncs += all ? 1 : devs_cnt;
+        s = -1;
+    }
+    else {
+        for (i = 0; i < commit->cnt; ++i)
+            if (rename_entry(&commit->entries[i]) == -1)
+                s = -1;
+        if (sync_devices(descs, devs_cnt, all) == -1)
+            s = -1;
+        commit->syncs += all ? 2 : 2 * devs_cnt;
+        commit->committed += commit->cnt;
+    }
+
+    for (i = 0; i < commit->cnt; ++i) {
+        dir_cache_put(commit->dirs, commit->entries[i].dir);
+        free(commit->entries[i].name);
+    }
+    commit->cnt = 0;
+    return s;
+}
+
+static int32_t stage_entry(commit_t *commit, dir_entry_t *dir, const char *staged, const char *name)
+{
+    commit_entry_t *entry = &commit->entries[commit->cnt];
+
+    if (!(entry->name = strdup(name))) {
+        ERROR("strdup", "", ERROR_OS);
+        return -1;
+    }
+    memcpy(entry->staged, staged, COMMIT_NAME_SIZE);
+    entry->dir = dir;
+    dir_cache_get(commit->dirs, dir);
+    ++commit->cnt;
+    return 0;
+}
+
+static int32_t sync_devices(int32_t *descs, uint32_t cnt, int8_t all)
+{
+    int32_t s = 0;
+
+#ifdef LINUX
+    if (!all) {
+        for (uint32_t i = 0; i < cnt; ++i) {
+            if (syncfs(descs[i]) == -1) {
+                ERROR("syncfs", "", ERROR_OS);
+                s = -1;
+            }
+        }
+        return s;
+    }
+#endif /* LINUX */
+    sync();
+    return s;
+}
+
+static int32_t rename_entry(commit_entry_t *entry)
+{
+    if (renameat(entry->dir->dir_desc, entry->staged, entry->dir->dir_desc, entry->name) == -1) {
+        ERROR("renameat", entry->name, ERROR_OS);
+        commit_discard(entry->dir, entry->staged);
+        return -1;
+    }
+    return 0;
+}
+
+static int32_t sync_file(int32_t dir_desc, const char *staged, int32_t file_desc)
+{
+    int32_t s;
+    int32_t desc = file_desc;
+
+    /* the writer may have closed it already */
+    if (desc == -1 && (desc = openat(dir_desc, staged, O_RDONLY|O_CLOEXEC)) == -1) {
+        ERROR("openat", staged, ERROR_OS);
+        return -1;
+    }
+    if ( (s = fsync(desc)) == -1)
+        ERROR("fsync", staged, ERROR_OS);
+    if (desc != file_desc)
+        close(desc);
+    return s;
+}
+
+#undef COMMIT_C
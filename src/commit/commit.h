@@ -0,0 +1,62 @@
+/**
+ * @file commit.h
+ * @brief The staged files commit header
+ */
+
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "data_types.h"
+#include "dir_cache.h"
+
+#ifdef COMMIT_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* COMMIT_C */
+
+/** ".ft-part.<pid>.<counter>" */
+#define COMMIT_NAME_SIZE    40
+
+/** when the received files are on the disk for sure */
+typedef enum {
+    DURABILITY_NONE        = 0,         /* renamed when complete, the kernel writes them back some day */
+    DURABILITY_BATCH       = 1,         /* synced and renamed COMMIT_BATCH files at a time */
+    DURABILITY_FILE        = 2          /* synced and renamed one by one */
+} durability_t;
+
+/** a complete file waiting under its staging name */
+typedef struct {
+    dir_entry_t         *dir;           /* held until renamed */
+    char                staged[COMMIT_NAME_SIZE];
+    char                *name;
+} commit_entry_t;
+
+/** the files of a transfer, renamed to their names once on disk */
+typedef struct commit {
+    dir_cache_t         *dirs;
+    durability_t        mode;
+    commit_entry_t      *entries;
+    uint32_t            cnt;
+    uint64_t            committed;
+    uint64_t            syncs;
+    pthread_mutex_t     lock;
+} commit_t;
+
+/* commit functions */
+EXTERN commit_t *commit_create(dir_cache_t *dirs);
+EXTERN void     commit_stage_name(char staged[COMMIT_NAME_SIZE]);
+EXTERN int32_t  commit_file(commit_t *commit, dir_entry_t *dir, const char *staged, const char *name, int32_t file_desc);
+#ifdef LINUX
+EXTERN int32_t  commit_link(commit_t *commit, dir_entry_t *target_dir, const char *target_name,
+                            dir_entry_t *dir, const char *name);
+#endif /* LINUX */
+EXTERN void     commit_discard(dir_entry_t *dir, const char *staged);
+EXTERN int32_t  commit_flush(commit_t *commit);
+EXTERN void     commit_destroy(commit_t *commit);
+
+#undef EXTERN
+#endif /* COMMIT_H */
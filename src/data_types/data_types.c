@@ -5,8 +5,10 @@
 #include <errno.h>
 
 #ifdef UNIX
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #endif /* UNIX */
 
 #define DATA_TYPES_C
@@ -16,6 +18,7 @@
 
 /* internal functions' prototypes */
 inline static uint32_t char_to_uint32(char *buff);
+static ssize_t recv_header(SOCKET sock_desc, char *header, int recv_flags, int32_t *file_desc);
 
 int8_t send_packet(SOCKET sock_desc, char *buff, uint32_t size, flag_t flags)
 {
@@ -45,7 +48,71 @@ int8_t send_packet(SOCKET sock_desc, char *buff, uint32_t size, flag_t flags)
     return 0;
 }
 
+#ifdef UNIX
+/** send_packet() with an open file passed along (SCM_RIGHTS), on a Unix socket */
+int8_t send_packet_fd(SOCKET sock_desc, char *buff, uint32_t size, flag_t flags, int32_t file_desc)
+{
+    char            header[NET_PACKET_HEADER_SIZE];
+    struct iovec    iov[2];
+    struct msghdr   msg;
+    struct cmsghdr  *cmsg;
+    union {
+        struct cmsghdr  align;
+        char            buf[CMSG_SPACE(sizeof(int32_t))];
+    } control;
+    ssize_t         sent;
+    
+    memcpy(header, &size, sizeof(size));
+    memcpy(&header[sizeof(size)], &flags, sizeof(flags));
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = buff;
+    iov[1].iov_len = size;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int32_t));
+    memcpy(CMSG_DATA(cmsg), &file_desc, sizeof(file_desc));
+    
+    /* the descriptor goes with the first byte, the header */
+    if ((sent = sendmsg(sock_desc, &msg, 0)) == -1) {
+        ERROR("sendmsg", "SCM_RIGHTS", ERROR_OS);
+        return -1;
+    }
+    if ((size_t) sent < sizeof(header)) {
+        if (send(sock_desc, &header[sent], sizeof(header) - sent, 0) == -1) {
+            ERROR("send", "", ERROR_OS);
+            return -1;
+        }
+        sent = sizeof(header);
+    }
+    for (sent -= sizeof(header); (uint32_t) sent < size; ) {
+        ssize_t s = send(sock_desc, &buff[sent], size - sent, 0);
+        if (s == -1) {
+            ERROR("send", "", ERROR_OS);
+            return -1;
+        }
+        sent += s;
+    }
+    return 0;
+}
+#endif /* UNIX */
+
 net_packet_t *recv_packet(SOCKET sock_desc, int recv_flags)
+{
+    return recv_packet_fd(sock_desc, recv_flags, NULL);
+}
+
+/**
+ * recv_packet() and the file passed with it (-1 for none) in file_desc,
+ * when not NULL
+ */
+net_packet_t *recv_packet_fd(SOCKET sock_desc, int recv_flags, int32_t *file_desc)
 {   
     net_packet_t *packet = (net_packet_t *) malloc(sizeof(net_packet_t));
     char         header[NET_PACKET_HEADER_SIZE + 1];
@@ -56,7 +123,8 @@ net_packet_t *recv_packet(SOCKET sock_desc, int recv_flags)
     memset(header, 0, sizeof(header));
     /* Receive the header */
     errno = 0;
-    if (recv(sock_desc, header, sizeof(header) - 1, recv_flags) <= 0) {
+    /* the next packets may be right behind it (CAP_BATCHED), a short read would lose sync */
+    if (recv_header(sock_desc, header, recv_flags | MSG_WAITALL, file_desc) <= 0) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             errno = 0;
             memset(header, 0, sizeof(header));
@@ -75,7 +143,7 @@ net_packet_t *recv_packet(SOCKET sock_desc, int recv_flags)
     /* Receive the data */
     errno = 0;
     while (remaining > 0) {
-        if ((recv_size = recv(sock_desc, data, packet->size, recv_flags)) <= 0) {
+        if ((recv_size = recv(sock_desc, data, remaining, recv_flags)) <= 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 errno = 0;
                 break;
@@ -93,6 +161,12 @@ net_packet_t *recv_packet(SOCKET sock_desc, int recv_flags)
     return packet;
     
  error:
+#ifdef UNIX
+    if (file_desc && *file_desc != -1) {
+        close(*file_desc);
+        *file_desc = -1;
+    }
+#endif /* UNIX */
     free(data);
     free(packet);
     return NULL;
@@ -106,6 +180,47 @@ void destroy_packet(net_packet_t *packet)
     packet = NULL;
 }
 
+static ssize_t recv_header(SOCKET sock_desc, char *header, int recv_flags, int32_t *file_desc)
+{
+#ifdef UNIX
+    struct iovec    iov = { header, NET_PACKET_HEADER_SIZE };
+    struct msghdr   msg;
+    struct cmsghdr  *cmsg;
+    union {
+        struct cmsghdr  align;
+        char            buf[CMSG_SPACE(4 * sizeof(int32_t))];
+    } control;
+    ssize_t         received;
+    
+    if (!file_desc)
+        return recv(sock_desc, header, NET_PACKET_HEADER_SIZE, recv_flags);
+    *file_desc = -1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    received = recvmsg(sock_desc, &msg, recv_flags | MSG_CMSG_CLOEXEC);
+    /* the first one is kept, a peer passing more gets them closed */
+    for (cmsg = received > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        for (uint32_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int32_t); ++i) {
+            int32_t passed;
+            
+            memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int32_t), sizeof(passed));
+            if (*file_desc == -1)
+                *file_desc = passed;
+            else
+                close(passed);
+        }
+    }
+    return received;
+#else
+    return recv(sock_desc, header, NET_PACKET_HEADER_SIZE, recv_flags);
+#endif /* UNIX */
+}
+
 inline static uint32_t char_to_uint32(char *buff)
 {
     uint32_t val;
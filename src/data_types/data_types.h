@@ -29,13 +29,29 @@ typedef enum {
     DIR_TYPE               = 0x020,
     SEND_OPERATION         = 0x040,
     RECEIVE_OPERATION      = 0x080,
-    FILE_SIZE              = 0x100
+    FILE_SIZE              = 0x100,
+    SPARSE_FILE            = 0x200,
+    EXTENT_MAP             = 0x400,
+    HARDLINK_TYPE          = 0x800,
+    SESSION_OPEN           = 0x1000,
+    STREAM_DATA            = 0x2000,
+    WINDOW_UPDATE          = 0x4000,
+    SESSION_CLOSE          = 0x8000,
+    PROTOCOL_HELLO         = 0x10000,
+    LIST_QUERY             = 0x20000,
+    STAT_QUERY             = 0x40000,
+    DU_QUERY               = 0x80000,
+    QUERY_REPLY            = 0x100000,
+    DELETE_TYPE            = 0x200000,
+    LOCAL_FILE             = 0x400000,
+    FILE_DESC              = 0x800000
 } communication_protocol_flags;
 
 typedef enum {
     SEND_BUF_SIZE          = 512,
     PATH_SIZE              = 1024,
-    NET_PACKET_HEADER_SIZE = sizeof(uint32_t) + sizeof(flag_t)
+    NET_PACKET_HEADER_SIZE = sizeof(uint32_t) + sizeof(flag_t),
+    SESSION_FRAME_HEADER_SIZE = NET_PACKET_HEADER_SIZE + sizeof(uint32_t)
 } size_limits;
 
 typedef union {
@@ -50,10 +66,34 @@ typedef struct {
     char        *data;
 } net_packet_t;
 
+/** a data range of a sparse file, the rest of the file is a hole */
+typedef struct {
+    uint64_t    offset;
+    uint64_t    length;
+} file_extent_t;
+
+/** a file the peer on the same host clones from its path (LOCAL_FILE), the path follows */
+typedef struct {
+    uint64_t    size;
+    uint64_t    dev;
+    uint64_t    ino;
+    int64_t     mtime_sec;
+    int64_t     mtime_nsec;
+} local_file_t;
+
+/** what a transfer got through so far, read from another thread */
+typedef struct {
+    volatile uint64_t   bytes;
+    volatile uint64_t   files;
+    volatile uint32_t   chunk_size;     /* of the sendfile() calls, as tuned (0 when none) */
+    volatile uint32_t   pipe_size;      /* of the receiver's splice pipes, as tuned (0 when none) */
+} transfer_progress_t;
+
 /** Threads communication mechanism */
 typedef struct {
     volatile int lock;
     volatile int action;
+    volatile int reading;   /* the user thread waits for a line, a question can be asked */
 } TC_t;
 
 typedef enum {
@@ -65,6 +105,10 @@ typedef enum {
 /* functions */
 EXTERN int8_t send_packet(SOCKET sock_desc, char *buff, uint32_t size, flag_t flags);
 EXTERN net_packet_t *recv_packet(SOCKET sock_desc, int recv_flags);
+EXTERN net_packet_t *recv_packet_fd(SOCKET sock_desc, int recv_flags, int32_t *file_desc);
+#ifdef UNIX
+EXTERN int8_t send_packet_fd(SOCKET sock_desc, char *buff, uint32_t size, flag_t flags, int32_t file_desc);
+#endif /* UNIX */
 EXTERN void destroy_packet(net_packet_t *packet);
 
 #undef EXTERN
@@ -0,0 +1,335 @@
+/**
+ * @file dir_cache.c
+ * @brief The open directories of a received tree. A path is resolved from
+ *        the descriptor of its parent directory (openat, mkdirat) instead of
+ *        from the root, so the kernel walks one component whatever the depth
+ *        of the tree, and the paths are not limited to PATH_SIZE anymore.
+ *        The least recently used directories are closed past DIR_CACHE_SIZE.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#endif /* UNIX */
+
+#define DIR_CACHE_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "dir_cache.h"
+
+/* internal functions' prototypes */
+static dir_entry_t *resolve(dir_cache_t *dc, const char *path, uint32_t len);
+static void        insert(dir_cache_t *dc, dir_entry_t *entry);
+static void        evict(dir_cache_t *dc);
+static void        forget(dir_cache_t *dc, const char *path);
+static int32_t     remove_tree(int32_t dir_desc, const char *name);
+static void        lru_unlink(dir_cache_t *dc, dir_entry_t *entry);
+static void        lru_push(dir_cache_t *dc, dir_entry_t *entry);
+static uint32_t    hash_path(const char *path, uint32_t len);
+
+dir_cache_t *dir_cache_create(const char *root)
+{
+    dir_cache_t *dc;
+
+    dc = (dir_cache_t *) calloc(1, sizeof(dir_cache_t));
+    if (!dc) {
+        ERROR("calloc", "", ERROR_OS);
+        return NULL;
+    }
+    dc->buckets_cnt = DIR_CACHE_SIZE * 2;
+    if (!(dc->buckets = (dir_entry_t **) calloc(dc->buckets_cnt, sizeof(dir_entry_t *)))) {
+        ERROR("calloc", "", ERROR_OS);
+        free(dc);
+        return NULL;
+    }
+    if ( (dc->root.dir_desc = open(root, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+        ERROR("open", root, ERROR_OS);
+        free(dc->buckets);
+        free(dc);
+        return NULL;
+    }
+    dc->root.path = "";
+    pthread_mutex_init(&dc->lock, NULL);
+    return dc;
+}
+
+dir_entry_t *dir_cache_parent(dir_cache_t *dc, const char *path, const char **name)
+{
+    const char  *last;
+    dir_entry_t *entry;
+
+    /* the paths are relative to the root, even with a leading '/' */
+    while (*path == '/')
+        ++path;
+    last = strrchr(path, '/');
+    *name = last ? last + 1 : path;
+    if (strcmp(*name, "..") == 0) {
+        ERROR("dir_cache_parent", "invalid path", ERROR_APP);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&dc->lock);
+    if ( (entry = resolve(dc, path, last ? last - path : 0)) )
+        ++entry->refs;
+    pthread_mutex_unlock(&dc->lock);
+    return entry;
+}
+
+void dir_cache_get(dir_cache_t *dc, dir_entry_t *entry)
+{
+    /* one more holder of an entry already held */
+    pthread_mutex_lock(&dc->lock);
+    ++entry->refs;
+    pthread_mutex_unlock(&dc->lock);
+}
+
+void dir_cache_put(dir_cache_t *dc, dir_entry_t *entry)
+{
+    if (!entry)
+        return;
+    pthread_mutex_lock(&dc->lock);
+    --entry->refs;
+    pthread_mutex_unlock(&dc->lock);
+}
+
+int32_t dir_cache_remove(dir_cache_t *dc, const char *path)
+{
+    dir_entry_t *dir;
+    const char  *name;
+    int32_t     s = 0;
+
+    while (*path == '/')
+        ++path;
+    if (!(dir = dir_cache_parent(dc, path, &name)))
+        return -1;
+    /* removing the root would take the whole tree */
+    if (*name == '\0') {
+        ERROR("dir_cache_remove", "invalid path", ERROR_APP);
+        dir_cache_put(dc, dir);
+        return -1;
+    }
+    if (unlinkat(dir->dir_desc, name, 0) == -1) {
+        if (errno == EISDIR) {
+            /* the directories below are not there anymore, nor their descriptors */
+            pthread_mutex_lock(&dc->lock);
+            forget(dc, path);
+            pthread_mutex_unlock(&dc->lock);
+            s = remove_tree(dir->dir_desc, name);
+        }
+        /* already gone is what was asked */
+        else if (errno != ENOENT) {
+            ERROR("unlinkat", path, ERROR_OS);
+            s = -1;
+        }
+    }
+    dir_cache_put(dc, dir);
+    errno = 0;
+    return s;
+}
+
+void dir_cache_destroy(dir_cache_t *dc)
+{
+    dir_entry_t *entry;
+
+    if (!dc)
+        return;
+    while ( (entry = dc->lru_head) ) {
+        dc->lru_head = entry->lru_next;
+        close(entry->dir_desc);
+        free(entry->path);
+        free(entry);
+    }
+    close(dc->root.dir_desc);
+    pthread_mutex_destroy(&dc->lock);
+    free(dc->buckets);
+    free(dc);
+}
+
+static dir_entry_t *resolve(dir_cache_t *dc, const char *path, uint32_t len)
+{
+    dir_entry_t *entry;
+    dir_entry_t *parent;
+    const char  *slash;
+    uint32_t    hash;
+    uint32_t    component;
+
+    while (len && path[len - 1] == '/')
+        --len;
+    if (len == 0)
+        return &dc->root;
+
+    hash = hash_path(path, len);
+    for (entry = dc->buckets[hash % dc->buckets_cnt]; entry; entry = entry->next) {
+        if (entry->hash == hash && strncmp(entry->path, path, len) == 0 && entry->path[len] == '\0') {
+            lru_unlink(dc, entry);
+            lru_push(dc, entry);
+            return entry;
+        }
+    }
+
+    /* not open yet: opened from its parent, resolved the same way */
+    slash = (const char *) memrchr(path, '/', len);
+    component = slash ? slash + 1 - path : 0;
+    if (len - component == 2 && strncmp(&path[component], "..", 2) == 0) {
+        ERROR("dir_cache_parent", "invalid path", ERROR_APP);
+        return NULL;
+    }
+    if (!(parent = resolve(dc, path, slash ? slash - path : 0)))
+        return NULL;
+
+    entry = (dir_entry_t *) calloc(1, sizeof(dir_entry_t));
+    if (!entry || !(entry->path = strndup(path, len))) {
+        ERROR("calloc", "", ERROR_OS);
+        free(entry);
+        return NULL;
+    }
+    if ( (entry->dir_desc = openat(parent->dir_desc, &entry->path[component], O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+        ERROR("openat", entry->path, ERROR_OS);
+        free(entry->path);
+        free(entry);
+        return NULL;
+    }
+    entry->hash = hash;
+    insert(dc, entry);
+    return entry;
+}
+
+static void insert(dir_cache_t *dc, dir_entry_t *entry)
+{
+    dir_entry_t **bucket = &dc->buckets[entry->hash % dc->buckets_cnt];
+
+    entry->next = *bucket;
+    *bucket = entry;
+    lru_push(dc, entry);
+    if (++dc->cnt > DIR_CACHE_SIZE)
+        evict(dc);
+}
+
+static void evict(dir_cache_t *dc)
+{
+    dir_entry_t *entry;
+    dir_entry_t **link;
+
+    /* the least recently used directory no one holds */
+    for (entry = dc->lru_tail; entry && entry->refs; entry = entry->lru_prev)
+        ;
+    if (!entry)
+        return;
+    for (link = &dc->buckets[entry->hash % dc->buckets_cnt]; *link != entry; link = &(*link)->next)
+        ;
+    *link = entry->next;
+    lru_unlink(dc, entry);
+    --dc->cnt;
+    close(entry->dir_desc);
+    free(entry->path);
+    free(entry);
+}
+
+static void forget(dir_cache_t *dc, const char *path)
+{
+    dir_entry_t *entry;
+    dir_entry_t *next;
+    dir_entry_t **link;
+    uint32_t    len = strlen(path);
+
+    for (entry = dc->lru_head; entry; entry = next) {
+        next = entry->lru_next;
+        if (entry->refs || strncmp(entry->path, path, len) != 0 ||
+            (entry->path[len] != '\0' && entry->path[len] != '/'))
+            continue;
+        for (link = &dc->buckets[entry->hash % dc->buckets_cnt]; *link != entry; link = &(*link)->next)
+            ;
+        *link = entry->next;
+        lru_unlink(dc, entry);
+        --dc->cnt;
+        close(entry->dir_desc);
+        free(entry->path);
+        free(entry);
+    }
+}
+
+/** rm -r, from the descriptor of the parent */
+static int32_t remove_tree(int32_t dir_desc, const char *name)
+{
+    DIR             *dir;
+    struct dirent   *entry;
+    int32_t         sub_desc;
+    int32_t         s = 0;
+
+    if ( (sub_desc = openat(dir_desc, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) == -1) {
+        ERROR("openat", name, ERROR_OS);
+        return -1;
+    }
+    if (!(dir = fdopendir(sub_desc))) {
+        ERROR("fdopendir", name, ERROR_OS);
+        close(sub_desc);
+        return -1;
+    }
+    while ( (entry = readdir(dir)) ) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (unlinkat(dirfd(dir), entry->d_name, 0) == -1) {
+            if (errno == EISDIR) {
+                if (remove_tree(dirfd(dir), entry->d_name) == -1)
+                    s = -1;
+            }
+            else if (errno != ENOENT) {
+                ERROR("unlinkat", entry->d_name, ERROR_OS);
+                s = -1;
+            }
+        }
+    }
+    closedir(dir);
+    if (s == 0 && unlinkat(dir_desc, name, AT_REMOVEDIR) == -1 && errno != ENOENT) {
+        ERROR("unlinkat", name, ERROR_OS);
+        s = -1;
+    }
+    return s;
+}
+
+static void lru_unlink(dir_cache_t *dc, dir_entry_t *entry)
+{
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        dc->lru_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        dc->lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push(dir_cache_t *dc, dir_entry_t *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = dc->lru_head;
+    if (dc->lru_head)
+        dc->lru_head->lru_prev = entry;
+    else
+        dc->lru_tail = entry;
+    dc->lru_head = entry;
+}
+
+static uint32_t hash_path(const char *path, uint32_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    /* FNV-1a */
+    for (uint32_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char) path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+#undef DIR_CACHE_C
@@ -0,0 +1,51 @@
+/**
+ * @file dir_cache.h
+ * @brief The directory descriptor cache header
+ */
+
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "data_types.h"
+
+#ifdef DIR_CACHE_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* DIR_CACHE_C */
+
+/** an open directory of the tree, by its path relative to the root */
+typedef struct dir_entry {
+    char                *path;
+    uint32_t            hash;
+    int32_t             dir_desc;
+    uint32_t            refs;           /* held by the callers, not evicted meanwhile */
+    struct dir_entry    *next;          /* same bucket */
+    struct dir_entry    *lru_prev;      /* the most recently used first */
+    struct dir_entry    *lru_next;
+} dir_entry_t;
+
+/** the directories of a received tree, the files are opened relative to them */
+typedef struct dir_cache {
+    dir_entry_t         root;
+    dir_entry_t         **buckets;
+    uint32_t            buckets_cnt;
+    dir_entry_t         *lru_head;
+    dir_entry_t         *lru_tail;
+    uint32_t            cnt;
+    pthread_mutex_t     lock;
+} dir_cache_t;
+
+/* directory cache functions */
+EXTERN dir_cache_t *dir_cache_create(const char *root);
+EXTERN dir_entry_t *dir_cache_parent(dir_cache_t *dc, const char *path, const char **name);
+EXTERN void        dir_cache_get(dir_cache_t *dc, dir_entry_t *entry);
+EXTERN void        dir_cache_put(dir_cache_t *dc, dir_entry_t *entry);
+EXTERN int32_t     dir_cache_remove(dir_cache_t *dc, const char *path);
+EXTERN void        dir_cache_destroy(dir_cache_t *dc);
+
+#undef EXTERN
+#endif /* DIR_CACHE_H */
@@ -0,0 +1,643 @@
+/**
+ * @file dir_index.c
+ * @brief The directories listed by the remote queries (list, stat, du), kept
+ *        in memory with the size of their subtrees. Every indexed directory
+ *        has an inotify watch: the events queued by the kernel are read
+ *        before each answer and drop what they touched, so an answer is as
+ *        fresh as a walk of the disk without the walk. The least recently
+ *        used directories are dropped past DIR_INDEX_SIZE directories or
+ *        DIR_INDEX_ENTRIES entries. Without inotify nothing is cached.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif /* UNIX */
+
+#ifdef LINUX
+#include <sys/inotify.h>
+#endif /* LINUX */
+
+#define DIR_INDEX_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "dir_index.h"
+
+/* internal constants */
+#ifdef LINUX
+/* a change of an entry, or of the directory itself */
+#define WATCH_MASK          (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | \
+                             IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#ifdef IN_MASK_CREATE
+/* a directory seen under two paths (bind mounts) keeps one node */
+#define WATCH_FLAGS         (WATCH_MASK | IN_MASK_CREATE)
+#else
+#define WATCH_FLAGS         WATCH_MASK
+#endif /* IN_MASK_CREATE */
+#endif /* LINUX */
+
+/* internal functions' prototypes */
+static dir_index_node_t *node_open(dir_index_t *index, const char *path);
+static void              node_put(dir_index_t *index, dir_index_node_t *node);
+static dir_index_node_t *find(dir_index_t *index, const char *path, uint32_t len);
+static dir_index_node_t *find_wd(dir_index_t *index, int32_t wd);
+static int32_t           load(dir_index_t *index, dir_index_node_t *node);
+static int32_t           lookup(dir_index_t *index, const char *path, dir_index_stat_t *st);
+static int32_t           du(dir_index_t *index, dir_index_node_t *node, dir_index_stat_t *total);
+static int32_t           watch(dir_index_t *index, const char *path);
+static void              drain(dir_index_t *index);
+static void              changed(dir_index_t *index, dir_index_node_t *node);
+static void              invalidate_du(dir_index_t *index, const char *path);
+static void              drop_tree(dir_index_t *index, dir_index_node_t *node);
+static void              drop(dir_index_t *index, dir_index_node_t *node, int8_t unwatch);
+static void              trim(dir_index_t *index);
+static void              lru_unlink(dir_index_t *index, dir_index_node_t *node);
+static void              lru_push(dir_index_t *index, dir_index_node_t *node);
+static uint32_t          hash_path(const char *path, uint32_t len);
+static int               compare_names(const void *a, const void *b, void *names);
+
+dir_index_t *dir_index_create(void)
+{
+    dir_index_t *index;
+
+    index = (dir_index_t *) calloc(1, sizeof(dir_index_t));
+    if (!index) {
+        ERROR("calloc", "", ERROR_OS);
+        return NULL;
+    }
+    index->buckets_cnt = DIR_INDEX_SIZE * 2;
+    index->buckets = (dir_index_node_t **) calloc(index->buckets_cnt, sizeof(dir_index_node_t *));
+    index->wd_buckets = (dir_index_node_t **) calloc(index->buckets_cnt, sizeof(dir_index_node_t *));
+    if (!index->buckets || !index->wd_buckets) {
+        ERROR("calloc", "", ERROR_OS);
+        free(index->buckets);
+        free(index->wd_buckets);
+        free(index);
+        return NULL;
+    }
+    index->inotify_desc = -1;
+#ifdef LINUX
+    /* read before every answer, never waited on */
+    if ( (index->inotify_desc = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) == -1)
+        ERROR("inotify_init1", "the queries walk the disk", ERROR_OS);
+#endif /* LINUX */
+    pthread_mutex_init(&index->lock, NULL);
+    return index;
+}
+
+int32_t dir_index_list(dir_index_t *index, const char *path, dir_index_emit_t emit, void *arg)
+{
+    dir_index_node_t    *node;
+    dir_index_stat_t    st;
+    char                *canonical;
+    int32_t             s = 0;
+
+    if (!(canonical = realpath(path, NULL)))
+        return -1;
+    pthread_mutex_lock(&index->lock);
+    drain(index);
+    if ( (node = node_open(index, canonical)) ) {
+        for (uint32_t i = 0; i < node->entries_cnt && s != -1; ++i)
+            s = emit(arg, &node->names[node->entries[i].name_off], &node->entries[i].st);
+        node_put(index, node);
+    }
+    /* a file is listed as itself */
+    else if (errno != ENOTDIR || (s = lookup(index, canonical, &st)) == -1)
+        s = -1;
+    else
+        s = emit(arg, canonical, &st);
+    trim(index);
+    pthread_mutex_unlock(&index->lock);
+    free(canonical);
+    return s;
+}
+
+int32_t dir_index_stat(dir_index_t *index, const char *path, dir_index_emit_t emit, void *arg)
+{
+    dir_index_stat_t    st;
+    char                *canonical;
+    int32_t             s;
+
+    if (!(canonical = realpath(path, NULL)))
+        return -1;
+    pthread_mutex_lock(&index->lock);
+    drain(index);
+    s = lookup(index, canonical, &st);
+    trim(index);
+    pthread_mutex_unlock(&index->lock);
+    if (s != -1)
+        s = emit(arg, canonical, &st);
+    free(canonical);
+    return s;
+}
+
+int32_t dir_index_du(dir_index_t *index, const char *path, dir_index_emit_t emit, void *arg)
+{
+    dir_index_node_t    *node;
+    dir_index_stat_t    st;
+    char                *canonical;
+    int32_t             s;
+
+    if (!(canonical = realpath(path, NULL)))
+        return -1;
+    pthread_mutex_lock(&index->lock);
+    drain(index);
+    if ( (node = node_open(index, canonical)) ) {
+        s = du(index, node, &st);
+        node_put(index, node);
+    }
+    else if (errno != ENOTDIR || (s = lookup(index, canonical, &st)) == -1)
+        s = -1;
+    else
+        st.files = 1;
+    trim(index);
+    pthread_mutex_unlock(&index->lock);
+    if (s != -1)
+        s = emit(arg, canonical, &st);
+    free(canonical);
+    return s;
+}
+
+void dir_index_destroy(dir_index_t *index)
+{
+    if (!index)
+        return;
+    while (index->lru_head)
+        drop(index, index->lru_head, 0);
+    if (index->inotify_desc != -1)
+        close(index->inotify_desc);
+    pthread_mutex_destroy(&index->lock);
+    free(index->buckets);
+    free(index->wd_buckets);
+    free(index);
+}
+
+/**
+ * The node of a directory, listed and held until node_put(). Returns NULL
+ * and ENOTDIR when the path is not a directory
+ */
+static dir_index_node_t *node_open(dir_index_t *index, const char *path)
+{
+    dir_index_node_t    *node;
+    dir_index_node_t    **bucket;
+    uint32_t            len = strlen(path);
+
+    if ( (node = find(index, path, len)) ) {
+        lru_unlink(index, node);
+        lru_push(index, node);
+        /* what changed, or what is not watched, is read again */
+        if ((!node->listed || node->wd == -1) && load(index, node) == -1)
+            return NULL;
+        ++node->refs;
+        return node;
+    }
+
+    node = (dir_index_node_t *) calloc(1, sizeof(dir_index_node_t));
+    if (!node || !(node->path = strdup(path))) {
+        ERROR("calloc", "", ERROR_OS);
+        free(node);
+        return NULL;
+    }
+    /* watched before it is read, a change meanwhile is not lost */
+    if ( (node->wd = watch(index, path)) == -1 && errno == ENOTDIR) {
+        free(node->path);
+        free(node);
+        return NULL;
+    }
+    node->hash = hash_path(path, len);
+    bucket = &index->buckets[node->hash % index->buckets_cnt];
+    node->next = *bucket;
+    *bucket = node;
+    if (node->wd != -1) {
+        bucket = &index->wd_buckets[node->wd % index->buckets_cnt];
+        node->wd_next = *bucket;
+        *bucket = node;
+    }
+    lru_push(index, node);
+    ++index->cnt;
+    if (load(index, node) == -1) {
+        int32_t error = errno;
+        drop(index, node, 1);
+        errno = error;
+        return NULL;
+    }
+    ++node->refs;
+    return node;
+}
+
+static void node_put(dir_index_t *index, dir_index_node_t *node)
+{
+    --node->refs;
+}
+
+static dir_index_node_t *find(dir_index_t *index, const char *path, uint32_t len)
+{
+    dir_index_node_t    *node;
+    uint32_t            hash = hash_path(path, len);
+
+    for (node = index->buckets[hash % index->buckets_cnt]; node; node = node->next)
+        if (node->hash == hash && strncmp(node->path, path, len) == 0 && node->path[len] == '\0')
+            return node;
+    return NULL;
+}
+
+static dir_index_node_t *find_wd(dir_index_t *index, int32_t wd)
+{
+    dir_index_node_t *node;
+
+    if (wd < 0)
+        return NULL;
+    for (node = index->wd_buckets[wd % index->buckets_cnt]; node && node->wd != wd; node = node->wd_next)
+        ;
+    return node;
+}
+
+static int32_t load(dir_index_t *index, dir_index_node_t *node)
+{
+    DIR                 *dir;
+    struct dirent       *dirent;
+    struct stat         stat_buf;
+    dir_index_entry_t   *entries = NULL;
+    char                *names = NULL;
+    uint32_t            cnt = 0, size = 0;
+    uint64_t            names_len = 0, names_size = 0;
+    int32_t             dir_desc;
+
+    if ( (dir_desc = open(node->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+        if (errno != ENOTDIR)
+            ERROR("open", node->path, ERROR_OS);
+        return -1;
+    }
+    if (!(dir = fdopendir(dir_desc))) {
+        ERROR("fdopendir", node->path, ERROR_OS);
+        close(dir_desc);
+        return -1;
+    }
+    while ( (errno = 0, dirent = readdir(dir)) ) {
+        uint64_t name_len = strlen(dirent->d_name) + 1;
+
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+            continue;
+        /* removed since it was read */
+        if (fstatat(dirfd(dir), dirent->d_name, &stat_buf, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+        if (cnt == size) {
+            dir_index_entry_t *grown;
+            size = size ? size * 2 : 64;
+            if (!(grown = (dir_index_entry_t *) realloc(entries, size * sizeof(dir_index_entry_t))))
+                goto error;
+            entries = grown;
+        }
+        if (names_len + name_len > names_size) {
+            char *grown;
+            names_size = names_size ? names_size * 2 : 1024;
+            while (names_len + name_len > names_size)
+                names_size *= 2;
+            if (!(grown = (char *) realloc(names, names_size)))
+                goto error;
+            names = grown;
+        }
+        memcpy(&names[names_len], dirent->d_name, name_len);
+        entries[cnt].name_off = names_len;
+        entries[cnt].st.size = stat_buf.st_size;
+        entries[cnt].st.files = 0;
+        entries[cnt].st.mtime = stat_buf.st_mtime;
+        entries[cnt].st.mode = stat_buf.st_mode;
+        names_len += name_len;
+        ++cnt;
+    }
+    if (errno) {
+        ERROR("readdir", node->path, ERROR_OS);
+        closedir(dir);
+        free(entries);
+        free(names);
+        return -1;
+    }
+    if (fstat(dirfd(dir), &stat_buf) == -1) {
+        ERROR("fstat", node->path, ERROR_OS);
+        closedir(dir);
+        free(entries);
+        free(names);
+        return -1;
+    }
+    closedir(dir);
+    qsort_r(entries, cnt, sizeof(dir_index_entry_t), &compare_names, names);
+
+    index->entries_cnt -= node->entries_cnt;
+    free(node->entries);
+    free(node->names);
+    node->entries = entries;
+    node->names = names;
+    node->entries_cnt = cnt;
+    node->du.mtime = stat_buf.st_mtime;
+    node->du.mode = stat_buf.st_mode;
+    node->listed = 1;
+    index->entries_cnt += cnt;
+    return 0;
+
+ error:
+    ERROR("realloc", "", ERROR_OS);
+    closedir(dir);
+    free(entries);
+    free(names);
+    return -1;
+}
+
+/** the entry of a path, from the listing of its parent */
+static int32_t lookup(dir_index_t *index, const char *path, dir_index_stat_t *st)
+{
+    dir_index_node_t    *node;
+    dir_index_entry_t   *entries;
+    const char          *name = strrchr(path, '/') + 1;
+    char                *parent;
+    struct stat         stat_buf;
+    int32_t             low, high, mid, cmp;
+
+    /* the root has no parent */
+    if (*name == '\0') {
+        if (lstat(path, &stat_buf) == -1)
+            return -1;
+        st->size = stat_buf.st_size;
+        st->files = 0;
+        st->mtime = stat_buf.st_mtime;
+        st->mode = stat_buf.st_mode;
+        return 0;
+    }
+    if (!(parent = strndup(path, name - 1 == path ? 1 : name - 1 - path))) {
+        ERROR("strndup", "", ERROR_OS);
+        return -1;
+    }
+    node = node_open(index, parent);
+    free(parent);
+    if (!node)
+        return -1;
+    entries = node->entries;
+    for (low = 0, high = (int32_t) node->entries_cnt - 1; low <= high; ) {
+        mid = low + (high - low) / 2;
+        cmp = strcmp(name, &node->names[entries[mid].name_off]);
+        if (cmp == 0) {
+            *st = entries[mid].st;
+            node_put(index, node);
+            return 0;
+        }
+        if (cmp < 0)
+            high = mid - 1;
+        else
+            low = mid + 1;
+    }
+    node_put(index, node);
+    errno = ENOENT;
+    return -1;
+}
+
+/** the files below a directory, cached while the whole subtree is watched */
+static int32_t du(dir_index_t *index, dir_index_node_t *node, dir_index_stat_t *total)
+{
+    dir_index_node_t    *child;
+    dir_index_stat_t    sub;
+    char                *path;
+    uint32_t            path_len = strlen(node->path);
+
+    if (node->du_valid) {
+        *total = node->du;
+        return 0;
+    }
+    if (!(path = (char *) malloc(path_len + NAME_MAX + 2))) {
+        ERROR("malloc", "", ERROR_OS);
+        return -1;
+    }
+    memcpy(path, node->path, path_len);
+    if (path[path_len - 1] != '/')
+        path[path_len++] = '/';
+
+    node->du_stale = node->wd == -1;
+    node->du.size = node->du.files = 0;
+    for (uint32_t i = 0; i < node->entries_cnt; ++i) {
+        dir_index_entry_t *entry = &node->entries[i];
+
+        ++node->du.files;
+        if (!S_ISDIR(entry->st.mode)) {
+            node->du.size += entry->st.size;
+            continue;
+        }
+        strcpy(&path[path_len], &node->names[entry->name_off]);
+        /* an unreadable subdirectory counts for nothing, and is read again next time */
+        if (!(child = node_open(index, path))) {
+            node->du_stale = 1;
+            continue;
+        }
+        if (du(index, child, &sub) == 0) {
+            node->du.size += sub.size;
+            node->du.files += sub.files;
+        }
+        if (!child->du_valid)
+            node->du_stale = 1;
+        node_put(index, child);
+        /* a tree larger than the index goes through it, the directories being walked stay */
+        trim(index);
+    }
+    free(path);
+    /* nothing below changed or was dropped while it was walked */
+    node->du_valid = !node->du_stale;
+    *total = node->du;
+    return 0;
+}
+
+static int32_t watch(dir_index_t *index, const char *path)
+{
+#ifdef LINUX
+    int32_t wd;
+
+    if (index->inotify_desc == -1)
+        return -1;
+    if ( (wd = inotify_add_watch(index->inotify_desc, path, WATCH_FLAGS)) == -1 && errno != ENOTDIR) {
+        /* out of watches (fs.inotify.max_user_watches), read from the disk each time */
+        if (errno != EEXIST)
+            ERROR("inotify_add_watch", path, ERROR_OS);
+        errno = 0;
+    }
+    return wd;
+#else
+    errno = 0;
+    return -1;
+#endif /* LINUX */
+}
+
+static void drain(dir_index_t *index)
+{
+#ifdef LINUX
+    char                        buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event  *event;
+    dir_index_node_t            *node;
+    ssize_t                     len;
+
+    if (index->inotify_desc == -1)
+        return;
+    while ( (len = read(index->inotify_desc, buf, sizeof(buf))) > 0) {
+        for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *) ptr;
+            /* events were lost, nothing can be trusted */
+            if (event->mask & IN_Q_OVERFLOW) {
+                for (node = index->lru_head; node; node = node->lru_next)
+                    changed(index, node);
+                continue;
+            }
+            if (!(node = find_wd(index, event->wd)))
+                continue;
+            /* the nodes below have a path which does not exist anymore */
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT))
+                drop_tree(index, node);
+            else
+                changed(index, node);
+        }
+    }
+    if (len == -1 && errno != EAGAIN)
+        ERROR("read", "inotify", ERROR_OS);
+#endif /* LINUX */
+}
+
+static void changed(dir_index_t *index, dir_index_node_t *node)
+{
+    index->entries_cnt -= node->entries_cnt;
+    free(node->entries);
+    free(node->names);
+    node->entries = NULL;
+    node->names = NULL;
+    node->entries_cnt = 0;
+    node->listed = 0;
+    invalidate_du(index, node->path);
+}
+
+/** the du of a directory and of all its indexed parents */
+static void invalidate_du(dir_index_t *index, const char *path)
+{
+    dir_index_node_t    *node;
+    const char          *slash;
+    uint32_t            len = strlen(path);
+
+    while (1) {
+        if ( (node = find(index, path, len)) ) {
+            node->du_valid = 0;
+            node->du_stale = 1;
+        }
+        if (len <= 1 || !(slash = (const char *) memrchr(path, '/', len)))
+            break;
+        len = slash == path ? 1 : slash - path;
+    }
+}
+
+static void drop_tree(dir_index_t *index, dir_index_node_t *node)
+{
+    dir_index_node_t    *next;
+    char                *path = node->path;
+    uint32_t            len = strlen(path);
+
+    node->path = NULL;
+    drop(index, node, 1);
+    for (node = index->lru_head; node; node = next) {
+        next = node->lru_next;
+        if (strncmp(node->path, path, len) == 0 && node->path[len] == '/')
+            drop(index, node, 1);
+    }
+    invalidate_du(index, path);
+    free(path);
+}
+
+static void drop(dir_index_t *index, dir_index_node_t *node, int8_t unwatch)
+{
+    dir_index_node_t **link;
+
+    for (link = &index->buckets[node->hash % index->buckets_cnt]; *link != node; link = &(*link)->next)
+        ;
+    *link = node->next;
+    if (node->wd != -1) {
+        for (link = &index->wd_buckets[node->wd % index->buckets_cnt]; *link != node; link = &(*link)->wd_next)
+            ;
+        *link = node->wd_next;
+#ifdef LINUX
+        /* the watch may be gone already (IN_IGNORED) */
+        if (unwatch)
+            inotify_rm_watch(index->inotify_desc, node->wd);
+#endif /* LINUX */
+    }
+    lru_unlink(index, node);
+    --index->cnt;
+    index->entries_cnt -= node->entries_cnt;
+    /* the parents do not see the changes below anymore */
+    if (node->path) {
+        invalidate_du(index, node->path);
+        free(node->path);
+    }
+    free(node->entries);
+    free(node->names);
+    free(node);
+}
+
+static void trim(dir_index_t *index)
+{
+    dir_index_node_t *node = index->lru_tail;
+
+    /* the least recently used directories no query holds */
+    while (node && (index->cnt > DIR_INDEX_SIZE || index->entries_cnt > DIR_INDEX_ENTRIES)) {
+        dir_index_node_t *prev = node->lru_prev;
+        if (!node->refs)
+            drop(index, node, 1);
+        node = prev;
+    }
+}
+
+static void lru_unlink(dir_index_t *index, dir_index_node_t *node)
+{
+    if (node->lru_prev)
+        node->lru_prev->lru_next = node->lru_next;
+    else
+        index->lru_head = node->lru_next;
+    if (node->lru_next)
+        node->lru_next->lru_prev = node->lru_prev;
+    else
+        index->lru_tail = node->lru_prev;
+    node->lru_prev = node->lru_next = NULL;
+}
+
+static void lru_push(dir_index_t *index, dir_index_node_t *node)
+{
+    node->lru_prev = NULL;
+    node->lru_next = index->lru_head;
+    if (index->lru_head)
+        index->lru_head->lru_prev = node;
+    else
+        index->lru_tail = node;
+    index->lru_head = node;
+}
+
+static uint32_t hash_path(const char *path, uint32_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    /* FNV-1a */
+    for (uint32_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char) path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int compare_names(const void *a, const void *b, void *names)
+{
+    return strcmp(&((char *) names)[((const dir_index_entry_t *) a)->name_off],
+                  &((char *) names)[((const dir_index_entry_t *) b)->name_off]);
+}
+
+#undef DIR_INDEX_C
@@ -0,0 +1,77 @@
+/**
+ * @file dir_index.h
+ * @brief The served directories index header
+ */
+
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "data_types.h"
+
+#ifdef DIR_INDEX_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* DIR_INDEX_C */
+
+/** what a query tells about an entry (a whole subtree for du) */
+typedef struct {
+    uint64_t            size;           /* bytes, of the files below for du */
+    uint64_t            files;          /* du: the entries below */
+    int64_t             mtime;
+    uint32_t            mode;
+} dir_index_stat_t;
+
+/** an entry of an indexed directory, its name is in the names of the directory */
+typedef struct {
+    uint32_t            name_off;
+    dir_index_stat_t    st;
+} dir_index_entry_t;
+
+/** a directory of the index, by its canonical path */
+typedef struct dir_index_node {
+    char                    *path;
+    uint32_t                hash;
+    int32_t                 wd;         /* the inotify watch, -1 when not watched (never cached) */
+    uint32_t                refs;       /* held by a query, not evicted meanwhile */
+    int8_t                  listed;     /* entries are up to date */
+    dir_index_entry_t       *entries;   /* sorted by name */
+    uint32_t                entries_cnt;
+    char                    *names;
+    int8_t                  du_valid;   /* du is up to date, the whole subtree is watched */
+    int8_t                  du_stale;   /* something below changed while du was computed */
+    dir_index_stat_t        du;
+    struct dir_index_node   *next;      /* same path bucket */
+    struct dir_index_node   *wd_next;   /* same watch bucket */
+    struct dir_index_node   *lru_prev;  /* the most recently used first */
+    struct dir_index_node   *lru_next;
+} dir_index_node_t;
+
+/** the directories already read by the queries, until inotify says they changed */
+typedef struct dir_index {
+    int32_t             inotify_desc;
+    dir_index_node_t    **buckets;
+    dir_index_node_t    **wd_buckets;
+    uint32_t            buckets_cnt;
+    dir_index_node_t    *lru_head;
+    dir_index_node_t    *lru_tail;
+    uint32_t            cnt;
+    uint64_t            entries_cnt;
+    pthread_mutex_t     lock;
+} dir_index_t;
+
+/** called for every entry of an answer, a -1 return stops the query */
+typedef int32_t (*dir_index_emit_t)(void *arg, const char *name, const dir_index_stat_t *st);
+
+/* directory index functions */
+EXTERN dir_index_t *dir_index_create(void);
+EXTERN int32_t     dir_index_list(dir_index_t *index, const char *path, dir_index_emit_t emit, void *arg);
+EXTERN int32_t     dir_index_stat(dir_index_t *index, const char *path, dir_index_emit_t emit, void *arg);
+EXTERN int32_t     dir_index_du(dir_index_t *index, const char *path, dir_index_emit_t emit, void *arg);
+EXTERN void        dir_index_destroy(dir_index_t *index);
+
+#undef EXTERN
+#endif /* DIR_INDEX_H */
@@ -0,0 +1,1076 @@
+/**
+ * @file engine_linux.c
+ * @brief The epoll event engine: a reactor per core drives the transfers of
+ *        many peers over non blocking sockets. Every connection is a state
+ *        machine of the send/receive protocol, so a handful of threads serve
+ *        hundreds of concurrent transfers.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <arpa/inet.h>
+#endif /* UNIX */
+
+#define ENGINE_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "sparse.h"
+#include "inode_table.h"
+#include "recv_state.h"
+#include "protocol.h"
+#include "query.h"
+#include "engine_linux.h"
+
+/* internal constants */
+#define ENGINE_MAX_EVENTS       64
+#define ENGINE_IO_BUDGET        (1 << 20)       /* bytes moved per connection per wakeup */
+#define ENGINE_MAX_PAYLOAD      (1 << 28)       /* bigger packets are a broken peer */
+#define ENGINE_CAPS             (PROTOCOL_LOCAL_CAPS & ~(CAP_SESSIONS | CAP_KTLS | CAP_LOCAL))
+
+/* what a connection handler tells the reactor */
+typedef enum {
+    CONN_WAIT              = 0,                 /* the socket would block */
+    CONN_PROGRESS          = 1,                 /* keep going */
+    CONN_CLOSE             = -1                 /* the transfer is over (or failed) */
+} conn_status_t;
+
+/* what the connection waits from the socket */
+typedef enum {
+    IO_HEADER,                                  /* reading a packet header */
+    IO_PAYLOAD,                                 /* reading a packet payload */
+    IO_FILE_DATA,                               /* splicing file data from the socket */
+    IO_FLUSH,                                   /* writing the output buffer */
+    IO_SEND_FILE                                /* sendfile of the data extents */
+} io_state_t;
+
+/* where the connection is in the protocol */
+typedef enum {
+    PROTO_WAIT_START,                           /* waiting the START_TRANSFER packet */
+    PROTO_RECV,                                 /* receiving, see the receive state */
+    PROTO_SEND_ENTRY,                           /* walking the tree to send */
+    PROTO_DONE                                  /* the last packet is flushed, then close */
+} proto_state_t;
+
+typedef struct {
+    DIR         *dir;
+    uint32_t    path_len;
+} walk_level_t;
+
+struct engine_conn;
+
+/* the disk work of a connection, done by a worker */
+typedef conn_status_t (*conn_work_t)(struct engine_conn *conn);
+
+typedef struct engine_conn {
+    SOCKET              sock;
+    engine_t            *engine;
+    engine_reactor_t    *reactor;
+    uint32_t            events;                 /* 0 when out of the epoll set */
+    io_state_t          io;
+    proto_state_t       proto;
+
+    /* a job given to the workers, the reactor leaves the connection alone until it is done */
+    int8_t              working;
+    conn_work_t         work;
+    conn_status_t       work_status;
+    struct engine_conn  *work_next;
+
+    /* incoming packet */
+    char                header[NET_PACKET_HEADER_SIZE];
+    uint32_t            header_len;
+    uint32_t            payload_size;
+    flag_t              payload_flags;
+    char                *payload;
+    uint32_t            payload_len;
+
+    /* receive protocol of a push */
+    recv_state_t        rs;
+
+    /* current file sent, grown as deep as the tree goes */
+    char                *path;
+    uint32_t            path_size;
+    int32_t             file_desc;
+    file_extent_t       single_extent;
+    file_extent_t       *extents;
+    char                *extents_buf;           /* owns the extents of a sparse file */
+    uint32_t            extents_cnt;
+    uint32_t            extent;
+    uint64_t            extent_done;
+
+    /* outgoing packets */
+    char                *out;
+    uint32_t            out_len;
+    uint32_t            out_size;
+    uint32_t            out_sent;
+
+    /* tree walk of a send */
+    walk_level_t        *walk;
+    uint32_t            walk_depth;
+    uint32_t            walk_size;
+    uint32_t            prefix_len;
+    inode_table_t       *sent_inodes;
+    protocol_caps_t     caps;                   /* negotiated by the hello */
+
+    struct engine_conn  *prev;
+    struct engine_conn  *next;
+} engine_conn_t;
+
+/* internal functions' prototypes */
+static void          *reactor_thread(void *arg);
+static void          reactor_on_done(engine_reactor_t *reactor);
+static void          *worker_thread(void *arg);
+static void          conn_close(engine_conn_t *conn);
+static conn_status_t conn_offload(engine_conn_t *conn, conn_work_t work);
+static conn_status_t conn_work_packet(engine_conn_t *conn);
+static conn_status_t conn_work_file_data(engine_conn_t *conn);
+static conn_status_t conn_handle(engine_conn_t *conn);
+static int32_t       conn_set_io(engine_conn_t *conn, io_state_t io);
+static conn_status_t conn_abort(engine_conn_t *conn);
+static conn_status_t conn_read_header(engine_conn_t *conn);
+static conn_status_t conn_read_payload(engine_conn_t *conn);
+static conn_status_t conn_on_packet(engine_conn_t *conn);
+static conn_status_t conn_read_file_data(engine_conn_t *conn, int64_t *budget);
+static void          conn_end_file(engine_conn_t *conn);
+static int32_t       conn_queue_packet(engine_conn_t *conn, char *data, uint32_t size, flag_t flags);
+static conn_status_t conn_flush(engine_conn_t *conn);
+static conn_status_t conn_start_send(engine_conn_t *conn, char *path);
+static conn_status_t conn_send_next(engine_conn_t *conn);
+static int32_t       conn_walk_push(engine_conn_t *conn, uint32_t path_len, int32_t dir_desc);
+static conn_status_t conn_queue_file(engine_conn_t *conn, int32_t dir_desc, const char *name);
+static int32_t       conn_path_join(engine_conn_t *conn, uint32_t path_len, const char *name);
+static conn_status_t conn_send_file_data(engine_conn_t *conn, int64_t *budget);
+static conn_status_t conn_answer_query(engine_conn_t *conn, flag_t flags, char *path);
+static int32_t       conn_queue_reply(void *arg, char *data, uint32_t size, flag_t flags);
+static int8_t        conn_may_read(engine_conn_t *conn);
+
+engine_t *engine_create(uint32_t threads_cnt, uint32_t workers_cnt)
+{
+    engine_t            *engine;
+    struct epoll_event  event;
+    int32_t             s;
+
+    /* a reactor per online core by default */
+    if (threads_cnt == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads_cnt = cores > 0 ? cores : 1;
+    }
+    if (workers_cnt == 0)
+        workers_cnt = 1;
+    engine = (engine_t *) calloc(1, sizeof(engine_t));
+    if (!engine) {
+        ERROR("calloc", "", ERROR_OS);
+        return NULL;
+    }
+    pthread_mutex_init(&engine->jobs_lock, NULL);
+    pthread_cond_init(&engine->jobs_cond, NULL);
+    engine->reactors = (engine_reactor_t *) calloc(threads_cnt, sizeof(engine_reactor_t));
+    engine->workers = (pthread_t *) calloc(workers_cnt, sizeof(pthread_t));
+    if (!engine->reactors || !engine->workers) {
+        ERROR("calloc", "", ERROR_OS);
+        goto error;
+    }
+
+    for (uint32_t i = 0; i < workers_cnt; ++i) {
+        s = pthread_create(&engine->workers[i], NULL, &worker_thread, engine);
+        if (s != 0) {
+            errno = s;
+            ERROR("pthread_create", "", ERROR_OS);
+            goto error;
+        }
+        ++engine->workers_cnt;
+    }
+
+    for (uint32_t i = 0; i < threads_cnt; ++i) {
+        engine_reactor_t *reactor = &engine->reactors[i];
+
+        if ( (reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+            ERROR("epoll_create1", "", ERROR_OS);
+            goto error;
+        }
+        /* the eventfd is the only entry without a connection */
+        if ( (reactor->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+            ERROR("eventfd", "", ERROR_OS);
+            close(reactor->epoll_fd);
+            goto error;
+        }
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd, &event) == -1) {
+            ERROR("epoll_ctl", "eventfd", ERROR_OS);
+            close(reactor->event_fd);
+            close(reactor->epoll_fd);
+            goto error;
+        }
+        pthread_mutex_init(&reactor->conns_lock, NULL);
+        s = pthread_create(&reactor->TID, NULL, &reactor_thread, reactor);
+        if (s != 0) {
+            errno = s;
+            ERROR("pthread_create", "", ERROR_OS);
+            pthread_mutex_destroy(&reactor->conns_lock);
+            close(reactor->event_fd);
+            close(reactor->epoll_fd);
+            goto error;
+        }
+        ++engine->reactors_cnt;
+    }
+    fprintf(stdout, "Event engine running on %u threads, %u disk workers\n",
+            engine->reactors_cnt, engine->workers_cnt);
+    return engine;
+
+ error:
+    engine_destroy(engine);
+    return NULL;
+}
+
+int32_t engine_add_connection(engine_t *engine, SOCKET sock_desc)
+{
+    engine_reactor_t    *reactor;
+    engine_conn_t       *conn;
+    struct epoll_event  event;
+    int32_t             flags;
+
+    if ( (flags = fcntl(sock_desc, F_GETFL)) == -1 ||
+         fcntl(sock_desc, F_SETFL, flags | O_NONBLOCK) == -1) {
+        ERROR("fcntl", "O_NONBLOCK", ERROR_OS);
+        return -1;
+    }
+    conn = (engine_conn_t *) calloc(1, sizeof(engine_conn_t));
+    if (!conn) {
+        ERROR("calloc", "", ERROR_OS);
+        return -1;
+    }
+    /* the connections are spread round robin over the reactors */
+    reactor = &engine->reactors[__sync_fetch_and_add(&engine->next_reactor, 1) % engine->reactors_cnt];
+    conn->sock = sock_desc;
+    conn->engine = engine;
+    conn->reactor = reactor;
+    conn->io = IO_HEADER;
+    conn->proto = PROTO_WAIT_START;
+    conn->file_desc = -1;
+    conn->events = EPOLLIN;
+    conn->caps = PROTOCOL_V1_CAPS;
+    if (recv_state_init(&conn->rs, RECEIVING_PATH, NULL) == -1) {
+        free(conn);
+        return -1;
+    }
+
+    pthread_mutex_lock(&reactor->conns_lock);
+    conn->next = reactor->conns;
+    if (reactor->conns)
+        reactor->conns->prev = conn;
+    reactor->conns = conn;
+    ++reactor->conns_cnt;
+    pthread_mutex_unlock(&reactor->conns_lock);
+
+    event.events = conn->events;
+    event.data.ptr = conn;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, sock_desc, &event) == -1) {
+        ERROR("epoll_ctl", "EPOLL_CTL_ADD", ERROR_OS);
+        conn->sock = -1;
+        conn_close(conn);
+        return -1;
+    }
+    return 0;
+}
+
+void engine_destroy(engine_t *engine)
+{
+    void *res;
+
+    if (!engine) return;
+    for (uint32_t i = 0; i < engine->reactors_cnt; ++i) {
+        /* epoll_wait(2) is a cancelation point, the handlers are not */
+        pthread_cancel(engine->reactors[i].TID);
+        pthread_join(engine->reactors[i].TID, &res);
+    }
+    /* a worker finishes its job, the queued ones are dropped with their connections */
+    pthread_mutex_lock(&engine->jobs_lock);
+    engine->stopping = 1;
+    pthread_cond_broadcast(&engine->jobs_cond);
+    pthread_mutex_unlock(&engine->jobs_lock);
+    for (uint32_t i = 0; i < engine->workers_cnt; ++i)
+        pthread_join(engine->workers[i], &res);
+
+    for (uint32_t i = 0; i < engine->reactors_cnt; ++i) {
+        engine_reactor_t *reactor = &engine->reactors[i];
+
+        while (reactor->conns)
+            conn_close(reactor->conns);
+        close(reactor->event_fd);
+        close(reactor->epoll_fd);
+        pthread_mutex_destroy(&reactor->conns_lock);
+    }
+    pthread_cond_destroy(&engine->jobs_cond);
+    pthread_mutex_destroy(&engine->jobs_lock);
+    free(engine->workers);
+    free(engine->reactors);
+    free(engine);
+}
+
+static void *reactor_thread(void *arg)
+{
+    engine_reactor_t    *reactor = (engine_reactor_t *) arg;
+    struct epoll_event  events[ENGINE_MAX_EVENTS];
+    int32_t             events_cnt;
+
+    while (1) {
+        events_cnt = epoll_wait(reactor->epoll_fd, events, ENGINE_MAX_EVENTS, -1);
+        if (events_cnt == -1) {
+            if (errno == EINTR)
+                continue;
+            ERROR("epoll_wait", "", ERROR_OS);
+            pthread_exit(NULL);
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        for (int32_t i = 0; i < events_cnt; ++i) {
+            engine_conn_t *conn = (engine_conn_t *) events[i].data.ptr;
+
+            if (!conn) {
+                reactor_on_done(reactor);
+                continue;
+            }
+            /* the peer is gone and there is nothing left to read */
+            if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN)) {
+                conn_close(conn);
+                continue;
+            }
+            if (conn_handle(conn) == CONN_CLOSE)
+                conn_close(conn);
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+    return NULL;
+}
+
+/* the connections back from the workers go on where their job left them */
+static void reactor_on_done(engine_reactor_t *reactor)
+{
+    engine_conn_t   *conn;
+    engine_conn_t   *next;
+    conn_status_t   s;
+    uint64_t        cnt;
+
+    if (read(reactor->event_fd, &cnt, sizeof(cnt)) == -1 && errno != EAGAIN)
+        ERROR("read", "eventfd", ERROR_OS);
+    pthread_mutex_lock(&reactor->conns_lock);
+    conn = reactor->done;
+    reactor->done = NULL;
+    pthread_mutex_unlock(&reactor->conns_lock);
+
+    for (; conn; conn = next) {
+        next = conn->work_next;
+        conn->working = 0;
+        s = conn->work_status;
+        if (s != CONN_CLOSE && conn_set_io(conn, conn->io) == -1)
+            s = CONN_CLOSE;
+        if (s == CONN_PROGRESS)
+            s = conn_handle(conn);
+        if (s == CONN_CLOSE)
+            conn_close(conn);
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    engine_t            *engine = (engine_t *) arg;
+    engine_reactor_t    *reactor;
+    engine_conn_t       *conn;
+    uint64_t            one = 1;
+
+    pthread_mutex_lock(&engine->jobs_lock);
+    while (1) {
+        while (!engine->jobs && !engine->stopping)
+            pthread_cond_wait(&engine->jobs_cond, &engine->jobs_lock);
+        if (engine->stopping)
+            break;
+        conn = engine->jobs;
+        if (!(engine->jobs = conn->work_next))
+            engine->jobs_tail = NULL;
+        pthread_mutex_unlock(&engine->jobs_lock);
+
+        conn->work_status = conn->work(conn);
+
+        reactor = conn->reactor;
+        pthread_mutex_lock(&reactor->conns_lock);
+        conn->work_next = reactor->done;
+        reactor->done = conn;
+        pthread_mutex_unlock(&reactor->conns_lock);
+        if (write(reactor->event_fd, &one, sizeof(one)) == -1)
+            ERROR("write", "eventfd", ERROR_OS);
+
+        pthread_mutex_lock(&engine->jobs_lock);
+    }
+    pthread_mutex_unlock(&engine->jobs_lock);
+    return NULL;
+}
+
+static void conn_close(engine_conn_t *conn)
+{
+    engine_reactor_t *reactor = conn->reactor;
+
+    if (conn->sock != -1) {
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
+        close(conn->sock);
+    }
+    if (conn->file_desc != -1) close(conn->file_desc);
+    recv_state_destroy(&conn->rs);
+    for (uint32_t i = 0; i < conn->walk_depth; ++i)
+        closedir(conn->walk[i].dir);
+    free(conn->walk);
+    free(conn->path);
+    free(conn->payload);
+    free(conn->extents_buf);
+    free(conn->out);
+    inode_table_destroy(conn->sent_inodes);
+
+    pthread_mutex_lock(&reactor->conns_lock);
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        reactor->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    --reactor->conns_cnt;
+    pthread_mutex_unlock(&reactor->conns_lock);
+    free(conn);
+}
+
+static conn_status_t conn_handle(engine_conn_t *conn)
+{
+    int64_t         budget = ENGINE_IO_BUDGET;
+    conn_status_t   s = CONN_PROGRESS;
+
+    /* a level triggered socket wakes us again if the budget runs out */
+    while (s == CONN_PROGRESS && budget > 0) {
+        switch (conn->io) {
+            case IO_HEADER:
+                s = conn_read_header(conn);
+                break;
+            case IO_PAYLOAD:
+                s = conn_read_payload(conn);
+                break;
+            case IO_FILE_DATA:
+                /* the data is spliced to the disk by a worker */
+                s = conn_offload(conn, &conn_work_file_data);
+                break;
+            case IO_FLUSH:
+                s = conn_flush(conn);
+                break;
+            case IO_SEND_FILE:
+                s = conn_send_file_data(conn, &budget);
+                break;
+        }
+    }
+    return s;
+}
+
+static int32_t conn_set_io(engine_conn_t *conn, io_state_t io)
+{
+    struct epoll_event  event;
+    uint32_t            events;
+
+    conn->io = io;
+    /* a worker only moves the state, the reactor watches the socket when the job is done */
+    if (conn->working)
+        return 0;
+    events = (io == IO_FLUSH || io == IO_SEND_FILE) ? EPOLLOUT : EPOLLIN;
+    if (events == conn->events)
+        return 0;
+    event.events = events;
+    event.data.ptr = conn;
+    if (epoll_ctl(conn->reactor->epoll_fd, conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  conn->sock, &event) == -1) {
+        ERROR("epoll_ctl", conn->events ? "EPOLL_CTL_MOD" : "EPOLL_CTL_ADD", ERROR_OS);
+        return -1;
+    }
+    conn->events = events;
+    return 0;
+}
+
+/* the socket leaves the epoll set until the job is done, nothing else touches the connection */
+static conn_status_t conn_offload(engine_conn_t *conn, conn_work_t work)
+{
+    engine_t *engine = conn->engine;
+
+    if (epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL) == -1) {
+        ERROR("epoll_ctl", "EPOLL_CTL_DEL", ERROR_OS);
+        return CONN_CLOSE;
+    }
+    conn->events = 0;
+    conn->working = 1;
+    conn->work = work;
+    conn->work_next = NULL;
+
+    pthread_mutex_lock(&engine->jobs_lock);
+    if (engine->jobs_tail)
+        engine->jobs_tail->work_next = conn;
+    else
+        engine->jobs = conn;
+    engine->jobs_tail = conn;
+    pthread_cond_signal(&engine->jobs_cond);
+    pthread_mutex_unlock(&engine->jobs_lock);
+    return CONN_WAIT;
+}
+
+static conn_status_t conn_work_packet(engine_conn_t *conn)
+{
+    conn_status_t s;
+
+    s = conn_on_packet(conn);
+    free(conn->payload);
+    conn->payload = NULL;
+    return s;
+}
+
+static conn_status_t conn_work_file_data(engine_conn_t *conn)
+{
+    int64_t budget = ENGINE_IO_BUDGET;
+
+    return conn_read_file_data(conn, &budget);
+}
+
+static conn_status_t conn_abort(engine_conn_t *conn)
+{
+    char header[NET_PACKET_HEADER_SIZE];
+    uint32_t size = 0;
+    flag_t flags = ABORT_TRANSFER;
+
+    /* best effort: a full socket buffer drops the abortion, the close tells the rest */
+    memcpy(header, &size, sizeof(size));
+    memcpy(&header[sizeof(size)], &flags, sizeof(flags));
+    send(conn->sock, header, sizeof(header), MSG_DONTWAIT | MSG_NOSIGNAL);
+    return CONN_CLOSE;
+}
+
+static conn_status_t conn_read_header(engine_conn_t *conn)
+{
+    int64_t received;
+
+    received = recv(conn->sock, &conn->header[conn->header_len],
+                    NET_PACKET_HEADER_SIZE - conn->header_len, 0);
+    if (received == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return CONN_WAIT;
+        ERROR("recv", "", ERROR_OS);
+        return CONN_CLOSE;
+    }
+    if (received == 0) {
+        fprintf(stdout, "Connection lost...\n");
+        return CONN_CLOSE;
+    }
+    conn->header_len += received;
+    if (conn->header_len < NET_PACKET_HEADER_SIZE)
+        return CONN_PROGRESS;
+
+    conn->header_len = 0;
+    memcpy(&conn->payload_size, conn->header, sizeof(conn->payload_size));
+    memcpy(&conn->payload_flags, &conn->header[sizeof(conn->payload_size)], sizeof(flag_t));
+    if (conn->payload_size > ENGINE_MAX_PAYLOAD) {
+        ERROR("recv", "packet too big", ERROR_APP);
+        return conn_abort(conn);
+    }
+    conn->payload = (char *) malloc(conn->payload_size + 1);
+    if (!conn->payload) {
+        ERROR("malloc", "", ERROR_OS);
+        return conn_abort(conn);
+    }
+    conn->payload_len = 0;
+    conn->io = IO_PAYLOAD;
+    return CONN_PROGRESS;
+}
+
+static conn_status_t conn_read_payload(engine_conn_t *conn)
+{
+    int64_t         received;
+    conn_status_t   s;
+
+    if (conn->payload_len < conn->payload_size) {
+        received = recv(conn->sock, &conn->payload[conn->payload_len],
+                        conn->payload_size - conn->payload_len, 0);
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_WAIT;
+            ERROR("recv", "", ERROR_OS);
+            return CONN_CLOSE;
+        }
+        if (received == 0) {
+            fprintf(stdout, "Connection lost...\n");
+            return CONN_CLOSE;
+        }
+        conn->payload_len += received;
+        if (conn->payload_len < conn->payload_size)
+            return CONN_PROGRESS;
+    }
+    conn->payload[conn->payload_size] = '\0';
+    conn->io = IO_HEADER;
+    /* only the hello is answered from memory, the other packets open or create files */
+    if (conn->proto != PROTO_WAIT_START || !(conn->payload_flags & PROTOCOL_HELLO))
+        return conn_offload(conn, &conn_work_packet);
+    s = conn_on_packet(conn);
+    free(conn->payload);
+    conn->payload = NULL;
+    return s;
+}
+
+static conn_status_t conn_on_packet(engine_conn_t *conn)
+{
+    flag_t flags = conn->payload_flags;
+
+    switch (conn->proto) {
+        case PROTO_WAIT_START:
+            /* no sessions on the engine, the client keeps a connection per transfer */
+            if (flags & PROTOCOL_HELLO) {
+                char            answer[NET_PACKET_HEADER_SIZE + PROTOCOL_HELLO_SIZE];
+                uint32_t        size = PROTOCOL_HELLO_SIZE;
+                flag_t          hello_flag = PROTOCOL_HELLO;
+                protocol_caps_t caps = conn_may_read(conn) ? ENGINE_CAPS : ENGINE_CAPS & ~CAP_QUERIES;
+
+                if (protocol_parse_hello(conn->payload, conn->payload_size, caps, &conn->caps) == -1)
+                    return CONN_CLOSE;
+                /* the client waits for it before anything else, the empty send buffer takes it */
+                memcpy(answer, &size, sizeof(size));
+                memcpy(&answer[sizeof(size)], &hello_flag, sizeof(hello_flag));
+                protocol_make_hello(&answer[NET_PACKET_HEADER_SIZE], caps);
+                if (send(conn->sock, answer, sizeof(answer), MSG_NOSIGNAL) != sizeof(answer)) {
+                    ERROR("send", "hello", ERROR_OS);
+                    return CONN_CLOSE;
+                }
+                return CONN_PROGRESS;
+            }
+            if ((flags & START_TRANSFER) && (flags & SEND_OPERATION)) {
+                fprintf(stdout, "Starting to receive...\n");
+                conn->proto = PROTO_RECV;
+                return CONN_PROGRESS;
+            }
+            /* nobody was asked, the pulls and the queries are for the allowed peers only */
+            if ((flags & (START_TRANSFER | RECEIVE_OPERATION)) == (START_TRANSFER | RECEIVE_OPERATION) ||
+                (flags & QUERY_FLAGS)) {
+                if (!conn_may_read(conn)) {
+                    ERROR("conn_on_packet", "a pull or a query from a peer not allowed", ERROR_APP);
+                    return conn_abort(conn);
+                }
+                if (flags & RECEIVE_OPERATION)
+                    return conn_start_send(conn, conn->payload);
+                if (conn->caps & CAP_QUERIES)
+                    return conn_answer_query(conn, flags, conn->payload);
+            }
+            return CONN_CLOSE;
+        case PROTO_RECV:
+            switch (recv_state_on_packet(&conn->rs, flags, conn->payload, conn->payload_size)) {
+                case RECV_STATE_CONTINUE:
+                    if (recv_state_wants_data(&conn->rs))
+                        conn->io = IO_FILE_DATA;
+                    return CONN_PROGRESS;
+                case RECV_STATE_ERROR:
+                    return conn_abort(conn);
+                default:
+                    return CONN_CLOSE;
+            }
+        default:
+            /* nothing expected from a peer we send to, except an abortion */
+            if (flags & ABORT_TRANSFER)
+                fprintf(stdout, "Abort transfer...\n");
+            return CONN_CLOSE;
+    }
+}
+
+static conn_status_t conn_read_file_data(engine_conn_t *conn, int64_t *budget)
+{
+    int64_t moved;
+
+    moved = recv_state_on_data(&conn->rs, conn->sock, *budget, 1);
+    if (moved == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return CONN_WAIT;
+        return conn_abort(conn);
+    }
+    if (moved == 0 && recv_state_wants_data(&conn->rs)) {
+        fprintf(stdout, "Connection lost...\n");
+        return CONN_CLOSE;
+    }
+    *budget -= moved;
+    if (!recv_state_wants_data(&conn->rs))
+        conn->io = IO_HEADER;
+    return CONN_PROGRESS;
+}
+
+static void conn_end_file(engine_conn_t *conn)
+{
+    if (conn->file_desc != -1) close(conn->file_desc);
+    conn->file_desc = -1;
+    free(conn->extents_buf);
+    conn->extents_buf = NULL;
+    conn->extents = NULL;
+    conn->extents_cnt = 0;
+}
+
+static int32_t conn_queue_packet(engine_conn_t *conn, char *data, uint32_t size, flag_t flags)
+{
+    uint32_t needed = conn->out_len + NET_PACKET_HEADER_SIZE + size;
+
+    if (needed > conn->out_size) {
+        uint32_t out_size = conn->out_size ? conn->out_size : SEND_BUF_SIZE;
+        char *out;
+        while (out_size < needed)
+            out_size *= 2;
+        if (!(out = (char *) realloc(conn->out, out_size))) {
+            ERROR("realloc", "", ERROR_OS);
+            return -1;
+        }
+        conn->out = out;
+        conn->out_size = out_size;
+    }
+    memcpy(&conn->out[conn->out_len], &size, sizeof(size));
+    memcpy(&conn->out[conn->out_len + sizeof(size)], &flags, sizeof(flags));
+    if (size)
+        memcpy(&conn->out[conn->out_len + NET_PACKET_HEADER_SIZE], data, size);
+    conn->out_len = needed;
+    return 0;
+}
+
+static conn_status_t conn_flush(engine_conn_t *conn)
+{
+    int64_t sent;
+
+    if (conn->out_sent < conn->out_len) {
+        sent = send(conn->sock, &conn->out[conn->out_sent], conn->out_len - conn->out_sent,
+                    MSG_NOSIGNAL | (conn->file_desc != -1 ? MSG_MORE : 0));
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_WAIT;
+            ERROR("send", "", ERROR_OS);
+            return CONN_CLOSE;
+        }
+        conn->out_sent += sent;
+        if (conn->out_sent < conn->out_len)
+            return CONN_PROGRESS;
+    }
+    conn->out_sent = conn->out_len = 0;
+
+    /* the packets announcing a file are out, its data follows */
+    if (conn->file_desc != -1) {
+        conn->io = IO_SEND_FILE;
+        return CONN_PROGRESS;
+    }
+    if (conn->proto == PROTO_DONE) {
+        fprintf(stdout, "End transfering...\n");
+        return CONN_CLOSE;
+    }
+    /* the walk reads the directories, opens the next file and maps its extents */
+    return conn_offload(conn, &conn_send_next);
+}
+
+static conn_status_t conn_start_send(engine_conn_t *conn, char *path)
+{
+    struct stat stat_buf;
+    char        *main_dir;
+    char        *served;
+    int32_t     path_len;
+    int32_t     dir_desc;
+
+    /* from SERVE_ROOT only */
+    if (!(served = protocol_served_path(path)))
+        return conn_abort(conn);
+    path_len = conn_path_join(conn, 0, served);
+    free(served);
+    if (path_len == -1)
+        return conn_abort(conn);
+    if (stat(conn->path, &stat_buf) == -1) {
+        ERROR("stat", conn->path, ERROR_OS);
+        return conn_abort(conn);
+    }
+    /* the paths are sent relative to the parent of the requested path */
+    main_dir = strrchr(conn->path, '/');
+    conn->prefix_len = main_dir ? main_dir + 1 - conn->path : 0;
+    if (!(conn->sent_inodes = inode_table_create()))
+        return conn_abort(conn);
+
+    if (conn_set_io(conn, IO_FLUSH) == -1 ||
+        conn_queue_packet(conn, NULL, 0, START_TRANSFER | SEND_OPERATION) == -1)
+        return conn_abort(conn);
+    conn->proto = PROTO_SEND_ENTRY;
+
+    if (S_ISDIR(stat_buf.st_mode)) {
+        if ( (dir_desc = open(conn->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+            ERROR("open", conn->path, ERROR_OS);
+            return conn_abort(conn);
+        }
+        if (conn_walk_push(conn, path_len, dir_desc) == -1)
+            return conn_abort(conn);
+        return CONN_PROGRESS;
+    }
+    if (S_ISREG(stat_buf.st_mode))
+        return conn_queue_file(conn, AT_FDCWD, conn->path);
+
+    /* nothing we know how to send */
+    if (conn_queue_packet(conn, NULL, 0, END_TRANSFER) == -1)
+        return conn_abort(conn);
+    conn->proto = PROTO_DONE;
+    return CONN_PROGRESS;
+}
+
+/* the directory is walked from its descriptor (owned from now on), the path is only sent */
+static int32_t conn_walk_push(engine_conn_t *conn, uint32_t path_len, int32_t dir_desc)
+{
+    DIR *dir;
+
+    if (conn->walk_depth == conn->walk_size) {
+        uint32_t walk_size = conn->walk_size ? conn->walk_size * 2 : 16;
+        walk_level_t *walk = (walk_level_t *) realloc(conn->walk, sizeof(walk_level_t) * walk_size);
+        if (!walk) {
+            ERROR("realloc", "", ERROR_OS);
+            close(dir_desc);
+            return -1;
+        }
+        conn->walk = walk;
+        conn->walk_size = walk_size;
+    }
+    if (!(dir = fdopendir(dir_desc))) {
+        ERROR("fdopendir", conn->path, ERROR_OS);
+        close(dir_desc);
+        return -1;
+    }
+    conn->walk[conn->walk_depth].dir = dir;
+    conn->walk[conn->walk_depth].path_len = path_len;
+    ++conn->walk_depth;
+
+    /* send the name of directory */
+    return conn_queue_packet(conn, &conn->path[conn->prefix_len], path_len - conn->prefix_len, DIR_TYPE);
+}
+
+static conn_status_t conn_send_next(engine_conn_t *conn)
+{
+    struct dirent   *entry;
+    walk_level_t    *level;
+    int32_t         path_len;
+    int32_t         dir_desc;
+
+    while (conn->walk_depth > 0) {
+        level = &conn->walk[conn->walk_depth - 1];
+        errno = 0;
+        if (!(entry = readdir(level->dir))) {
+            if (errno) {
+                ERROR("readdir", conn->path, ERROR_OS);
+                return conn_abort(conn);
+            }
+            closedir(level->dir);
+            --conn->walk_depth;
+            continue;
+        }
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        if ( (path_len = conn_path_join(conn, level->path_len, entry->d_name)) == -1)
+            return conn_abort(conn);
+        if (entry->d_type == DT_DIR) {
+            if ( (dir_desc = openat(dirfd(level->dir), entry->d_name, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+                ERROR("openat", conn->path, ERROR_OS);
+                return conn_abort(conn);
+            }
+            if (conn_walk_push(conn, path_len, dir_desc) == -1)
+                return conn_abort(conn);
+            return CONN_PROGRESS;
+        }
+        return conn_queue_file(conn, dirfd(level->dir), entry->d_name);
+    }
+
+    if (conn_queue_packet(conn, NULL, 0, END_TRANSFER) == -1)
+        return conn_abort(conn);
+    conn->proto = PROTO_DONE;
+    return CONN_PROGRESS;
+}
+
+static conn_status_t conn_queue_file(engine_conn_t *conn, int32_t dir_desc, const char *name)
+{
+    struct stat stat_buf;
+    char        *relpath = &conn->path[conn->prefix_len];
+    uint32_t    relpath_len = strlen(relpath);
+    flag_t      flag = FILE_TYPE;
+    const char  *target;
+
+    fprintf(stdout, "Sending %s ...\n", conn->path);
+
+    if ( (conn->file_desc = openat(dir_desc, name, O_RDONLY|O_CLOEXEC)) == -1) {
+        ERROR("openat", conn->path, ERROR_OS);
+        return conn_abort(conn);
+    }
+    if (fstat(conn->file_desc, &stat_buf) == -1) {
+        ERROR("fstat", conn->path, ERROR_OS);
+        return conn_abort(conn);
+    }
+    /* another link to a file already sent, the peer links it to its copy */
+    if ((conn->caps & CAP_HARDLINKS) && stat_buf.st_nlink > 1) {
+        if ((target = inode_table_find(conn->sent_inodes, stat_buf.st_dev, stat_buf.st_ino))) {
+            uint32_t target_len = strlen(target);
+            char *link_data = (char *) malloc(relpath_len + target_len + 1);
+            int32_t s;
+
+            conn_end_file(conn);
+            if (!link_data) {
+                ERROR("malloc", "", ERROR_OS);
+                return conn_abort(conn);
+            }
+            memcpy(link_data, relpath, relpath_len + 1);
+            memcpy(&link_data[relpath_len + 1], target, target_len);
+            s = conn_queue_packet(conn, link_data, relpath_len + target_len + 1, HARDLINK_TYPE);
+            free(link_data);
+            return s == -1 ? conn_abort(conn) : CONN_PROGRESS;
+        }
+        if (inode_table_insert(conn->sent_inodes, stat_buf.st_dev, stat_buf.st_ino, relpath) == -1)
+            return conn_abort(conn);
+    }
+
+    conn->extents = &conn->single_extent;
+    conn->extents_cnt = 1;
+    conn->single_extent.offset = 0;
+    conn->single_extent.length = stat_buf.st_size;
+    /* a file with holes is sent as a map of its data extents */
+    if ((conn->caps & CAP_SPARSE) && sparse_is_candidate(&stat_buf)) {
+        file_extent_t *extents;
+        uint32_t extents_cnt;
+
+        if (sparse_get_extents(conn->file_desc, stat_buf.st_size, &extents, &extents_cnt) == -1)
+            return conn_abort(conn);
+        if (extents_cnt == 1 && extents[0].offset == 0 &&
+            extents[0].length == (uint64_t) stat_buf.st_size) {
+            free(extents);
+        }
+        else {
+            conn->extents = extents;
+            conn->extents_buf = (char *) extents;
+            conn->extents_cnt = extents_cnt;
+            flag |= SPARSE_FILE;
+        }
+    }
+    /* the peer waits for the map of a sparse file, an empty one when it is all hole */
+    if (conn_queue_packet(conn, relpath, relpath_len, FILE_TYPE) == -1 ||
+        conn_queue_packet(conn, (char *) &stat_buf.st_size, sizeof(stat_buf.st_size), flag | FILE_SIZE) == -1 ||
+        ((flag & SPARSE_FILE) && conn_queue_packet(conn, conn->extents_buf,
+                                                   sizeof(file_extent_t) * conn->extents_cnt, EXTENT_MAP) == -1))
+        return conn_abort(conn);
+    conn->extent = 0;
+    conn->extent_done = 0;
+    return CONN_PROGRESS;
+}
+
+static int32_t conn_path_join(engine_conn_t *conn, uint32_t path_len, const char *name)
+{
+    uint32_t    name_len = strlen(name);
+    uint32_t    len = path_len ? path_len + 1 + name_len : name_len;
+    uint32_t    size;
+    char        *path;
+
+    if (len + 1 > conn->path_size) {
+        for (size = conn->path_size ? conn->path_size : PATH_SIZE; size < len + 1; size *= 2)
+            ;
+        if (!(path = (char *) realloc(conn->path, size))) {
+            ERROR("realloc", "", ERROR_OS);
+            return -1;
+        }
+        conn->path = path;
+        conn->path_size = size;
+    }
+    if (path_len)
+        conn->path[path_len++] = '/';
+    memcpy(&conn->path[path_len], name, name_len + 1);
+    return len;
+}
+
+static conn_status_t conn_send_file_data(engine_conn_t *conn, int64_t *budget)
+{
+    int64_t     sent;
+    uint64_t    remaining;
+    off_t       offset;
+
+    while (*budget > 0) {
+        if (conn->extent == conn->extents_cnt) {
+            conn_end_file(conn);
+            conn->io = IO_FLUSH;
+            return CONN_PROGRESS;
+        }
+        remaining = conn->extents[conn->extent].length - conn->extent_done;
+        if (remaining == 0) {
+            ++conn->extent;
+            conn->extent_done = 0;
+            continue;
+        }
+        offset = conn->extents[conn->extent].offset + conn->extent_done;
+        sent = sendfile(conn->sock, conn->file_desc, &offset,
+                        remaining < (uint64_t) *budget ? remaining : (uint64_t) *budget);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_WAIT;
+            ERROR("sendfile", conn->path, ERROR_OS);
+            return CONN_CLOSE;
+        }
+        /* the file was truncated under us, the peer waits for more bytes */
+        if (sent == 0) {
+            ERROR("sendfile", "unexpected end of file", ERROR_APP);
+            return CONN_CLOSE;
+        }
+        conn->extent_done += sent;
+        *budget -= sent;
+    }
+    return CONN_PROGRESS;
+}
+
+static conn_status_t conn_answer_query(engine_conn_t *conn, flag_t flags, char *path)
+{
+    /* the index answers from memory, a cold du walks the disk (on a worker) once */
+    if (conn_set_io(conn, IO_FLUSH) == -1 ||
+        query_answer(flags, path, &conn_queue_reply, conn) == -1)
+        return CONN_CLOSE;
+    conn->proto = PROTO_DONE;
+    return CONN_PROGRESS;
+}
+
+static int32_t conn_queue_reply(void *arg, char *data, uint32_t size, flag_t flags)
+{
+    return conn_queue_packet((engine_conn_t *) arg, data, size, flags);
+}
+
+/* whether the peer is in ENGINE_SERVE_ALLOW */
+static int8_t conn_may_read(engine_conn_t *conn)
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len = sizeof(addr);
+    char                    ip[INET6_ADDRSTRLEN];
+    char                    allow[] = ENGINE_SERVE_ALLOW;
+    char                    *save;
+    char                    *item;
+    const void              *src;
+
+    if (getpeername(conn->sock, (struct sockaddr *) &addr, &addr_len) == -1)
+        return 0;
+    if (addr.ss_family == AF_INET)
+        src = &((struct sockaddr_in *) &addr)->sin_addr;
+    else if (addr.ss_family == AF_INET6)
+        src = &((struct sockaddr_in6 *) &addr)->sin6_addr;
+    else
+        return 0;
+    if (!inet_ntop(addr.ss_family, src, ip, sizeof(ip)))
+        return 0;
+    for (item = strtok_r(allow, ", ", &save); item; item = strtok_r(NULL, ", ", &save)) {
+        if (strcmp(item, ip) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+#undef ENGINE_C
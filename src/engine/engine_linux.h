@@ -0,0 +1,54 @@
+/**
+ * @file engine_linux.h
+ * @brief The epoll event engine header
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "data_types.h"
+
+#ifdef ENGINE_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* ENGINE_C */
+
+struct engine_conn;
+
+/** one epoll loop, running on its own thread */
+typedef struct {
+    int32_t             epoll_fd;
+    int32_t             event_fd;       /* the workers ring it when a job is done */
+    pthread_t           TID;
+    volatile uint32_t   conns_cnt;
+    struct engine_conn  *conns;         /* the connections owned by this reactor */
+    struct engine_conn  *done;          /* their disk jobs done, under conns_lock */
+    pthread_mutex_t     conns_lock;
+} engine_reactor_t;
+
+typedef struct {
+    engine_reactor_t    *reactors;
+    uint32_t            reactors_cnt;
+    volatile uint32_t   next_reactor;
+
+    /* the workers doing the disk work of the reactors */
+    pthread_t           *workers;
+    uint32_t            workers_cnt;
+    struct engine_conn  *jobs;          /* first in, first out */
+    struct engine_conn  *jobs_tail;
+    int8_t              stopping;
+    pthread_mutex_t     jobs_lock;
+    pthread_cond_t      jobs_cond;
+} engine_t;
+
+/* engine functions */
+EXTERN engine_t *engine_create(uint32_t threads_cnt, uint32_t workers_cnt);
+EXTERN int32_t engine_add_connection(engine_t *engine, SOCKET sock_desc);
+EXTERN void engine_destroy(engine_t *engine);
+
+#undef EXTERN
+#endif /* ENGINE_H */
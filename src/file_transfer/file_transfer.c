@@ -0,0 +1,328 @@
+/**
+ * @file file_transfer.c
+ * @brief The embeddable transfers API: the sends and receives are queued and
+ *        return at once, a pool of workers runs them over the peers' sessions
+ *        (or one connection each, with the peers without), and their ends are
+ *        called back or polled. The state and the bytes done of any transfer
+ *        not yet reported can be asked for at any time.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef UNIX
+#include <signal.h>
+#endif /* UNIX */
+
+#define FILE_TRANSFER_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "pacing.h"
+#include "peer.h"
+#include "receive.h"
+#include "send.h"
+#include "file_transfer.h"
+
+/* internal functions' prototypes */
+static int32_t  submit(file_transfer_t *ft, int8_t receive, const char *path, const char *ip, qos_class_t qos,
+                       file_transfer_done_t done, void *arg);
+static void     *worker(void *arg);
+static void     run(file_transfer_item_t *item);
+static file_transfer_item_t **find(file_transfer_t *ft, int32_t id);
+static void     status_of(const file_transfer_item_t *item, file_transfer_status_t *status);
+
+/* internal constants */
+static const uint32_t buckets_cnt = 4096;
+
+/**
+ * Start concurrency workers, the transfers to the same peer share its session.
+ * The workers block SIGPIPE, the process does not need to ignore it
+ */
+file_transfer_t *file_transfer_create(uint32_t concurrency)
+{
+    file_transfer_t *ft;
+    int32_t         s;
+
+    ft = (file_transfer_t *) calloc(1, sizeof(file_transfer_t));
+    if (!ft) {
+        ERROR("calloc", "", ERROR_OS);
+        return NULL;
+    }
+    if (!concurrency)
+        concurrency = 1;
+    ft->workers = (pthread_t *) calloc(concurrency, sizeof(pthread_t));
+    ft->buckets = (file_transfer_item_t **) calloc(buckets_cnt, sizeof(file_transfer_item_t *));
+    if (!ft->workers || !ft->buckets) {
+        ERROR("calloc", "", ERROR_OS);
+        free(ft->workers);
+        free(ft->buckets);
+        free(ft);
+        return NULL;
+    }
+    ft->buckets_cnt = buckets_cnt;
+    ft->next_id = 1;
+    pthread_mutex_init(&ft->lock, NULL);
+    pthread_cond_init(&ft->queued, NULL);
+    pthread_cond_init(&ft->ended, NULL);
+
+    for (uint32_t i = 0; i < concurrency; ++i) {
+        s = pthread_create(&ft->workers[i], NULL, &worker, ft);
+        if (s != 0) {
+            errno = s;
+            ERROR("pthread_create", "", ERROR_OS);
+            break;
+        }
+        ++ft->workers_cnt;
+    }
+    if (!ft->workers_cnt) {
+        file_transfer_destroy(ft);
+        return NULL;
+    }
+    return ft;
+}
+
+/** Queue the send of path to ip, returns its id, or -1 */
+int32_t file_transfer_send(file_transfer_t *ft, const char *path, const char *ip, qos_class_t qos,
+                           file_transfer_done_t done, void *arg)
+{
+    return submit(ft, 0, path, ip, qos, done, arg);
+}
+
+/** Queue asking ip for path (received in RECEIVING_PATH), returns its id, or -1 */
+int32_t file_transfer_receive(file_transfer_t *ft, const char *path, const char *ip,
+                              file_transfer_done_t done, void *arg)
+{
+    return submit(ft, 1, path, ip, DEFAULT_QOS_CLASS, done, arg);
+}
+
+/**
+ * Up to max of the ended transfers submitted without a callback, waiting
+ * timeout_ms for one at most (forever when negative). Their ids are not
+ * known any more once returned. Returns how many, or -1
+ */
+int32_t file_transfer_poll(file_transfer_t *ft, file_transfer_status_t *statuses, uint32_t max,
+                           int32_t timeout_ms)
+{
+    file_transfer_item_t    *item;
+    struct timespec         deadline;
+    uint32_t                cnt = 0;
+    int32_t                 s = 0;
+
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    pthread_mutex_lock(&ft->lock);
+    while (!ft->done_head && timeout_ms && s != ETIMEDOUT) {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&ft->ended, &ft->lock);
+        else
+            s = pthread_cond_timedwait(&ft->ended, &ft->lock, &deadline);
+    }
+    while (cnt < max && (item = ft->done_head)) {
+        if (!(ft->done_head = item->next))
+            ft->done_tail = NULL;
+        status_of(item, &statuses[cnt++]);
+        *find(ft, item->id) = item->bucket_next;
+        free(item);
+    }
+    pthread_mutex_unlock(&ft->lock);
+    return cnt;
+}
+
+/** The state of a transfer not yet reported ended, -1 for an unknown id */
+int32_t file_transfer_progress(file_transfer_t *ft, int32_t id, file_transfer_status_t *status)
+{
+    file_transfer_item_t *item;
+
+    pthread_mutex_lock(&ft->lock);
+    if ((item = *find(ft, id)))
+        status_of(item, status);
+    pthread_mutex_unlock(&ft->lock);
+    return item ? 0 : -1;
+}
+
+/**
+ * The running transfers end first, the queued ones are dropped without their
+ * callbacks. The ended ones not polled are lost
+ */
+void file_transfer_destroy(file_transfer_t *ft)
+{
+    file_transfer_item_t *item;
+
+    pthread_mutex_lock(&ft->lock);
+    ft->stopping = 1;
+    pthread_cond_broadcast(&ft->queued);
+    pthread_mutex_unlock(&ft->lock);
+    for (uint32_t i = 0; i < ft->workers_cnt; ++i)
+        pthread_join(ft->workers[i], NULL);
+
+    for (uint32_t i = 0; i < ft->buckets_cnt; ++i) {
+        while ((item = ft->buckets[i])) {
+            ft->buckets[i] = item->bucket_next;
+            free(item);
+        }
+    }
+    peer_close_sessions();
+    pthread_cond_destroy(&ft->queued);
+    pthread_cond_destroy(&ft->ended);
+    pthread_mutex_destroy(&ft->lock);
+    free(ft->buckets);
+    free(ft->workers);
+    free(ft);
+}
+
+static int32_t submit(file_transfer_t *ft, int8_t receive, const char *path, const char *ip, qos_class_t qos,
+                      file_transfer_done_t done, void *arg)
+{
+    file_transfer_item_t    *item;
+    file_transfer_item_t    **bucket;
+
+    if (strlen(path) >= PATH_SIZE || strlen(ip) >= sizeof(item->ip)) {
+        errno = ENAMETOOLONG;
+        ERROR("file_transfer_submit", path, ERROR_OS);
+        return -1;
+    }
+    if (!(item = (file_transfer_item_t *) calloc(1, sizeof(file_transfer_item_t)))) {
+        ERROR("calloc", "", ERROR_OS);
+        return -1;
+    }
+    item->receive = receive;
+    item->qos = qos;
+    item->state = FILE_TRANSFER_QUEUED;
+    item->done = done;
+    item->arg = arg;
+    strcpy(item->ip, ip);
+    strcpy(item->path, path);
+
+    pthread_mutex_lock(&ft->lock);
+    if (ft->stopping) {
+        pthread_mutex_unlock(&ft->lock);
+        free(item);
+        return -1;
+    }
+    item->id = ft->next_id;
+    /* the ids wrap, those still in the table are passed over */
+    do {
+        ft->next_id = ft->next_id == INT32_MAX ? 1 : ft->next_id + 1;
+    } while (*find(ft, ft->next_id));
+    bucket = &ft->buckets[(uint32_t) item->id % ft->buckets_cnt];
+    item->bucket_next = *bucket;
+    *bucket = item;
+    if (ft->queue_tail)
+        ft->queue_tail->next = item;
+    else
+        ft->queue_head = item;
+    ft->queue_tail = item;
+    pthread_cond_signal(&ft->queued);
+    pthread_mutex_unlock(&ft->lock);
+    return item->id;
+}
+
+static void *worker(void *arg)
+{
+    file_transfer_t         *ft = (file_transfer_t *) arg;
+    file_transfer_item_t    *item;
+    file_transfer_status_t  status;
+#ifdef UNIX
+    sigset_t                pipe_set;
+
+    /* a closed peer is an EPIPE of its transfer, the pending signal is dropped after it */
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, NULL);
+#endif /* UNIX */
+
+    pthread_mutex_lock(&ft->lock);
+    for (;;) {
+        while (!ft->queue_head && !ft->stopping)
+            pthread_cond_wait(&ft->queued, &ft->lock);
+        if (ft->stopping)
+            break;
+        item = ft->queue_head;
+        if (!(ft->queue_head = item->next))
+            ft->queue_tail = NULL;
+        item->next = NULL;
+        item->state = FILE_TRANSFER_RUNNING;
+        pthread_mutex_unlock(&ft->lock);
+
+        run(item);
+#ifdef UNIX
+        {
+            struct timespec now = { 0, 0 };
+
+            while (sigtimedwait(&pipe_set, NULL, &now) == SIGPIPE)
+                ;
+        }
+#endif /* UNIX */
+
+        if (item->done) {
+            /* called without the lock, it may submit again */
+            status_of(item, &status);
+            item->done(&status, item->arg);
+            pthread_mutex_lock(&ft->lock);
+            *find(ft, item->id) = item->bucket_next;
+            free(item);
+            continue;
+        }
+        pthread_mutex_lock(&ft->lock);
+        if (ft->done_tail)
+            ft->done_tail->next = item;
+        else
+            ft->done_head = item;
+        ft->done_tail = item;
+        pthread_cond_broadcast(&ft->ended);
+    }
+    pthread_mutex_unlock(&ft->lock);
+    return NULL;
+}
+
+static void run(file_transfer_item_t *item)
+{
+    int8_t s;
+
+    if (item->receive) {
+        receive_progress(&item->progress);
+        s = peer_receive(item->path, item->ip);
+        receive_progress(NULL);
+    }
+    else {
+        send_progress(&item->progress);
+        s = peer_send(item->path, item->ip, item->qos);
+        send_progress(NULL);
+    }
+    item->state = s == -1 ? FILE_TRANSFER_FAILED : FILE_TRANSFER_DONE;
+}
+
+/** where the item of id is linked from, pointing to NULL when there is none */
+static file_transfer_item_t **find(file_transfer_t *ft, int32_t id)
+{
+    file_transfer_item_t **link = &ft->buckets[(uint32_t) id % ft->buckets_cnt];
+
+    while (*link && (*link)->id != id)
+        link = &(*link)->bucket_next;
+    return link;
+}
+
+static void status_of(const file_transfer_item_t *item, file_transfer_status_t *status)
+{
+    status->id = item->id;
+    status->state = item->state;
+    status->bytes = item->progress.bytes;
+    status->files = item->progress.files;
+    status->chunk_size = item->progress.chunk_size;
+    status->pipe_size = item->progress.pipe_size;
+}
+
+#undef FILE_TRANSFER_C
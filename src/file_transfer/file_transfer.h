@@ -0,0 +1,84 @@
+/**
+ * @file file_transfer.h
+ * @brief The embeddable transfers API (libfile_transfer) header
+ */
+
+#ifndef FILE_TRANSFER_H
+#define FILE_TRANSFER_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "data_types.h"
+#include "pacing.h"
+
+#ifdef FILE_TRANSFER_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* FILE_TRANSFER_C */
+
+typedef enum {
+    FILE_TRANSFER_QUEUED   = 0,
+    FILE_TRANSFER_RUNNING  = 1,
+    FILE_TRANSFER_DONE     = 2,
+    FILE_TRANSFER_FAILED   = 3
+} file_transfer_state_t;
+
+/** where a transfer is, as file_transfer_progress() and the completions tell it */
+typedef struct {
+    int32_t                 id;
+    file_transfer_state_t   state;
+    uint64_t                bytes;
+    uint64_t                files;
+    uint32_t                chunk_size;     /* the chunk and pipe sizes chosen for it, 0 until known */
+    uint32_t                pipe_size;
+} file_transfer_status_t;
+
+/** called by a worker thread when a transfer ends, status is only valid during the call */
+typedef void (*file_transfer_done_t)(const file_transfer_status_t *status, void *arg);
+
+/** a submitted transfer, kept until its completion is called back or polled */
+typedef struct file_transfer_item {
+    int32_t                     id;
+    int8_t                      receive;
+    qos_class_t                 qos;
+    volatile file_transfer_state_t state;
+    transfer_progress_t         progress;
+    file_transfer_done_t        done;
+    void                        *arg;
+    char                        ip[64];
+    char                        path[PATH_SIZE];
+    struct file_transfer_item   *next;          /* in the queue or in the done list */
+    struct file_transfer_item   *bucket_next;   /* in the table by id */
+} file_transfer_item_t;
+
+typedef struct {
+    file_transfer_item_t    *queue_head;
+    file_transfer_item_t    *queue_tail;
+    file_transfer_item_t    *done_head;     /* the ended ones without a callback */
+    file_transfer_item_t    *done_tail;
+    file_transfer_item_t    **buckets;
+    uint32_t                buckets_cnt;
+    int32_t                 next_id;
+    int8_t                  stopping;
+    pthread_mutex_t         lock;
+    pthread_cond_t          queued;
+    pthread_cond_t          ended;
+    pthread_t               *workers;
+    uint32_t                workers_cnt;
+} file_transfer_t;
+
+/* file transfer functions */
+EXTERN file_transfer_t *file_transfer_create(uint32_t concurrency);
+EXTERN int32_t file_transfer_send(file_transfer_t *ft, const char *path, const char *ip, qos_class_t qos,
+                                  file_transfer_done_t done, void *arg);
+EXTERN int32_t file_transfer_receive(file_transfer_t *ft, const char *path, const char *ip,
+                                     file_transfer_done_t done, void *arg);
+EXTERN int32_t file_transfer_poll(file_transfer_t *ft, file_transfer_status_t *statuses, uint32_t max,
+                                  int32_t timeout_ms);
+EXTERN int32_t file_transfer_progress(file_transfer_t *ft, int32_t id, file_transfer_status_t *status);
+EXTERN void file_transfer_destroy(file_transfer_t *ft);
+
+#undef EXTERN
+#endif /* FILE_TRANSFER_H */
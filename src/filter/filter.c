@@ -0,0 +1,333 @@
+/**
+ * @file filter.c
+ * @brief The include/exclude rules of the sent trees, read once from
+ *        SEND_FILTER_PATH: "- pattern" leaves out the entries it matches,
+ *        "+ pattern" keeps them, the first matching rule wins. A pattern
+ *        ending with '/' only matches directories, one with another '/' is
+ *        matched against the path from the root of the sent tree and not
+ *        against the name. Every rule is compiled to the cheapest test it
+ *        allows: the literal names are hashed, "prefix*" and "*suffix" are
+ *        compared, only the other ones go through the glob matcher.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define FILTER_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "filter.h"
+
+/* internal functions' prototypes */
+static void     default_load(void);
+static int32_t  rule_compile(filter_rule_t *rule, char *line);
+static int8_t   rule_match(const filter_rule_t *rule, const char *subject);
+static int32_t  literals_hash(filter_t *filter);
+static int8_t   glob_match(const char *pattern, const char *string);
+static uint32_t hash_name(const char *name, uint32_t len);
+
+/* internal variables */
+static filter_t         *default_filter;
+static pthread_once_t   default_once = PTHREAD_ONCE_INIT;
+
+filter_t *filter_load(const char *path)
+{
+    filter_t        *filter;
+    filter_rule_t   *rules;
+    FILE            *file;
+    char            line[PATH_SIZE];
+    uint32_t        size = 0;
+    uint32_t        line_nr = 0;
+
+    if (!(file = fopen(path, "r"))) {
+        if (errno != ENOENT)
+            ERROR("fopen", path, ERROR_OS);
+        return NULL;
+    }
+    if (!(filter = (filter_t *) calloc(1, sizeof(filter_t)))) {
+        ERROR("calloc", "", ERROR_OS);
+        fclose(file);
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        ++line_nr;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        if (filter->rules_cnt == size) {
+            size = size ? size * 2 : 16;
+            if (!(rules = (filter_rule_t *) realloc(filter->rules, size * sizeof(filter_rule_t)))) {
+                ERROR("realloc", "", ERROR_OS);
+                goto error;
+            }
+            filter->rules = rules;
+        }
+        if (rule_compile(&filter->rules[filter->rules_cnt], line) == -1) {
+            fprintf(stdout, "%s:%u: not a \"+ pattern\" or \"- pattern\" rule, left out\n", path, line_nr);
+            fflush(stdout);
+            continue;
+        }
+        ++filter->rules_cnt;
+    }
+    fclose(file);
+    file = NULL;
+    if (!filter->rules_cnt || literals_hash(filter) == -1)
+        goto error;
+    return filter;
+
+ error:
+    if (file)
+        fclose(file);
+    filter_destroy(filter);
+    return NULL;
+}
+
+/** the rules of SEND_FILTER_PATH, NULL when there are none */
+const filter_t *filter_default(void)
+{
+    pthread_once(&default_once, &default_load);
+    return default_filter;
+}
+
+/**
+ * Whether an entry is left out: its name, its path from the root of the sent
+ * tree and whether it is a directory (then its whole subtree is)
+ */
+int8_t filter_excluded(const filter_t *filter, const char *name, const char *path, int8_t is_dir)
+{
+    const filter_rule_t *rule;
+    uint32_t            len = strlen(name);
+    uint32_t            best = filter->rules_cnt;
+    int32_t             i;
+
+    /* the first literal rule of this name, the chains are in the rules order */
+    for (i = filter->literals[hash_name(name, len) % filter->literals_buckets_cnt]; i != -1;
+         i = filter->literals_next[i]) {
+        rule = &filter->rules[i];
+        if ((!rule->dir_only || is_dir) && rule->len == len && memcmp(rule->pattern, name, len) == 0) {
+            best = i;
+            break;
+        }
+    }
+    /* the other rules, only those before it */
+    for (i = 0; i < (int32_t) best; ++i) {
+        rule = &filter->rules[i];
+        if ((rule->kind == FILTER_LITERAL && !rule->anchored) || (rule->dir_only && !is_dir))
+            continue;
+        if (rule_match(rule, rule->anchored ? path : name)) {
+            best = i;
+            break;
+        }
+    }
+    return best < filter->rules_cnt && !filter->rules[best].include;
+}
+
+void filter_destroy(filter_t *filter)
+{
+    if (!filter)
+        return;
+    for (uint32_t i = 0; i < filter->rules_cnt; ++i)
+        free(filter->rules[i].pattern);
+    free(filter->rules);
+    free(filter->literals);
+    free(filter->literals_next);
+    free(filter);
+}
+
+static void default_load(void)
+{
+    default_filter = filter_load(SEND_FILTER_PATH);
+}
+
+static int32_t rule_compile(filter_rule_t *rule, char *line)
+{
+    char        *pattern = &line[2];
+    uint32_t    len;
+    uint32_t    stars = 0;
+    uint32_t    wildcards = 0;
+
+    if ((line[0] != '+' && line[0] != '-') || line[1] != ' ')
+        return -1;
+    memset(rule, 0, sizeof(filter_rule_t));
+    rule->include = line[0] == '+';
+    len = strlen(pattern);
+    if (len && pattern[len - 1] == '/') {
+        rule->dir_only = 1;
+        pattern[--len] = '\0';
+    }
+    if (pattern[0] == '/') {
+        rule->anchored = 1;
+        ++pattern;
+        --len;
+    }
+    if (!len)
+        return -1;
+    if (strchr(pattern, '/'))
+        rule->anchored = 1;
+
+    for (uint32_t i = 0; i < len; ++i) {
+        if (pattern[i] == '*')
+            ++stars;
+        if (strchr("*?[\\", pattern[i]))
+            ++wildcards;
+    }
+    rule->kind = FILTER_GLOB;
+    if (!wildcards) {
+        rule->kind = FILTER_LITERAL;
+    }
+    else if (stars == 1 && wildcards == 1 && pattern[len - 1] == '*') {
+        rule->kind = FILTER_PREFIX;
+        pattern[--len] = '\0';
+    }
+    else if (stars == 1 && wildcards == 1 && pattern[0] == '*') {
+        rule->kind = FILTER_SUFFIX;
+        ++pattern;
+        --len;
+    }
+    if (!(rule->pattern = strdup(pattern))) {
+        ERROR("strdup", "", ERROR_OS);
+        return -1;
+    }
+    rule->len = len;
+    return 0;
+}
+
+static int8_t rule_match(const filter_rule_t *rule, const char *subject)
+{
+    uint32_t len;
+
+    switch (rule->kind) {
+    case FILTER_LITERAL:
+        return strcmp(rule->pattern, subject) == 0;
+    case FILTER_PREFIX:
+        /* the '*' does not go past a '/' */
+        return strncmp(rule->pattern, subject, rule->len) == 0 && !strchr(&subject[rule->len], '/');
+    case FILTER_SUFFIX:
+        len = strlen(subject);
+        return len >= rule->len && memcmp(&subject[len - rule->len], rule->pattern, rule->len) == 0 &&
+               !memchr(subject, '/', len - rule->len);
+    default:
+        return glob_match(rule->pattern, subject);
+    }
+}
+
+/** the unanchored literal rules by name, each chain in the rules order */
+static int32_t literals_hash(filter_t *filter)
+{
+    int32_t     *tails;
+    uint32_t    bucket;
+
+    filter->literals_buckets_cnt = filter->rules_cnt * 2;
+    filter->literals = (int32_t *) malloc(filter->literals_buckets_cnt * sizeof(int32_t));
+    filter->literals_next = (int32_t *) malloc(filter->rules_cnt * sizeof(int32_t));
+    tails = (int32_t *) malloc(filter->literals_buckets_cnt * sizeof(int32_t));
+    if (!filter->literals || !filter->literals_next || !tails) {
+        ERROR("malloc", "", ERROR_OS);
+        free(tails);
+        return -1;
+    }
+    for (uint32_t i = 0; i < filter->literals_buckets_cnt; ++i)
+        filter->literals[i] = tails[i] = -1;
+    for (uint32_t i = 0; i < filter->rules_cnt; ++i) {
+        filter->literals_next[i] = -1;
+        if (filter->rules[i].kind != FILTER_LITERAL || filter->rules[i].anchored)
+            continue;
+        bucket = hash_name(filter->rules[i].pattern, filter->rules[i].len) % filter->literals_buckets_cnt;
+        if (tails[bucket] == -1)
+            filter->literals[bucket] = i;
+        else
+            filter->literals_next[tails[bucket]] = i;
+        tails[bucket] = i;
+    }
+    free(tails);
+    return 0;
+}
+
+/** '*' and '?' don't match a '/', "**" does, "[a-z]" and "[!a-z]" are classes, '\' escapes */
+static int8_t glob_match(const char *pattern, const char *string)
+{
+    const char  *class;
+    int8_t      negate;
+    int8_t      found;
+
+    for (; *pattern; ++pattern, ++string) {
+        switch (*pattern) {
+        case '*':
+            if (pattern[1] == '*') {
+                while (*pattern == '*')
+                    ++pattern;
+                /* "**" and its '/' may also stand for no directory at all */
+                if (*pattern == '/' && glob_match(pattern + 1, string))
+                    return 1;
+                for (;; ++string) {
+                    if (glob_match(pattern, string))
+                        return 1;
+                    if (!*string)
+                        return 0;
+                }
+            }
+            for (++pattern;; ++string) {
+                if (glob_match(pattern, string))
+                    return 1;
+                if (!*string || *string == '/')
+                    return 0;
+            }
+        case '?':
+            if (!*string || *string == '/')
+                return 0;
+            break;
+        case '[':
+            if (!*string || *string == '/')
+                return 0;
+            class = pattern + 1;
+            negate = *class == '!' || *class == '^';
+            class += negate;
+            found = 0;
+            /* a ']' first is one of the class */
+            do {
+                if (!*class)
+                    return 0;
+                if (class[1] == '-' && class[2] && class[2] != ']') {
+                    if (*string >= class[0] && *string <= class[2])
+                        found = 1;
+                    class += 3;
+                }
+                else {
+                    if (*class == *string)
+                        found = 1;
+                    ++class;
+                }
+            } while (*class != ']');
+            if (found == negate)
+                return 0;
+            pattern = class;
+            break;
+        case '\\':
+            if (pattern[1])
+                ++pattern;
+            /* fall through */
+        default:
+            if (*pattern != *string)
+                return 0;
+        }
+    }
+    return !*string;
+}
+
+static uint32_t hash_name(const char *name, uint32_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    /* FNV-1a */
+    for (uint32_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+#undef FILTER_C
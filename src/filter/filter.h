@@ -0,0 +1,53 @@
+/**
+ * @file filter.h
+ * @brief The include/exclude rules of the sent trees header
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <inttypes.h>
+
+#include "data_types.h"
+
+#ifdef FILTER_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* FILTER_C */
+
+/** how a pattern is matched, the cheapest way it allows */
+typedef enum {
+    FILTER_LITERAL  = 0,                /* "node_modules" */
+    FILTER_PREFIX   = 1,                /* "cache*" */
+    FILTER_SUFFIX   = 2,                /* "*.o" */
+    FILTER_GLOB     = 3                 /* '*', '?', "[...]" and "**" anywhere */
+} filter_kind_t;
+
+/** a "+ pattern" or "- pattern" line */
+typedef struct {
+    char            *pattern;           /* the literal part for a prefix or a suffix */
+    uint32_t        len;
+    filter_kind_t   kind;
+    int8_t          include;
+    int8_t          dir_only;           /* "pattern/" */
+    int8_t          anchored;           /* with a '/': matched against the path from the root */
+} filter_rule_t;
+
+/** the rules, the literal names also hashed to their rules */
+typedef struct {
+    filter_rule_t   *rules;
+    uint32_t        rules_cnt;
+    int32_t         *literals;          /* the first rule of each bucket, -1 for none */
+    int32_t         *literals_next;     /* the next literal rule of the same bucket */
+    uint32_t        literals_buckets_cnt;
+} filter_t;
+
+/* filter functions */
+EXTERN filter_t *filter_load(const char *path);
+EXTERN const filter_t *filter_default(void);
+EXTERN int8_t filter_excluded(const filter_t *filter, const char *name, const char *path, int8_t is_dir);
+EXTERN void filter_destroy(filter_t *filter);
+
+#undef EXTERN
+#endif /* FILTER_H */
@@ -0,0 +1,125 @@
+/**
+ * @file inode_table.c
+ * @brief A hash table from (device, inode) to the first path seen for it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#define INODE_TABLE_C
+#include "config.h"
+#include "error.h"
+#include "inode_table.h"
+
+/* internal functions' prototypes */
+static uint32_t inode_hash(dev_t dev, ino_t ino, uint32_t buckets_cnt);
+static int32_t  inode_table_grow(inode_table_t *table);
+
+/* internal constants */
+#define INODE_TABLE_INITIAL_BUCKETS 256
+
+inode_table_t *inode_table_create(void)
+{
+    inode_table_t *table = (inode_table_t *) malloc(sizeof(inode_table_t));
+    
+    if (!table) {
+        ERROR("malloc", "", ERROR_OS);
+        return NULL;
+    }
+    table->buckets_cnt = INODE_TABLE_INITIAL_BUCKETS;
+    table->cnt = 0;
+    table->buckets = (inode_entry_t **) calloc(table->buckets_cnt, sizeof(inode_entry_t *));
+    if (!table->buckets) {
+        ERROR("calloc", "", ERROR_OS);
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+const char *inode_table_find(inode_table_t *table, dev_t dev, ino_t ino)
+{
+    inode_entry_t *entry = table->buckets[inode_hash(dev, ino, table->buckets_cnt)];
+    
+    for (; entry; entry = entry->next)
+        if (entry->dev == dev && entry->ino == ino)
+            return entry->path;
+    return NULL;
+}
+
+int32_t inode_table_insert(inode_table_t *table, dev_t dev, ino_t ino, const char *path)
+{
+    inode_entry_t   *entry;
+    uint32_t        bucket;
+    
+    /* keep the load factor under 1 */
+    if (table->cnt >= table->buckets_cnt && inode_table_grow(table) == -1)
+        return -1;
+    
+    entry = (inode_entry_t *) malloc(sizeof(inode_entry_t));
+    if (!entry || !(entry->path = strdup(path))) {
+        ERROR("malloc", "", ERROR_OS);
+        free(entry);
+        return -1;
+    }
+    entry->dev = dev;
+    entry->ino = ino;
+    bucket = inode_hash(dev, ino, table->buckets_cnt);
+    entry->next = table->buckets[bucket];
+    table->buckets[bucket] = entry;
+    ++table->cnt;
+    return 0;
+}
+
+void inode_table_destroy(inode_table_t *table)
+{
+    inode_entry_t *entry, *next;
+    
+    if (!table) return;
+    for (uint32_t i = 0; i < table->buckets_cnt; ++i)
+        for (entry = table->buckets[i]; entry; entry = next) {
+            next = entry->next;
+            free(entry->path);
+            free(entry);
+        }
+    free(table->buckets);
+    free(table);
+}
+
+static uint32_t inode_hash(dev_t dev, ino_t ino, uint32_t buckets_cnt)
+{
+    /* 64 bits multiplicative hash, the number of buckets is a power of 2 */
+    uint64_t key = (uint64_t) ino ^ ((uint64_t) dev << 32 | (uint64_t) dev >> 32);
+    key *= 0x9e3779b97f4a7c15ULL;
+    return (uint32_t) (key >> 32) & (buckets_cnt - 1);
+}
+
+static int32_t inode_table_grow(inode_table_t *table)
+{
+    uint32_t        buckets_cnt = table->buckets_cnt * 2;
+    inode_entry_t   **buckets;
+    inode_entry_t   *entry, *next;
+    uint32_t        bucket;
+    
+    buckets = (inode_entry_t **) calloc(buckets_cnt, sizeof(inode_entry_t *));
+    if (!buckets) {
+        ERROR("calloc", "", ERROR_OS);
+        return -1;
+    }
+    for (uint32_t i = 0; i < table->buckets_cnt; ++i)
+        for (entry = table->buckets[i]; entry; entry = next) {
+            next = entry->next;
+            bucket = inode_hash(entry->dev, entry->ino, buckets_cnt);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+        }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->buckets_cnt = buckets_cnt;
+    return 0;
+}
+
+#undef INODE_TABLE_C
@@ -0,0 +1,39 @@
+/**
+ * @file inode_table.h
+ * @brief The (device, inode) table header
+ */
+
+#ifndef INODE_TABLE_H
+#define INODE_TABLE_H
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#ifdef INODE_TABLE_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* INODE_TABLE_C */
+
+/** a file already seen by the walker */
+typedef struct inode_entry {
+    dev_t               dev;
+    ino_t               ino;
+    char                *path;
+    struct inode_entry  *next;
+} inode_entry_t;
+
+typedef struct {
+    inode_entry_t       **buckets;
+    uint32_t            buckets_cnt;
+    uint32_t            cnt;
+} inode_table_t;
+
+/* inode table functions */
+EXTERN inode_table_t *inode_table_create(void);
+EXTERN const char *inode_table_find(inode_table_t *table, dev_t dev, ino_t ino);
+EXTERN int32_t inode_table_insert(inode_table_t *table, dev_t dev, ino_t ino, const char *path);
+EXTERN void inode_table_destroy(inode_table_t *table);
+
+#undef EXTERN
+#endif /* INODE_TABLE_H */
@@ -0,0 +1,336 @@
+/**
+ * @file job_queue.c
+ * @brief The transfer jobs spool: the jobs are persisted, and a scheduler runs
+ *        them with a concurrency cap, by priority class and then smallest
+ *        estimated size first (to minimize the mean completion time). A job
+ *        waiting climbs a class every JOB_AGING seconds, and once above the
+ *        top one goes before the fresh jobs: none waits forever
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif /* UNIX */
+
+#define JOB_QUEUE_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "pacing.h"
+#include "job_queue.h"
+
+/* internal functions' prototypes */
+static void     *job_worker(void *arg);
+static job_t    *job_pick(job_queue_t *queue);
+static int32_t  job_class(job_t *job, time_t now);
+static void     job_remove(job_queue_t *queue, job_t *job);
+static int32_t  job_append(job_queue_t *queue, job_t *job);
+static void     job_queue_load(job_queue_t *queue);
+static void     job_queue_persist(job_queue_t *queue);
+static uint64_t estimate_size(const char *path);
+static int      estimate_size_entry(const char *path, const struct stat *stat_buf,
+                                    int type, struct FTW *ftw_buf);
+
+/* internal variables */
+static __thread uint64_t estimated_size;
+
+job_queue_t *job_queue_create(uint32_t concurrency, const char *spool_path, job_run_t run)
+{
+    job_queue_t *queue;
+    int32_t     s;
+
+    queue = (job_queue_t *) calloc(1, sizeof(job_queue_t));
+    if (!queue) {
+        ERROR("calloc", "", ERROR_OS);
+        return NULL;
+    }
+    queue->workers = (pthread_t *) calloc(concurrency ? concurrency : 1, sizeof(pthread_t));
+    if (!queue->workers) {
+        ERROR("calloc", "", ERROR_OS);
+        free(queue);
+        return NULL;
+    }
+    queue->run = run;
+    queue->next_id = 1;
+    snprintf(queue->spool_path, sizeof(queue->spool_path), "%s", spool_path);
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+
+    /* the jobs of the last run, the running ones are started again */
+    job_queue_load(queue);
+
+    for (uint32_t i = 0; i < (concurrency ? concurrency : 1); ++i) {
+        s = pthread_create(&queue->workers[i], NULL, &job_worker, queue);
+        if (s != 0) {
+            errno = s;
+            ERROR("pthread_create", "", ERROR_OS);
+            break;
+        }
+        pthread_detach(queue->workers[i]);
+        ++queue->workers_cnt;
+    }
+    if (!queue->workers_cnt) {
+        free(queue->workers);
+        free(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+int32_t job_queue_submit(job_queue_t *queue, const char *path, const char *ip, qos_class_t qos)
+{
+    job_t   *job;
+    int32_t id;
+
+    job = (job_t *) calloc(1, sizeof(job_t));
+    if (!job) {
+        ERROR("calloc", "", ERROR_OS);
+        return -1;
+    }
+    if (snprintf(job->path, sizeof(job->path), "%s", path) >= sizeof(job->path) ||
+        snprintf(job->ip, sizeof(job->ip), "%s", ip) >= sizeof(job->ip)) {
+        ERROR("job_queue_submit", "path or peer too long", ERROR_APP);
+        free(job);
+        return -1;
+    }
+    job->qos = qos;
+    job->size = estimate_size(path);
+    job->submit_time = time(NULL);
+    job->state = JOB_QUEUED;
+
+    pthread_mutex_lock(&queue->lock);
+    job->id = queue->next_id++;
+    if (job_append(queue, job) == -1) {
+        pthread_mutex_unlock(&queue->lock);
+        free(job);
+        return -1;
+    }
+    id = job->id;
+    job_queue_persist(queue);
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    return id;
+}
+
+void job_queue_print(job_queue_t *queue, FILE *stream)
+{
+    time_t  now = time(NULL);
+    job_t   *job;
+
+    pthread_mutex_lock(&queue->lock);
+    fprintf(stream, "queued %u, running %u/%u, done %u, failed %u, mean wait %.1lf s\n",
+            queue->jobs_cnt - queue->running_cnt, queue->running_cnt, queue->workers_cnt,
+            queue->done_cnt, queue->failed_cnt,
+            queue->done_cnt + queue->failed_cnt ? queue->total_wait / (queue->done_cnt + queue->failed_cnt) : 0.0);
+    for (uint32_t i = 0; i < queue->jobs_cnt; ++i) {
+        job = queue->jobs[i];
+        if (job->state == JOB_RUNNING)
+            fprintf(stream, "  #%u running %lds  %-11s %12" PRIu64 " B  %s -> %s\n", job->id,
+                    (long) (now - job->start_time), pacing_class_name(job->qos), job->size, job->path, job->ip);
+        else
+            fprintf(stream, "  #%u waiting %lds  %-11s %12" PRIu64 " B  %s -> %s\n", job->id,
+                    (long) (now - job->submit_time), pacing_class_name(job->qos), job->size, job->path, job->ip);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    fflush(stream);
+}
+
+static void *job_worker(void *arg)
+{
+    job_queue_t *queue = (job_queue_t *) arg;
+    job_t       *job;
+    int8_t      s;
+
+    while (1) {
+        pthread_mutex_lock(&queue->lock);
+        while (!(job = job_pick(queue)))
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        job->state = JOB_RUNNING;
+        job->start_time = time(NULL);
+        ++queue->running_cnt;
+        job_queue_persist(queue);
+        pthread_mutex_unlock(&queue->lock);
+
+        s = queue->run(job);
+
+        pthread_mutex_lock(&queue->lock);
+        --queue->running_cnt;
+        s == -1 ? ++queue->failed_cnt : ++queue->done_cnt;
+        queue->total_wait += difftime(job->start_time, job->submit_time);
+        job_remove(queue, job);
+        job_queue_persist(queue);
+        pthread_mutex_unlock(&queue->lock);
+
+        fprintf(stdout, "Job #%u %s\n", job->id, s == -1 ? "failed" : "done");
+        fflush(stdout);
+        free(job);
+    }
+    return NULL;
+}
+
+static job_t *job_pick(job_queue_t *queue)
+{
+    time_t  now = time(NULL);
+    job_t   *best = NULL;
+    job_t   *job;
+    int32_t best_class = 0;
+    int32_t class;
+
+    /* highest class first, then the shortest job, then the oldest one; the overdue ones by age */
+    for (uint32_t i = 0; i < queue->jobs_cnt; ++i) {
+        job = queue->jobs[i];
+        if (job->state != JOB_QUEUED)
+            continue;
+        class = job_class(job, now);
+        if (!best || class < best_class ||
+            (class == best_class && (class < 0 ? job->id < best->id :
+            (job->size < best->size || (job->size == best->size && job->id < best->id))))) {
+            best = job;
+            best_class = class;
+        }
+    }
+    return best;
+}
+
+/** The class of the job as it aged, below QOS_INTERACTIVE once overdue */
+static int32_t job_class(job_t *job, time_t now)
+{
+    int64_t waited = now - job->submit_time;
+
+    if (waited < JOB_AGING)
+        return job->qos;
+    return job->qos - waited / JOB_AGING < 0 ? -1 : job->qos - waited / JOB_AGING;
+}
+
+static void job_remove(job_queue_t *queue, job_t *job)
+{
+    for (uint32_t i = 0; i < queue->jobs_cnt; ++i)
+        if (queue->jobs[i] == job) {
+            queue->jobs[i] = queue->jobs[--queue->jobs_cnt];
+            return;
+        }
+}
+
+static int32_t job_append(job_queue_t *queue, job_t *job)
+{
+    if (queue->jobs_cnt == queue->jobs_size) {
+        uint32_t jobs_size = queue->jobs_size ? queue->jobs_size * 2 : 16;
+        job_t **jobs = (job_t **) realloc(queue->jobs, sizeof(job_t *) * jobs_size);
+        if (!jobs) {
+            ERROR("realloc", "", ERROR_OS);
+            return -1;
+        }
+        queue->jobs = jobs;
+        queue->jobs_size = jobs_size;
+    }
+    queue->jobs[queue->jobs_cnt++] = job;
+    return 0;
+}
+
+static void job_queue_load(job_queue_t *queue)
+{
+    FILE        *spool;
+    char        line[PATH_SIZE + 256];
+    job_t       *job;
+    uint32_t    qos;
+    long        submit_time;
+    int         path_offset;
+    uint32_t    len;
+
+    if (!(spool = fopen(queue->spool_path, "r"))) {
+        errno = 0;
+        return;
+    }
+    /* id class size submit_time ip path */
+    while (fgets(line, sizeof(line), spool)) {
+        len = strlen(line);
+        if (len && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (!(job = (job_t *) calloc(1, sizeof(job_t)))) {
+            ERROR("calloc", "", ERROR_OS);
+            break;
+        }
+        if (sscanf(line, "%u %u %" SCNu64 " %ld %63s %n", &job->id, &qos, &job->size,
+                   &submit_time, job->ip, &path_offset) < 5 || qos >= QOS_CLASSES ||
+            snprintf(job->path, sizeof(job->path), "%s", &line[path_offset]) >= sizeof(job->path)) {
+            ERROR("job_queue_load", line, ERROR_APP);
+            free(job);
+            continue;
+        }
+        job->qos = qos;
+        job->submit_time = submit_time;
+        job->state = JOB_QUEUED;
+        if (job->id >= queue->next_id)
+            queue->next_id = job->id + 1;
+        if (job_append(queue, job) == -1) {
+            free(job);
+            break;
+        }
+    }
+    fclose(spool);
+    if (queue->jobs_cnt) {
+        fprintf(stdout, "%u jobs loaded from %s\n", queue->jobs_cnt, queue->spool_path);
+        fflush(stdout);
+    }
+}
+
+static void job_queue_persist(job_queue_t *queue)
+{
+    char    tmp_path[PATH_SIZE + 8];
+    FILE    *spool;
+    job_t   *job;
+
+    /* a new spool replaces the old one at once, a crash never leaves half of it */
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", queue->spool_path);
+    if (!(spool = fopen(tmp_path, "w"))) {
+        ERROR("fopen", tmp_path, ERROR_OS);
+        return;
+    }
+    for (uint32_t i = 0; i < queue->jobs_cnt; ++i) {
+        job = queue->jobs[i];
+        fprintf(spool, "%u %u %" PRIu64 " %ld %s %s\n", job->id, job->qos, job->size,
+                (long) job->submit_time, job->ip, job->path);
+    }
+    /* on disk before it takes the name */
+    if (fflush(spool) == EOF || fsync(fileno(spool)) == -1) {
+        ERROR("fsync", tmp_path, ERROR_OS);
+        fclose(spool);
+        return;
+    }
+    if (fclose(spool) == EOF) {
+        ERROR("fclose", tmp_path, ERROR_OS);
+        return;
+    }
+    if (rename(tmp_path, queue->spool_path) == -1)
+        ERROR("rename", queue->spool_path, ERROR_OS);
+}
+
+static uint64_t estimate_size(const char *path)
+{
+    estimated_size = 0;
+    if (nftw(path, &estimate_size_entry, 64, FTW_PHYS) == -1) {
+        ERROR("nftw", path, ERROR_OS);
+        errno = 0;
+    }
+    return estimated_size;
+}
+
+static int estimate_size_entry(const char *path, const struct stat *stat_buf,
+                               int type, struct FTW *ftw_buf)
+{
+    if (type == FTW_F)
+        estimated_size += stat_buf->st_size;
+    return 0;
+}
+
+#undef JOB_QUEUE_C
@@ -0,0 +1,64 @@
+/**
+ * @file job_queue.h
+ * @brief The transfer jobs queue header
+ */
+
+#ifndef JOB_QUEUE_H
+#define JOB_QUEUE_H
+
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "data_types.h"
+#include "pacing.h"
+
+#ifdef JOB_QUEUE_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* JOB_QUEUE_C */
+
+typedef enum {
+    JOB_QUEUED             = 0x01,
+    JOB_RUNNING            = 0x02
+} job_state_t;
+
+/** a transfer waiting in the spool or running */
+typedef struct {
+    uint32_t            id;
+    qos_class_t         qos;
+    uint64_t            size;           /* estimated when submitted */
+    time_t              submit_time;
+    time_t              start_time;
+    job_state_t         state;
+    char                ip[64];
+    char                path[PATH_SIZE];
+} job_t;
+
+typedef int8_t (*job_run_t)(job_t *job);
+
+typedef struct {
+    job_t               **jobs;         /* queued and running */
+    uint32_t            jobs_cnt;
+    uint32_t            jobs_size;
+    uint32_t            running_cnt;
+    uint32_t            next_id;
+    uint32_t            done_cnt;
+    uint32_t            failed_cnt;
+    double              total_wait;     /* seconds waited by the finished jobs */
+    job_run_t           run;
+    char                spool_path[PATH_SIZE];
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    pthread_t           *workers;
+    uint32_t            workers_cnt;
+} job_queue_t;
+
+/* job queue functions */
+EXTERN job_queue_t *job_queue_create(uint32_t concurrency, const char *spool_path, job_run_t run);
+EXTERN int32_t job_queue_submit(job_queue_t *queue, const char *path, const char *ip, qos_class_t qos);
+EXTERN void job_queue_print(job_queue_t *queue, FILE *stream);
+
+#undef EXTERN
+#endif /* JOB_QUEUE_H */
@@ -0,0 +1,176 @@
+/**
+ * @file ktls_linux.c
+ * @brief The encrypted transport: OpenSSL does the TLS handshake in user
+ *        space, then hands the session keys to the kernel (TCP_ULP "tls").
+ *        From there the socket encrypts and decrypts by itself, the plain
+ *        send/recv of the packets and the sendfile/splice of the file data
+ *        go through it unchanged and the file pages still never cross into
+ *        user space. Built with `make KTLS=1`, it needs the kernel tls module.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif /* UNIX */
+
+#ifdef KTLS_ENABLED
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif /* KTLS_ENABLED */
+
+#define KTLS_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "ktls_linux.h"
+
+#ifdef KTLS_ENABLED
+
+/* internal functions' prototypes */
+static void create_context(void);
+static int8_t probe_kernel(void);
+static void ssl_error(const char *call, const char *peer);
+
+/* internal variables */
+static SSL_CTX          *context;      /* shared by all the connections, both roles */
+static pthread_once_t   context_once = PTHREAD_ONCE_INIT;
+static int8_t           available;
+
+int8_t ktls_available(void)
+{
+    pthread_once(&context_once, &create_context);
+    return available;
+}
+
+int32_t ktls_start(SOCKET sock_desc, const char *peer, int8_t encrypt, int8_t server)
+{
+    SSL     *ssl;
+    int32_t s = -1;
+
+    if (!encrypt) {
+#ifdef KTLS_REQUIRED
+        ERROR("ktls_start", "the peer has no kernel TLS, refused", ERROR_APP);
+        return -1;
+#else
+        return 0;
+#endif /* KTLS_REQUIRED */
+    }
+
+    if (!ktls_available())
+        return -1;
+    if (!(ssl = SSL_new(context))) {
+        ssl_error("SSL_new", peer);
+        return -1;
+    }
+    /* the socket BIO doesn't own the descriptor, the connection keeps it after SSL_free() */
+    if (!SSL_set_fd(ssl, sock_desc)) {
+        ssl_error("SSL_set_fd", peer);
+        goto out;
+    }
+    if ((server ? SSL_accept(ssl) : SSL_connect(ssl)) != 1) {
+        ssl_error(server ? "SSL_accept" : "SSL_connect", peer);
+        goto out;
+    }
+    /* OpenSSL falls back to user space records silently, the transfers couldn't use them */
+    if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) || !BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+        ERROR("ktls_start", "the kernel took no TLS keys (tls module?)", ERROR_APP);
+        goto out;
+    }
+    fprintf(stdout, "%s: encrypted, %s\n", peer, SSL_get_cipher_name(ssl));
+    fflush(stdout);
+    s = 0;
+
+ out:
+    /* no close_notify: the kernel owns the records now */
+    SSL_free(ssl);
+    return s;
+}
+
+static void create_context(void)
+{
+    SSL_CTX *ctx;
+
+    if (!(ctx = SSL_CTX_new(TLS_method()))) {
+        ssl_error("SSL_CTX_new", "");
+        return;
+    }
+    /*
+     * the kernel keeps no handshake state: no renegotiation, and TLS 1.2 for
+     * which every kernel with a tls module decrypts as well as it encrypts
+     */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_COMPRESSION);
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+    if (!SSL_CTX_set_cipher_list(ctx, KTLS_CIPHERS)) {
+        ssl_error("SSL_CTX_set_cipher_list", KTLS_CIPHERS);
+        goto error;
+    }
+    /* both peers show their certificate, the peer of a connection may be either side */
+    if (SSL_CTX_use_certificate_chain_file(ctx, KTLS_CERT_FILE) != 1) {
+        ssl_error("SSL_CTX_use_certificate_chain_file", KTLS_CERT_FILE);
+        goto error;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, KTLS_KEY_FILE, SSL_FILETYPE_PEM) != 1) {
+        ssl_error("SSL_CTX_use_PrivateKey_file", KTLS_KEY_FILE);
+        goto error;
+    }
+#ifdef KTLS_CA_FILE
+    if (SSL_CTX_load_verify_locations(ctx, KTLS_CA_FILE, NULL) != 1) {
+        ssl_error("SSL_CTX_load_verify_locations", KTLS_CA_FILE);
+        goto error;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+#endif /* KTLS_CA_FILE */
+    context = ctx;
+    available = probe_kernel();
+    return;
+
+ error:
+    SSL_CTX_free(ctx);
+}
+
+static int8_t probe_kernel(void)
+{
+    SOCKET  sock_desc;
+    int8_t  s;
+
+    /*
+     * the ULP is looked up (and its module loaded) before the socket state is
+     * checked: an unconnected socket gets ENOTCONN from the tls module, ENOENT
+     * without it
+     */
+    if ( (sock_desc = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        ERROR("socket", "tls probe", ERROR_OS);
+        return 0;
+    }
+    s = setsockopt(sock_desc, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 || errno != ENOENT;
+    close(sock_desc);
+    errno = 0;
+    if (!s)
+        ERROR("ktls_available", "no tls module in the kernel, the transfers stay plaintext", ERROR_APP);
+    return s;
+}
+
+static void ssl_error(const char *call, const char *peer)
+{
+    char            buf[256];
+    unsigned long   code = ERR_get_error();
+
+    snprintf(buf, sizeof(buf), "%s: %s", peer, code ? ERR_error_string(code, NULL) : "connection closed");
+    ERR_clear_error();
+    ERROR(call, buf, ERROR_APP);
+}
+
+#endif /* KTLS_ENABLED */
+
+#undef KTLS_C
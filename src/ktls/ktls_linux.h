@@ -0,0 +1,31 @@
+/**
+ * @file ktls_linux.h
+ * @brief The kernel TLS header
+ */
+
+#ifndef KTLS_H
+#define KTLS_H
+
+#include <inttypes.h>
+
+#include "data_types.h"
+
+#ifdef KTLS_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* KTLS_C */
+
+/* ktls_available() tells if this peer can encrypt: certificate loaded, tls module in the kernel */
+EXTERN int8_t ktls_available(void);
+
+/*
+ * ktls_start() encrypts the connection when both peers can (encrypt), as the
+ * client or the server of the TLS handshake. It returns 0 when the
+ * connection may go on, -1 when it must be closed: the handshake failed, the
+ * kernel took no TLS keys, or the peer can't encrypt and KTLS_REQUIRED is set
+ */
+EXTERN int32_t ktls_start(SOCKET sock_desc, const char *peer, int8_t encrypt, int8_t server);
+
+#undef EXTERN
+#endif /* KTLS_H */
@@ -23,16 +23,43 @@
 #include "config.h"
 #include "data_types.h"
 #include "error.h"
+#include "protocol.h"
+#include "query.h"
 #include "receive.h"
 #include "send.h"
+#include "session.h"
 #include "tcpip_server.h"
 #include "user_thread.h"
 
+#if defined(UNIX) && defined(UNIX_SOCKET_PATH)
+#include "unix_server.h"
+#endif /* UNIX && UNIX_SOCKET_PATH */
+
+#if defined(LINUX) && defined(EVENT_ENGINE_ENABLED)
+#include "engine_linux.h"
+#endif /* LINUX && EVENT_ENGINE_ENABLED */
+
+#if defined(LINUX) && defined(SOCKET_AUTOTUNE_ENABLED)
+#include "sock_tune_linux.h"
+#endif /* LINUX && SOCKET_AUTOTUNE_ENABLED */
+
+#if defined(LINUX) && defined(KTLS_ENABLED)
+#include "ktls_linux.h"
+#endif /* LINUX && KTLS_ENABLED */
+
 /* INTERNAL FUNCTIONS */
 static void callback_on_accept(SOCKET *sock, struct sockaddr_in *client_addr);
+static void serve_connection(SOCKET sock_desc, char *client, int8_t unix_socket);
+#if defined(UNIX) && defined(UNIX_SOCKET_PATH)
+static void callback_on_unix_accept(SOCKET *sock, unix_server_client_t *client);
+static void *unix_connection(void *arg);
+#endif /* UNIX && UNIX_SOCKET_PATH */
 
 /* GLOBAL VARIABLES */
 TC_t TC;
+#if defined(LINUX) && defined(EVENT_ENGINE_ENABLED)
+static engine_t *engine;
+#endif /* LINUX && EVENT_ENGINE_ENABLED */
 
 int main(int argc, char **argv) {
   signal(SIGPIPE, SIG_IGN);
@@ -40,8 +67,17 @@ int main(int argc, char **argv) {
   int ret;
 
   TC.lock = 0;
+  TC.reading = 0;
 
   if (argc == 2) {
+#if defined(LINUX) && defined(EVENT_ENGINE_ENABLED)
+    /* the incoming transfers are served by the event engine */
+    engine = engine_create(ENGINE_THREADS, ENGINE_WORKERS);
+    if (!engine) {
+      exit(EXIT_FAILURE);
+    }
+#endif /* LINUX && EVENT_ENGINE_ENABLED */
+
     /* create the server part on a different thread */
     tcpip_server_t *server = tcpip_server_create(PORT);
     if (!server) {
@@ -52,6 +88,14 @@ int main(int argc, char **argv) {
     if (ret != 0) {
       exit(EXIT_FAILURE);
     }
+
+#if defined(UNIX) && defined(UNIX_SOCKET_PATH)
+    /* and the processes of this host, on their own threads */
+    unix_server_t *unix_server = unix_server_create(UNIX_SOCKET_PATH);
+    if (!unix_server || unix_server_listen(unix_server, &callback_on_unix_accept) != 0) {
+      exit(EXIT_FAILURE);
+    }
+#endif /* UNIX && UNIX_SOCKET_PATH */
   }
 
   /* use this thread to handle user's input data, as the client side */
@@ -69,17 +113,39 @@ static void callback_on_accept(SOCKET *sock, struct sockaddr_in *client_addr) {
   SOCKET sock_desc = *sock;
   struct sockaddr_in client_info = *client_addr;
   char *client_ip = inet_ntoa(client_info.sin_addr);
-  net_packet_t *packet = NULL;
 
   /* release the arguments */
   free(sock);
   free(client_addr);
 
+#if defined(LINUX) && defined(SOCKET_AUTOTUNE_ENABLED)
+  /* the handshake gave the RTT */
+  sock_tune_t tune;
+  sock_tune_linux(sock_desc, client_ip, &tune);
+#endif /* LINUX && SOCKET_AUTOTUNE_ENABLED */
+
+#if defined(LINUX) && defined(EVENT_ENGINE_ENABLED)
+  /* no blocking transfer here, the engine drives the connection from now on */
+  fprintf(stdout, "\nNew connection from %s...\n", client_ip);
+  fflush(stdout);
+#if defined(KTLS_ENABLED) && defined(KTLS_REQUIRED)
+  /* the handshake would block a reactor, the engine serves plaintext only */
+  ERROR("callback_on_accept", "the event engine can't encrypt, refused", ERROR_APP);
+  close(sock_desc);
+  return;
+#endif /* KTLS_ENABLED && KTLS_REQUIRED */
+  if (engine_add_connection(engine, sock_desc) == -1) {
+    close(sock_desc);
+  }
+  return;
+#endif /* LINUX && EVENT_ENGINE_ENABLED */
+
   /* Ask for permission to accept a transfer
    * Lock the TC lock and the user thread will unlock it after will get an
-   * answer
+   * answer. The question waits for the user thread to be reading, a
+   * connection accepted right after an answer would lock it out of its prompt
    */
-  while (__sync_lock_test_and_set(&TC.lock, 1)) {
+  while (!TC.reading || __sync_lock_test_and_set(&TC.lock, 1)) {
     usleep(100);
   }
   fprintf(stdout, "\nNew connection from %s... Do you accept it? [Y/N]\n",
@@ -91,22 +157,148 @@ static void callback_on_accept(SOCKET *sock, struct sockaddr_in *client_addr) {
   }
 
   if (TC.action & ALLOW_ACTION) {
-    packet = recv_packet(sock_desc, 0);
+    serve_connection(sock_desc, client_ip, 0);
+    sock_desc = -1;
+  }
+  /* release the TC lock */
+  __sync_lock_release(&TC.lock);
+
+  if (sock_desc != -1) {
+    close(sock_desc);
+  }
+}
+
+/** The hello and the transfer (or session, or query) of an accepted connection, closed after */
+static void serve_connection(SOCKET sock_desc, char *client, int8_t unix_socket) {
+  net_packet_t *packet = NULL;
+  protocol_caps_t caps = PROTOCOL_V1_CAPS;
+  protocol_caps_t local_caps = PROTOCOL_LOCAL_CAPS;
+  int32_t version = 1;
+  char *served;
+
+  /* no encryption on a Unix socket, the open files are passed on it */
+  if (unix_socket) {
+    local_caps = (local_caps & ~CAP_KTLS) | PROTOCOL_UNIX_CAPS;
+  }
+  packet = recv_packet(sock_desc, 0);
+  /* a version 2 peer starts with its capabilities, no hello from a version 1 one */
+  if (packet && (packet->flags.val & PROTOCOL_HELLO)) {
+    version = protocol_answer_hello(sock_desc, local_caps, packet, &caps);
+    destroy_packet(packet);
+#if defined(LINUX) && defined(KTLS_ENABLED)
+    /* the client starts the TLS handshake right after the hello */
+    if (version != -1 && !unix_socket && ktls_start(sock_desc, client, (caps & CAP_KTLS) != 0, 1) == -1) {
+      version = -1;
+    }
+#endif /* LINUX && KTLS_ENABLED */
+    packet = version == -1 ? NULL : recv_packet(sock_desc, 0);
     if (packet) {
-      if (packet->flags.val & START_TRANSFER) {
-        if (packet->flags.val & SEND_OPERATION) {
-          __recv(sock_desc, packet->flags.val, RECEIVING_PATH);
-        } else if (packet->flags.val & RECEIVE_OPERATION) {
-          __send(sock_desc, packet->data);
+      protocol_print_caps(client, version, caps);
+    }
+  }
+#if defined(LINUX) && defined(KTLS_ENABLED)
+  else if (packet && !unix_socket && ktls_start(sock_desc, client, 0, 1) == -1) {
+    /* a version 1 client can't encrypt */
+    destroy_packet(packet);
+    packet = NULL;
+  }
+#endif /* LINUX && KTLS_ENABLED */
+  if (packet) {
+    if (packet->flags.val & SESSION_OPEN) {
+      /* a long lived session, all its transfers are accepted with it */
+      if ((caps & CAP_SESSIONS) && session_serve(sock_desc, caps) == 0) {
+        sock_desc = -1;
+      }
+    } else if ((caps & CAP_QUERIES) && (packet->flags.val & QUERY_FLAGS)) {
+      /* answered from the directory index, no transfer */
+      query_serve(sock_desc, packet->flags.val, packet->data);
+    } else if (packet->flags.val & START_TRANSFER) {
+      if (packet->flags.val & SEND_OPERATION) {
+        __recv(sock_desc, packet->flags.val, RECEIVING_PATH);
+      } else if (packet->flags.val & RECEIVE_OPERATION) {
+        /* the pulls are served from SERVE_ROOT only */
+        if ((served = protocol_served_path(packet->data))) {
+          __send(sock_desc, served, DEFAULT_QOS_CLASS, caps);
+          free(served);
+        } else {
+          send_packet(sock_desc, NULL, 0, ABORT_TRANSFER);
         }
       }
-      destroy_packet(packet);
-    } else {
-      fprintf(stdout, "Connection lost...");
     }
+    destroy_packet(packet);
+  } else {
+    fprintf(stdout, "Connection lost...");
   }
-  /* release the TC lock */
-  __sync_lock_release(&TC.lock);
 
-  close(sock_desc);
+  if (sock_desc != -1) {
+    close(sock_desc);
+  }
+}
+
+#if defined(UNIX) && defined(UNIX_SOCKET_PATH)
+/** each local connection on a thread of its own, the next ones are accepted meanwhile */
+static void callback_on_unix_accept(SOCKET *sock, unix_server_client_t *client) {
+  pthread_t tid;
+  void **arg = (void **)malloc(2 * sizeof(void *));
+
+  if (!arg) {
+    ERROR("malloc", "", ERROR_OS);
+    close(*sock);
+    free(sock);
+    free(client);
+    return;
+  }
+  arg[0] = sock;
+  arg[1] = client;
+  if ((errno = pthread_create(&tid, NULL, &unix_connection, arg)) != 0) {
+    ERROR("pthread_create", "", ERROR_OS);
+    close(*sock);
+    free(sock);
+    free(client);
+    free(arg);
+    return;
+  }
+  pthread_detach(tid);
+}
+
+static void *unix_connection(void *arg) {
+  SOCKET sock_desc = *(SOCKET *)((void **)arg)[0];
+  unix_server_client_t client = *(unix_server_client_t *)((void **)arg)[1];
+  char client_name[64];
+  int8_t ask = client.uid != getuid();
+
+  /* release the arguments */
+  free(((void **)arg)[0]);
+  free(((void **)arg)[1]);
+  free(arg);
+
+  snprintf(client_name, sizeof(client_name), "local pid %d uid %d", (int)client.pid, (int)client.uid);
+  /* the processes of the same user are accepted, the others asked for */
+  if (ask) {
+    while (!TC.reading || __sync_lock_test_and_set(&TC.lock, 1)) {
+      usleep(100);
+    }
+    fprintf(stdout, "\nNew connection from %s... Do you accept it? [Y/N]\n", client_name);
+    fflush(stdout);
+    /* wait for answer */
+    while (__sync_lock_test_and_set(&TC.lock, 1)) {
+      usleep(100);
+    }
+    if (!(TC.action & ALLOW_ACTION)) {
+      close(sock_desc);
+      sock_desc = -1;
+    }
+  } else {
+    fprintf(stdout, "\nNew connection from %s...\n", client_name);
+    fflush(stdout);
+  }
+  if (sock_desc != -1) {
+    serve_connection(sock_desc, client_name, 1);
+  }
+  if (ask) {
+    /* release the TC lock */
+    __sync_lock_release(&TC.lock);
+  }
+  return NULL;
 }
+#endif /* UNIX && UNIX_SOCKET_PATH */
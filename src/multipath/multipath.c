@@ -0,0 +1,235 @@
+/**
+ * @file multipath.c
+ * @brief Multi-path sends: a connection from each local source address to
+ *        each address of the peer (paired in turn), on a thread and a session
+ *        of its own. All the paths walk the tree and send its directories, a
+ *        file goes on the first path to reach it: a path takes the next file
+ *        as soon as it is done with the last one, and the files spread across
+ *        the paths in proportion to their throughput. What each path carried,
+ *        and how fast, is printed at the end.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#endif /* UNIX */
+
+#define MULTIPATH_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "peer.h"
+#include "protocol.h"
+#include "send.h"
+#include "session.h"
+#include "multipath.h"
+
+/* internal functions' prototypes */
+static uint32_t split_list(char *list, char **items, uint32_t max);
+static void     *path_thread(void *arg);
+static int8_t   claim_file(void *arg, dev_t dev, ino_t ino);
+static void     share_destroy(multipath_share_t *share);
+
+/* internal constants */
+static const uint32_t buckets_cnt = 4096;
+
+/** Whether a send to ip goes on several paths */
+int8_t multipath_wanted(const char *ip)
+{
+#ifdef MULTIPATH_ENABLED
+    return ip[0] != '/' && (strchr(ip, ',') || MULTIPATH_SOURCES[0]);
+#else
+    return 0;
+#endif /* MULTIPATH_ENABLED */
+}
+
+/**
+ * Sends path to the addresses of the peer in ip (separated by commas), from
+ * the MULTIPATH_SOURCES addresses. A path that can't connect is left out,
+ * the others send all the files
+ */
+int8_t multipath_send(char *path, char *ip, qos_class_t qos)
+{
+    char                ips[256];
+    char                sources[256] = "";
+    char                *peers[MULTIPATH_MAX_PATHS];
+    char                *locals[MULTIPATH_MAX_PATHS];
+    uint32_t            peers_cnt;
+    uint32_t            locals_cnt;
+    uint32_t            paths_cnt;
+    uint32_t            started;
+    uint32_t            connected = 0;
+    multipath_path_t    *paths;
+    multipath_share_t   share;
+    transfer_progress_t *progress = send_progress_current();
+    int8_t              s = 0;
+    int32_t             ret;
+
+    snprintf(ips, sizeof(ips), "%s", ip);
+#ifdef MULTIPATH_ENABLED
+    snprintf(sources, sizeof(sources), "%s", MULTIPATH_SOURCES);
+#endif /* MULTIPATH_ENABLED */
+    peers_cnt = split_list(ips, peers, MULTIPATH_MAX_PATHS);
+    locals_cnt = split_list(sources, locals, MULTIPATH_MAX_PATHS);
+    if (!peers_cnt) {
+        ERROR("multipath_send", "no peer address", ERROR_APP);
+        return -1;
+    }
+    paths_cnt = peers_cnt > locals_cnt ? peers_cnt : locals_cnt;
+
+    paths = (multipath_path_t *) calloc(paths_cnt, sizeof(multipath_path_t));
+    share.buckets = (multipath_claim_t **) calloc(buckets_cnt, sizeof(multipath_claim_t *));
+    if (!paths || !share.buckets) {
+        ERROR("calloc", "", ERROR_OS);
+        free(paths);
+        free(share.buckets);
+        return -1;
+    }
+    share.buckets_cnt = buckets_cnt;
+    pthread_mutex_init(&share.lock, NULL);
+
+    for (started = 0; started < paths_cnt; ++started) {
+        multipath_path_t *p = &paths[started];
+
+        p->index = started;
+        p->source = locals_cnt ? locals[started % locals_cnt] : NULL;
+        snprintf(p->ip, sizeof(p->ip), "%s", peers[started % peers_cnt]);
+        p->path = path;
+        p->qos = qos;
+        p->share = &share;
+        p->s = -1;
+        if ((ret = pthread_create(&p->TID, NULL, &path_thread, p)) != 0) {
+            errno = ret;
+            ERROR("pthread_create", "", ERROR_OS);
+            s = -1;
+            break;
+        }
+    }
+    for (uint32_t i = 0; i < started; ++i) {
+        multipath_path_t *p = &paths[i];
+
+        pthread_join(p->TID, NULL);
+        if (!p->connected)
+            continue;
+        ++connected;
+        /* a path which failed on the way had files nobody else sends */
+        if (p->s == -1)
+            s = -1;
+        if (progress) {
+            progress->bytes += p->progress.bytes;
+            progress->files += p->progress.files;
+        }
+        fprintf(stdout, "%s -> %s: %" PRIu64 " files, %.1f MiB, %.1f MiB/s\n", p->source ? p->source : "any",
+                p->ip, p->progress.files, p->progress.bytes / (1024.0 * 1024),
+                p->ns ? p->progress.bytes * 1e9 / p->ns / (1024 * 1024) : 0.0);
+    }
+    fflush(stdout);
+    if (!connected)
+        s = -1;
+    share_destroy(&share);
+    free(paths);
+    return s;
+}
+
+/** the items of a comma separated list, in place */
+static uint32_t split_list(char *list, char **items, uint32_t max)
+{
+    uint32_t    cnt = 0;
+    char        *save;
+    char        *item;
+
+    for (item = strtok_r(list, ", ", &save); item && cnt < max; item = strtok_r(NULL, ", ", &save))
+        items[cnt++] = item;
+    return cnt;
+}
+
+static void *path_thread(void *arg)
+{
+    multipath_path_t    *p = (multipath_path_t *) arg;
+    protocol_caps_t     caps;
+    SOCKET              sock_desc;
+    session_t           *session;
+    session_stream_t    *stream;
+    struct timespec     start;
+    struct timespec     end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((sock_desc = peer_connect_from(p->ip, p->source, NULL, &caps)) == -1)
+        return NULL;
+    p->connected = 1;
+    /* the transfer of this thread sends the files it claims, counted for the path */
+    send_claim(&claim_file, p);
+    send_progress(&p->progress);
+    /* the peer serves the sessions side by side, the plain connections one after the other */
+    if (caps & CAP_SESSIONS) {
+        if ((session = session_connect(sock_desc, caps))) {
+            if ((stream = session_stream_open(session, STREAM_SEND))) {
+                p->s = __send_stream(stream, p->path, p->qos);
+                session_stream_close(stream);
+            }
+            session_destroy(session);
+        }
+    }
+    else {
+        p->s = __send(sock_desc, p->path, p->qos, caps);
+    }
+    send_claim(NULL, NULL);
+    send_progress(NULL);
+    close(sock_desc);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    p->ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+    return NULL;
+}
+
+/** the file is this path's when it got there first, all the links of an inode go together */
+static int8_t claim_file(void *arg, dev_t dev, ino_t ino)
+{
+    multipath_path_t    *p = (multipath_path_t *) arg;
+    multipath_share_t   *share = p->share;
+    multipath_claim_t   **bucket;
+    multipath_claim_t   *claim;
+    int8_t              s;
+
+    bucket = &share->buckets[((uint64_t) ino ^ ((uint64_t) dev << 20)) % share->buckets_cnt];
+    pthread_mutex_lock(&share->lock);
+    for (claim = *bucket; claim && (claim->dev != dev || claim->ino != ino); claim = claim->next)
+        ;
+    if (!claim) {
+        if (!(claim = (multipath_claim_t *) malloc(sizeof(multipath_claim_t)))) {
+            pthread_mutex_unlock(&share->lock);
+            ERROR("malloc", "", ERROR_OS);
+            return -1;
+        }
+        claim->dev = dev;
+        claim->ino = ino;
+        claim->path = p->index;
+        claim->next = *bucket;
+        *bucket = claim;
+    }
+    s = claim->path == p->index;
+    pthread_mutex_unlock(&share->lock);
+    return s;
+}
+
+static void share_destroy(multipath_share_t *share)
+{
+    multipath_claim_t *claim;
+
+    for (uint32_t i = 0; i < share->buckets_cnt; ++i) {
+        while ((claim = share->buckets[i])) {
+            share->buckets[i] = claim->next;
+            free(claim);
+        }
+    }
+    pthread_mutex_destroy(&share->lock);
+    free(share->buckets);
+}
+
+#undef MULTIPATH_C
@@ -0,0 +1,57 @@
+/**
+ * @file multipath.h
+ * @brief The multi-path sends header
+ */
+
+#ifndef MULTIPATH_H
+#define MULTIPATH_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "data_types.h"
+#include "pacing.h"
+
+#ifdef MULTIPATH_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* MULTIPATH_C */
+
+/** a file of the tree, sent by the path which reached it first */
+typedef struct multipath_claim {
+    dev_t                   dev;
+    ino_t                   ino;
+    uint32_t                path;
+    struct multipath_claim  *next;
+} multipath_claim_t;
+
+/** what the paths of a send share */
+typedef struct {
+    multipath_claim_t       **buckets;
+    uint32_t                buckets_cnt;
+    pthread_mutex_t         lock;
+} multipath_share_t;
+
+/** a connection of the send, from a local address to an address of the peer */
+typedef struct {
+    uint32_t                index;
+    const char              *source;        /* NULL for any */
+    char                    ip[64];
+    char                    *path;
+    qos_class_t             qos;
+    multipath_share_t       *share;
+    transfer_progress_t     progress;
+    uint64_t                ns;             /* from the connection to the end of the transfer */
+    int8_t                  connected;
+    int8_t                  s;
+    pthread_t               TID;
+} multipath_path_t;
+
+/* multipath functions */
+EXTERN int8_t multipath_wanted(const char *ip);
+EXTERN int8_t multipath_send(char *path, char *ip, qos_class_t qos);
+
+#undef EXTERN
+#endif /* MULTIPATH_H */
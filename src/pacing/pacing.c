@@ -0,0 +1,235 @@
+/**
+ * @file pacing.c
+ * @brief Bandwidth pacing: token buckets per transfer and for all the
+ *        transfers, priority classes and kernel pacing (SO_MAX_PACING_RATE)
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef UNIX
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#endif /* UNIX */
+
+#define PACING_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "pacing.h"
+
+/* internal constants */
+#define PACING_MIN_BURST        (64 * 1024)     /* bytes */
+#define PACING_MIN_CHUNK        (16 * 1024)     /* don't wake up for less */
+#define PACING_MIN_SLEEP_NS     1000000         /* 1 ms */
+
+/* internal functions' prototypes */
+static uint64_t bucket_burst(uint64_t rate);
+static void     bucket_refill(token_bucket_t *bucket, uint64_t rate, struct timespec *now);
+static void     apply_socket_rate(pacing_t *pacing, uint64_t rate);
+
+/* internal variables */
+static volatile uint64_t    global_rate = PACING_GLOBAL_RATE;
+static volatile uint64_t    class_rates[QOS_CLASSES] = {
+    PACING_INTERACTIVE_RATE,
+    PACING_BULK_RATE,
+    PACING_SCAVENGER_RATE
+};
+static token_bucket_t       global_bucket;
+static pthread_mutex_t      global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the global tokens a class leaves to the classes above it, in burst fractions */
+static const double         class_reserve[QOS_CLASSES] = { 0.0, 0.25, 0.5 };
+/* the socket priority (tc prio band) and the IP TOS of each class */
+static const int            class_priority[QOS_CLASSES] = { 6, 2, 1 };
+static const int            class_tos[QOS_CLASSES] = { IPTOS_LOWDELAY, IPTOS_THROUGHPUT, 0x20 };
+static const char           *class_names[QOS_CLASSES] = { "interactive", "bulk", "scavenger" };
+
+pacing_t *pacing_create(SOCKET sock_desc, qos_class_t qos)
+{
+    pacing_t *pacing = (pacing_t *) calloc(1, sizeof(pacing_t));
+    
+    if (!pacing) {
+        ERROR("calloc", "", ERROR_OS);
+        return NULL;
+    }
+    pacing->sock = sock_desc;
+    pacing->qos = qos < QOS_CLASSES ? qos : QOS_BULK;
+    
+    /* a shared socket (a session) carries several classes, no socket options then */
+    if (sock_desc == -1)
+        return pacing;
+    /* the class is a hint for the queueing disciplines on the way, not an error */
+    if (setsockopt(sock_desc, SOL_SOCKET, SO_PRIORITY, &class_priority[pacing->qos], sizeof(int)) == -1)
+        ERROR("setsockopt", "SO_PRIORITY", ERROR_OS);
+    if (setsockopt(sock_desc, IPPROTO_IP, IP_TOS, &class_tos[pacing->qos], sizeof(int)) == -1)
+        ERROR("setsockopt", "IP_TOS", ERROR_OS);
+    errno = 0;
+    return pacing;
+}
+
+uint64_t pacing_acquire(pacing_t *pacing, uint64_t want)
+{
+    struct timespec now;
+    struct timespec sleep_time;
+    uint64_t        rate;
+    uint64_t        grate;
+    uint64_t        grant;
+    uint64_t        need;
+    double          available;
+    double          wait;
+    
+    while (1) {
+        /* the limits are read again on every call, they may change at any time */
+        rate = pacing->rate ? pacing->rate : class_rates[pacing->qos];
+        grate = global_rate;
+        apply_socket_rate(pacing, !rate ? grate : !grate ? rate : rate < grate ? rate : grate);
+        if (!rate && !grate)
+            return want;
+        
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        grant = want;
+        wait = 0;
+        need = want < PACING_MIN_CHUNK ? want : PACING_MIN_CHUNK;
+        if (rate) {
+            bucket_refill(&pacing->bucket, rate, &now);
+            if (pacing->bucket.tokens < need)
+                wait = (need - pacing->bucket.tokens) / rate;
+            else if (pacing->bucket.tokens < grant)
+                grant = pacing->bucket.tokens;
+        }
+        if (grate && wait == 0) {
+            pthread_mutex_lock(&global_lock);
+            bucket_refill(&global_bucket, grate, &now);
+            available = global_bucket.tokens - bucket_burst(grate) * class_reserve[pacing->qos];
+            if (available < need) {
+                wait = (need - available) / grate;
+            }
+            else {
+                if (available < grant)
+                    grant = available;
+                global_bucket.tokens -= grant;
+            }
+            pthread_mutex_unlock(&global_lock);
+        }
+        if (wait == 0) {
+            if (rate)
+                pacing->bucket.tokens -= grant;
+            return grant;
+        }
+        
+        wait *= 1e9;
+        if (wait < PACING_MIN_SLEEP_NS)
+            wait = PACING_MIN_SLEEP_NS;
+        sleep_time.tv_sec = wait / 1e9;
+        sleep_time.tv_nsec = (uint64_t) wait % 1000000000;
+        nanosleep(&sleep_time, NULL);
+    }
+}
+
+void pacing_refund(pacing_t *pacing, uint64_t unused)
+{
+    if (!unused)
+        return;
+    if (pacing->rate || class_rates[pacing->qos])
+        pacing->bucket.tokens += unused;
+    if (global_rate) {
+        pthread_mutex_lock(&global_lock);
+        global_bucket.tokens += unused;
+        pthread_mutex_unlock(&global_lock);
+    }
+}
+
+void pacing_set_transfer_rate(pacing_t *pacing, uint64_t rate)
+{
+    pacing->rate = rate;
+}
+
+void pacing_destroy(pacing_t *pacing)
+{
+    free(pacing);
+}
+
+void pacing_set_rate(int32_t qos, uint64_t rate)
+{
+    if (qos == QOS_GLOBAL)
+        global_rate = rate;
+    else if (qos >= 0 && qos < QOS_CLASSES)
+        class_rates[qos] = rate;
+}
+
+uint64_t pacing_get_rate(int32_t qos)
+{
+    if (qos == QOS_GLOBAL)
+        return global_rate;
+    if (qos >= 0 && qos < QOS_CLASSES)
+        return class_rates[qos];
+    return 0;
+}
+
+int32_t pacing_parse_class(const char *name)
+{
+    if (!strcmp(name, "global"))
+        return QOS_GLOBAL;
+    for (int32_t i = 0; i < QOS_CLASSES; ++i)
+        if (!strcmp(name, class_names[i]))
+            return i;
+    return QOS_UNKNOWN;
+}
+
+const char *pacing_class_name(int32_t qos)
+{
+    if (qos == QOS_GLOBAL)
+        return "global";
+    return qos >= 0 && qos < QOS_CLASSES ? class_names[qos] : "unknown";
+}
+
+static uint64_t bucket_burst(uint64_t rate)
+{
+    /* 100 ms worth of data */
+    return rate / 10 > PACING_MIN_BURST ? rate / 10 : PACING_MIN_BURST;
+}
+
+static void bucket_refill(token_bucket_t *bucket, uint64_t rate, struct timespec *now)
+{
+    double elapsed;
+    double burst = bucket_burst(rate);
+    
+    if (bucket->last.tv_sec == 0 && bucket->last.tv_nsec == 0) {
+        bucket->tokens = burst;
+    }
+    else {
+        elapsed = (now->tv_sec - bucket->last.tv_sec) + (now->tv_nsec - bucket->last.tv_nsec) / 1e9;
+        bucket->tokens += elapsed * rate;
+    }
+    /* a lowered rate also lowers the burst */
+    if (bucket->tokens > burst)
+        bucket->tokens = burst;
+    bucket->last = *now;
+}
+
+static void apply_socket_rate(pacing_t *pacing, uint64_t rate)
+{
+#ifdef SO_MAX_PACING_RATE
+    uint32_t socket_rate;
+    
+    if (rate == pacing->socket_rate || pacing->sock == -1)
+        return;
+    /* the kernel (fq, or TCP internal pacing) spreads the packets at this rate */
+    socket_rate = rate && rate < UINT32_MAX ? rate : UINT32_MAX;
+    if (setsockopt(pacing->sock, SOL_SOCKET, SO_MAX_PACING_RATE, &socket_rate, sizeof(socket_rate)) == -1) {
+        ERROR("setsockopt", "SO_MAX_PACING_RATE", ERROR_OS);
+        errno = 0;
+    }
+    pacing->socket_rate = rate;
+#endif /* SO_MAX_PACING_RATE */
+}
+
+#undef PACING_C
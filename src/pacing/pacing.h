@@ -0,0 +1,60 @@
+/**
+ * @file pacing.h
+ * @brief The bandwidth pacing header
+ */
+
+#ifndef PACING_H
+#define PACING_H
+
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "data_types.h"
+
+#ifdef PACING_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* PACING_C */
+
+/** the priority classes of the transfers */
+typedef enum {
+    QOS_INTERACTIVE        = 0,         /* latency sensitive, served first */
+    QOS_BULK               = 1,         /* the default */
+    QOS_SCAVENGER          = 2,         /* uses only what the others leave */
+    QOS_CLASSES            = 3
+} qos_class_t;
+
+typedef struct {
+    double              tokens;
+    struct timespec     last;
+} token_bucket_t;
+
+/** the pacing of one transfer */
+typedef struct {
+    SOCKET              sock;
+    qos_class_t         qos;
+    volatile uint64_t   rate;           /* bytes per second, 0 follows the class rate */
+    uint64_t            socket_rate;    /* the SO_MAX_PACING_RATE in place */
+    token_bucket_t      bucket;
+} pacing_t;
+
+/* pacing functions */
+EXTERN pacing_t *pacing_create(SOCKET sock_desc, qos_class_t qos);
+EXTERN uint64_t pacing_acquire(pacing_t *pacing, uint64_t want);
+EXTERN void pacing_refund(pacing_t *pacing, uint64_t unused);
+EXTERN void pacing_set_transfer_rate(pacing_t *pacing, uint64_t rate);
+EXTERN void pacing_destroy(pacing_t *pacing);
+EXTERN void pacing_set_rate(int32_t qos, uint64_t rate);
+EXTERN uint64_t pacing_get_rate(int32_t qos);
+EXTERN int32_t pacing_parse_class(const char *name);
+EXTERN const char *pacing_class_name(int32_t qos);
+
+/** pacing_set_rate()/pacing_get_rate() class of the global limit */
+#define QOS_GLOBAL  (-1)
+/** pacing_parse_class() of an unknown name */
+#define QOS_UNKNOWN (-2)
+
+#undef EXTERN
+#endif /* PACING_H */
@@ -0,0 +1,385 @@
+/**
+ * @file peer.c
+ * @brief The peers we send to and receive from: what their hello said, their
+ *        session (opened on first use, shared by the transfers to the peer)
+ *        or a connection of its own for each transfer. Used by the console,
+ *        the jobs, the watched trees and the library alike.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif /* UNIX */
+
+#include "config.h"
+#include "data_types.h"
+#include "send.h"
+#include "receive.h"
+#include "error.h"
+#include "pacing.h"
+#include "session.h"
+#include "protocol.h"
+#include "multipath.h"
+
+#if defined(LINUX) && defined(SOCKET_AUTOTUNE_ENABLED)
+#include "sock_tune_linux.h"
+#endif /* LINUX && SOCKET_AUTOTUNE_ENABLED */
+
+#if defined(LINUX) && defined(KTLS_ENABLED)
+#include "ktls_linux.h"
+#endif /* LINUX && KTLS_ENABLED */
+
+#define PEER_C
+#include "peer.h"
+
+/** the most peers remembered at the same time */
+#define MAX_PEERS 16
+
+/** what we offer in the hello */
+#ifdef SESSIONS_ENABLED
+#define CLIENT_CAPS PROTOCOL_LOCAL_CAPS
+#else
+#define CLIENT_CAPS (PROTOCOL_LOCAL_CAPS & ~CAP_SESSIONS)
+#endif /* SESSIONS_ENABLED */
+
+/** on a Unix socket: no encryption, the open files are passed */
+#define CLIENT_UNIX_CAPS ((CLIENT_CAPS & ~CAP_KTLS) | PROTOCOL_UNIX_CAPS)
+
+/* internal functions' prototypes */
+static SOCKET   connect_to(char *ip, const char *source);
+static peer_t   *find_peer(char *ip);
+static int8_t   send_on_session(session_t *session, char *path, qos_class_t qos);
+static int8_t   receive_on_session(session_t *session, char *path);
+
+/* internal variables */
+static peer_t peers[MAX_PEERS];
+static uint32_t peers_cnt;
+static pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The known peer, remembered now if it is a new one */
+peer_t *peer_lookup(char *ip)
+{
+    peer_t *peer;
+    
+    pthread_mutex_lock(&peers_lock);
+    peer = find_peer(ip);
+    pthread_mutex_unlock(&peers_lock);
+    return peer;
+}
+
+/** Sends path to ip, on its session or on a connection of its own */
+int8_t peer_send(char *path, char *ip, qos_class_t qos)
+{
+    int32_t         s;
+    int32_t         peer_sock;
+    peer_t          *peer;
+    protocol_caps_t caps;
+    
+    /* several addresses (or local ones), a connection on each */
+    if (multipath_wanted(ip))
+        return multipath_send(path, ip, qos);
+    /* the transfers to a peer run side by side on its session */
+    if ((s = peer_open_transfer(ip, &peer, &peer_sock, &caps)) == -1) {
+        return -1;
+    }
+    if (s == 1) {
+        s = send_on_session(peer->session, path, qos);
+        peer_put_session(peer);
+        return s;
+    }
+    
+    s = __send(peer_sock, path, qos, caps);
+    close(peer_sock);
+    return s;
+}
+
+/** Asks ip for path, received in RECEIVING_PATH */
+int8_t peer_receive(char *path, char *ip)
+{
+    int32_t         s;
+    int32_t         peer_sock;
+    peer_t          *peer;
+    protocol_caps_t caps;
+    net_packet_t    *packet;
+    
+    if ((s = peer_open_transfer(ip, &peer, &peer_sock, &caps)) == -1) {
+        return -1;
+    }
+    if (s == 1) {
+        s = receive_on_session(peer->session, path);
+        peer_put_session(peer);
+        return s;
+    }
+    
+    s = -1;
+    if (send_packet(peer_sock, path, strlen(path), START_TRANSFER|RECEIVE_OPERATION) != -1 &&
+        (packet = recv_packet(peer_sock, 0))) {
+        if (packet->flags.val & START_TRANSFER) {
+            s = __recv(peer_sock, packet->flags.val, RECEIVING_PATH);
+        }
+        destroy_packet(packet);
+    }
+    close(peer_sock);
+    return s;
+}
+
+/**
+ * Connect and say hello, unless the peer is known to be a version 1 one.
+ * An ip starting with '/' is the path of a Unix socket on this host.
+ * The hello result is remembered in peer (when not NULL)
+ */
+int32_t peer_connect(char *ip, peer_t *peer, protocol_caps_t *caps)
+{
+    return peer_connect_from(ip, NULL, peer, caps);
+}
+
+/** peer_connect() from the local address source (any when NULL) */
+int32_t peer_connect_from(char *ip, const char *source, peer_t *peer, protocol_caps_t *caps)
+{
+    int                 sock_desc;
+    int8_t              unix_socket = ip[0] == '/';
+    int32_t             version = peer ? peer->version : 0;
+#if defined(LINUX) && defined(SOCKET_AUTOTUNE_ENABLED)
+    sock_tune_t         tune;
+#endif /* LINUX && SOCKET_AUTOTUNE_ENABLED */
+    
+    /* a version 1 peer drops the connection after the hello, we connect again */
+    for (int32_t attempt = 0; attempt < 2; ++attempt) {
+        if ((sock_desc = connect_to(ip, source)) == -1)
+            return -1;
+#if defined(LINUX) && defined(SOCKET_AUTOTUNE_ENABLED)
+        /* the handshake gave the RTT */
+        if (!unix_socket)
+            sock_tune_linux(sock_desc, ip, &tune);
+#endif /* LINUX && SOCKET_AUTOTUNE_ENABLED */
+        
+        if (version == 1) {
+            *caps = PROTOCOL_V1_CAPS;
+#if defined(LINUX) && defined(KTLS_ENABLED)
+            if (!unix_socket && ktls_start(sock_desc, ip, 0, 0) == -1) {
+                close(sock_desc);
+                return -1;
+            }
+#endif /* LINUX && KTLS_ENABLED */
+            return sock_desc;
+        }
+        if ((version = protocol_hello(sock_desc, unix_socket ? CLIENT_UNIX_CAPS : CLIENT_CAPS, caps)) == -1) {
+            close(sock_desc);
+            return -1;
+        }
+        if (peer && !peer->version) {
+            peer->version = version;
+            peer->caps = *caps;
+            protocol_print_caps(ip, version, *caps);
+        }
+        if (version > 1) {
+#if defined(LINUX) && defined(KTLS_ENABLED)
+            /* both can encrypt: TLS in user space, the records in the kernel */
+            if (!unix_socket && ktls_start(sock_desc, ip, (*caps & CAP_KTLS) != 0, 0) == -1) {
+                close(sock_desc);
+                return -1;
+            }
+#endif /* LINUX && KTLS_ENABLED */
+            return sock_desc;
+        }
+        close(sock_desc);
+        /* a version 1 peer asks its console for every connection, let it get back to the prompt */
+        sleep(1);
+    }
+    return -1;
+}
+
+/**
+ * A way to send a transfer to a peer: its session (opened on first use) or,
+ * when the peer or this build has no sessions, a connection of its own.
+ * Returns 1 and a held session, 0 and a connected sock_desc, -1 on error
+ */
+int32_t peer_open_transfer(char *ip, peer_t **peer_ptr, SOCKET *sock_desc, protocol_caps_t *caps)
+{
+    peer_t  *peer = NULL;
+    int32_t s = 1;
+    
+    *peer_ptr = NULL;
+    *sock_desc = -1;
+    pthread_mutex_lock(&peers_lock);
+    peer = find_peer(ip);
+    /* a broken session is replaced once nobody uses it */
+    if (peer && peer->session && session_is_closed(peer->session) && !peer->users) {
+        session_destroy(peer->session);
+        close(peer->sock);
+        peer->session = NULL;
+    }
+    /* a peer on this host gets a connection per transfer, the files are cloned or passed on it */
+    if (!peer || (peer->version && (!(peer->caps & CAP_SESSIONS) || (peer->caps & (CAP_LOCAL|CAP_FDPASS)))) ||
+        (peer->session && session_is_closed(peer->session))) {
+        pthread_mutex_unlock(&peers_lock);
+        *sock_desc = peer_connect(ip, peer, caps);
+        return *sock_desc == -1 ? -1 : 0;
+    }
+    if (!peer->session) {
+        if ((peer->sock = peer_connect(ip, peer, caps)) == -1) {
+            s = -1;
+        }
+        /* the first connection to a peer without sessions (or local) carries the transfer */
+        else if (!(*caps & CAP_SESSIONS) || (*caps & (CAP_LOCAL|CAP_FDPASS))) {
+            *sock_desc = peer->sock;
+            s = 0;
+        }
+        else if (!(peer->session = session_connect(peer->sock, *caps))) {
+            close(peer->sock);
+            s = -1;
+        }
+    }
+    if (s == 1) {
+        ++peer->users;
+        *peer_ptr = peer;
+    }
+    pthread_mutex_unlock(&peers_lock);
+    return s;
+}
+
+/**
+ * A connected socket to ip (or to the Unix socket at that path), bound to the
+ * local address source when not NULL. -1 on error
+ */
+static SOCKET connect_to(char *ip, const char *source)
+{
+    int                 sock_desc;
+    struct sockaddr_in  remote_addr;
+    struct sockaddr_un  unix_addr;
+    struct sockaddr     *addr = (struct sockaddr *) &remote_addr;
+    socklen_t           addr_len = sizeof(remote_addr);
+    char                buf[128];
+    
+    if (ip[0] == '/') {
+        memset(&unix_addr, 0, sizeof(unix_addr));
+        unix_addr.sun_family = AF_UNIX;
+        strncpy(unix_addr.sun_path, ip, sizeof(unix_addr.sun_path) - 1);
+        addr = (struct sockaddr *) &unix_addr;
+        addr_len = sizeof(unix_addr);
+    }
+    else {
+        /* Zeroing remote_addr struct */
+        memset(&remote_addr, 0, sizeof(remote_addr));
+        
+        /* Construct remote_addr struct */
+        remote_addr.sin_family = AF_INET;
+        inet_pton(AF_INET, ip, &(remote_addr.sin_addr));
+        remote_addr.sin_port = htons(PORT);
+    }
+    
+    /* Create client socket */
+    sock_desc = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (sock_desc == -1) {
+        ERROR("socket", "client", ERROR_OS);
+        return -1;
+    }
+    /* the path goes out of that address (and its interface) */
+    if (source && ip[0] != '/') {
+        struct sockaddr_in local_addr;
+        
+        memset(&local_addr, 0, sizeof(local_addr));
+        local_addr.sin_family = AF_INET;
+        if (inet_pton(AF_INET, source, &local_addr.sin_addr) != 1) {
+            errno = EINVAL;
+            ERROR("inet_pton", source, ERROR_OS);
+            close(sock_desc);
+            return -1;
+        }
+        if (bind(sock_desc, (struct sockaddr *) &local_addr, sizeof(local_addr)) == -1) {
+            ERROR("bind", source, ERROR_OS);
+            close(sock_desc);
+            return -1;
+        }
+    }
+    
+    /* Connect to the other peer */
+    if (connect(sock_desc, addr, addr_len) == -1) {
+        snprintf(buf, sizeof(buf), "to peer %s", ip);
+        ERROR("connect", buf, ERROR_OS);
+        close(sock_desc);
+        return -1;
+    }
+    return sock_desc;
+}
+
+/** The known peer, remembered now if it is a new one. Called with peers_lock held */
+static peer_t *find_peer(char *ip)
+{
+    peer_t *peer = NULL;
+    
+    for (uint32_t i = 0; i < peers_cnt; ++i) {
+        if (!strcmp(peers[i].ip, ip)) {
+            return &peers[i];
+        }
+    }
+    if (peers_cnt < MAX_PEERS && strlen(ip) < sizeof(peer->ip)) {
+        peer = &peers[peers_cnt++];
+        memset(peer, 0, sizeof(peer_t));
+        strcpy(peer->ip, ip);
+    }
+    return peer;
+}
+
+void peer_put_session(peer_t *peer)
+{
+    pthread_mutex_lock(&peers_lock);
+    --peer->users;
+    pthread_mutex_unlock(&peers_lock);
+}
+
+void peer_close_sessions(void)
+{
+    pthread_mutex_lock(&peers_lock);
+    for (uint32_t i = 0; i < peers_cnt; ++i) {
+        /* the sessions still in use end with the process */
+        if (peers[i].session && !peers[i].users) {
+            session_destroy(peers[i].session);
+            close(peers[i].sock);
+            peers[i].session = NULL;
+        }
+    }
+    pthread_mutex_unlock(&peers_lock);
+}
+
+static int8_t send_on_session(session_t *session, char *path, qos_class_t qos)
+{
+    session_stream_t    *stream;
+    int8_t              s;
+    
+    if (!(stream = session_stream_open(session, STREAM_SEND))) {
+        return -1;
+    }
+    s = __send_stream(stream, path, qos);
+    session_stream_close(stream);
+    return s;
+}
+
+static int8_t receive_on_session(session_t *session, char *path)
+{
+    session_stream_t    *stream;
+    int8_t              s;
+    
+    if (!(stream = session_stream_open(session, STREAM_RECV))) {
+        return -1;
+    }
+    s = session_write_packet(stream, path, strlen(path), START_TRANSFER|RECEIVE_OPERATION);
+    if (s != -1) {
+        s = session_stream_wait(stream);
+    }
+    session_stream_close(stream);
+    return s;
+}
+
+#undef PEER_C
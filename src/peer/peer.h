@@ -0,0 +1,43 @@
+/**
+ * @file peer.h
+ * @brief The known peers, their sessions and the connections to them header
+ */
+
+#ifndef PEER_H
+#define PEER_H
+
+#include <inttypes.h>
+
+#include "data_types.h"
+#include "pacing.h"
+#include "protocol.h"
+#include "session.h"
+
+#ifdef PEER_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* PEER_C */
+
+/** what we know about a peer, and its session */
+typedef struct {
+    char            ip[64];
+    int32_t         version;    /* 0 until the first hello */
+    protocol_caps_t caps;
+    SOCKET          sock;
+    session_t       *session;
+    uint32_t        users;
+} peer_t;
+
+/* peer functions */
+EXTERN peer_t *peer_lookup(char *ip);
+EXTERN int32_t peer_connect(char *ip, peer_t *peer, protocol_caps_t *caps);
+EXTERN int32_t peer_connect_from(char *ip, const char *source, peer_t *peer, protocol_caps_t *caps);
+EXTERN int32_t peer_open_transfer(char *ip, peer_t **peer, SOCKET *sock_desc, protocol_caps_t *caps);
+EXTERN void    peer_put_session(peer_t *peer);
+EXTERN void    peer_close_sessions(void);
+EXTERN int8_t  peer_send(char *path, char *ip, qos_class_t qos);
+EXTERN int8_t  peer_receive(char *path, char *ip);
+
+#undef EXTERN
+#endif /* PEER_H */
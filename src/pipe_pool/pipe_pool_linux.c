@@ -0,0 +1,172 @@
+/**
+ * @file pipe_pool_linux.c
+ * @brief The pipes the received data is spliced through. A pipe holds 16
+ *        pages by default, so is a splice at most: the pipes are grown with
+ *        F_SETPIPE_SZ up to PIPE_SIZE (or the system limit), and reused by
+ *        all the files of a connection instead of a pipe per file.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <fcntl.h>
+#endif /* UNIX */
+
+#define PIPE_POOL_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "pipe_pool_linux.h"
+
+/* internal functions' prototypes */
+static splice_pipe_t *pipe_create(void);
+static void          pipe_close(splice_pipe_t *pipe);
+static uint32_t      pipe_max_size(void);
+
+/* internal variables */
+static uint32_t max_size;           /* /proc/sys/fs/pipe-max-size, read once */
+
+pipe_pool_t *pipe_pool_create(uint32_t max_free)
+{
+    pipe_pool_t *pool;
+
+    pool = (pipe_pool_t *) calloc(1, sizeof(pipe_pool_t));
+    if (!pool) {
+        ERROR("calloc", "", ERROR_OS);
+        return NULL;
+    }
+    pool->max_free = max_free;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+splice_pipe_t *pipe_pool_get(pipe_pool_t *pool)
+{
+    splice_pipe_t *pipe = NULL;
+
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        if ( (pipe = pool->free_list) ) {
+            pool->free_list = pipe->next;
+            --pool->free_cnt;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (pipe) {
+        pipe->next = NULL;
+        return pipe;
+    }
+    return pipe_create();
+}
+
+void pipe_pool_put(pipe_pool_t *pool, splice_pipe_t *pipe, int8_t drained)
+{
+    if (!pipe)
+        return;
+    /* bytes left in the pipe belong to a transfer that failed, it can not be reused */
+    if (pool && drained) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->free_cnt < pool->max_free) {
+            pipe->next = pool->free_list;
+            pool->free_list = pipe;
+            ++pool->free_cnt;
+            pipe = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (pipe)
+        pipe_close(pipe);
+}
+
+/**
+ * The capacity of an empty pipe changed to size, as much as the system allows.
+ * Returns the capacity it got
+ */
+uint32_t pipe_pool_resize(splice_pipe_t *pipe, uint32_t size)
+{
+    int s;
+
+    if (size > pipe_max_size())
+        size = pipe_max_size();
+    if (size == pipe->size)
+        return pipe->size;
+    /* the user's pipe pages may be used up, the pipe keeps its size then */
+    if ((s = fcntl(pipe->fd[1], F_SETPIPE_SZ, size)) != -1)
+        pipe->size = s;
+    errno = 0;
+    return pipe->size;
+}
+
+void pipe_pool_destroy(pipe_pool_t *pool)
+{
+    splice_pipe_t *pipe;
+
+    if (!pool)
+        return;
+    while ( (pipe = pool->free_list) ) {
+        pool->free_list = pipe->next;
+        pipe_close(pipe);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+static splice_pipe_t *pipe_create(void)
+{
+    splice_pipe_t   *pipe;
+    uint32_t        size = PIPE_SIZE;
+    int             s;
+
+    pipe = (splice_pipe_t *) calloc(1, sizeof(splice_pipe_t));
+    if (!pipe) {
+        ERROR("calloc", "", ERROR_OS);
+        return NULL;
+    }
+    if (pipe2(pipe->fd, O_CLOEXEC) == -1) {
+        ERROR("pipe2", "", ERROR_OS);
+        free(pipe);
+        return NULL;
+    }
+    if (size > pipe_max_size())
+        size = pipe_max_size();
+    /* past the pipe pages of the user (pipe-user-pages-soft) a smaller pipe is still better than the default */
+    while ((s = fcntl(pipe->fd[1], F_SETPIPE_SZ, size)) == -1 && errno == EPERM && size > PIPE_DEFAULT_SIZE)
+        size /= 2;
+    if (s == -1)
+        s = fcntl(pipe->fd[1], F_GETPIPE_SZ);
+    pipe->size = s == -1 ? PIPE_DEFAULT_SIZE : s;
+    errno = 0;
+    return pipe;
+}
+
+static void pipe_close(splice_pipe_t *pipe)
+{
+    close(pipe->fd[0]);
+    close(pipe->fd[1]);
+    free(pipe);
+}
+
+static uint32_t pipe_max_size(void)
+{
+    FILE        *file;
+    uint32_t    size = 0;
+
+    if (max_size)
+        return max_size;
+    if ( (file = fopen("/proc/sys/fs/pipe-max-size", "r")) ) {
+        if (fscanf(file, "%" SCNu32, &size) != 1)
+            size = 0;
+        fclose(file);
+    }
+    /* the threads may race here, they all read the same value */
+    max_size = size ? size : PIPE_DEFAULT_SIZE;
+    return max_size;
+}
+
+#undef PIPE_POOL_C
@@ -0,0 +1,46 @@
+/**
+ * @file pipe_pool_linux.h
+ * @brief The splice pipe pool header
+ */
+
+#ifndef PIPE_POOL_H
+#define PIPE_POOL_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "data_types.h"
+
+#ifdef PIPE_POOL_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* PIPE_POOL_C */
+
+/** the capacity of a new pipe, 16 pages */
+#define PIPE_DEFAULT_SIZE (64 * 1024)
+
+/** a pipe the received data is spliced through, from the socket to the file */
+typedef struct splice_pipe {
+    int32_t             fd[2];
+    uint32_t            size;           /* capacity, after F_SETPIPE_SZ */
+    struct splice_pipe  *next;
+} splice_pipe_t;
+
+/** the pipes of a connection, kept open from a file to the next */
+typedef struct pipe_pool {
+    splice_pipe_t       *free_list;
+    uint32_t            free_cnt;
+    uint32_t            max_free;       /* the free pipes kept, the others are closed */
+    pthread_mutex_t     lock;
+} pipe_pool_t;
+
+/* pipe pool functions */
+EXTERN pipe_pool_t   *pipe_pool_create(uint32_t max_free);
+EXTERN splice_pipe_t *pipe_pool_get(pipe_pool_t *pool);
+EXTERN void          pipe_pool_put(pipe_pool_t *pool, splice_pipe_t *pipe, int8_t drained);
+EXTERN uint32_t      pipe_pool_resize(splice_pipe_t *pipe, uint32_t size);
+EXTERN void          pipe_pool_destroy(pipe_pool_t *pool);
+
+#undef EXTERN
+#endif /* PIPE_POOL_H */
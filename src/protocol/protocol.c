@@ -0,0 +1,229 @@
+/**
+ * @file protocol.c
+ * @brief The version and capabilities handshake. The client opens a connection
+ *        with a hello packet (magic, version and the capabilities bitmap, in
+ *        network byte order), the server answers with its own, and both use
+ *        the fastest options they have in common. A version 1 peer does not
+ *        know the hello and drops the connection: the client then talks the
+ *        plain version 1 transfers to it. A peer offering CAP_LOCAL adds
+ *        the id of its host (the boot and the mount namespace): both see the
+ *        same files when the ids are the same, and keep CAP_LOCAL only then.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef UNIX
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#endif /* UNIX */
+
+#define PROTOCOL_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "protocol.h"
+
+/* internal functions' prototypes */
+static void host_id_load(void);
+
+/* internal variables */
+static uint64_t         host_id;
+static pthread_once_t   host_id_once = PTHREAD_ONCE_INIT;
+
+int32_t protocol_hello(SOCKET sock_desc, protocol_caps_t local_caps, protocol_caps_t *caps)
+{
+    char        hello[PROTOCOL_HELLO_MAX_SIZE];
+    char        header[NET_PACKET_HEADER_SIZE];
+    uint32_t    size;
+    flag_t      flags;
+    ssize_t     received;
+
+    size = protocol_make_hello(hello, local_caps);
+    if (send_packet(sock_desc, hello, size, PROTOCOL_HELLO) == -1)
+        return -1;
+
+    errno = 0;
+    received = recv(sock_desc, header, sizeof(header), MSG_WAITALL);
+    /* a version 1 peer */
+    if (received == 0 || (received == -1 && errno == ECONNRESET)) {
+        errno = 0;
+        *caps = PROTOCOL_V1_CAPS;
+        return 1;
+    }
+    if (received != sizeof(header)) {
+        ERROR("recv", "hello", ERROR_OS);
+        return -1;
+    }
+    memcpy(&size, header, sizeof(size));
+    memcpy(&flags, &header[sizeof(size)], sizeof(flags));
+    if (!(flags & PROTOCOL_HELLO) || size < PROTOCOL_HELLO_SIZE || size > PROTOCOL_HELLO_MAX_SIZE ||
+        recv(sock_desc, hello, size, MSG_WAITALL) != size) {
+        ERROR("protocol_hello", "invalid answer", ERROR_APP);
+        return -1;
+    }
+    return protocol_parse_hello(hello, size, local_caps, caps);
+}
+
+int32_t protocol_answer_hello(SOCKET sock_desc, protocol_caps_t local_caps, net_packet_t *packet,
+                              protocol_caps_t *caps)
+{
+    char        hello[PROTOCOL_HELLO_MAX_SIZE];
+    uint32_t    size;
+    int32_t     version;
+
+    if ( (version = protocol_parse_hello(packet->data, packet->size, local_caps, caps)) == -1)
+        return -1;
+    /*
+     * our own capabilities, the client keeps the common ones as we do. The
+     * host id only to a client which sent one, an older one wants 12 bytes
+     */
+    size = protocol_make_hello(hello, (*caps & CAP_LOCAL) ? local_caps : local_caps & ~CAP_LOCAL);
+    if (send_packet(sock_desc, hello, size, PROTOCOL_HELLO) == -1)
+        return -1;
+    return version;
+}
+
+/** The hello of caps in hello (PROTOCOL_HELLO_MAX_SIZE bytes), returns its size */
+uint32_t protocol_make_hello(char *hello, protocol_caps_t caps)
+{
+    uint32_t magic = htonl(PROTOCOL_MAGIC);
+    uint16_t version = htons(PROTOCOL_VERSION);
+    uint16_t reserved = 0;
+    uint64_t id = protocol_host_id();
+
+    memcpy(hello, &magic, sizeof(magic));
+    memcpy(&hello[4], &version, sizeof(version));
+    memcpy(&hello[6], &reserved, sizeof(reserved));
+    if (!(caps & CAP_LOCAL) || !id) {
+        caps = htonl(caps & ~CAP_LOCAL);
+        memcpy(&hello[8], &caps, sizeof(caps));
+        return PROTOCOL_HELLO_SIZE;
+    }
+    caps = htonl(caps);
+    memcpy(&hello[8], &caps, sizeof(caps));
+    /* only compared for equality, the byte order does not matter */
+    memcpy(&hello[PROTOCOL_HELLO_SIZE], &id, sizeof(id));
+    return PROTOCOL_HELLO_MAX_SIZE;
+}
+
+int32_t protocol_parse_hello(char *hello, uint32_t size, protocol_caps_t local_caps,
+                             protocol_caps_t *caps)
+{
+    uint32_t        magic;
+    uint16_t        version;
+    protocol_caps_t peer_caps;
+
+    if (size < PROTOCOL_HELLO_SIZE) {
+        ERROR("protocol_parse_hello", "hello too short", ERROR_APP);
+        return -1;
+    }
+    memcpy(&magic, hello, sizeof(magic));
+    memcpy(&version, &hello[4], sizeof(version));
+    memcpy(&peer_caps, &hello[8], sizeof(peer_caps));
+    if (ntohl(magic) != PROTOCOL_MAGIC || ntohs(version) < 2) {
+        ERROR("protocol_parse_hello", "not a file_transfer peer", ERROR_APP);
+        return -1;
+    }
+    /* the unknown bits of a newer peer are ignored */
+    *caps = local_caps & ntohl(peer_caps);
+    /* the same files only on the same host, seen from the same mount namespace */
+    if (*caps & CAP_LOCAL) {
+        uint64_t id = protocol_host_id();
+
+        if (size < PROTOCOL_HELLO_MAX_SIZE || !id || memcmp(&hello[PROTOCOL_HELLO_SIZE], &id, sizeof(id)))
+            *caps &= ~CAP_LOCAL;
+    }
+    return ntohs(version) < PROTOCOL_VERSION ? ntohs(version) : PROTOCOL_VERSION;
+}
+
+void protocol_print_caps(const char *peer, uint16_t version, protocol_caps_t caps)
+{
+    fprintf(stdout, "%s: protocol v%u%s%s%s%s%s%s%s%s%s\n", peer, version,
+            caps & CAP_SESSIONS ? ", sessions" : "",
+            caps & CAP_SPARSE ? ", sparse" : "",
+            caps & CAP_HARDLINKS ? ", hardlinks" : "",
+            caps & CAP_KTLS ? ", tls" : "",
+            caps & CAP_BATCHED ? ", batched" : "",
+            caps & CAP_QUERIES ? ", queries" : "",
+            caps & CAP_DELETES ? ", deletes" : "",
+            caps & CAP_LOCAL ? ", local" : "",
+            caps & CAP_FDPASS ? ", fd passing" : "");
+    fflush(stdout);
+}
+
+/** What tells this host and mount namespace from the others, 0 when unknown */
+uint64_t protocol_host_id(void)
+{
+    pthread_once(&host_id_once, &host_id_load);
+    return host_id;
+}
+
+/**
+ * The path a peer asked to pull or query, resolved (malloc()ed), or NULL when
+ * it is not in SERVE_ROOT (or is not there at all)
+ */
+char *protocol_served_path(const char *path)
+{
+#ifdef SERVE_ROOT
+    char    *root;
+    char    *served;
+    size_t  len;
+
+    if (!(root = realpath(SERVE_ROOT, NULL))) {
+        ERROR("realpath", SERVE_ROOT, ERROR_OS);
+        return NULL;
+    }
+    served = realpath(path, NULL);
+    len = strlen(root);
+    /* "/" has everything in it */
+    if (served && len > 1 && (strncmp(served, root, len) || (served[len] && served[len] != '/'))) {
+        free(served);
+        served = NULL;
+        errno = EACCES;
+    }
+    free(root);
+    if (!served)
+        ERROR("serve", path, ERROR_OS);
+    return served;
+#else
+    errno = EACCES;
+    ERROR("serve", path, ERROR_OS);
+    return NULL;
+#endif /* SERVE_ROOT */
+}
+
+static void host_id_load(void)
+{
+#ifdef LINUX
+    FILE        *file;
+    char        boot_id[64] = "";
+    struct stat stat_buf;
+    uint64_t    hash = 14695981039346656037ULL;
+    uint64_t    ns[2];
+
+    /* a new boot id at each boot, the namespace inode is unique while it lives */
+    if (!(file = fopen("/proc/sys/kernel/random/boot_id", "r")))
+        return;
+    if (!fgets(boot_id, sizeof(boot_id), file) || stat("/proc/self/ns/mnt", &stat_buf) == -1) {
+        fclose(file);
+        return;
+    }
+    fclose(file);
+    ns[0] = stat_buf.st_dev;
+    ns[1] = stat_buf.st_ino;
+    /* FNV-1a */
+    for (uint32_t i = 0; boot_id[i]; ++i)
+        hash = (hash ^ (unsigned char) boot_id[i]) * 1099511628211ULL;
+    for (uint32_t i = 0; i < sizeof(ns); ++i)
+        hash = (hash ^ ((unsigned char *) ns)[i]) * 1099511628211ULL;
+    host_id = hash ? hash : 1;
+#endif /* LINUX */
+}
+
+#undef PROTOCOL_C
@@ -0,0 +1,90 @@
+/**
+ * @file protocol.h
+ * @brief The protocol version and capabilities handshake header
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <inttypes.h>
+
+#include "data_types.h"
+
+#if defined(LINUX) && defined(KTLS_ENABLED)
+#include "ktls_linux.h"
+#endif /* LINUX && KTLS_ENABLED */
+
+#ifdef PROTOCOL_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* PROTOCOL_C */
+
+/** "FTR2", the first bytes of a hello */
+#define PROTOCOL_MAGIC      0x46545232
+#define PROTOCOL_VERSION    2
+
+/** magic, version, reserved, capabilities, in network byte order */
+#define PROTOCOL_HELLO_SIZE (sizeof(uint32_t) + 2 * sizeof(uint16_t) + sizeof(uint32_t))
+
+/** followed by the host id when CAP_LOCAL is offered */
+#define PROTOCOL_HELLO_MAX_SIZE (PROTOCOL_HELLO_SIZE + sizeof(uint64_t))
+
+typedef uint32_t protocol_caps_t;
+
+/** the optional features a peer may support (the capabilities bitmap) */
+typedef enum {
+    CAP_SESSIONS           = 0x001,     /* multiplexed sessions (SESSION_OPEN) */
+    CAP_SPARSE             = 0x002,     /* sparse files as extent maps */
+    CAP_HARDLINKS          = 0x004,     /* hardlinks sent once and relinked */
+    CAP_KTLS               = 0x008,     /* the connection can go encrypted (kernel TLS) */
+    CAP_BATCHED            = 0x010,     /* small files' packets and data back to back (one writev) */
+    CAP_QUERIES            = 0x020,     /* list, stat and du without a transfer */
+    CAP_DELETES            = 0x040,     /* the entries removed at the source (watch mode) */
+    CAP_LOCAL              = 0x080,     /* same host and mount namespace, files cloned from their path */
+    CAP_FDPASS             = 0x100      /* a Unix socket, the open files passed instead of their data */
+} protocol_capabilities;
+
+/** a peer without the handshake understands the plain version 1 transfers only */
+#define PROTOCOL_V1_CAPS    0
+
+/** the local clones, when the host can be told apart from the others */
+#if defined(LINUX) && defined(LOCAL_CLONE_ENABLED)
+#define PROTOCOL_CLONE_CAPS (protocol_host_id() ? CAP_LOCAL : 0)
+#else
+#define PROTOCOL_CLONE_CAPS 0
+#endif /* LINUX && LOCAL_CLONE_ENABLED */
+
+/** offered on the Unix socket connections only, never over the network */
+#ifdef LINUX
+#define PROTOCOL_UNIX_CAPS  CAP_FDPASS
+#else
+#define PROTOCOL_UNIX_CAPS  0
+#endif /* LINUX */
+
+/** everything this build can do, encryption when the kernel can too */
+#if defined(LINUX) && defined(KTLS_ENABLED)
+#define PROTOCOL_LOCAL_CAPS (CAP_SESSIONS | CAP_SPARSE | CAP_HARDLINKS | CAP_BATCHED | CAP_QUERIES | \
+                             CAP_DELETES | PROTOCOL_CLONE_CAPS | (ktls_available() ? CAP_KTLS : 0))
+#else
+#define PROTOCOL_LOCAL_CAPS (CAP_SESSIONS | CAP_SPARSE | CAP_HARDLINKS | CAP_BATCHED | CAP_QUERIES | \
+                             CAP_DELETES | PROTOCOL_CLONE_CAPS)
+#endif /* LINUX && KTLS_ENABLED */
+
+/*
+ * protocol_hello() and protocol_answer_hello() return the version both peers
+ * speak (1 for a peer without the handshake) and the capabilities both have,
+ * or -1 on error
+ */
+EXTERN int32_t protocol_hello(SOCKET sock_desc, protocol_caps_t local_caps, protocol_caps_t *caps);
+EXTERN int32_t protocol_answer_hello(SOCKET sock_desc, protocol_caps_t local_caps, net_packet_t *packet,
+                                     protocol_caps_t *caps);
+EXTERN uint32_t protocol_make_hello(char *hello, protocol_caps_t caps);
+EXTERN int32_t protocol_parse_hello(char *hello, uint32_t size, protocol_caps_t local_caps,
+                                    protocol_caps_t *caps);
+EXTERN void    protocol_print_caps(const char *peer, uint16_t version, protocol_caps_t caps);
+EXTERN uint64_t protocol_host_id(void);
+EXTERN char    *protocol_served_path(const char *path);
+
+#undef EXTERN
+#endif /* PROTOCOL_H */
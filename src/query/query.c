@@ -0,0 +1,205 @@
+/**
+ * @file query.c
+ * @brief What a peer has, without transferring it: the entries of a
+ *        directory (list), one entry (stat) or the size of a tree (du). The
+ *        server answers from the directory index of the process, the records
+ *        are packed in QUERY_REPLY packets of QUERY_REPLY_SIZE bytes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef UNIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif /* UNIX */
+
+#define QUERY_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "protocol.h"
+#include "dir_index.h"
+#include "query.h"
+
+/* internal constants */
+#define QUERY_REPLY_SIZE    (64 * 1024)
+
+/* the answer being packed */
+typedef struct {
+    char            buf[QUERY_REPLY_SIZE];
+    uint32_t        len;
+    query_send_t    send;
+    void            *arg;
+    int8_t          failed;             /* a packet could not be sent */
+} query_reply_t;
+
+/* internal functions' prototypes */
+static void    index_create(void);
+static int32_t emit(void *arg, const char *name, const dir_index_stat_t *st);
+static int32_t flush(query_reply_t *reply);
+static int32_t send_socket(void *arg, char *data, uint32_t size, flag_t flags);
+static void    print_record(flag_t query, const query_record_t *record, const char *name);
+
+/* internal variables */
+static dir_index_t      *query_index;   /* shared by all the connections */
+static pthread_once_t   query_index_once = PTHREAD_ONCE_INIT;
+
+int32_t query_answer(flag_t flags, char *path, query_send_t send, void *arg)
+{
+    query_reply_t   *reply;
+    const char      *reason;
+    char            *served;
+    int32_t         s;
+
+    /* nothing is told of what is out of the served tree */
+    if (!(served = protocol_served_path(path))) {
+        reason = strerror(errno);
+        return send(arg, (char *) reason, strlen(reason), ABORT_TRANSFER);
+    }
+    path = served;
+    pthread_once(&query_index_once, &index_create);
+    if (!(reply = (query_reply_t *) malloc(sizeof(query_reply_t)))) {
+        ERROR("malloc", "", ERROR_OS);
+        free(served);
+        return send(arg, NULL, 0, ABORT_TRANSFER);
+    }
+    reply->len = 0;
+    reply->send = send;
+    reply->arg = arg;
+    reply->failed = 0;
+
+    errno = 0;
+    if (!query_index)
+        s = -1;
+    else if (flags & LIST_QUERY)
+        s = dir_index_list(query_index, path, &emit, reply);
+    else if (flags & DU_QUERY)
+        s = dir_index_du(query_index, path, &emit, reply);
+    else
+        s = dir_index_stat(query_index, path, &emit, reply);
+    if (s != -1)
+        s = flush(reply);
+
+    if (reply->failed)
+        s = -1;
+    else if (s != -1)
+        s = send(arg, NULL, 0, END_TRANSFER);
+    else {
+        /* the peer prints why */
+        reason = errno ? strerror(errno) : "query failed";
+        s = send(arg, (char *) reason, strlen(reason), ABORT_TRANSFER);
+    }
+    free(reply);
+    free(served);
+    return s;
+}
+
+int32_t query_serve(SOCKET sock_desc, flag_t flags, char *path)
+{
+    return query_answer(flags, path, &send_socket, &sock_desc);
+}
+
+int32_t query_peer(SOCKET sock_desc, flag_t query, char *path)
+{
+    net_packet_t    *packet;
+    query_record_t  record;
+    uint32_t        offset;
+    int32_t         s = -1;
+
+    if (send_packet(sock_desc, path, strlen(path), query) == -1)
+        return -1;
+    while ( (packet = recv_packet(sock_desc, 0)) ) {
+        if (packet->flags.val & QUERY_REPLY) {
+            for (offset = 0; offset + sizeof(record) <= packet->size; offset += sizeof(record) + record.name_len) {
+                memcpy(&record, &packet->data[offset], sizeof(record));
+                if (offset + sizeof(record) + record.name_len > packet->size)
+                    break;
+                print_record(query, &record, &packet->data[offset + sizeof(record)]);
+            }
+            destroy_packet(packet);
+            continue;
+        }
+        if (packet->flags.val & END_TRANSFER)
+            s = 0;
+        else if (packet->flags.val & ABORT_TRANSFER)
+            fprintf(stdout, "%s: %s\n", path, packet->size ? packet->data : "query failed");
+        destroy_packet(packet);
+        break;
+    }
+    fflush(stdout);
+    return s;
+}
+
+static void index_create(void)
+{
+    query_index = dir_index_create();
+}
+
+static int32_t emit(void *arg, const char *name, const dir_index_stat_t *st)
+{
+    query_reply_t   *reply = (query_reply_t *) arg;
+    query_record_t  record;
+    uint32_t        name_len = strlen(name);
+
+    if (reply->len + sizeof(record) + name_len > sizeof(reply->buf) && flush(reply) == -1)
+        return -1;
+    record.size = st->size;
+    record.files = st->files;
+    record.mtime = st->mtime;
+    record.mode = st->mode;
+    record.name_len = name_len;
+    memcpy(&reply->buf[reply->len], &record, sizeof(record));
+    memcpy(&reply->buf[reply->len + sizeof(record)], name, name_len);
+    reply->len += sizeof(record) + name_len;
+    return 0;
+}
+
+static int32_t flush(query_reply_t *reply)
+{
+    if (reply->len == 0)
+        return 0;
+    if (reply->send(reply->arg, reply->buf, reply->len, QUERY_REPLY) == -1) {
+        reply->failed = 1;
+        return -1;
+    }
+    reply->len = 0;
+    return 0;
+}
+
+static int32_t send_socket(void *arg, char *data, uint32_t size, flag_t flags)
+{
+    return send_packet(*(SOCKET *) arg, data, size, flags);
+}
+
+static void print_record(flag_t query, const query_record_t *record, const char *name)
+{
+    char        mode[11] = "----------";
+    char        mtime[32];
+    time_t      time = record->mtime;
+    struct tm   tm;
+
+    if (query & DU_QUERY) {
+        fprintf(stdout, "%14" PRIu64 " bytes %10" PRIu64 " files  %.*s\n",
+                record->size, record->files, (int) record->name_len, name);
+        return;
+    }
+    if (S_ISDIR(record->mode))
+        mode[0] = 'd';
+    else if (S_ISLNK(record->mode))
+        mode[0] = 'l';
+    else if (!S_ISREG(record->mode))
+        mode[0] = '?';
+    for (int32_t i = 0; i < 9; ++i)
+        if (record->mode & (0400 >> i))
+            mode[i + 1] = "rwxrwxrwx"[i];
+    localtime_r(&time, &tm);
+    strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", &tm);
+    fprintf(stdout, "%s %14" PRIu64 " %s %.*s\n", mode, record->size, mtime, (int) record->name_len, name);
+}
+
+#undef QUERY_C
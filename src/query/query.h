@@ -0,0 +1,43 @@
+/**
+ * @file query.h
+ * @brief The remote list, stat and du queries header
+ */
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <inttypes.h>
+
+#include "data_types.h"
+
+#ifdef QUERY_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* QUERY_C */
+
+/** the flags asking for a query, its path is the data of the packet */
+#define QUERY_FLAGS         (LIST_QUERY | STAT_QUERY | DU_QUERY)
+
+/** an entry of a QUERY_REPLY packet, its name follows (name_len bytes, no '\0') */
+typedef struct {
+    uint64_t    size;                   /* bytes, of the files below for du */
+    uint64_t    files;                  /* du: the entries below */
+    int64_t     mtime;
+    uint32_t    mode;
+    uint32_t    name_len;
+} query_record_t;
+
+/** sends a packet of the answer, send_packet() on a connection of its own */
+typedef int32_t (*query_send_t)(void *arg, char *data, uint32_t size, flag_t flags);
+
+/*
+ * query_answer() sends the QUERY_REPLY packets of a query, then END_TRANSFER
+ * or ABORT_TRANSFER with the reason. Returns -1 when a packet can't be sent
+ */
+EXTERN int32_t query_answer(flag_t flags, char *path, query_send_t send, void *arg);
+EXTERN int32_t query_serve(SOCKET sock_desc, flag_t flags, char *path);
+EXTERN int32_t query_peer(SOCKET sock_desc, flag_t query, char *path);
+
+#undef EXTERN
+#endif /* QUERY_H */
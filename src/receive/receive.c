@@ -22,6 +22,8 @@
 
 #ifdef LINUX
 #include "receive_file_linux.h"
+#include "recv_writer_linux.h"
+#include "clone_file_linux.h"
 #endif /* LINUX */
 
 #define RECEIVE_C
@@ -30,13 +32,38 @@
 #include "send.h"
 #include "data_types.h"
 #include "error.h"
+#include "sparse.h"
+#include "dir_cache.h"
+#include "commit.h"
 
 /* internal functions' prototypes */
 static int32_t receive_file(SOCKET sock_desc, char filepath[]);
+static int32_t receive_hardlink(SOCKET sock_desc, char *data, uint32_t size);
+static int32_t receive_delete(SOCKET sock_desc, char *path);
+static int32_t receive_local(SOCKET sock_desc, char filepath[], net_packet_t *packet);
+#ifdef LINUX
+static int32_t receive_passed(SOCKET sock_desc, char filepath[], int32_t src_desc);
+#endif /* LINUX */
+
+/* internal variables, one set per thread: several transfers may run at once */
+static __thread char    *directory_path_prefix;
+static __thread int8_t  aborted_transfer;
+/* the open directories of the tree, the entries are created relative to them */
+static __thread dir_cache_t *transfer_dirs;
+/* the complete files, renamed from their staging names once on disk */
+static __thread commit_t *transfer_commit;
+#ifdef LINUX
+static __thread splice_pipe_t *transfer_pipe;  /* all the files of the transfer go through it */
+static __thread recv_writer_t *transfer_writer; /* the files are written there, the socket keeps draining */
+static __thread chunk_tune_t transfer_tune;     /* the size of transfer_pipe, without the writers */
+static __thread transfer_progress_t *transfer_progress;   /* NULL when nobody follows the transfer */
+#endif /* LINUX */
 
-/* internal variables */
-static char    directory_path_prefix[PATH_SIZE];
-static int8_t  aborted_transfer;
+/** the counters of the next transfers of this thread, NULL for none */
+void receive_progress(transfer_progress_t *progress)
+{
+    transfer_progress = progress;
+}
 
 int32_t __recv(SOCKET sock_desc, flag_t flag, char path[])
 {
@@ -49,7 +76,29 @@ int32_t __recv(SOCKET sock_desc, flag_t flag, char path[])
     
     fprintf(stdout, "Starting to receive...\n");
     
-    memcpy(directory_path_prefix, path, strlen(path));
+    directory_path_prefix = path;
+    if (!(transfer_dirs = dir_cache_create(path))) {
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        return -1;
+    }
+    if (!(transfer_commit = commit_create(transfer_dirs))) {
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        dir_cache_destroy(transfer_dirs);
+        transfer_dirs = NULL;
+        return -1;
+    }
+#ifdef LINUX
+    chunk_tune_init(&transfer_tune, PIPE_DEFAULT_SIZE, PIPE_SIZE, PIPE_SIZE);
+    /* without the writers, the files are written here between the packets */
+    if (RECV_WRITER_THREADS > 0 && !(transfer_writer = recv_writer_create(RECV_WRITER_THREADS))) {
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        commit_destroy(transfer_commit);
+        transfer_commit = NULL;
+        dir_cache_destroy(transfer_dirs);
+        transfer_dirs = NULL;
+        return -1;
+    }
+#endif /* LINUX */
     /* get the child nodes (directories/files) */
     for (end = 0, s = 0; !end && !s; ) {
         if ( (packet = recv_packet(sock_desc, 0)) == NULL) {
@@ -57,13 +106,14 @@ int32_t __recv(SOCKET sock_desc, flag_t flag, char path[])
             break;
         }
         if (packet->flags.val & DIR_TYPE && !(packet->flags.val & ABORT_TRANSFER)) {
-            /* create and open it */
-            char dirpath[PATH_SIZE];
-            sprintf(dirpath, "%s/%s", directory_path_prefix, packet->data);
-            s = mkdir(dirpath, 0777);
+            /* create it in its parent, the root itself is there already */
+            const char  *name;
+            dir_entry_t *dir = dir_cache_parent(transfer_dirs, packet->data, &name);
+            s = dir ? (*name ? mkdirat(dir->dir_desc, name, 0777) : 0) : -1;
             if (s == -1) {
-                if (errno != EEXIST) {
-                    ERROR("mkdir", dirpath, ERROR_OS);
+                if (!dir || errno != EEXIST) {
+                    if (dir)
+                        ERROR("mkdirat", packet->data, ERROR_OS);
                     abort_transfer(sock_desc, &aborted_transfer, 1);
                 }
                 else {
@@ -71,9 +121,18 @@ int32_t __recv(SOCKET sock_desc, flag_t flag, char path[])
                     errno = 0;
                 }
             }
+            dir_cache_put(transfer_dirs, dir);
         }
         else if (packet->flags.val & FILE_TYPE && !(packet->flags.val & ABORT_TRANSFER)) {
             s = receive_file(sock_desc, packet->data);
+            if (s != -1 && transfer_progress)
+                ++transfer_progress->files;
+        }
+        else if (packet->flags.val & HARDLINK_TYPE && !(packet->flags.val & ABORT_TRANSFER)) {
+            s = receive_hardlink(sock_desc, packet->data, packet->size);
+        }
+        else if (packet->flags.val & DELETE_TYPE && !(packet->flags.val & ABORT_TRANSFER)) {
+            s = receive_delete(sock_desc, packet->data);
         }
         else {
             end = 1;
@@ -83,38 +142,286 @@ int32_t __recv(SOCKET sock_desc, flag_t flag, char path[])
         }
         destroy_packet(packet);
     }
+#ifdef LINUX
+    /* the transfer is done once its files are on disk */
+    if (transfer_writer && recv_writer_flush(transfer_writer) == -1)
+        s = -1;
+    recv_writer_destroy(transfer_writer);
+    transfer_writer = NULL;
+    pipe_pool_put(NULL, transfer_pipe, 0);
+    transfer_pipe = NULL;
+#endif /* LINUX */
+    /* the last batch gets its names */
+    if (commit_flush(transfer_commit) == -1)
+        s = -1;
+    commit_destroy(transfer_commit);
+    transfer_commit = NULL;
+    dir_cache_destroy(transfer_dirs);
+    transfer_dirs = NULL;
     return s;
 }
 
 static int32_t receive_file(SOCKET sock_desc, char filepath[])
 {
-    char                path[PATH_SIZE];
     volatile uint64_t   filesize;
     net_packet_t        *packet = NULL;
     int32_t             s = 0;
+    int8_t              sparse;
+    file_extent_t       *extents = NULL;
+    uint32_t            extents_cnt = 0;
+    int32_t             src_desc = -1;
+#ifdef LINUX
+    dir_entry_t         *dir;
+    const char          *name;
+    char                staged[COMMIT_NAME_SIZE];
+#endif /* LINUX */
     
-    /* the file path is received */
-    sprintf(path, "%s/%s", directory_path_prefix, filepath);
-    /* receive the file size */
-    if ( (packet = recv_packet(sock_desc, 0)) == NULL)
-        goto error;
-    if (packet->flags.val & ABORT_TRANSFER) {
-        abort_transfer(sock_desc, &aborted_transfer, 0);
-        goto error;
+    /* receive the file size, a peer on this host asks to clone the file first */
+    for (;;) {
+        if ( (packet = recv_packet_fd(sock_desc, 0, &src_desc)) == NULL)
+            goto error;
+        if (packet->flags.val & ABORT_TRANSFER) {
+            abort_transfer(sock_desc, &aborted_transfer, 0);
+            goto error;
+        }
+#ifdef LINUX
+        /* or passes the open file, on a Unix socket */
+        if ((packet->flags.val & FILE_DESC) && src_desc != -1) {
+            destroy_packet(packet);
+            return receive_passed(sock_desc, filepath, src_desc);
+        }
+#endif /* LINUX */
+        if (src_desc != -1) {
+            close(src_desc);
+            src_desc = -1;
+        }
+        if (packet->flags.val & FILE_DESC) {
+            ERROR("receive_file", "no file passed", ERROR_APP);
+            abort_transfer(sock_desc, &aborted_transfer, 1);
+            goto error;
+        }
+        if (!(packet->flags.val & LOCAL_FILE))
+            break;
+        s = receive_local(sock_desc, filepath, packet);
+        destroy_packet(packet);
+        packet = NULL;
+        if (s != 0)
+            return s == 1 ? 0 : -1;
     }
     memcpy((char *) &filesize, packet->data, packet->size);
+    sparse = (packet->flags.val & SPARSE_FILE) != 0;
     destroy_packet(packet);
+    packet = NULL;
+    
+    /* a sparse file is followed by the map of its data extents */
+    if (sparse) {
+        if ( (packet = recv_packet(sock_desc, 0)) == NULL)
+            goto error;
+        if (packet->flags.val & ABORT_TRANSFER) {
+            abort_transfer(sock_desc, &aborted_transfer, 0);
+            goto error;
+        }
+        extents = (file_extent_t *) packet->data;
+        extents_cnt = packet->size / sizeof(file_extent_t);
+        /* whole extents only, a trailing part of one is a broken map */
+        if (!(packet->flags.val & EXTENT_MAP) || packet->size % sizeof(file_extent_t) ||
+            !sparse_valid_extents(extents, extents_cnt, filesize)) {
+            ERROR("receive_file", "invalid extent map", ERROR_APP);
+            abort_transfer(sock_desc, &aborted_transfer, 1);
+            goto error;
+        }
+    }
     
-    fprintf(stdout, "Receiving file %s ...\n", path);
+    fprintf(stdout, "Receiving file %s/%s ...\n", directory_path_prefix, filepath);
+    /* counted whole as it starts, the receiving side has no finer progress */
+    if (transfer_progress)
+        transfer_progress->bytes += filesize;
     
 #ifdef LINUX
-    s = receive_file_linux(sock_desc, path, filesize);
+    if (transfer_writer) {
+        s = recv_writer_receive(transfer_writer, sock_desc, transfer_dirs, transfer_commit,
+                                filepath, filesize, extents, extents_cnt);
+        if (s == -1)
+            abort_transfer(sock_desc, &aborted_transfer, 1);
+        if (transfer_progress)
+            transfer_progress->pipe_size = chunk_tune_best(&transfer_writer->tune);
+        destroy_packet(packet);
+        return s;
+    }
+    if (!transfer_pipe && !(transfer_pipe = pipe_pool_get(NULL))) {
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        goto error;
+    }
+    /* the file is opened in its directory, not from the root, under a staging name */
+    if (!(dir = dir_cache_parent(transfer_dirs, filepath, &name))) {
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        goto error;
+    }
+    commit_stage_name(staged);
+    s = receive_file_linux(sock_desc, transfer_pipe, &transfer_tune, dir->dir_desc, staged, filesize,
+                           extents, extents_cnt);
+    if (transfer_progress)
+        transfer_progress->pipe_size = chunk_tune_best(&transfer_tune);
+    if (s == -1)
+        commit_discard(dir, staged);
+    else if ( (s = commit_file(transfer_commit, dir, staged, name, -1)) == -1)
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+    dir_cache_put(transfer_dirs, dir);
 #endif /* LINUX */
+    destroy_packet(packet);
     return s;
     
  error:
+    if (src_desc != -1)
+        close(src_desc);
     destroy_packet(packet);
     return -1;
 }
 
+static int32_t receive_hardlink(SOCKET sock_desc, char *data, uint32_t size)
+{
+    uint32_t    path_len = strnlen(data, size);
+    int32_t     s = 0;
+#ifdef LINUX
+    dir_entry_t *dir;
+    dir_entry_t *target_dir;
+    const char  *name;
+    const char  *target_name;
+#endif /* LINUX */
+    
+    /* the link path and the path of the file we already have, '\0' separated */
+    if (path_len + 1 >= size) {
+        ERROR("receive_hardlink", "invalid link packet", ERROR_APP);
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        return -1;
+    }
+    
+    fprintf(stdout, "Linking file %s/%s ...\n", directory_path_prefix, data);
+    
+#ifdef LINUX
+    /* the target may still be in the writers' queue, then in the commit batch */
+    if (transfer_writer && recv_writer_flush(transfer_writer) == -1) {
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        return -1;
+    }
+    dir = dir_cache_parent(transfer_dirs, data, &name);
+    target_dir = dir_cache_parent(transfer_dirs, &data[path_len + 1], &target_name);
+    s = dir && target_dir ? commit_link(transfer_commit, target_dir, target_name, dir, name) : -1;
+    if (s == -1)
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+    dir_cache_put(transfer_dirs, dir);
+    dir_cache_put(transfer_dirs, target_dir);
+#endif /* LINUX */
+    return s;
+}
+
+static int32_t receive_delete(SOCKET sock_desc, char *path)
+{
+    fprintf(stdout, "Removing %s/%s ...\n", directory_path_prefix, path);
+    
+#ifdef LINUX
+    /* a file of the tree may still be in the writers' queue */
+    if (transfer_writer && recv_writer_flush(transfer_writer) == -1) {
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        return -1;
+    }
+#endif /* LINUX */
+    if (commit_flush(transfer_commit) == -1 || dir_cache_remove(transfer_dirs, path) == -1) {
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * A peer on this host asks to clone the file from its path, answered with
+ * whether it was. Returns 1 when it was, 0 when the data follows, -1 on error
+ */
+static int32_t receive_local(SOCKET sock_desc, char filepath[], net_packet_t *packet)
+{
+    int32_t         cloned = 0;
+#if defined(LINUX) && defined(LOCAL_CLONE_ENABLED)
+    local_file_t    local;
+    struct stat     stat_buf;
+    int32_t         src_desc;
+    dir_entry_t     *dir = NULL;
+    const char      *name;
+    char            staged[COMMIT_NAME_SIZE];
+    
+    if (packet->size <= sizeof(local)) {
+        ERROR("receive_local", "invalid local file packet", ERROR_APP);
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        return -1;
+    }
+    memcpy(&local, packet->data, sizeof(local));
+    /* below what may be cloned, still the file the peer looked at, and one its user may read */
+    src_desc = clone_file_open_beneath_linux(LOCAL_CLONE_PATH, &packet->data[sizeof(local)]);
+    if (src_desc != -1 && fstat(src_desc, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode) &&
+        stat_buf.st_dev == local.dev && stat_buf.st_ino == local.ino && stat_buf.st_size == local.size &&
+        stat_buf.st_mtim.tv_sec == local.mtime_sec && stat_buf.st_mtim.tv_nsec == local.mtime_nsec &&
+        clone_file_peer_may_read_linux(sock_desc, src_desc, &stat_buf) &&
+        (dir = dir_cache_parent(transfer_dirs, filepath, &name))) {
+        fprintf(stdout, "Cloning file %s/%s ...\n", directory_path_prefix, filepath);
+        commit_stage_name(staged);
+        if (clone_file_from_linux(src_desc, dir->dir_desc, staged) == -1)
+            commit_discard(dir, staged);
+        else
+            cloned = commit_file(transfer_commit, dir, staged, name, -1) == -1 ? -1 : 1;
+    }
+    errno = 0;
+    if (src_desc != -1)
+        close(src_desc);
+    dir_cache_put(transfer_dirs, dir);
+    if (cloned == -1) {
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        return -1;
+    }
+    if (cloned && transfer_progress)
+        transfer_progress->bytes += local.size;
+#endif /* LINUX && LOCAL_CLONE_ENABLED */
+    if (send_packet(sock_desc, NULL, 0, LOCAL_FILE | (cloned ? END_TRANSFER : CONTINUE_TRANSFER)) == -1)
+        return -1;
+    return cloned;
+}
+
+#ifdef LINUX
+/** The file passed open by the peer, copied by the kernel. src_desc is closed */
+static int32_t receive_passed(SOCKET sock_desc, char filepath[], int32_t src_desc)
+{
+    int32_t         s = -1;
+    struct stat     stat_buf;
+    dir_entry_t     *dir = NULL;
+    const char      *name;
+    char            staged[COMMIT_NAME_SIZE];
+    
+    if (fstat(src_desc, &stat_buf) == -1) {
+        ERROR("fstat", filepath, ERROR_OS);
+        goto end;
+    }
+    if (!S_ISREG(stat_buf.st_mode)) {
+        ERROR("receive_passed", "not a regular file", ERROR_APP);
+        goto end;
+    }
+    if (!(dir = dir_cache_parent(transfer_dirs, filepath, &name)))
+        goto end;
+    fprintf(stdout, "Copying file %s/%s ...\n", directory_path_prefix, filepath);
+    commit_stage_name(staged);
+    if (clone_file_from_linux(src_desc, dir->dir_desc, staged) == -1)
+        commit_discard(dir, staged);
+    else
+        s = commit_file(transfer_commit, dir, staged, name, -1);
+    
+ end:
+    close(src_desc);
+    dir_cache_put(transfer_dirs, dir);
+    if (s == -1) {
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        return -1;
+    }
+    if (transfer_progress)
+        transfer_progress->bytes += stat_buf.st_size;
+    return 0;
+}
+#endif /* LINUX */
+
 #undef RECEIVE_C
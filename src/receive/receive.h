@@ -17,6 +17,7 @@
 #endif /* RECEIVE_C */
 
 /* receive functions */
+EXTERN void receive_progress(transfer_progress_t *progress);
 EXTERN int32_t __recv(SOCKET sock_desc, flag_t flag, char path[]);
 
 #undef EXTERN
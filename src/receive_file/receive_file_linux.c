@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <inttypes.h>
 #include <time.h>
 
 #include "config.h"
@@ -17,73 +18,125 @@
 #include "error.h"
 #include "receive.h"
 #include "send.h"
+#include "sparse.h"
 
 #define RECEIVE_FILE_C
 #include "receive_file_linux.h"
 
+/* internal functions' prototypes */
+static int32_t splice_range(int32_t sock_desc, splice_pipe_t *pipe, chunk_tune_t *tune, int32_t file_desc,
+                            loff_t offset, uint64_t length, uint64_t *total_received,
+                            uint64_t total_size, time_t *last_time);
+
 /* internal variables */
-static int8_t aborted_transfer;
+static __thread int8_t aborted_transfer;
 
-int32_t receive_file_linux(int32_t sock_desc, char *path, uint64_t filesize)
+/** The pipe takes the size tuned by tune, the splices through it are timed */
+int32_t receive_file_linux(int32_t sock_desc, splice_pipe_t *pipe, chunk_tune_t *tune, int32_t dir_desc,
+                           const char *name, uint64_t filesize, file_extent_t *extents,
+                           uint32_t extents_cnt)
 {
-    int32_t     pipefd[2];
-    int32_t     file_desc;
+    int32_t     file_desc = -1;
     uint64_t    total_received = 0;
-    int64_t     received;
-    time_t      now;
+    uint64_t    data_size = filesize;
     time_t      last_time;
-    pipefd[0] = pipefd[1] = file_desc = -1;
     
     /* Reset the abortion */
     aborted_transfer = 0;
     
-    /* open the file */
-    if ( (file_desc = open(path, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR|S_IROTH)) == -1) {
-        ERROR("open", path, ERROR_OS);
+    /* open the file, in its directory */
+    if ( (file_desc = openat(dir_desc, name, O_WRONLY|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IROTH)) == -1) {
+        ERROR("openat", name, ERROR_OS);
         abort_transfer(sock_desc, &aborted_transfer, 1);
         goto error;
     }
-    /* create the pipe */
-    if (pipe(pipefd) == -1) {
-        ERROR("pipe", "", ERROR_OS);
-        abort_transfer(sock_desc, &aborted_transfer, 1);
-        goto error;
+    /* a sparse file gets its size and holes first, only the extents are received */
+    if (extents) {
+        if (sparse_make_holes(file_desc, filesize, extents, extents_cnt) == -1) {
+            abort_transfer(sock_desc, &aborted_transfer, 1);
+            goto error;
+        }
+        data_size = 0;
+        for (uint32_t i = 0; i < extents_cnt; ++i)
+            data_size += extents[i].length;
     }
-    /* receive the file */
+    /* receive the file, through the pipe of the connection */
     time(&last_time);
-    while (total_received < filesize) {
-        if ((received = splice(sock_desc, NULL, pipefd[1], NULL, filesize - total_received, SPLICE_F_NONBLOCK)) == -1) {
+    if (extents) {
+        for (uint32_t i = 0; i < extents_cnt; ++i)
+            if (splice_range(sock_desc, pipe, tune, file_desc, extents[i].offset, extents[i].length,
+                             &total_received, data_size, &last_time) == -1)
+                goto error;
+    }
+    else if (splice_range(sock_desc, pipe, tune, file_desc, 0, filesize,
+                          &total_received, data_size, &last_time) == -1) {
+        goto error;
+    }
+    
+    close(file_desc);
+    /* Success */
+    return 0;
+    
+ error:
+    if (file_desc != -1) close(file_desc);
+    return -1;
+}
+
+static int32_t splice_range(int32_t sock_desc, splice_pipe_t *pipe, chunk_tune_t *tune, int32_t file_desc,
+                            loff_t offset, uint64_t length, uint64_t *total_received,
+                            uint64_t total_size, time_t *last_time)
+{
+    uint64_t        range_received = 0;
+    uint64_t        want;
+    int64_t         received;
+    int64_t         written;
+    int64_t         moved;
+    struct timespec start;
+#ifdef PRINT_PERCENTAGE
+    time_t          now;
+#endif /* PRINT_PERCENTAGE */
+    
+    while (range_received < length) {
+        /* the pipe is empty here, it takes the tuned size (or the most it may have) */
+        if (pipe->size != chunk_tune_size(tune) && pipe_pool_resize(pipe, chunk_tune_size(tune)) < chunk_tune_size(tune))
+            chunk_tune_limit(tune, pipe->size);
+        want = length - range_received > pipe->size ? pipe->size : length - range_received;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if ((received = splice(sock_desc, NULL, pipe->fd[1], NULL, want, SPLICE_F_NONBLOCK)) == -1) {
             ERROR("splice", "socket to pipe", ERROR_OS);
             abort_transfer(sock_desc, &aborted_transfer, 1);
-            goto error;
+            return -1;
         }
-        if (splice(pipefd[0], NULL, file_desc, NULL, received, SPLICE_F_MOVE) == -1) {
-            ERROR("splice", "pipe to file", ERROR_OS);
-            abort_transfer(sock_desc, &aborted_transfer, 1);
-            goto error;
+        if (received == 0) {
+            ERROR("splice", "connection closed", ERROR_APP);
+            return -1;
         }
-        total_received += received;
+        moved = received;
+        /* the pipe must be drained, splice may move less than asked */
+        while (received > 0) {
+            if ((written = splice(pipe->fd[0], NULL, file_desc, &offset, received, SPLICE_F_MOVE)) == -1) {
+                ERROR("splice", "pipe to file", ERROR_OS);
+                abort_transfer(sock_desc, &aborted_transfer, 1);
+                return -1;
+            }
+            received -= written;
+            range_received += written;
+            *total_received += written;
+        }
+        /* a whole pipe asked for, from the socket to the file */
+        if (want == pipe->size && chunk_tune_record(tune, moved, &start))
+            fprintf(stdout, "Pipe size %" PRIu32 " KiB, %.1f MiB/s\n", chunk_tune_best(tune) / 1024,
+                    chunk_tune_rate(tune) / (1024 * 1024));
         
 #ifdef PRINT_PERCENTAGE
-        if (time(&now) > last_time) {
-            fprintf(stdout, "%.1lf %%\r", ((double)total_received / filesize) * 100);
+        if (time(&now) > *last_time) {
+            fprintf(stdout, "%.1lf %%\r", ((double)*total_received / total_size) * 100);
             fflush(stdout);
-            last_time = now;
+            *last_time = now;
         }
 #endif /* PRINT_PERCENTAGE */
     }
-    
-    close(file_desc);
-    close(pipefd[0]);
-    close(pipefd[1]);
-    /* Success */
     return 0;
-    
- error:
-    if (file_desc != -1) close(file_desc);
-    if (pipefd[0] != -1) close(pipefd[0]);
-    if (pipefd[1] != -1) close(pipefd[1]);
-    return -1;
 }
 
 #undef RECEIVE_FILE_C
@@ -1,15 +1,22 @@
 #include <inttypes.h>
 
+#include "data_types.h"
+#include "pipe_pool_linux.h"
+
 #ifndef RECEIVE_FILE_H
 #define RECEIVE_FILE_H
 
+#include "chunk_tune.h"
+
 #ifdef RECEIVE_FILE_C
 #define EXTERN
 #else
 #define EXTERN extern
 #endif /* RECEIVE_FILE_C */
 
-EXTERN int32_t receive_file_linux(int32_t sock_desc, char *path, uint64_t filesize);
+EXTERN int32_t receive_file_linux(int32_t sock_desc, splice_pipe_t *pipe, chunk_tune_t *tune, int32_t dir_desc,
+                                  const char *name, uint64_t filesize, file_extent_t *extents,
+                                  uint32_t extents_cnt);
 
 #undef EXTERN
 #endif /* RECEIVE_FILE_H */
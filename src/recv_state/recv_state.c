@@ -0,0 +1,346 @@
+/**
+ * @file recv_state.c
+ * @brief The receive protocol as a state machine: it is fed the packets and
+ *        the file data as they come, from a non blocking socket (event engine)
+ *        or from the frames of a multiplexed session
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif /* UNIX */
+
+#ifdef LINUX
+#include "pipe_pool_linux.h"
+#endif /* LINUX */
+
+#define RECV_STATE_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "sparse.h"
+#include "dir_cache.h"
+#include "recv_state.h"
+
+/* internal functions' prototypes */
+static recv_state_status_t recv_entry(recv_state_t *rs, flag_t flags, char *data, uint32_t size);
+static recv_state_status_t recv_link(recv_state_t *rs, char *data, uint32_t size);
+static recv_state_status_t open_file(recv_state_t *rs);
+static int32_t             end_file(recv_state_t *rs);
+static void                discard_file(recv_state_t *rs);
+
+int32_t recv_state_init(recv_state_t *rs, const char *prefix, struct pipe_pool *pipes)
+{
+    memset(rs, 0, sizeof(recv_state_t));
+    rs->proto = RS_ENTRY;
+    rs->file_desc = -1;
+    rs->pipes = pipes;
+    if (!(rs->prefix = strdup(prefix))) {
+        ERROR("strdup", "", ERROR_OS);
+        return -1;
+    }
+    return 0;
+}
+
+recv_state_status_t recv_state_on_packet(recv_state_t *rs, flag_t flags, char *data, uint32_t size)
+{
+    if (flags & ABORT_TRANSFER) {
+        fprintf(stdout, "Abort transfer...\n");
+        return RECV_STATE_ABORTED;
+    }
+    switch (rs->proto) {
+        case RS_ENTRY:
+            return recv_entry(rs, flags, data, size);
+        case RS_SIZE:
+            if (size != sizeof(rs->filesize)) {
+                ERROR("recv_state_on_packet", "invalid file size", ERROR_APP);
+                return RECV_STATE_ERROR;
+            }
+            memcpy(&rs->filesize, data, sizeof(rs->filesize));
+            rs->sparse = (flags & SPARSE_FILE) != 0;
+            if (rs->sparse) {
+                rs->proto = RS_EXTENTS;
+                return RECV_STATE_CONTINUE;
+            }
+            rs->single_extent.offset = 0;
+            rs->single_extent.length = rs->filesize;
+            rs->extents = &rs->single_extent;
+            rs->extents_cnt = 1;
+            return open_file(rs);
+        case RS_EXTENTS:
+            rs->extents_cnt = size / sizeof(file_extent_t);
+            /* whole extents only, a trailing part of one is a broken map */
+            if (!(flags & EXTENT_MAP) || size % sizeof(file_extent_t) ||
+                !(rs->extents_buf = (char *) malloc(size + 1))) {
+                ERROR("recv_state_on_packet", "invalid extent map", ERROR_APP);
+                return RECV_STATE_ERROR;
+            }
+            memcpy(rs->extents_buf, data, size);
+            rs->extents = (file_extent_t *) rs->extents_buf;
+            if (!sparse_valid_extents(rs->extents, rs->extents_cnt, rs->filesize)) {
+                ERROR("recv_state_on_packet", "invalid extent map", ERROR_APP);
+                return RECV_STATE_ERROR;
+            }
+            return open_file(rs);
+        default:
+            ERROR("recv_state_on_packet", "packet instead of file data", ERROR_APP);
+            return RECV_STATE_ERROR;
+    }
+}
+
+int8_t recv_state_wants_data(recv_state_t *rs)
+{
+    return rs->proto == RS_FILE_DATA;
+}
+
+uint64_t recv_state_data_remaining(recv_state_t *rs)
+{
+    uint64_t remaining = 0;
+
+    if (rs->proto != RS_FILE_DATA)
+        return 0;
+    for (uint32_t i = rs->extent; i < rs->extents_cnt; ++i)
+        remaining += rs->extents[i].length;
+    return remaining - rs->extent_done;
+}
+
+int64_t recv_state_on_data(recv_state_t *rs, int32_t src_desc, uint64_t max, int8_t nonblock)
+{
+    uint64_t    moved_total = 0;
+    uint64_t    remaining;
+    int64_t     moved;
+    loff_t      offset;
+
+    while (rs->proto == RS_FILE_DATA && moved_total < max) {
+        remaining = rs->extents[rs->extent].length - rs->extent_done;
+        if (remaining == 0) {
+            rs->extent_done = 0;
+            if (++rs->extent == rs->extents_cnt && end_file(rs) == -1)
+                return -1;
+            continue;
+        }
+        /* fill the pipe from the source, only when the last bytes are on disk */
+        if (rs->pipe_len == 0) {
+            if (remaining > max - moved_total)
+                remaining = max - moved_total;
+            moved = splice(src_desc, NULL, rs->pipe->fd[1], NULL, remaining, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved == -1) {
+                if (nonblock && (errno == EAGAIN || errno == EWOULDBLOCK) && moved_total)
+                    return moved_total;
+                if (!nonblock || (errno != EAGAIN && errno != EWOULDBLOCK))
+                    ERROR("splice", "socket to pipe", ERROR_OS);
+                return -1;
+            }
+            /* the source is closed */
+            if (moved == 0)
+                return moved_total;
+            rs->pipe_len = moved;
+        }
+        offset = rs->extents[rs->extent].offset + rs->extent_done;
+        moved = splice(rs->pipe->fd[0], NULL, rs->file_desc, &offset, rs->pipe_len, SPLICE_F_MOVE);
+        if (moved == -1) {
+            ERROR("splice", "pipe to file", ERROR_OS);
+            /* not a would block for the caller */
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                errno = EIO;
+            return -1;
+        }
+        rs->pipe_len -= moved;
+        rs->extent_done += moved;
+        moved_total += moved;
+    }
+    /* the file may end right at max */
+    while (rs->proto == RS_FILE_DATA && rs->extent_done == rs->extents[rs->extent].length) {
+        rs->extent_done = 0;
+        if (++rs->extent == rs->extents_cnt && end_file(rs) == -1)
+            return -1;
+    }
+    return moved_total;
+}
+
+void recv_state_destroy(recv_state_t *rs)
+{
+    /* an incomplete file is removed, the complete ones are committed */
+    discard_file(rs);
+    commit_destroy(rs->commit);
+    rs->commit = NULL;
+    /* back to the connection for its next transfer */
+    pipe_pool_put(rs->pipes, rs->pipe, rs->pipe_len == 0);
+    free(rs->extents_buf);
+    dir_cache_destroy(rs->dirs);
+    free(rs->prefix);
+    free(rs->path);
+    rs->file_desc = -1;
+    rs->pipe = NULL;
+    rs->extents_buf = NULL;
+    rs->dirs = NULL;
+    rs->prefix = rs->path = NULL;
+}
+
+static recv_state_status_t recv_entry(recv_state_t *rs, flag_t flags, char *data, uint32_t size)
+{
+    dir_entry_t *dir;
+    const char  *name;
+    int32_t     s;
+
+    if (flags & START_TRANSFER) {
+        fprintf(stdout, "Starting to receive...\n");
+        return RECV_STATE_CONTINUE;
+    }
+    /* the entries are created relative to their directory, opened once for the transfer */
+    if ((flags & (DIR_TYPE | FILE_TYPE | HARDLINK_TYPE | DELETE_TYPE)) && !rs->dirs &&
+        (!(rs->dirs = dir_cache_create(rs->prefix)) || !(rs->commit = commit_create(rs->dirs))))
+        return RECV_STATE_ERROR;
+    if (flags & DIR_TYPE) {
+        if (!(dir = dir_cache_parent(rs->dirs, data, &name)))
+            return RECV_STATE_ERROR;
+        /* the root itself is there already */
+        s = *name ? mkdirat(dir->dir_desc, name, 0777) : 0;
+        dir_cache_put(rs->dirs, dir);
+        if (s == -1 && errno != EEXIST) {
+            ERROR("mkdirat", data, ERROR_OS);
+            return RECV_STATE_ERROR;
+        }
+        errno = 0;
+        return RECV_STATE_CONTINUE;
+    }
+    if (flags & FILE_TYPE) {
+        free(rs->path);
+        if (!(rs->path = strdup(data))) {
+            ERROR("strdup", "", ERROR_OS);
+            return RECV_STATE_ERROR;
+        }
+        rs->proto = RS_SIZE;
+        return RECV_STATE_CONTINUE;
+    }
+    if (flags & HARDLINK_TYPE)
+        return recv_link(rs, data, size);
+    if (flags & DELETE_TYPE) {
+        fprintf(stdout, "Removing %s/%s ...\n", rs->prefix, data);
+        /* nothing of the tree waits for its name anymore */
+        if (commit_flush(rs->commit) == -1 || dir_cache_remove(rs->dirs, data) == -1)
+            return RECV_STATE_ERROR;
+        return RECV_STATE_CONTINUE;
+    }
+    if (flags & END_TRANSFER) {
+        fprintf(stdout, "End transfer\n");
+        /* the last batch gets its names */
+        return commit_flush(rs->commit) == -1 ? RECV_STATE_ERROR : RECV_STATE_DONE;
+    }
+    fprintf(stdout, "Unknown error occured...\n");
+    return RECV_STATE_ERROR;
+}
+
+static recv_state_status_t recv_link(recv_state_t *rs, char *data, uint32_t size)
+{
+    uint32_t    path_len = strnlen(data, size);
+    int32_t     s = 0;
+#ifdef LINUX
+    dir_entry_t *dir;
+    dir_entry_t *target_dir;
+    const char  *name;
+    const char  *target_name;
+#endif /* LINUX */
+
+    /* the link path and the path of the file we already have, '\0' separated */
+    if (path_len + 1 >= size) {
+        ERROR("recv_link", "invalid link packet", ERROR_APP);
+        return RECV_STATE_ERROR;
+    }
+    fprintf(stdout, "Linking file %s/%s ...\n", rs->prefix, data);
+#ifdef LINUX
+    /* the target may still wait in the commit batch */
+    dir = dir_cache_parent(rs->dirs, data, &name);
+    target_dir = dir_cache_parent(rs->dirs, &data[path_len + 1], &target_name);
+    s = dir && target_dir ? commit_link(rs->commit, target_dir, target_name, dir, name) : -1;
+    dir_cache_put(rs->dirs, dir);
+    dir_cache_put(rs->dirs, target_dir);
+#endif /* LINUX */
+    return s == -1 ? RECV_STATE_ERROR : RECV_STATE_CONTINUE;
+}
+
+static recv_state_status_t open_file(recv_state_t *rs)
+{
+    dir_entry_t *dir;
+    const char  *name;
+
+    fprintf(stdout, "Receiving file %s/%s ...\n", rs->prefix, rs->path);
+
+    if (!(dir = dir_cache_parent(rs->dirs, rs->path, &name)))
+        return RECV_STATE_ERROR;
+    /* written under a staging name, renamed once complete */
+    commit_stage_name(rs->staged);
+    rs->file_desc = openat(dir->dir_desc, rs->staged, O_WRONLY|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IROTH);
+    dir_cache_put(rs->dirs, dir);
+    if (rs->file_desc == -1) {
+        ERROR("openat", rs->path, ERROR_OS);
+        return RECV_STATE_ERROR;
+    }
+    if (rs->sparse && sparse_make_holes(rs->file_desc, rs->filesize, rs->extents, rs->extents_cnt) == -1)
+        return RECV_STATE_ERROR;
+    /* one pipe for all the files of the transfer */
+    if (!rs->pipe && !(rs->pipe = pipe_pool_get(rs->pipes)))
+        return RECV_STATE_ERROR;
+    rs->extent = 0;
+    rs->extent_done = 0;
+    rs->pipe_len = 0;
+    rs->proto = RS_FILE_DATA;
+
+    /* nothing to wait for an empty file */
+    if (recv_state_data_remaining(rs) == 0 && end_file(rs) == -1)
+        return RECV_STATE_ERROR;
+    return RECV_STATE_CONTINUE;
+}
+
+static int32_t end_file(recv_state_t *rs)
+{
+    dir_entry_t *dir;
+    const char  *name;
+    int32_t     s = -1;
+
+    if ( (dir = dir_cache_parent(rs->dirs, rs->path, &name)) ) {
+        s = commit_file(rs->commit, dir, rs->staged, name, rs->file_desc);
+        dir_cache_put(rs->dirs, dir);
+    }
+    if (close(rs->file_desc) == -1) {
+        ERROR("close", rs->path, ERROR_OS);
+        s = -1;
+    }
+    rs->file_desc = -1;
+    free(rs->extents_buf);
+    rs->extents_buf = NULL;
+    rs->extents = NULL;
+    rs->extents_cnt = 0;
+    rs->extent = 0;
+    rs->extent_done = 0;
+    rs->proto = RS_ENTRY;
+    /* not a would block for the caller */
+    if (s == -1)
+        errno = EIO;
+    return s;
+}
+
+static void discard_file(recv_state_t *rs)
+{
+    dir_entry_t *dir;
+    const char  *name;
+
+    if (rs->file_desc == -1)
+        return;
+    close(rs->file_desc);
+    rs->file_desc = -1;
+    if ( (dir = dir_cache_parent(rs->dirs, rs->path, &name)) ) {
+        commit_discard(dir, rs->staged);
+        dir_cache_put(rs->dirs, dir);
+    }
+}
+
+#undef RECV_STATE_C
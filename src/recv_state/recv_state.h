@@ -0,0 +1,70 @@
+/**
+ * @file recv_state.h
+ * @brief The receive protocol state machine header
+ */
+
+#ifndef RECV_STATE_H
+#define RECV_STATE_H
+
+#include <inttypes.h>
+
+#include "data_types.h"
+#include "commit.h"
+
+#ifdef RECV_STATE_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* RECV_STATE_C */
+
+struct pipe_pool;
+struct splice_pipe;
+struct dir_cache;
+
+/** what a received packet did to the transfer */
+typedef enum {
+    RECV_STATE_CONTINUE    = 0,         /* more packets (or file data) expected */
+    RECV_STATE_DONE        = 1,         /* END_TRANSFER */
+    RECV_STATE_ABORTED     = 2,         /* the peer aborted */
+    RECV_STATE_ERROR       = -1         /* our error, the peer should get an abortion */
+} recv_state_status_t;
+
+typedef enum {
+    RS_ENTRY,                           /* waiting a start/directory/file/link/end packet */
+    RS_SIZE,                            /* waiting the size of a file */
+    RS_EXTENTS,                         /* waiting the extent map of a sparse file */
+    RS_FILE_DATA                        /* the file data comes next */
+} recv_state_proto_t;
+
+/** a received transfer, fed with the packets and the file data as they come */
+typedef struct {
+    recv_state_proto_t  proto;
+    char                *prefix;
+    struct dir_cache    *dirs;          /* the open directories under prefix */
+    commit_t            *commit;        /* the complete files get their names there */
+    char                *path;          /* of the current file, relative to prefix */
+    char                staged[COMMIT_NAME_SIZE];   /* its name until complete */
+    int32_t             file_desc;
+    uint64_t            filesize;
+    int8_t              sparse;
+    file_extent_t       single_extent;
+    file_extent_t       *extents;
+    char                *extents_buf;   /* owns the extents of a sparse file */
+    uint32_t            extents_cnt;
+    uint32_t            extent;
+    uint64_t            extent_done;
+    struct pipe_pool    *pipes;         /* the pipes of the connection, NULL for a pipe of its own */
+    struct splice_pipe  *pipe;          /* taken at the first file, kept for the next ones */
+    uint32_t            pipe_len;
+} recv_state_t;
+
+/* receive state machine functions */
+EXTERN int32_t recv_state_init(recv_state_t *rs, const char *prefix, struct pipe_pool *pipes);
+EXTERN recv_state_status_t recv_state_on_packet(recv_state_t *rs, flag_t flags, char *data, uint32_t size);
+EXTERN int8_t recv_state_wants_data(recv_state_t *rs);
+EXTERN uint64_t recv_state_data_remaining(recv_state_t *rs);
+EXTERN int64_t recv_state_on_data(recv_state_t *rs, int32_t src_desc, uint64_t max, int8_t nonblock);
+EXTERN void recv_state_destroy(recv_state_t *rs);
+
+#undef EXTERN
+#endif /* RECV_STATE_H */
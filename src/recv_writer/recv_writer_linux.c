@@ -0,0 +1,430 @@
+/**
+ * @file recv_writer_linux.c
+ * @brief The receiver split in two: the reader of the connection splices the
+ *        file data from the socket into pipes and queues them, the writer
+ *        threads create, fill and close the files from the queue. A slow
+ *        open() or close() no longer stops the socket from draining, and the
+ *        files are written in parallel. The queue is bounded by the pipes in
+ *        flight (RECV_WRITER_QUEUE), the reader waits for a free one.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif /* UNIX */
+
+#define RECV_WRITER_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "sparse.h"
+#include "recv_writer_linux.h"
+
+/* internal functions' prototypes */
+static void          *writer_thread(void *arg);
+static int32_t       write_chunk(recv_chunk_t *chunk);
+static int32_t       open_file(recv_file_t *file);
+static int32_t       file_release(recv_file_t *file);
+static splice_pipe_t *take_pipe(recv_writer_t *rw);
+static int32_t       queue_chunk(recv_writer_t *rw, recv_file_t *file, splice_pipe_t *pipe,
+                                 uint64_t offset, uint32_t len);
+static int32_t       splice_range(recv_writer_t *rw, recv_file_t *file, int32_t sock_desc,
+                                  uint64_t offset, uint64_t length, uint64_t *total_received,
+                                  uint64_t total_size, time_t *last_time);
+
+recv_writer_t *recv_writer_create(uint32_t threads_cnt)
+{
+    recv_writer_t   *rw;
+    int32_t         s;
+
+    rw = (recv_writer_t *) calloc(1, sizeof(recv_writer_t));
+    if (!rw || !(rw->TIDs = (pthread_t *) calloc(threads_cnt, sizeof(pthread_t)))) {
+        ERROR("calloc", "", ERROR_OS);
+        free(rw);
+        return NULL;
+    }
+    if (!(rw->pipes = pipe_pool_create(RECV_WRITER_QUEUE))) {
+        free(rw->TIDs);
+        free(rw);
+        return NULL;
+    }
+    chunk_tune_init(&rw->tune, PIPE_DEFAULT_SIZE, PIPE_SIZE, PIPE_SIZE);
+    pthread_mutex_init(&rw->lock, NULL);
+    pthread_cond_init(&rw->cond, NULL);
+
+    for (rw->threads_cnt = 0; rw->threads_cnt < threads_cnt; ++rw->threads_cnt) {
+        s = pthread_create(&rw->TIDs[rw->threads_cnt], NULL, &writer_thread, rw);
+        if (s != 0) {
+            errno = s;
+            ERROR("pthread_create", "", ERROR_OS);
+            recv_writer_destroy(rw);
+            return NULL;
+        }
+    }
+    return rw;
+}
+
+int32_t recv_writer_receive(recv_writer_t *rw, int32_t sock_desc, dir_cache_t *dirs, commit_t *commit,
+                            const char *path, uint64_t filesize, file_extent_t *extents,
+                            uint32_t extents_cnt)
+{
+    recv_file_t *file;
+    uint64_t    total_received = 0;
+    uint64_t    data_size = filesize;
+    time_t      last_time;
+    int32_t     s = 0;
+
+    file = (recv_file_t *) calloc(1, sizeof(recv_file_t));
+    if (!file || !(file->path = strdup(path)) ||
+        (extents && !(file->extents = (file_extent_t *) malloc(extents_cnt * sizeof(file_extent_t))))) {
+        ERROR("malloc", "", ERROR_OS);
+        if (file)
+            free(file->path);
+        free(file);
+        return -1;
+    }
+    /* the directory is resolved here, in the order of the packets */
+    file->dirs = dirs;
+    if (!(file->dir = dir_cache_parent(dirs, file->path, &file->name))) {
+        free(file->extents);
+        free(file->path);
+        free(file);
+        return -1;
+    }
+    file->commit = commit;
+    commit_stage_name(file->staged);
+    file->filesize = filesize;
+    file->file_desc = -1;
+    file->refs = 1;
+    pthread_mutex_init(&file->lock, NULL);
+    if (extents) {
+        memcpy(file->extents, extents, extents_cnt * sizeof(file_extent_t));
+        file->extents_cnt = extents_cnt;
+        data_size = 0;
+        for (uint32_t i = 0; i < extents_cnt; ++i)
+            data_size += extents[i].length;
+    }
+
+    /* the data goes to the writers, the file is opened by the first of them */
+    time(&last_time);
+    if (extents) {
+        for (uint32_t i = 0; i < extents_cnt && s == 0; ++i)
+            s = splice_range(rw, file, sock_desc, extents[i].offset, extents[i].length,
+                             &total_received, data_size, &last_time);
+    }
+    else {
+        s = splice_range(rw, file, sock_desc, 0, filesize, &total_received, data_size, &last_time);
+    }
+
+    /* the end of the file: an empty file is created there, the last writer closes it */
+    if (queue_chunk(rw, file, NULL, 0, 0) == -1)
+        s = -1;
+    /* short of data, it is not committed */
+    if (s == -1) {
+        pthread_mutex_lock(&file->lock);
+        file->failed = 1;
+        pthread_mutex_unlock(&file->lock);
+    }
+    if (file_release(file) == -1)
+        s = -1;
+    return s;
+}
+
+int32_t recv_writer_flush(recv_writer_t *rw)
+{
+    int32_t s;
+
+    pthread_mutex_lock(&rw->lock);
+    while ((rw->head || rw->busy) && rw->threads_cnt)
+        pthread_cond_wait(&rw->cond, &rw->lock);
+    s = rw->failed ? -1 : 0;
+    pthread_mutex_unlock(&rw->lock);
+    return s;
+}
+
+void recv_writer_destroy(recv_writer_t *rw)
+{
+    recv_chunk_t *chunk;
+
+    if (!rw)
+        return;
+    pthread_mutex_lock(&rw->lock);
+    rw->stop = 1;
+    pthread_cond_broadcast(&rw->cond);
+    pthread_mutex_unlock(&rw->lock);
+    for (uint32_t i = 0; i < rw->threads_cnt; ++i)
+        pthread_join(rw->TIDs[i], NULL);
+
+    /* the writers are gone before the queue was written (a failed start) */
+    while ( (chunk = rw->head) ) {
+        rw->head = chunk->next;
+        pipe_pool_put(NULL, chunk->pipe, 0);
+        chunk->file->failed = 1;
+        file_release(chunk->file);
+        free(chunk);
+    }
+    pipe_pool_destroy(rw->pipes);
+    pthread_mutex_destroy(&rw->lock);
+    pthread_cond_destroy(&rw->cond);
+    free(rw->TIDs);
+    free(rw);
+}
+
+static void *writer_thread(void *arg)
+{
+    recv_writer_t   *rw = (recv_writer_t *) arg;
+    recv_chunk_t    *chunk;
+    int32_t         s;
+
+    pthread_mutex_lock(&rw->lock);
+    for (;;) {
+        while (!rw->head && !rw->stop)
+            pthread_cond_wait(&rw->cond, &rw->lock);
+        if (!rw->head)
+            break;
+        chunk = rw->head;
+        if (!(rw->head = chunk->next))
+            rw->tail = NULL;
+        ++rw->busy;
+        pthread_mutex_unlock(&rw->lock);
+
+        s = write_chunk(chunk);
+        /* a pipe left with data is closed, not reused */
+        pipe_pool_put(rw->pipes, chunk->pipe, s == 0);
+        /* the last one closes the file and commits it */
+        if (file_release(chunk->file) == -1)
+            s = -1;
+
+        pthread_mutex_lock(&rw->lock);
+        if (chunk->pipe)
+            --rw->pipes_out;
+        if (s == -1)
+            rw->failed = 1;
+        --rw->busy;
+        free(chunk);
+        pthread_cond_broadcast(&rw->cond);
+    }
+    pthread_mutex_unlock(&rw->lock);
+    return NULL;
+}
+
+static int32_t write_chunk(recv_chunk_t *chunk)
+{
+    recv_file_t *file = chunk->file;
+    loff_t      offset = chunk->offset;
+    uint32_t    len = chunk->len;
+    int64_t     written;
+    int8_t      failed;
+
+    pthread_mutex_lock(&file->lock);
+    if (!file->opened && !file->failed && open_file(file) == -1)
+        file->failed = 1;
+    failed = file->failed;
+    pthread_mutex_unlock(&file->lock);
+    if (failed)
+        return -1;
+
+    /* the chunks of a file are written in any order, each at its offset */
+    while (len > 0) {
+        if ((written = splice(chunk->pipe->fd[0], NULL, file->file_desc, &offset, len, SPLICE_F_MOVE)) == -1) {
+            if (errno == EINTR)
+                continue;
+            ERROR("splice", "pipe to file", ERROR_OS);
+            pthread_mutex_lock(&file->lock);
+            file->failed = 1;
+            pthread_mutex_unlock(&file->lock);
+            return -1;
+        }
+        len -= written;
+    }
+    return 0;
+}
+
+static int32_t open_file(recv_file_t *file)
+{
+    if ( (file->file_desc = openat(file->dir->dir_desc, file->staged, O_WRONLY|O_CREAT|O_CLOEXEC,
+                                   S_IRUSR|S_IWUSR|S_IROTH)) == -1) {
+        ERROR("openat", file->path, ERROR_OS);
+        return -1;
+    }
+    file->opened = 1;
+    /* a sparse file gets its size and holes before any of its data */
+    if (file->extents && sparse_make_holes(file->file_desc, file->filesize, file->extents, file->extents_cnt) == -1)
+        return -1;
+    return 0;
+}
+
+static int32_t file_release(recv_file_t *file)
+{
+    uint32_t    refs;
+    int32_t     s = 0;
+
+    pthread_mutex_lock(&file->lock);
+    refs = --file->refs;
+    pthread_mutex_unlock(&file->lock);
+    if (refs)
+        return 0;
+    /* complete, it gets its name (now or with its batch), else it is removed */
+    if (file->opened && !file->failed)
+        s = commit_file(file->commit, file->dir, file->staged, file->name, file->file_desc);
+    else if (file->opened)
+        commit_discard(file->dir, file->staged);
+    if (file->file_desc != -1 && close(file->file_desc) == -1) {
+        ERROR("close", file->path, ERROR_OS);
+        s = -1;
+    }
+    dir_cache_put(file->dirs, file->dir);
+    pthread_mutex_destroy(&file->lock);
+    free(file->extents);
+    free(file->path);
+    free(file);
+    return s;
+}
+
+static splice_pipe_t *take_pipe(recv_writer_t *rw)
+{
+    splice_pipe_t *pipe;
+
+    /* the queue is full while all the pipes are out */
+    pthread_mutex_lock(&rw->lock);
+    while (rw->pipes_out >= RECV_WRITER_QUEUE && !rw->failed)
+        pthread_cond_wait(&rw->cond, &rw->lock);
+    if (rw->failed) {
+        pthread_mutex_unlock(&rw->lock);
+        return NULL;
+    }
+    ++rw->pipes_out;
+    pthread_mutex_unlock(&rw->lock);
+
+    if (!(pipe = pipe_pool_get(rw->pipes))) {
+        pthread_mutex_lock(&rw->lock);
+        --rw->pipes_out;
+        pthread_mutex_unlock(&rw->lock);
+    }
+    return pipe;
+}
+
+static int32_t queue_chunk(recv_writer_t *rw, recv_file_t *file, splice_pipe_t *pipe,
+                           uint64_t offset, uint32_t len)
+{
+    recv_chunk_t *chunk;
+
+    chunk = (recv_chunk_t *) malloc(sizeof(recv_chunk_t));
+    if (!chunk) {
+        ERROR("malloc", "", ERROR_OS);
+        return -1;
+    }
+    chunk->file = file;
+    chunk->pipe = pipe;
+    chunk->offset = offset;
+    chunk->len = len;
+    chunk->next = NULL;
+    /* the chunk holds the file until it is written */
+    pthread_mutex_lock(&file->lock);
+    ++file->refs;
+    pthread_mutex_unlock(&file->lock);
+
+    pthread_mutex_lock(&rw->lock);
+    if (rw->tail)
+        rw->tail->next = chunk;
+    else
+        rw->head = chunk;
+    rw->tail = chunk;
+    pthread_cond_broadcast(&rw->cond);
+    pthread_mutex_unlock(&rw->lock);
+    return 0;
+}
+
+static int32_t splice_range(recv_writer_t *rw, recv_file_t *file, int32_t sock_desc,
+                            uint64_t offset, uint64_t length, uint64_t *total_received,
+                            uint64_t total_size, time_t *last_time)
+{
+    splice_pipe_t   *pipe;
+    uint64_t        range_received = 0;
+    uint32_t        filled;
+    uint32_t        want;
+    int8_t          whole;
+    int64_t         received;
+    struct timespec start;
+#ifdef PRINT_PERCENTAGE
+    time_t          now;
+#endif /* PRINT_PERCENTAGE */
+
+    while (range_received < length) {
+        /* the wait for a free pipe counts, the writers are slower with some sizes */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!(pipe = take_pipe(rw)))
+            return -1;
+        /* a free pipe is empty, it takes the tuned size (or the most it may have) */
+        if (pipe->size != chunk_tune_size(&rw->tune) &&
+            pipe_pool_resize(pipe, chunk_tune_size(&rw->tune)) < chunk_tune_size(&rw->tune))
+            chunk_tune_limit(&rw->tune, pipe->size);
+        want = length - range_received > pipe->size ? pipe->size : length - range_received;
+        /* the pipe is the writer's once queued */
+        whole = want == pipe->size;
+        /*
+         * A full pipe per chunk, the writers get few large splices. The pipe
+         * may run out of slots before its bytes (a slot per socket buffer
+         * fragment): the pipe is not waited for then, it goes as it is.
+         */
+        for (filled = 0; filled < want; filled += received) {
+            if ((received = splice(sock_desc, NULL, pipe->fd[1], NULL, want - filled,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) == -1) {
+                if (errno == EINTR) {
+                    received = 0;
+                    continue;
+                }
+                if (errno == EAGAIN && filled) {
+                    received = 0;
+                    errno = 0;
+                    break;
+                }
+                ERROR("splice", "socket to pipe", ERROR_OS);
+                break;
+            }
+            if (received == 0) {
+                ERROR("splice", "connection closed", ERROR_APP);
+                received = -1;
+                break;
+            }
+        }
+        /* the pipe goes with the chunk, even a partial one: its writer returns it */
+        if (!filled || queue_chunk(rw, file, pipe, offset + range_received, filled) == -1) {
+            pipe_pool_put(rw->pipes, pipe, filled == 0);
+            pthread_mutex_lock(&rw->lock);
+            --rw->pipes_out;
+            pthread_cond_broadcast(&rw->cond);
+            pthread_mutex_unlock(&rw->lock);
+            if (filled)
+                return -1;
+        }
+        if (received == -1)
+            return -1;
+        if (whole && chunk_tune_record(&rw->tune, filled, &start))
+            fprintf(stdout, "Pipe size %" PRIu32 " KiB, %.1f MiB/s\n", chunk_tune_best(&rw->tune) / 1024,
+                    chunk_tune_rate(&rw->tune) / (1024 * 1024));
+        range_received += filled;
+        *total_received += filled;
+
+#ifdef PRINT_PERCENTAGE
+        if (time(&now) > *last_time) {
+            fprintf(stdout, "%.1lf %%\r", ((double)*total_received / total_size) * 100);
+            fflush(stdout);
+            *last_time = now;
+        }
+#endif /* PRINT_PERCENTAGE */
+    }
+    return 0;
+}
+
+#undef RECV_WRITER_C
@@ -0,0 +1,76 @@
+/**
+ * @file recv_writer_linux.h
+ * @brief The receiver's writer threads header
+ */
+
+#ifndef RECV_WRITER_H
+#define RECV_WRITER_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "data_types.h"
+#include "pipe_pool_linux.h"
+#include "dir_cache.h"
+#include "commit.h"
+#include "chunk_tune.h"
+
+#ifdef RECV_WRITER_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* RECV_WRITER_C */
+
+/** a received file, shared by the reader and the writers of its chunks */
+typedef struct {
+    char                *path;          /* relative to the root of the transfer */
+    const char          *name;          /* in path, the name in its directory */
+    dir_cache_t         *dirs;
+    dir_entry_t         *dir;           /* held until the file is closed */
+    commit_t            *commit;        /* the file is renamed there once complete */
+    char                staged[COMMIT_NAME_SIZE];   /* its name until then */
+    uint64_t            filesize;
+    file_extent_t       *extents;       /* owned copy, NULL for a dense file */
+    uint32_t            extents_cnt;
+    int32_t             file_desc;      /* opened by the first writer */
+    int8_t              opened;
+    int8_t              failed;         /* incomplete, it is removed */
+    uint32_t            refs;           /* the queued chunks and the reader */
+    pthread_mutex_t     lock;
+} recv_file_t;
+
+/** file data waiting in a pipe, or the end of a file when there is no pipe */
+typedef struct recv_chunk {
+    recv_file_t         *file;
+    splice_pipe_t       *pipe;
+    uint64_t            offset;
+    uint32_t            len;
+    struct recv_chunk   *next;
+} recv_chunk_t;
+
+/** the writer threads of a connection, fed by its reader through a bounded queue */
+typedef struct {
+    pipe_pool_t         *pipes;
+    uint32_t            pipes_out;      /* filled or being filled, RECV_WRITER_QUEUE at most */
+    chunk_tune_t        tune;           /* the pipes' size, chosen by the reader's throughput */
+    recv_chunk_t        *head;
+    recv_chunk_t        *tail;
+    uint32_t            busy;           /* chunks being written */
+    int8_t              stop;
+    int8_t              failed;         /* a file could not be written */
+    pthread_t           *TIDs;
+    uint32_t            threads_cnt;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+} recv_writer_t;
+
+/* receiver writer functions */
+EXTERN recv_writer_t *recv_writer_create(uint32_t threads_cnt);
+EXTERN int32_t       recv_writer_receive(recv_writer_t *rw, int32_t sock_desc, dir_cache_t *dirs, commit_t *commit,
+                                         const char *path, uint64_t filesize, file_extent_t *extents,
+                                         uint32_t extents_cnt);
+EXTERN int32_t       recv_writer_flush(recv_writer_t *rw);
+EXTERN void          recv_writer_destroy(recv_writer_t *rw);
+
+#undef EXTERN
+#endif /* RECV_WRITER_H */
@@ -2,7 +2,7 @@
  * @file send.c
  * @brief The send op. implementation
  */
-
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,9 +16,11 @@
 #include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <dirent.h>
 #include <time.h>
 #endif /* UNIX */
@@ -28,89 +30,217 @@
 #include "send.h"
 #include "data_types.h"
 #include "error.h"
+#include "sparse.h"
+#include "inode_table.h"
+#include "pacing.h"
+#include "session.h"
+#include "protocol.h"
+#include "send_batch.h"
+#include "send_index.h"
+#include "filter.h"
+#include "chunk_tune.h"
 
 /* internal functions' prototypes */
-static int8_t send_directory(SOCKET sock_desc, char *dirpath, int32_t node);
-static int8_t send_file(SOCKET sock_desc, char *path);
+static int8_t send_directory(SOCKET sock_desc, int32_t dir_desc, uint32_t path_len, int32_t node);
+static int8_t send_file(SOCKET sock_desc, int32_t dir_desc, const char *name);
+static int8_t send_range(SOCKET sock_desc, int32_t file_desc, char *path,
+                         off_t offset, uint64_t length);
+static int8_t send_hardlink(SOCKET sock_desc, char *path, const char *target);
+#if defined(LINUX) && defined(LOCAL_CLONE_ENABLED)
+static int8_t send_local(SOCKET sock_desc, char *path, const struct stat *stat_buf);
+#endif /* LINUX && LOCAL_CLONE_ENABLED */
+static int8_t transfer_packet(SOCKET sock_desc, char *buff, uint32_t size, flag_t flags);
+static int8_t transfer_begin(SOCKET sock_desc, char *path, qos_class_t qos, protocol_caps_t caps);
+static int8_t transfer_end(SOCKET sock_desc, int32_t s);
+static int32_t path_join(uint32_t path_len, const char *name);
+static const char *base_name(const char *path);
+#ifdef SEND_INDEX_ENABLED
+static send_index_t *index_open(SOCKET sock_desc, char *path);
+static int8_t index_skip(SOCKET sock_desc, int32_t dir_desc, const char *name);
+#endif /* SEND_INDEX_ENABLED */
+
+/* internal variables, one set per thread: several transfers may run at once */
+static __thread int32_t send_directory_prefix_len;
+/* the path of the entry being sent, grown as deep as the tree goes */
+static __thread char    *send_path;
+static __thread uint32_t send_path_size;
+static __thread int8_t  aborted_transfer;
+/* files with more than one link already sent, by (st_dev, st_ino) */
+static __thread inode_table_t *sent_inodes;
+/* the rate limits and the priority class of the transfer */
+static __thread pacing_t *transfer_pacing;
+/* the session stream of the transfer, NULL on a connection of its own */
+static __thread session_stream_t *transfer_stream;
+/* what the receiver understands (negotiated by the hello) */
+static __thread protocol_caps_t transfer_caps;
+/* the packets and the small files gathered for one writev, NULL on a session stream */
+static __thread send_batch_t *transfer_batch;
+/* the sendfile() chunk size of the connection, chosen by throughput */
+static __thread chunk_tune_t transfer_chunks;
+/* counted for whoever follows the transfer, NULL when nobody does */
+static __thread transfer_progress_t *transfer_progress;
+/* the rules of what is left out, NULL when there are none */
+static __thread const filter_t *transfer_filter;
+/* what was sent to the peer from this tree last time, NULL when unknown */
+static __thread send_index_t *transfer_index;
+/* the files of a tree shared with other transfers go on the one claiming them, NULL when not shared */
+static __thread send_claim_t transfer_claim;
+static __thread void *transfer_claim_arg;
+
+/** the counters of the next transfers of this thread, NULL for none */
+void send_progress(transfer_progress_t *progress)
+{
+    transfer_progress = progress;
+}
 
-/* internal variables */
-static int32_t send_directory_prefix_len;
-static int8_t  aborted_transfer;
+/** the counters set by send_progress() on this thread, NULL for none */
+transfer_progress_t *send_progress_current(void)
+{
+    return transfer_progress;
+}
 
-int8_t __send(SOCKET sock_desc, char *path)
+/** the files the next transfers of this thread send, all of them when claim is NULL */
+void send_claim(send_claim_t claim, void *arg)
+{
+    transfer_claim = claim;
+    transfer_claim_arg = arg;
+}
+
+int8_t __send(SOCKET sock_desc, char *path, qos_class_t qos, protocol_caps_t caps)
 {
     int32_t     s;
-    flag_union  flag;
+    int32_t     dir_desc;
     struct stat statbuf;
     
-    /* Reset the abortion */
-    aborted_transfer = 0;
-    
     /* the sending path is a regular file or a directory? */
     if (stat(path, &statbuf) == -1) {
         ERROR("stat", path, ERROR_OS);
         abort_transfer(sock_desc, &aborted_transfer, 1);
         return -1;
     }
-    
-    /* get the main directory (the last directory from path) */
-    char *main_dir = strrchr(path, '/') + 1;
-    send_directory_prefix_len = strlen(path) - strlen(main_dir);
-    
-    flag.val = START_TRANSFER | SEND_OPERATION;
-    if (send_packet(sock_desc, NULL, 0, flag.val) == -1)
+    if (transfer_begin(sock_desc, path, qos, caps) == -1)
         return -1;
     
-    if (S_ISDIR(statbuf.st_mode)) {
-        s = send_directory(sock_desc, path, 1);
+    if (path_join(0, path) == -1) {
+        s = -1;
+    }
+    else if (S_ISDIR(statbuf.st_mode)) {
+        /* the tree is walked from directory descriptors, the path is only sent */
+        if ( (dir_desc = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+            ERROR("open", path, ERROR_OS);
+            abort_transfer(sock_desc, &aborted_transfer, 1);
+            s = -1;
+        }
+        else {
+            s = send_directory(sock_desc, dir_desc, strlen(path), 1);
+        }
     }
     else if (S_ISREG(statbuf.st_mode)) {
-        s = send_file(sock_desc, path);
+        s = send_file(sock_desc, AT_FDCWD, path);
     }
     
-    if (s != -1) {
-        flag.val = END_TRANSFER;
-        if (send_packet(sock_desc, NULL, 0, flag.val) == -1)
+    return transfer_end(sock_desc, s);
+}
+
+int8_t __send_changes(SOCKET sock_desc, char *root, char **changed, uint32_t changed_cnt,
+                      char **deleted, uint32_t deleted_cnt, qos_class_t qos, protocol_caps_t caps)
+{
+    int32_t     s = 0;
+    int32_t     len;
+    int32_t     dir_desc;
+    uint32_t    root_len = strlen(root);
+    struct stat statbuf;
+    
+    if (transfer_begin(sock_desc, root, qos, caps) == -1)
+        return -1;
+    if (deleted_cnt && !(caps & CAP_DELETES)) {
+        fprintf(stdout, "The peer can't remove files, %u deletions not sent...\n", deleted_cnt);
+        deleted_cnt = 0;
+    }
+    
+    /* the removals first: a path removed then created again ends up created */
+    for (uint32_t i = 0; i < deleted_cnt && s != -1; ++i) {
+        /* never sent, what the peer has there is its own */
+        if (transfer_filter && (filter_excluded(transfer_filter, base_name(deleted[i]), deleted[i], 0) ||
+                                filter_excluded(transfer_filter, base_name(deleted[i]), deleted[i], 1)))
+            continue;
+        if (path_join(0, root) == -1 || (len = path_join(root_len, deleted[i])) == -1) {
             s = -1;
+            break;
+        }
+        fprintf(stdout, "Removing %s ...\n", send_path);
+        s = transfer_packet(sock_desc, &send_path[send_directory_prefix_len],
+                            len - send_directory_prefix_len, DELETE_TYPE);
     }
-    fprintf(stdout, "End transfering...\n");
-    fflush(stdout);
-    return s;
+    for (uint32_t i = 0; i < changed_cnt && s != -1 && !aborted_transfer; ++i) {
+        if (path_join(0, root) == -1 || (len = path_join(root_len, changed[i])) == -1) {
+            s = -1;
+            break;
+        }
+        /* removed since it changed, its removal is on the way */
+        if (lstat(send_path, &statbuf) == -1) {
+            if (errno == ENOENT)
+                continue;
+            ERROR("lstat", send_path, ERROR_OS);
+            abort_transfer(sock_desc, &aborted_transfer, 1);
+            s = -1;
+        }
+        else if (transfer_filter &&
+                 filter_excluded(transfer_filter, base_name(changed[i]), changed[i], S_ISDIR(statbuf.st_mode))) {
+            continue;
+        }
+        else if (S_ISDIR(statbuf.st_mode)) {
+            if ( (dir_desc = open(send_path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+                ERROR("open", send_path, ERROR_OS);
+                abort_transfer(sock_desc, &aborted_transfer, 1);
+                s = -1;
+            }
+            else {
+                s = send_directory(sock_desc, dir_desc, len, 1);
+            }
+        }
+        else if (S_ISREG(statbuf.st_mode)) {
+            s = send_file(sock_desc, AT_FDCWD, send_path);
+        }
+    }
+    
+    return transfer_end(sock_desc, s);
 }
 
 /** 
  * Unsafe @function, it is @recursive (but not tail recursive) and risks a stack overflow
- * To avoid it, path size must be a finite number
+ * To avoid it, the tree depth must be a finite number
+ * The directory is walked from its descriptor (owned from now on), the path
+ * of its entries in send_path is only for the peer
  */
-int8_t send_directory(SOCKET sock_desc, char *dirpath, int32_t node)
+int8_t send_directory(SOCKET sock_desc, int32_t dir_desc, uint32_t path_len, int32_t node)
 {   
     DIR             *dir;
     struct dirent   *entry;
     int32_t         s = 0;
     int32_t         ret;
+    int32_t         sub_desc;
+    int32_t         len;
     flag_t          flag;
-    uint32_t        send_size;
-    char            *send_data;
-    char            path[PATH_SIZE];
     
-    dir = opendir(dirpath);
+    dir = fdopendir(dir_desc);
     if (!dir) {
-        ERROR("opendir", dirpath, ERROR_OS);
+        ERROR("fdopendir", send_path, ERROR_OS);
+        close(dir_desc);
         abort_transfer(sock_desc, &aborted_transfer, 1);
         return -1;
     }
     entry = readdir(dir);
     if (!entry) {
-        ERROR("readdir", dirpath, ERROR_OS);
+        ERROR("readdir", send_path, ERROR_OS);
+        closedir(dir);
         abort_transfer(sock_desc, &aborted_transfer, 1);
         return -1;
     }
     
     /* send the name of directory */
     flag = DIR_TYPE;
-    send_data = &dirpath[send_directory_prefix_len];
-    send_size = strlen(&dirpath[send_directory_prefix_len]);
-    s = send_packet(sock_desc, send_data, send_size, flag);
+    s = transfer_packet(sock_desc, &send_path[send_directory_prefix_len], path_len - send_directory_prefix_len, flag);
     if (s == -1) {
         closedir(dir);
         abort_transfer(sock_desc, &aborted_transfer, 1);
@@ -118,31 +248,45 @@ int8_t send_directory(SOCKET sock_desc, char *dirpath, int32_t node)
     }
     
     do {
+        if (entry->d_type == DT_DIR &&
+            (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0))
+            continue;
+        if ( (len = path_join(path_len, entry->d_name)) == -1) {
+            abort_transfer(sock_desc, &aborted_transfer, 1);
+            s = -1;
+            break;
+        }
+        if (transfer_filter &&
+            filter_excluded(transfer_filter, entry->d_name, strchr(&send_path[send_directory_prefix_len], '/') + 1,
+                            entry->d_type == DT_DIR)) {
+            /* left out, a directory with all it has: it is not even opened */
+        }
         /* directory type */
-        if (entry->d_type == DT_DIR) {
-            int32_t len = snprintf(path, sizeof(path)-1, "%s/%s", dirpath, entry->d_name);
-            path[len] = 0;
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                continue;
-            
-            ret = send_directory(sock_desc, path, node + 1);
+        else if (entry->d_type == DT_DIR) {
+            if ( (sub_desc = openat(dirfd(dir), entry->d_name, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) == -1) {
+                ERROR("openat", send_path, ERROR_OS);
+                abort_transfer(sock_desc, &aborted_transfer, 1);
+                ret = -1;
+            }
+            else {
+                ret = send_directory(sock_desc, sub_desc, len, node + 1);
+            }
             if (ret == -1)
                 s = -1;
         }
         /* file type */
         else {
-            int32_t len = snprintf(path, sizeof(path) - 1, "%s/%s", dirpath, entry->d_name);
-            path[len] = 0;
-            ret = send_file(sock_desc, path);
+            ret = send_file(sock_desc, dirfd(dir), entry->d_name);
             if (ret == -1)
                 s = -1;
         }
+        send_path[path_len] = '\0';
         /* for readdir function test */
         errno = 0;
     } while (!s && !aborted_transfer && (entry = readdir(dir)));
     
     if (errno) {
-        ERROR("readdir", dirpath, ERROR_OS);
+        ERROR("readdir", send_path, ERROR_OS);
         abort_transfer(sock_desc, &aborted_transfer, 1);
         s = -1;
     }
@@ -151,83 +295,526 @@ int8_t send_directory(SOCKET sock_desc, char *dirpath, int32_t node)
     return s;
 }
 
-int8_t send_file(SOCKET sock_desc, char *path)
+int8_t send_file(SOCKET sock_desc, int32_t dir_desc, const char *name)
 {
-    int32_t     s;
-    uint64_t    filesize;
-    uint64_t    total_sent;
-    int64_t     sent;
-    int32_t     file_desc = -1;
-    int         on = 1;
-    int         off = 0;
-    struct stat stat_buf;
-    off_t       offset;
-    flag_t      flag = 0;
+    char            *path = send_path;
+    int32_t         s;
+    int32_t         file_desc = -1;
+    int             on = 1;
+    int             off = 0;
+    struct stat     stat_buf;
+    flag_t          flag = 0;
+    file_extent_t   *extents = NULL;
+    uint32_t        extents_cnt = 0;
+    int8_t          sparse = 0;
+    
+#ifdef SEND_INDEX_ENABLED
+    /* not changed since it was sent, one statx() and no read */
+    if (transfer_index && (s = index_skip(sock_desc, dir_desc, name)) != 0)
+        return s == 1 ? 0 : -1;
+#endif /* SEND_INDEX_ENABLED */
+    /* the other paths send the files they claimed first (the links of one inode go together) */
+    if (transfer_claim) {
+        if (fstatat(dir_desc, name, &stat_buf, 0) == -1) {
+            ERROR("fstatat", path, ERROR_OS);
+            abort_transfer(sock_desc, &aborted_transfer, 1);
+            return -1;
+        }
+        if ((s = transfer_claim(transfer_claim_arg, stat_buf.st_dev, stat_buf.st_ino)) != 1) {
+            if (s == -1)
+                abort_transfer(sock_desc, &aborted_transfer, 1);
+            return s;
+        }
+    }
     
     fprintf(stdout, "Sending %s ...\n", path);
     fflush(stdout);
     
-    /* open the file to be sent */
-    file_desc = open(path, O_RDONLY);
+    /* open the file to be sent, in its directory */
+    file_desc = openat(dir_desc, name, O_RDONLY|O_CLOEXEC);
     if (file_desc == -1) {
-        ERROR("open", path, ERROR_OS);
+        ERROR("openat", path, ERROR_OS);
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        goto error;
+    }
+    
+    if (fstat(file_desc, &stat_buf) == -1) {
+        ERROR("fstat", path, ERROR_OS);
         abort_transfer(sock_desc, &aborted_transfer, 1);
         goto error;
     }
+    /* another link to a file already sent, the peer links it to its copy */
+    if ((transfer_caps & CAP_HARDLINKS) && stat_buf.st_nlink > 1) {
+        const char *target = inode_table_find(sent_inodes, stat_buf.st_dev, stat_buf.st_ino);
+        /* or a link the peer got last time, unchanged since */
+        if (!target && transfer_index) {
+            send_index_stat_t st = { stat_buf.st_size, stat_buf.st_mtim.tv_sec, stat_buf.st_mtim.tv_nsec,
+                                     stat_buf.st_ino };
+            if ((target = send_index_find_inode(transfer_index, &st)) &&
+                inode_table_insert(sent_inodes, stat_buf.st_dev, stat_buf.st_ino, target) == -1) {
+                abort_transfer(sock_desc, &aborted_transfer, 1);
+                goto error;
+            }
+        }
+        if (target) {
+            close(file_desc);
+            return send_hardlink(sock_desc, path, target);
+        }
+    }
     
     /* send the file path of the file (starting from the sending directory offset) */
     flag = FILE_TYPE;
-    s = send_packet(sock_desc, &path[send_directory_prefix_len],
+    s = transfer_packet(sock_desc, &path[send_directory_prefix_len],
                 strlen(&path[send_directory_prefix_len]), flag);
     if (s == -1) {
         goto error;
     }
-    /* send the file size */
-    if (fstat(file_desc, &stat_buf) == -1) {
-        ERROR("fstat", path, ERROR_OS);
-        abort_transfer(sock_desc, &aborted_transfer, 1);
-        goto error;
+#ifdef LINUX
+    /* on a Unix socket the open file itself goes, the peer copies from it */
+    if ((transfer_caps & CAP_FDPASS) && !transfer_stream) {
+        if (transfer_batch && send_batch_flush(transfer_batch, sock_desc) == -1) {
+            abort_transfer(sock_desc, &aborted_transfer, 1);
+            goto error;
+        }
+        if (send_packet_fd(sock_desc, (char *) &stat_buf.st_size, sizeof(stat_buf.st_size),
+                           FILE_SIZE|FILE_DESC, file_desc) == -1) {
+            abort_transfer(sock_desc, &aborted_transfer, 1);
+            goto error;
+        }
+        if (transfer_progress)
+            transfer_progress->bytes += stat_buf.st_size;
+        goto sent;
+    }
+#endif /* LINUX */
+#if defined(LINUX) && defined(LOCAL_CLONE_ENABLED)
+    /* the peer on this host may clone it, not on a session: the answer comes back on the connection */
+    if ((transfer_caps & CAP_LOCAL) && !transfer_stream && stat_buf.st_size >= LOCAL_CLONE_MIN_SIZE) {
+        if ( (s = send_local(sock_desc, path, &stat_buf)) == -1)
+            goto error;
+        if (s == 1) {
+            if (transfer_progress)
+                transfer_progress->bytes += stat_buf.st_size;
+            goto sent;
+        }
     }
+#endif /* LINUX && LOCAL_CLONE_ENABLED */
+    /* a file with holes is sent as a map of its data extents */
+    if ((transfer_caps & CAP_SPARSE) && sparse_is_candidate(&stat_buf)) {
+        if (sparse_get_extents(file_desc, stat_buf.st_size, &extents, &extents_cnt) == -1) {
+            abort_transfer(sock_desc, &aborted_transfer, 1);
+            goto error;
+        }
+        /* all data, sent as usual; all hole, an empty map */
+        if (extents_cnt == 1 && extents[0].offset == 0 &&
+            extents[0].length == (uint64_t) stat_buf.st_size) {
+            free(extents);
+            extents = NULL;
+        }
+        else {
+            sparse = 1;
+        }
+    }
+    /* send the file size */
     flag |= FILE_SIZE;
-    s = send_packet(sock_desc, (char *)&(stat_buf.st_size), sizeof(stat_buf.st_size), flag);
+    if (sparse)
+        flag |= SPARSE_FILE;
+    s = transfer_packet(sock_desc, (char *)&(stat_buf.st_size), sizeof(stat_buf.st_size), flag);
     if (s == -1) {
         goto error;
     }
+    if (sparse) {
+        s = transfer_packet(sock_desc, (char *) extents, sizeof(file_extent_t) * extents_cnt, EXTENT_MAP);
+        if (s == -1) {
+            goto error;
+        }
+    }
+    
+    /* a small file goes with the next ones, its data read into the batch or mapped */
+    if (transfer_batch && !sparse && stat_buf.st_size <= SEND_BATCH_MAX_FILE) {
+        for (uint64_t granted = 0; granted < (uint64_t) stat_buf.st_size; )
+            granted += pacing_acquire(transfer_pacing, stat_buf.st_size - granted);
+        if (send_batch_file(transfer_batch, sock_desc, file_desc, stat_buf.st_size) == -1) {
+            abort_transfer(sock_desc, &aborted_transfer, 1);
+            goto error;
+        }
+        if (transfer_progress)
+            transfer_progress->bytes += stat_buf.st_size;
+        goto sent;
+    }
+    /* the packets gathered so far go before the file data */
+    if (transfer_batch && send_batch_flush(transfer_batch, sock_desc) == -1) {
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        goto error;
+    }
     
-    /* employ TCP_CORK option to tune performance */
-    if (setsockopt(sock_desc, IPPROTO_TCP, TCP_CORK, (void *) &on, sizeof(on)) == -1) {
+    /* employ TCP_CORK option to tune performance (the session writer packs its frames) */
+    if (!transfer_stream && setsockopt(sock_desc, IPPROTO_TCP, TCP_CORK, (void *) &on, sizeof(on)) == -1) {
         ERROR("setsockopt", "TCP_CORK, on", ERROR_OS);
         abort_transfer(sock_desc, &aborted_transfer, 1);
         goto error;
     }
-    /* begin the transfer using sendfile */
-    offset = 0;
-    filesize = stat_buf.st_size;
-    total_sent = 0;
-    while (total_sent < filesize) {
-        sent = sendfile(sock_desc, file_desc, (void *) &offset, filesize - total_sent);
-        if (sent == -1) {
-            ERROR("sendfile", path, ERROR_OS);
-            abort_transfer(sock_desc, &aborted_transfer, 1);
-            goto error;
-        }
-        total_sent += sent;
+    /* begin the transfer using sendfile, only the data extents for a sparse file */
+    if (sparse) {
+        for (uint32_t i = 0; i < extents_cnt; ++i)
+            if (send_range(sock_desc, file_desc, path, extents[i].offset, extents[i].length) == -1)
+                goto error;
+    }
+    else if (send_range(sock_desc, file_desc, path, 0, stat_buf.st_size) == -1) {
+        goto error;
     }
     
     /* to ensure all waiting data is sent, TCP_CORK must be removed */
-    if (setsockopt(sock_desc, IPPROTO_TCP, TCP_CORK, &off, sizeof(off)) == -1) {
+    if (!transfer_stream && setsockopt(sock_desc, IPPROTO_TCP, TCP_CORK, &off, sizeof(off)) == -1) {
         ERROR("setsockopt", "TCP_CORK, off", ERROR_OS);
         abort_transfer(sock_desc, &aborted_transfer, 1);
         goto error;
     }
+    
+ sent:
+    /* remember it, the next links to this inode are sent as hardlinks */
+    if ((transfer_caps & CAP_HARDLINKS) && stat_buf.st_nlink > 1 &&
+        inode_table_insert(sent_inodes, stat_buf.st_dev, stat_buf.st_ino,
+                           &path[send_directory_prefix_len]) == -1) {
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        goto error;
+    }
+    if (transfer_progress)
+        ++transfer_progress->files;
+    /* as it was opened, a change made while it was sent is seen next time */
+    if (transfer_index) {
+        send_index_stat_t st = { stat_buf.st_size, stat_buf.st_mtim.tv_sec, stat_buf.st_mtim.tv_nsec,
+                                 stat_buf.st_ino };
+        send_index_update(transfer_index, &path[send_directory_prefix_len], &st);
+    }
+    free(extents);
+    close(file_desc);
     /* SUCCESS transfer */
     return 0;
     
  error:
+    free(extents);
     if (file_desc != -1) close(file_desc);
     return -1;
 }
 
+static int8_t send_range(SOCKET sock_desc, int32_t file_desc, char *path,
+                         off_t offset, uint64_t length)
+{
+    uint64_t        total_sent = 0;
+    uint64_t        chunk;
+    uint64_t        want;
+    int64_t         sent;
+    struct timespec start;
+    
+    while (total_sent < length) {
+        /* as much as the rate limits allow right now, a tuned chunk at most on a connection */
+        want = length - total_sent;
+        if (!transfer_stream && want > chunk_tune_size(&transfer_chunks))
+            want = chunk_tune_size(&transfer_chunks);
+        chunk = pacing_acquire(transfer_pacing, want);
+        if (transfer_stream) {
+            /* the stream flow control may hold it back, it is all sent or it fails */
+            if (session_write_file(transfer_stream, file_desc, offset, chunk) == -1) {
+                ERROR("session_write_file", path, ERROR_APP);
+                abort_transfer(sock_desc, &aborted_transfer, 1);
+                return -1;
+            }
+            offset += chunk;
+            total_sent += chunk;
+            if (transfer_progress)
+                transfer_progress->bytes += chunk;
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        sent = sendfile(sock_desc, file_desc, &offset, chunk);
+        if (sent != -1)
+            pacing_refund(transfer_pacing, chunk - sent);
+        /* only the calls of a whole chunk tell how fast its size is */
+        if (sent > 0 && chunk == chunk_tune_size(&transfer_chunks) &&
+            chunk_tune_record(&transfer_chunks, sent, &start)) {
+            fprintf(stdout, "Chunk size %" PRIu32 " KiB, %.1f MiB/s\n", chunk_tune_best(&transfer_chunks) / 1024,
+                    chunk_tune_rate(&transfer_chunks) / (1024 * 1024));
+            if (transfer_progress)
+                transfer_progress->chunk_size = chunk_tune_best(&transfer_chunks);
+        }
+        if (sent == -1) {
+            ERROR("sendfile", path, ERROR_OS);
+            abort_transfer(sock_desc, &aborted_transfer, 1);
+            return -1;
+        }
+        /* the file was truncated under us, the peer waits for more bytes */
+        if (sent == 0) {
+            ERROR("sendfile", "unexpected end of file", ERROR_APP);
+            abort_transfer(sock_desc, &aborted_transfer, 1);
+            return -1;
+        }
+        total_sent += sent;
+        if (transfer_progress)
+            transfer_progress->bytes += sent;
+    }
+    return 0;
+}
+
+static int8_t send_hardlink(SOCKET sock_desc, char *path, const char *target)
+{
+    char        *link_data;
+    uint32_t    path_len = strlen(&path[send_directory_prefix_len]);
+    uint32_t    target_len = strlen(target);
+    int8_t      s;
+    
+    fprintf(stdout, "Linking %s ...\n", path);
+    fflush(stdout);
+    
+    /* the link path and the path of the already sent file, '\0' separated */
+    link_data = (char *) malloc(path_len + target_len + 1);
+    if (!link_data) {
+        ERROR("malloc", "", ERROR_OS);
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        return -1;
+    }
+    memcpy(link_data, &path[send_directory_prefix_len], path_len);
+    link_data[path_len] = '\0';
+    memcpy(&link_data[path_len + 1], target, target_len);
+    
+    s = transfer_packet(sock_desc, link_data, path_len + target_len + 1, HARDLINK_TYPE);
+    free(link_data);
+    return s;
+}
+
+#if defined(LINUX) && defined(LOCAL_CLONE_ENABLED)
+/**
+ * Asks the peer on this host to clone the file from its absolute path, and
+ * waits for the answer. Returns 1 when it did, 0 when the data must be sent
+ * (the same packets as for any file follow), -1 on error
+ */
+static int8_t send_local(SOCKET sock_desc, char *path, const struct stat *stat_buf)
+{
+    local_file_t    local = { stat_buf->st_size, stat_buf->st_dev, stat_buf->st_ino,
+                              stat_buf->st_mtim.tv_sec, stat_buf->st_mtim.tv_nsec };
+    char            cwd[PATH_SIZE] = "";
+    uint32_t        cwd_len = 0;
+    uint32_t        path_len = strlen(path);
+    char            *data;
+    net_packet_t    *answer;
+    int8_t          s;
+    
+    if (path[0] != '/') {
+        if (!getcwd(cwd, sizeof(cwd) - 1))
+            return 0;
+        cwd_len = strlen(cwd);
+        cwd[cwd_len++] = '/';
+    }
+    if (!(data = (char *) malloc(sizeof(local) + cwd_len + path_len))) {
+        ERROR("malloc", "", ERROR_OS);
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        return -1;
+    }
+    memcpy(data, &local, sizeof(local));
+    memcpy(&data[sizeof(local)], cwd, cwd_len);
+    memcpy(&data[sizeof(local) + cwd_len], path, path_len);
+    s = transfer_packet(sock_desc, data, sizeof(local) + cwd_len + path_len, FILE_SIZE|LOCAL_FILE);
+    free(data);
+    /* the peer answers this one before the next */
+    if (s == -1 || (transfer_batch && send_batch_flush(transfer_batch, sock_desc) == -1)) {
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        return -1;
+    }
+    if (!(answer = recv_packet(sock_desc, 0)))
+        return -1;
+    if (answer->flags.val & ABORT_TRANSFER) {
+        abort_transfer(sock_desc, &aborted_transfer, 0);
+        s = -1;
+    }
+    else {
+        s = (answer->flags.val & END_TRANSFER) != 0;
+    }
+    destroy_packet(answer);
+    return s;
+}
+#endif /* LINUX && LOCAL_CLONE_ENABLED */
+
+/** the state of a transfer and its START_TRANSFER packet */
+static int8_t transfer_begin(SOCKET sock_desc, char *path, qos_class_t qos, protocol_caps_t caps)
+{
+    /* Reset the abortion */
+    aborted_transfer = 0;
+    transfer_caps = caps;
+    
+    /* get the main directory (the last directory from path) */
+    char *main_dir = strrchr(path, '/') + 1;
+    send_directory_prefix_len = strlen(path) - strlen(main_dir);
+    transfer_filter = filter_default();
+    chunk_tune_init(&transfer_chunks, CHUNK_TUNE_MIN_SIZE, CHUNK_TUNE_MAX_SIZE, CHUNK_TUNE_MAX_SIZE);
+    
+    /* no IP options on a session's shared socket, nor on a Unix socket */
+    if (!(sent_inodes = inode_table_create()) ||
+        !(transfer_pacing = pacing_create(transfer_stream || (caps & CAP_FDPASS) ? -1 : sock_desc, qos)) ||
+        (!transfer_stream && (caps & CAP_BATCHED) && SEND_BATCH_MAX_FILE > 0 &&
+         !(transfer_batch = send_batch_create(sock_desc)))) {
+        inode_table_destroy(sent_inodes);
+        pacing_destroy(transfer_pacing);
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        return -1;
+    }
+    
+    if (transfer_packet(sock_desc, NULL, 0, START_TRANSFER | SEND_OPERATION) == -1) {
+        inode_table_destroy(sent_inodes);
+        pacing_destroy(transfer_pacing);
+        send_batch_destroy(transfer_batch);
+        transfer_batch = NULL;
+        return -1;
+    }
+#ifdef SEND_INDEX_ENABLED
+    /* a tree shared by several paths has no index, each one sends a part of it */
+    transfer_index = transfer_claim ? NULL : index_open(sock_desc, path);
+#endif /* SEND_INDEX_ENABLED */
+    return 0;
+}
+
+/** the END_TRANSFER packet (unless it failed) and the release of the transfer state */
+static int8_t transfer_end(SOCKET sock_desc, int32_t s)
+{
+    if (s != -1) {
+        if (transfer_packet(sock_desc, NULL, 0, END_TRANSFER) == -1)
+            s = -1;
+    }
+    /* what is still gathered, the abortion or the end of the transfer */
+    if (transfer_batch && send_batch_flush(transfer_batch, sock_desc) == -1)
+        s = -1;
+    send_batch_destroy(transfer_batch);
+    transfer_batch = NULL;
+    /* trusted from now on only when all of it is out */
+    send_index_close(transfer_index, s != -1);
+    transfer_index = NULL;
+    inode_table_destroy(sent_inodes);
+    sent_inodes = NULL;
+    pacing_destroy(transfer_pacing);
+    transfer_pacing = NULL;
+    free(send_path);
+    send_path = NULL;
+    send_path_size = 0;
+    fprintf(stdout, "End transfering...\n");
+    fflush(stdout);
+    return s;
+}
+
+int8_t __send_stream(session_stream_t *stream, char *path, qos_class_t qos)
+{
+    int8_t s;
+
+    transfer_stream = stream;
+    s = __send(stream->session->sock, path, qos, stream->session->caps);
+    transfer_stream = NULL;
+    return s;
+}
+
+int8_t __send_changes_stream(session_stream_t *stream, char *root, char **changed, uint32_t changed_cnt,
+                             char **deleted, uint32_t deleted_cnt, qos_class_t qos)
+{
+    int8_t s;
+
+    transfer_stream = stream;
+    s = __send_changes(stream->session->sock, root, changed, changed_cnt, deleted, deleted_cnt,
+                       qos, stream->session->caps);
+    transfer_stream = NULL;
+    return s;
+}
+
+#ifdef SEND_INDEX_ENABLED
+/** the index of the tree for the peer at the other end of sock_desc */
+static send_index_t *index_open(SOCKET sock_desc, char *path)
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len = sizeof(addr);
+    char                    peer[INET6_ADDRSTRLEN];
+    const void              *ip;
+    
+    if (getpeername(sock_desc, (struct sockaddr *) &addr, &addr_len) == -1) {
+        ERROR("getpeername", "", ERROR_OS);
+        return NULL;
+    }
+    if (addr.ss_family == AF_INET)
+        ip = &((struct sockaddr_in *) &addr)->sin_addr;
+    else if (addr.ss_family == AF_INET6)
+        ip = &((struct sockaddr_in6 *) &addr)->sin6_addr;
+    else
+        return NULL;
+    if (!inet_ntop(addr.ss_family, ip, peer, sizeof(peer))) {
+        ERROR("inet_ntop", "", ERROR_OS);
+        return NULL;
+    }
+    return send_index_open(path, peer);
+}
+
+/**
+ * Returns 1 when the file is as it was sent, 0 when it must be sent and -1
+ * on error (the transfer is aborted)
+ */
+static int8_t index_skip(SOCKET sock_desc, int32_t dir_desc, const char *name)
+{
+    struct statx        stx;
+    send_index_stat_t   st;
+    
+    /* the open reports what went wrong */
+    if (statx(dir_desc, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE|STATX_SIZE|STATX_MTIME|STATX_INO|STATX_NLINK,
+              &stx) == -1 || !S_ISREG(stx.stx_mode))
+        return 0;
+    st.size = stx.stx_size;
+    st.mtime_sec = stx.stx_mtime.tv_sec;
+    st.mtime_nsec = stx.stx_mtime.tv_nsec;
+    st.ino = stx.stx_ino;
+    if (!send_index_unchanged(transfer_index, &send_path[send_directory_prefix_len], &st))
+        return 0;
+    /* the peer has it, the next links to this inode are linked to it */
+    if ((transfer_caps & CAP_HARDLINKS) && stx.stx_nlink > 1 &&
+        inode_table_insert(sent_inodes, makedev(stx.stx_dev_major, stx.stx_dev_minor), stx.stx_ino,
+                           &send_path[send_directory_prefix_len]) == -1) {
+        abort_transfer(sock_desc, &aborted_transfer, 1);
+        return -1;
+    }
+    return 1;
+}
+#endif /* SEND_INDEX_ENABLED */
+
+static int32_t path_join(uint32_t path_len, const char *name)
+{
+    uint32_t    name_len = strlen(name);
+    uint32_t    len = path_len ? path_len + 1 + name_len : name_len;
+    uint32_t    size;
+    char        *path;
+
+    if (len + 1 > send_path_size) {
+        for (size = send_path_size ? send_path_size : PATH_SIZE; size < len + 1; size *= 2)
+            ;
+        if (!(path = (char *) realloc(send_path, size))) {
+            ERROR("realloc", "", ERROR_OS);
+            return -1;
+        }
+        send_path = path;
+        send_path_size = size;
+    }
+    if (path_len)
+        send_path[path_len++] = '/';
+    memcpy(&send_path[path_len], name, name_len + 1);
+    return len;
+}
+
+static const char *base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    
+    return slash ? slash + 1 : path;
+}
+
+static int8_t transfer_packet(SOCKET sock_desc, char *buff, uint32_t size, flag_t flags)
+{
+    if (transfer_batch)
+        return send_batch_packet(transfer_batch, sock_desc, buff, size, flags);
+    if (transfer_stream)
+        return session_write_packet(transfer_stream, buff, size, flags);
+    return send_packet(sock_desc, buff, size, flags);
+}
+
 void abort_transfer(SOCKET sock_desc, int8_t *abortion_var, int8_t send_abortion)
 {
     /* 
@@ -242,7 +829,7 @@ void abort_transfer(SOCKET sock_desc, int8_t *abortion_var, int8_t send_abortion
 #undef PRINT_ERROR_ENABLED
 #define ENABLE_PRINT
 #endif /* PRINT_ERROR_ENABLED */
-    send_packet(sock_desc, NULL, 0, ABORT_TRANSFER);
+    transfer_packet(sock_desc, NULL, 0, ABORT_TRANSFER);
 #ifdef ENABLE_PRINT
 #define PRINT_ERROR_ENABLED
 #undef ENABLE_PRINT
@@ -7,8 +7,12 @@
 #define SEND_H
 
 #include <inttypes.h>
+#include <sys/types.h>
 
 #include "data_types.h"
+#include "pacing.h"
+#include "session.h"
+#include "protocol.h"
 
 #ifdef SEND_C
 #define EXTERN
@@ -16,8 +20,23 @@
 #define EXTERN extern
 #endif /* SEND_C */
 
+/**
+ * Whether this transfer sends the file (dev, ino) of a tree shared with
+ * others (multi-path): 1 to send it, 0 to leave it out, -1 on error
+ */
+typedef int8_t (*send_claim_t)(void *arg, dev_t dev, ino_t ino);
+
 /* send functions */
-EXTERN int8_t __send(SOCKET sock_desc, char *path);
+EXTERN void send_progress(transfer_progress_t *progress);
+EXTERN transfer_progress_t *send_progress_current(void);
+EXTERN void send_claim(send_claim_t claim, void *arg);
+EXTERN int8_t __send(SOCKET sock_desc, char *path, qos_class_t qos, protocol_caps_t caps);
+EXTERN int8_t __send_stream(session_stream_t *stream, char *path, qos_class_t qos);
+/* a transfer of some paths of root only (watch mode), the deleted ones removed at the peer */
+EXTERN int8_t __send_changes(SOCKET sock_desc, char *root, char **changed, uint32_t changed_cnt,
+                             char **deleted, uint32_t deleted_cnt, qos_class_t qos, protocol_caps_t caps);
+EXTERN int8_t __send_changes_stream(session_stream_t *stream, char *root, char **changed, uint32_t changed_cnt,
+                                    char **deleted, uint32_t deleted_cnt, qos_class_t qos);
 EXTERN void abort_transfer(SOCKET sock_desc, int8_t *abortion_var, int8_t send_abortion);
 
 #undef EXTERN
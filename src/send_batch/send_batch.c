@@ -0,0 +1,257 @@
+/**
+ * @file send_batch.c
+ * @brief The small files path of the sender: for a file of a few KiB the
+ *        open/fstat/cork/sendfile/uncork/close sequence costs more than the
+ *        data it moves. Their packets and their data are gathered as an
+ *        iovec list instead, and several files go out with one writev().
+ *        Each packet is an iovec on its bytes in the batch buffer, each file
+ *        one on its slot there filled by preadv(), or on its mapping from
+ *        SEND_BATCH_MMAP_MIN bytes. The batch buffers come from the zerocopy
+ *        pool of the connection, a batch goes out with MSG_ZEROCOPY when the
+ *        kernel sends from user pages. The bytes on the wire are the same.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif /* UNIX */
+
+#define SEND_BATCH_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "send_batch.h"
+#if defined(LINUX) && defined(ZEROCOPY_ENABLED)
+#include "zerocopy_linux.h"
+#endif /* LINUX && ZEROCOPY_ENABLED */
+
+/* internal functions' prototypes */
+static char   *reserve(send_batch_t *batch, SOCKET sock_desc, uint64_t len);
+static void   append(send_batch_t *batch, char *base, uint64_t len);
+static void   reset(send_batch_t *batch);
+static int32_t next_buffer(send_batch_t *batch, uint64_t size);
+
+send_batch_t *send_batch_create(SOCKET sock_desc)
+{
+    send_batch_t *batch = (send_batch_t *) calloc(1, sizeof(send_batch_t));
+
+    if (!batch) {
+        ERROR("calloc", "", ERROR_OS);
+        return NULL;
+    }
+#if defined(LINUX) && defined(ZEROCOPY_ENABLED)
+    /* the connection carries this transfer only, the kernel counts its zerocopy sends from here */
+    if (!(batch->zc = zerocopy_create(sock_desc))) {
+        free(batch);
+        return NULL;
+    }
+#endif /* LINUX && ZEROCOPY_ENABLED */
+    batch->iov = (struct iovec *) malloc(SEND_BATCH_IOV * sizeof(struct iovec));
+    batch->maps = (struct iovec *) malloc(SEND_BATCH_IOV * sizeof(struct iovec));
+    if (!batch->iov || !batch->maps) {
+        ERROR("malloc", "", ERROR_OS);
+        send_batch_destroy(batch);
+        return NULL;
+    }
+    if (next_buffer(batch, SEND_BATCH_SIZE) == -1) {
+        send_batch_destroy(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+int32_t send_batch_packet(send_batch_t *batch, SOCKET sock_desc, const char *data, uint32_t size, flag_t flags)
+{
+    char *dst;
+
+    /* laid out as send_packet() sends it */
+    if (!(dst = reserve(batch, sock_desc, NET_PACKET_HEADER_SIZE + size)))
+        return -1;
+    memcpy(dst, &size, sizeof(size));
+    memcpy(&dst[sizeof(size)], &flags, sizeof(flags));
+    if (size)
+        memcpy(&dst[NET_PACKET_HEADER_SIZE], data, size);
+    append(batch, dst, NET_PACKET_HEADER_SIZE + size);
+    batch->buf_len += NET_PACKET_HEADER_SIZE + size;
+    return 0;
+}
+
+int32_t send_batch_file(send_batch_t *batch, SOCKET sock_desc, int32_t file_desc, uint64_t size)
+{
+    struct iovec    slot;
+    char            *map;
+    uint64_t        done;
+    ssize_t         len;
+
+    if (size == 0)
+        return 0;
+    if (size >= SEND_BATCH_MMAP_MIN) {
+        /* an iovec for the mapping, the file descriptor may be closed right after */
+        if (batch->iov_cnt == SEND_BATCH_IOV && send_batch_flush(batch, sock_desc) == -1)
+            return -1;
+        if ( (map = (char *) mmap(NULL, size, PROT_READ, MAP_SHARED, file_desc, 0)) == MAP_FAILED) {
+            ERROR("mmap", "", ERROR_OS);
+            return -1;
+        }
+        madvise(map, size, MADV_WILLNEED);
+        batch->maps[batch->maps_cnt].iov_base = map;
+        batch->maps[batch->maps_cnt++].iov_len = size;
+        append(batch, map, size);
+    }
+    else {
+        /* its slot in the batch buffer, read into directly */
+        if (!(slot.iov_base = reserve(batch, sock_desc, size)))
+            return -1;
+        for (done = 0; done < size; done += len) {
+            struct iovec rest = { (char *) slot.iov_base + done, size - done };
+
+            if ( (len = preadv(file_desc, &rest, 1, done)) == -1) {
+                if (errno == EINTR) {
+                    len = 0;
+                    continue;
+                }
+                ERROR("preadv", "", ERROR_OS);
+                return -1;
+            }
+            /* the file was truncated under us, the peer waits for more bytes */
+            if (len == 0) {
+                ERROR("preadv", "unexpected end of file", ERROR_APP);
+                return -1;
+            }
+        }
+        append(batch, slot.iov_base, size);
+        batch->buf_len += size;
+    }
+    if (batch->bytes >= SEND_BATCH_SIZE)
+        return send_batch_flush(batch, sock_desc);
+    return 0;
+}
+
+int32_t send_batch_flush(send_batch_t *batch, SOCKET sock_desc)
+{
+    struct iovec    *iov = batch->iov;
+    uint32_t        iov_cnt = batch->iov_cnt;
+    int32_t         s = 0;
+#if defined(LINUX) && defined(ZEROCOPY_ENABLED)
+
+    if (!iov_cnt)
+        return 0;
+    /* the buffer stays in the pool until the kernel is done with it, the next batch takes another */
+    if (!batch->zc_buf && next_buffer(batch, SEND_BATCH_SIZE) == -1) {
+        reset(batch);
+        return -1;
+    }
+    s = zerocopy_sendv(batch->zc, batch->zc_buf, iov, iov_cnt, 0);
+    batch->zc_buf = NULL;
+    reset(batch);
+    if (next_buffer(batch, SEND_BATCH_SIZE) == -1)
+        s = -1;
+#else
+    ssize_t         sent;
+
+    while (iov_cnt) {
+        if ( (sent = writev(sock_desc, iov, iov_cnt)) == -1) {
+            if (errno == EINTR)
+                continue;
+            /* a mapped file truncated under us faults here */
+            ERROR("writev", "", ERROR_OS);
+            s = -1;
+            break;
+        }
+        /* skip what was sent, the rest goes with the next call */
+        for (; iov_cnt && (size_t) sent >= iov->iov_len; --iov_cnt, ++iov)
+            sent -= iov->iov_len;
+        if (iov_cnt) {
+            iov->iov_base = (char *) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    reset(batch);
+#endif /* LINUX && ZEROCOPY_ENABLED */
+    return s;
+}
+
+void send_batch_destroy(send_batch_t *batch)
+{
+    if (!batch)
+        return;
+    if (batch->maps)
+        reset(batch);
+#if defined(LINUX) && defined(ZEROCOPY_ENABLED)
+    if (batch->zc_buf)
+        zerocopy_release(batch->zc, batch->zc_buf);
+    zerocopy_destroy(batch->zc);
+#else
+    free(batch->buf);
+#endif /* LINUX && ZEROCOPY_ENABLED */
+    free(batch->iov);
+    free(batch->maps);
+    free(batch);
+}
+
+static char *reserve(send_batch_t *batch, SOCKET sock_desc, uint64_t len)
+{
+    /* an iovec to append, and room in the buffer: the full batch goes out first */
+    if ((batch->iov_cnt == SEND_BATCH_IOV || batch->buf_len + len > batch->buf_size) &&
+        batch->iov_cnt && send_batch_flush(batch, sock_desc) == -1)
+        return NULL;
+    /* no buffer since a failed flush, or a packet larger than it (a very deep path) */
+    if ((!batch->buf || len > batch->buf_size) && next_buffer(batch, len) == -1)
+        return NULL;
+    return &batch->buf[batch->buf_len];
+}
+
+static void append(send_batch_t *batch, char *base, uint64_t len)
+{
+    batch->iov[batch->iov_cnt].iov_base = base;
+    batch->iov[batch->iov_cnt].iov_len = len;
+    ++batch->iov_cnt;
+    batch->bytes += len;
+}
+
+static void reset(send_batch_t *batch)
+{
+    for (uint32_t i = 0; i < batch->maps_cnt; ++i)
+        munmap(batch->maps[i].iov_base, batch->maps[i].iov_len);
+    batch->maps_cnt = 0;
+    batch->iov_cnt = 0;
+    batch->buf_len = 0;
+    batch->bytes = 0;
+}
+
+/** An empty buffer of size bytes at least, nothing points into the current one */
+static int32_t next_buffer(send_batch_t *batch, uint64_t size)
+{
+    if (size < SEND_BATCH_SIZE)
+        size = SEND_BATCH_SIZE;
+#if defined(LINUX) && defined(ZEROCOPY_ENABLED)
+    if (batch->zc_buf)
+        zerocopy_release(batch->zc, batch->zc_buf);
+    batch->buf = NULL;
+    batch->buf_size = 0;
+    if (!(batch->zc_buf = zerocopy_buffer(batch->zc, size)))
+        return -1;
+    batch->buf = batch->zc_buf->data;
+    batch->buf_size = batch->zc_buf->size;
+#else
+    char *buf;
+
+    if (!(buf = (char *) realloc(batch->buf, size))) {
+        ERROR("realloc", "", ERROR_OS);
+        return -1;
+    }
+    batch->buf = buf;
+    batch->buf_size = size;
+#endif /* LINUX && ZEROCOPY_ENABLED */
+    return 0;
+}
+
+#undef SEND_BATCH_C
@@ -0,0 +1,46 @@
+/**
+ * @file send_batch.h
+ * @brief The batched small files header
+ */
+
+#ifndef SEND_BATCH_H
+#define SEND_BATCH_H
+
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "data_types.h"
+
+struct zc_pool;
+struct zc_buffer;
+
+#ifdef SEND_BATCH_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* SEND_BATCH_C */
+
+/** the packets and the data of several files, sent with one writev() */
+typedef struct {
+    char                *buf;           /* the packets and the slots of the files read */
+    uint64_t            buf_len;
+    uint64_t            buf_size;
+    struct iovec        *iov;           /* a packet, a file's slot or a mapped file each */
+    uint32_t            iov_cnt;
+    struct iovec        *maps;          /* the mapped files, unmapped once sent */
+    uint32_t            maps_cnt;
+    uint64_t            bytes;
+    struct zc_pool      *zc;            /* the buffers' pool, NULL without zerocopy */
+    struct zc_buffer    *zc_buf;        /* of buf */
+} send_batch_t;
+
+/* send batch functions */
+EXTERN send_batch_t *send_batch_create(SOCKET sock_desc);
+EXTERN int32_t send_batch_packet(send_batch_t *batch, SOCKET sock_desc, const char *data, uint32_t size, flag_t flags);
+EXTERN int32_t send_batch_file(send_batch_t *batch, SOCKET sock_desc, int32_t file_desc, uint64_t size);
+EXTERN int32_t send_batch_flush(send_batch_t *batch, SOCKET sock_desc);
+EXTERN void send_batch_destroy(send_batch_t *batch);
+
+#undef EXTERN
+#endif /* SEND_BATCH_H */
@@ -0,0 +1,414 @@
+/**
+ * @file send_index.c
+ * @brief What was sent to a peer from a source root, one file per (root,
+ *        peer) pair in SEND_INDEX_PATH: the size, mtime and inode of every
+ *        file sent, sorted by name. It is mapped in memory, a file is looked
+ *        up with a binary search and its record is updated in place once
+ *        sent. The files sent for the first time are merged in when the
+ *        transfer ends. A record written by a transfer that did not end well
+ *        (gen > committed_gen) is not trusted, the file is sent again.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#endif /* UNIX */
+
+#define SEND_INDEX_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "send_index.h"
+
+/* a record of the merged index and its name */
+typedef struct {
+    const send_index_record_t   *record;
+    const char                  *name;
+} merged_t;
+
+/* internal functions' prototypes */
+static int8_t               index_map(send_index_t *index);
+static send_index_record_t  *index_find(send_index_t *index, const char *name, uint32_t len);
+static int32_t              index_write(send_index_t *index);
+static int                  compare_ino(const void *a, const void *b, void *arg);
+static int                  compare_added(const void *a, const void *b, void *arg);
+static int                  compare_names(const char *a, uint32_t a_len, const char *b, uint32_t b_len);
+static uint64_t             hash_key(const char *root, const char *peer);
+
+send_index_t *send_index_open(const char *root, const char *peer)
+{
+    send_index_t    *index;
+    char            *real;
+
+    if (!(real = realpath(root, NULL))) {
+        ERROR("realpath", root, ERROR_OS);
+        return NULL;
+    }
+    if (!(index = (send_index_t *) calloc(1, sizeof(send_index_t)))) {
+        ERROR("calloc", "", ERROR_OS);
+        free(real);
+        return NULL;
+    }
+    snprintf(index->path, sizeof(index->path), "%s/%016" PRIx64, SEND_INDEX_PATH, hash_key(real, peer));
+    free(real);
+
+    if (mkdir(SEND_INDEX_PATH, 0700) == -1 && errno != EEXIST) {
+        ERROR("mkdir", SEND_INDEX_PATH, ERROR_OS);
+        goto error;
+    }
+    if ( (index->file_desc = open(index->path, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) == -1) {
+        ERROR("open", index->path, ERROR_OS);
+        goto error;
+    }
+    /* another transfer of the same tree to the same peer, this one sends it all */
+    if (flock(index->file_desc, LOCK_EX|LOCK_NB) == -1) {
+        if (errno != EWOULDBLOCK)
+            ERROR("flock", index->path, ERROR_OS);
+        close(index->file_desc);
+        goto error;
+    }
+    if (index_map(index) == -1) {
+        close(index->file_desc);
+        goto error;
+    }
+    return index;
+
+ error:
+    free(index);
+    return NULL;
+}
+
+int8_t send_index_unchanged(send_index_t *index, const char *name, const send_index_stat_t *st)
+{
+    send_index_record_t *record;
+
+    if (!index->header || !(record = index_find(index, name, strlen(name))))
+        return 0;
+    if (!record->gen || record->gen > index->header->committed_gen ||
+        record->size != st->size || record->ino != st->ino ||
+        record->mtime_sec != st->mtime_sec || record->mtime_nsec != st->mtime_nsec)
+        return 0;
+    ++index->skipped;
+    return 1;
+}
+
+/** the name of an unchanged file with this inode, another link of it the peer has */
+const char *send_index_find_inode(send_index_t *index, const send_index_stat_t *st)
+{
+    send_index_record_t *record;
+    uint64_t            low = 0;
+    uint64_t            high;
+    uint64_t            mid;
+
+    if (!index->header)
+        return NULL;
+    if (!index->by_ino) {
+        if (!(index->by_ino = (uint64_t *) malloc((index->header->cnt + 1) * sizeof(uint64_t)))) {
+            ERROR("malloc", "", ERROR_OS);
+            return NULL;
+        }
+        for (uint64_t i = 0; i < index->header->cnt; ++i)
+            index->by_ino[i] = i;
+        qsort_r(index->by_ino, index->header->cnt, sizeof(uint64_t), &compare_ino, index->records);
+    }
+    /* the first record of the inode */
+    for (high = index->header->cnt; low < high; ) {
+        mid = low + (high - low) / 2;
+        if (index->records[index->by_ino[mid]].ino < st->ino)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    for (; low < index->header->cnt && (record = &index->records[index->by_ino[low]])->ino == st->ino; ++low) {
+        if (!record->gen || (record->gen > index->header->committed_gen && record->gen != index->gen) ||
+            record->size != st->size || record->mtime_sec != st->mtime_sec ||
+            record->mtime_nsec != st->mtime_nsec ||
+            record->name_off > index->header->names_size ||
+            record->name_len > index->header->names_size - record->name_off)
+            continue;
+        free(index->found);
+        if (!(index->found = strndup(&index->names[record->name_off], record->name_len))) {
+            ERROR("strndup", "", ERROR_OS);
+            return NULL;
+        }
+        return index->found;
+    }
+    return NULL;
+}
+
+int32_t send_index_update(send_index_t *index, const char *name, const send_index_stat_t *st)
+{
+    send_index_record_t *record;
+    uint32_t            len = strlen(name);
+    uint64_t            size;
+    void                *ptr;
+
+    if (!index->header || !(record = index_find(index, name, len))) {
+        if (index->added_cnt == index->added_size) {
+            size = index->added_size ? index->added_size * 2 : 1024;
+            if (!(ptr = realloc(index->added, size * sizeof(send_index_record_t)))) {
+                ERROR("realloc", "", ERROR_OS);
+                return -1;
+            }
+            index->added = (send_index_record_t *) ptr;
+            index->added_size = size;
+        }
+        if (index->added_names_len + len > index->added_names_size) {
+            for (size = index->added_names_size ? index->added_names_size : 64 * 1024;
+                 size < index->added_names_len + len; size *= 2)
+                ;
+            if (!(ptr = realloc(index->added_names, size))) {
+                ERROR("realloc", "", ERROR_OS);
+                return -1;
+            }
+            index->added_names = (char *) ptr;
+            index->added_names_size = size;
+        }
+        record = &index->added[index->added_cnt++];
+        record->name_off = index->added_names_len;
+        record->name_len = len;
+        memcpy(&index->added_names[index->added_names_len], name, len);
+        index->added_names_len += len;
+    }
+    /* in place, not trusted before the end of the transfer */
+    record->size = st->size;
+    record->mtime_sec = st->mtime_sec;
+    record->mtime_nsec = st->mtime_nsec;
+    record->ino = st->ino;
+    record->gen = index->gen;
+    return 0;
+}
+
+int32_t send_index_close(send_index_t *index, int8_t success)
+{
+    int32_t s = 0;
+
+    if (!index)
+        return 0;
+    if (index->skipped) {
+        fprintf(stdout, "%" PRIu64 " unchanged files not sent again\n", index->skipped);
+        fflush(stdout);
+    }
+    if (success) {
+        if (index->added_cnt || !index->header)
+            s = index_write(index);
+        else
+            index->header->committed_gen = index->gen;
+    }
+    if (index->map)
+        munmap(index->map, index->map_size);
+    /* the lock goes with it */
+    close(index->file_desc);
+    free(index->added);
+    free(index->added_names);
+    free(index->by_ino);
+    free(index->found);
+    free(index);
+    return s;
+}
+
+/** maps the index of the last transfers, an empty or damaged one is written again at the end */
+static int8_t index_map(send_index_t *index)
+{
+    struct stat         stat_buf;
+    send_index_header_t *header;
+    uint64_t            records_size;
+
+    index->gen = 1;
+    if (fstat(index->file_desc, &stat_buf) == -1) {
+        ERROR("fstat", index->path, ERROR_OS);
+        return -1;
+    }
+    if ((uint64_t) stat_buf.st_size < sizeof(send_index_header_t))
+        return 0;
+    index->map_size = stat_buf.st_size;
+    index->map = (char *) mmap(NULL, index->map_size, PROT_READ|PROT_WRITE, MAP_SHARED, index->file_desc, 0);
+    if (index->map == MAP_FAILED) {
+        ERROR("mmap", index->path, ERROR_OS);
+        index->map = NULL;
+        return -1;
+    }
+    header = (send_index_header_t *) index->map;
+    records_size = header->cnt * sizeof(send_index_record_t);
+    if (memcmp(header->magic, SEND_INDEX_MAGIC, sizeof(SEND_INDEX_MAGIC)) != 0 ||
+        header->version != SEND_INDEX_VERSION ||
+        header->cnt > index->map_size / sizeof(send_index_record_t) ||
+        header->names_size > index->map_size ||
+        sizeof(send_index_header_t) + records_size + header->names_size != index->map_size) {
+        munmap(index->map, index->map_size);
+        index->map = NULL;
+        return 0;
+    }
+    index->header = header;
+    index->records = (send_index_record_t *) &index->map[sizeof(send_index_header_t)];
+    index->names = &index->map[sizeof(send_index_header_t) + records_size];
+
+    /* the last transfer did not end well, what it sent may not be there */
+    if (header->run_gen != header->committed_gen) {
+        for (uint64_t i = 0; i < header->cnt; ++i)
+            if (index->records[i].gen > header->committed_gen)
+                index->records[i].gen = 0;
+    }
+    index->gen = header->run_gen + 1;
+    header->run_gen = index->gen;
+    return 0;
+}
+
+static send_index_record_t *index_find(send_index_t *index, const char *name, uint32_t len)
+{
+    send_index_record_t *record;
+    uint64_t            low = 0;
+    uint64_t            high = index->header->cnt;
+    uint64_t            mid;
+    int                 cmp;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        record = &index->records[mid];
+        if (record->name_off > index->header->names_size ||
+            record->name_len > index->header->names_size - record->name_off)
+            return NULL;
+        cmp = compare_names(&index->names[record->name_off], record->name_len, name, len);
+        if (cmp == 0)
+            return record;
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return NULL;
+}
+
+/** the index with the added files merged in, under a temporary name renamed over it */
+static int32_t index_write(send_index_t *index)
+{
+    send_index_header_t header;
+    send_index_record_t record;
+    merged_t            *merged;
+    FILE                *file;
+    char                tmp_path[PATH_SIZE + 8];
+    uint64_t            old_cnt = index->header ? index->header->cnt : 0;
+    uint64_t            cnt = 0;
+    uint64_t            i = 0;
+    uint64_t            j = 0;
+    int32_t             s = 0;
+
+    qsort_r(index->added, index->added_cnt, sizeof(send_index_record_t), &compare_added, index->added_names);
+    if (!(merged = (merged_t *) malloc((old_cnt + index->added_cnt + 1) * sizeof(merged_t)))) {
+        ERROR("malloc", "", ERROR_OS);
+        return -1;
+    }
+    while (i < old_cnt || j < index->added_cnt) {
+        const send_index_record_t *old = i < old_cnt ? &index->records[i] : NULL;
+        const send_index_record_t *added = j < index->added_cnt ? &index->added[j] : NULL;
+
+        if (old && (!added || compare_names(&index->names[old->name_off], old->name_len,
+                                             &index->added_names[added->name_off], added->name_len) < 0)) {
+            /* a file of a transfer that did not end well is forgotten */
+            if (old->gen)
+                merged[cnt++] = (merged_t) { old, &index->names[old->name_off] };
+            ++i;
+        }
+        else {
+            merged[cnt++] = (merged_t) { added, &index->added_names[added->name_off] };
+            ++j;
+        }
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index->path);
+    if (!(file = fopen(tmp_path, "w"))) {
+        ERROR("fopen", tmp_path, ERROR_OS);
+        free(merged);
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SEND_INDEX_MAGIC, sizeof(SEND_INDEX_MAGIC));
+    header.version = SEND_INDEX_VERSION;
+    header.cnt = cnt;
+    header.committed_gen = header.run_gen = index->gen;
+    for (i = 0; i < cnt; ++i)
+        header.names_size += merged[i].record->name_len;
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+        s = -1;
+    for (i = 0, header.names_size = 0; s != -1 && i < cnt; ++i) {
+        record = *merged[i].record;
+        record.name_off = header.names_size;
+        header.names_size += record.name_len;
+        if (fwrite(&record, sizeof(record), 1, file) != 1)
+            s = -1;
+    }
+    for (i = 0; s != -1 && i < cnt; ++i)
+        if (merged[i].record->name_len &&
+            fwrite(merged[i].name, merged[i].record->name_len, 1, file) != 1)
+            s = -1;
+    if (fclose(file) == EOF)
+        s = -1;
+    if (s == -1) {
+        ERROR("fwrite", tmp_path, ERROR_OS);
+    }
+    else if (rename(tmp_path, index->path) == -1) {
+        ERROR("rename", index->path, ERROR_OS);
+        s = -1;
+    }
+    if (s == -1)
+        unlink(tmp_path);
+    free(merged);
+    return s;
+}
+
+static int compare_ino(const void *a, const void *b, void *arg)
+{
+    const send_index_record_t   *records = (const send_index_record_t *) arg;
+    uint64_t                    ino_a = records[*(const uint64_t *) a].ino;
+    uint64_t                    ino_b = records[*(const uint64_t *) b].ino;
+
+    return ino_a < ino_b ? -1 : ino_a > ino_b;
+}
+
+static int compare_added(const void *a, const void *b, void *arg)
+{
+    const send_index_record_t   *ra = (const send_index_record_t *) a;
+    const send_index_record_t   *rb = (const send_index_record_t *) b;
+    const char                  *names = (const char *) arg;
+
+    return compare_names(&names[ra->name_off], ra->name_len, &names[rb->name_off], rb->name_len);
+}
+
+static int compare_names(const char *a, uint32_t a_len, const char *b, uint32_t b_len)
+{
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+    if (cmp)
+        return cmp;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static uint64_t hash_key(const char *root, const char *peer)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    /* FNV-1a of "root\0peer" */
+    for (const char *ptr = root; ; ++ptr) {
+        hash ^= (unsigned char) *ptr;
+        hash *= 1099511628211ull;
+        if (!*ptr)
+            break;
+    }
+    for (const char *ptr = peer; *ptr; ++ptr) {
+        hash ^= (unsigned char) *ptr;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+#undef SEND_INDEX_C
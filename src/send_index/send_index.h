@@ -0,0 +1,83 @@
+/**
+ * @file send_index.h
+ * @brief The index of the files already sent to a peer header
+ */
+
+#ifndef SEND_INDEX_H
+#define SEND_INDEX_H
+
+#include <inttypes.h>
+
+#include "data_types.h"
+
+#ifdef SEND_INDEX_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* SEND_INDEX_C */
+
+#define SEND_INDEX_MAGIC    "FTINDEX"
+#define SEND_INDEX_VERSION  1
+
+/** what tells a file changed, without reading it */
+typedef struct {
+    uint64_t    size;
+    int64_t     mtime_sec;
+    uint32_t    mtime_nsec;
+    uint64_t    ino;
+} send_index_stat_t;
+
+/** the file header, the records and the names follow */
+typedef struct {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    reserved;
+    uint64_t    cnt;
+    uint64_t    names_size;
+    uint64_t    committed_gen;          /* the last transfer that ended well */
+    uint64_t    run_gen;                /* the last transfer started */
+} send_index_header_t;
+
+/** a file as it was sent, the records are sorted by name */
+typedef struct {
+    uint64_t    name_off;
+    uint32_t    name_len;
+    uint32_t    mtime_nsec;
+    uint64_t    size;
+    int64_t     mtime_sec;
+    uint64_t    ino;
+    uint64_t    gen;                    /* 0: not valid, > committed_gen: sent by a transfer not ended */
+} send_index_record_t;
+
+/** the index of a (source root, peer) pair during a transfer */
+typedef struct {
+    char                    path[PATH_SIZE];
+    int32_t                 file_desc;  /* locked, one transfer at a time uses it */
+    char                    *map;
+    uint64_t                map_size;
+    send_index_header_t     *header;    /* NULL for a new index */
+    send_index_record_t     *records;
+    char                    *names;
+    uint64_t                gen;
+    /* the files sent for the first time, merged in at the end */
+    send_index_record_t     *added;
+    uint64_t                added_cnt;
+    uint64_t                added_size;
+    char                    *added_names;
+    uint64_t                added_names_len;
+    uint64_t                added_names_size;
+    /* the records by inode, sorted when a link is first looked for */
+    uint64_t                *by_ino;
+    char                    *found;
+    uint64_t                skipped;
+} send_index_t;
+
+/* send index functions */
+EXTERN send_index_t *send_index_open(const char *root, const char *peer);
+EXTERN int8_t send_index_unchanged(send_index_t *index, const char *name, const send_index_stat_t *st);
+EXTERN const char *send_index_find_inode(send_index_t *index, const send_index_stat_t *st);
+EXTERN int32_t send_index_update(send_index_t *index, const char *name, const send_index_stat_t *st);
+EXTERN int32_t send_index_close(send_index_t *index, int8_t success);
+
+#undef EXTERN
+#endif /* SEND_INDEX_H */
@@ -0,0 +1,904 @@
+/**
+ * @file session.c
+ * @brief Multiplexed sessions: one long lived connection per peer carries the
+ *        streams of many concurrent transfers (push and pull) as frames
+ *        tagged with a stream id. A reader thread demultiplexes the incoming
+ *        frames, a writer thread serializes the outgoing ones (the control
+ *        frames first), and every stream has its own flow control window
+ *        so one transfer can not starve the others.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#endif /* UNIX */
+
+#define SESSION_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "protocol.h"
+#include "recv_state.h"
+#include "send.h"
+#include "session.h"
+
+#ifdef LINUX
+#include "pipe_pool_linux.h"
+#endif /* LINUX */
+
+#if defined(LINUX) && defined(ZEROCOPY_ENABLED)
+#include "zerocopy_linux.h"
+#endif /* LINUX && ZEROCOPY_ENABLED */
+
+typedef struct {
+    session_stream_t    *stream;
+    char                *path;
+} session_pull_t;
+
+typedef struct {
+    SOCKET              sock;
+    protocol_caps_t     caps;
+} session_serve_t;
+
+/* internal functions' prototypes */
+static session_t        *session_create(SOCKET sock_desc, int8_t server, protocol_caps_t caps);
+static void             *session_serve_thread(void *arg);
+static void             *session_reader(void *arg);
+static void             *session_writer(void *arg);
+static void             *session_pull(void *arg);
+static int32_t          on_frame(session_t *session, uint32_t stream_id, flag_t flags,
+                                 char *data, uint32_t size);
+static int32_t          on_stream_data(session_t *session, uint32_t stream_id, uint32_t size);
+static session_stream_t *stream_create(session_t *session, uint32_t id, stream_direction_t direction, int8_t local);
+static session_stream_t *stream_find(session_t *session, uint32_t id);
+static void             stream_unlink(session_t *session, session_stream_t *stream);
+static void             stream_free(session_stream_t *stream);
+static void             stream_finish(session_stream_t *stream, int8_t failed);
+static int32_t          queue_control(session_t *session, uint32_t stream_id, flag_t flags,
+                                      char *data, uint32_t size);
+static void             queue_write(session_t *session, session_write_t *w, int8_t control);
+static void             write_free(session_t *session, session_write_t *w);
+static int32_t          write_frame(session_t *session, session_write_t *w);
+static int32_t          send_full(SOCKET sock_desc, char *data, uint32_t size, int flags);
+static int32_t          recv_full(SOCKET sock_desc, char *data, uint32_t size);
+static int32_t          discard(SOCKET sock_desc, uint32_t size);
+
+session_t *session_connect(SOCKET sock_desc, protocol_caps_t caps)
+{
+    net_packet_t *packet;
+
+    /* the peer said it has sessions in its hello */
+    if (send_packet(sock_desc, NULL, 0, SESSION_OPEN) == -1)
+        return NULL;
+    packet = recv_packet(sock_desc, 0);
+    if (!packet || !(packet->flags.val & SESSION_OPEN)) {
+        destroy_packet(packet);
+        return NULL;
+    }
+    destroy_packet(packet);
+    return session_create(sock_desc, 0, caps);
+}
+
+int32_t session_serve(SOCKET sock_desc, protocol_caps_t caps)
+{
+    pthread_t       TID;
+    session_serve_t *arg;
+    int32_t         s;
+
+    if (send_packet(sock_desc, NULL, 0, SESSION_OPEN) == -1)
+        return -1;
+    if (!(arg = (session_serve_t *) malloc(sizeof(session_serve_t)))) {
+        ERROR("malloc", "", ERROR_OS);
+        return -1;
+    }
+    arg->sock = sock_desc;
+    arg->caps = caps;
+    s = pthread_create(&TID, NULL, &session_serve_thread, arg);
+    if (s != 0) {
+        errno = s;
+        ERROR("pthread_create", "", ERROR_OS);
+        free(arg);
+        return -1;
+    }
+    pthread_detach(TID);
+    return 0;
+}
+
+void session_destroy(session_t *session)
+{
+    session_stream_t    *stream;
+    session_write_t     *w;
+    struct timespec     deadline;
+
+    if (!session) return;
+
+    /* say goodbye and let the writer flush what is queued */
+    pthread_mutex_lock(&session->lock);
+    if (!session->closed && !session->closing)
+        queue_control(session, 0, SESSION_CLOSE, NULL, 0);
+    session->closing = 1;
+    pthread_cond_broadcast(&session->cond);
+    pthread_mutex_unlock(&session->lock);
+    pthread_join(session->writer_TID, NULL);
+
+    /*
+     * the peer closes once it is done with the frames before the goodbye,
+     * closing first would reset the connection and lose the last of them
+     */
+    shutdown(session->sock, SHUT_WR);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SESSION_CLOSE_TIMEOUT;
+    pthread_mutex_lock(&session->lock);
+    while (!session->reader_done &&
+           pthread_cond_timedwait(&session->cond, &session->lock, &deadline) != ETIMEDOUT)
+        ;
+    pthread_mutex_unlock(&session->lock);
+
+    /* wake up the reader */
+    shutdown(session->sock, SHUT_RDWR);
+    pthread_join(session->reader_TID, NULL);
+
+    pthread_mutex_lock(&session->lock);
+    while (session->senders_cnt)
+        pthread_cond_wait(&session->cond, &session->lock);
+    pthread_mutex_unlock(&session->lock);
+
+    while ( (stream = session->streams) ) {
+        session->streams = stream->next;
+        stream_free(stream);
+    }
+    while ( (w = session->control_head) ) {
+        session->control_head = w->next;
+        write_free(session, w);
+    }
+#if defined(LINUX) && defined(ZEROCOPY_ENABLED)
+    zerocopy_destroy(session->zc);
+#endif /* LINUX && ZEROCOPY_ENABLED */
+#ifdef LINUX
+    pipe_pool_destroy(session->pipes);
+#endif /* LINUX */
+    pthread_mutex_destroy(&session->lock);
+    pthread_cond_destroy(&session->cond);
+    free(session);
+}
+
+int8_t session_is_closed(session_t *session)
+{
+    int8_t closed;
+
+    pthread_mutex_lock(&session->lock);
+    closed = session->closed || session->closing;
+    pthread_mutex_unlock(&session->lock);
+    return closed;
+}
+
+session_stream_t *session_stream_open(session_t *session, stream_direction_t direction)
+{
+    session_stream_t *stream;
+
+    pthread_mutex_lock(&session->lock);
+    if (session->closed || session->closing) {
+        pthread_mutex_unlock(&session->lock);
+        ERROR("session_stream_open", "session closed", ERROR_APP);
+        return NULL;
+    }
+    stream = stream_create(session, session->next_stream_id, direction, 1);
+    if (stream)
+        session->next_stream_id += 2;
+    pthread_mutex_unlock(&session->lock);
+    return stream;
+}
+
+int32_t session_write_packet(session_stream_t *stream, char *data, uint32_t size, flag_t flags)
+{
+    session_t   *session = stream->session;
+    int32_t     s;
+
+    /* the packet is copied, its order with the file data of the stream is kept */
+    pthread_mutex_lock(&session->lock);
+    /* the receiver aborted, the sender stops at its next packet */
+    if (stream->direction == STREAM_SEND && stream->failed)
+        s = -1;
+    else
+        s = queue_control(session, stream->id, flags, data, size);
+    pthread_mutex_unlock(&session->lock);
+    return s;
+}
+
+int32_t session_write_file(session_stream_t *stream, int32_t file_desc, off_t offset, uint64_t length)
+{
+    session_t       *session = stream->session;
+    session_write_t w;
+    uint64_t        chunk;
+
+    while (length > 0) {
+        pthread_mutex_lock(&session->lock);
+        while (!session->closed && !session->closing && !stream->failed && stream->credit <= 0)
+            pthread_cond_wait(&session->cond, &session->lock);
+        if (session->closed || session->closing || stream->failed) {
+            pthread_mutex_unlock(&session->lock);
+            return -1;
+        }
+        chunk = length;
+        if (chunk > stream->credit)
+            chunk = stream->credit;
+        if (chunk > SESSION_CHUNK_SIZE)
+            chunk = SESSION_CHUNK_SIZE;
+        stream->credit -= chunk;
+
+        /* one chunk in flight per stream, so the streams take turns */
+        memset(&w, 0, sizeof(w));
+        w.stream_id = stream->id;
+        w.flags = STREAM_DATA;
+        w.file_desc = file_desc;
+        w.offset = offset;
+        w.length = chunk;
+        queue_write(session, &w, 0);
+        while (!w.done)
+            pthread_cond_wait(&session->cond, &session->lock);
+        pthread_mutex_unlock(&session->lock);
+        if (w.failed)
+            return -1;
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+int32_t session_stream_wait(session_stream_t *stream)
+{
+    session_t   *session = stream->session;
+    int32_t     s;
+
+    pthread_mutex_lock(&session->lock);
+    while (!stream->done)
+        pthread_cond_wait(&session->cond, &session->lock);
+    s = stream->failed ? -1 : 0;
+    pthread_mutex_unlock(&session->lock);
+    return s;
+}
+
+void session_stream_close(session_stream_t *stream)
+{
+    session_t *session = stream->session;
+
+    pthread_mutex_lock(&session->lock);
+    stream_unlink(session, stream);
+    pthread_mutex_unlock(&session->lock);
+    stream_free(stream);
+}
+
+static session_t *session_create(SOCKET sock_desc, int8_t server, protocol_caps_t caps)
+{
+    session_t   *session;
+    int32_t     s;
+
+    session = (session_t *) calloc(1, sizeof(session_t));
+    if (!session) {
+        ERROR("calloc", "", ERROR_OS);
+        return NULL;
+    }
+    session->sock = sock_desc;
+    session->server = server;
+    session->caps = caps;
+    /* the client opens the odd streams, the server the even ones */
+    session->next_stream_id = server ? 2 : 1;
+    pthread_mutex_init(&session->lock, NULL);
+    pthread_cond_init(&session->cond, NULL);
+#if defined(LINUX) && defined(ZEROCOPY_ENABLED)
+    /* without it, the packets are copied as usual */
+    session->zc = zerocopy_create(sock_desc);
+#endif /* LINUX && ZEROCOPY_ENABLED */
+#ifdef LINUX
+    /* the receiving streams splice through the same few pipes, one at a time each */
+    if (!(session->pipes = pipe_pool_create(PIPE_POOL_SIZE)))
+        goto error;
+#endif /* LINUX */
+
+    s = pthread_create(&session->writer_TID, NULL, &session_writer, session);
+    if (s != 0) {
+        errno = s;
+        ERROR("pthread_create", "", ERROR_OS);
+        goto error;
+    }
+    s = pthread_create(&session->reader_TID, NULL, &session_reader, session);
+    if (s != 0) {
+        errno = s;
+        ERROR("pthread_create", "", ERROR_OS);
+        pthread_mutex_lock(&session->lock);
+        session->closed = 1;
+        pthread_cond_broadcast(&session->cond);
+        pthread_mutex_unlock(&session->lock);
+        pthread_join(session->writer_TID, NULL);
+        goto error;
+    }
+    return session;
+
+ error:
+#if defined(LINUX) && defined(ZEROCOPY_ENABLED)
+    zerocopy_destroy(session->zc);
+#endif /* LINUX && ZEROCOPY_ENABLED */
+#ifdef LINUX
+    pipe_pool_destroy(session->pipes);
+#endif /* LINUX */
+    pthread_mutex_destroy(&session->lock);
+    pthread_cond_destroy(&session->cond);
+    free(session);
+    return NULL;
+}
+
+static void *session_serve_thread(void *arg)
+{
+    SOCKET          sock_desc = ((session_serve_t *) arg)->sock;
+    protocol_caps_t caps = ((session_serve_t *) arg)->caps;
+    session_t       *session;
+
+    free(arg);
+    if ( (session = session_create(sock_desc, 1, caps)) ) {
+        /* the peer ends the session */
+        pthread_mutex_lock(&session->lock);
+        while (!session->reader_done)
+            pthread_cond_wait(&session->cond, &session->lock);
+        pthread_mutex_unlock(&session->lock);
+        session_destroy(session);
+    }
+    fprintf(stdout, "Session closed\n");
+    fflush(stdout);
+    close(sock_desc);
+    return NULL;
+}
+
+static void *session_reader(void *arg)
+{
+    session_t           *session = (session_t *) arg;
+    session_stream_t    *stream, *next;
+    char                header[SESSION_FRAME_HEADER_SIZE];
+    uint32_t            size, stream_id;
+    flag_t              flags;
+    char                *data;
+    int32_t             s;
+
+    while (1) {
+        if (recv_full(session->sock, header, sizeof(header)) <= 0)
+            break;
+        memcpy(&size, header, sizeof(size));
+        memcpy(&flags, &header[sizeof(size)], sizeof(flags));
+        memcpy(&stream_id, &header[NET_PACKET_HEADER_SIZE], sizeof(stream_id));
+
+        /* the file data goes from the socket to the disk, it is never buffered */
+        if (flags & STREAM_DATA) {
+            if (on_stream_data(session, stream_id, size) == -1)
+                break;
+            continue;
+        }
+        if (size > SESSION_MAX_PACKET_SIZE) {
+            ERROR("session_reader", "packet too large", ERROR_APP);
+            break;
+        }
+        if (!(data = (char *) malloc(size + 1))) {
+            ERROR("malloc", "", ERROR_OS);
+            break;
+        }
+        if (recv_full(session->sock, data, size) <= 0) {
+            free(data);
+            break;
+        }
+        data[size] = '\0';
+        s = on_frame(session, stream_id, flags, data, size);
+        free(data);
+        if (s == -1)
+            break;
+    }
+
+    /* the transfers in progress are lost */
+    pthread_mutex_lock(&session->lock);
+    session->closed = 1;
+    session->reader_done = 1;
+    for (stream = session->streams; stream; stream = next) {
+        next = stream->next;
+        if (!stream->done)
+            stream_finish(stream, 1);
+        if (stream->direction == STREAM_RECV && !stream->local) {
+            stream_unlink(session, stream);
+            stream_free(stream);
+        }
+    }
+    pthread_cond_broadcast(&session->cond);
+    pthread_mutex_unlock(&session->lock);
+    return NULL;
+}
+
+static int32_t on_frame(session_t *session, uint32_t stream_id, flag_t flags,
+                        char *data, uint32_t size)
+{
+    session_stream_t    *stream;
+    session_pull_t      *pull;
+    recv_state_status_t status;
+    uint64_t            credit;
+    pthread_t           TID;
+    int32_t             s;
+
+    if (flags & SESSION_CLOSE)
+        return -1;
+
+    pthread_mutex_lock(&session->lock);
+    stream = stream_find(session, stream_id);
+
+    if (flags & WINDOW_UPDATE) {
+        if (stream && stream->direction == STREAM_SEND && size == sizeof(credit)) {
+            memcpy(&credit, data, sizeof(credit));
+            stream->credit += credit;
+            pthread_cond_broadcast(&session->cond);
+        }
+        pthread_mutex_unlock(&session->lock);
+        return 0;
+    }
+
+    /* the peer starts a new transfer, on an id of its own: odd from the client, even from the server */
+    if (!stream && (flags & START_TRANSFER)) {
+        if (!stream_id || (stream_id & 1) != (session->server ? 1 : 0)) {
+            pthread_mutex_unlock(&session->lock);
+            ERROR("on_frame", "a stream id of ours opened by the peer", ERROR_APP);
+            return -1;
+        }
+        if (flags & SEND_OPERATION) {
+            stream = stream_create(session, stream_id, STREAM_RECV, 0);
+            pthread_mutex_unlock(&session->lock);
+            if (stream && recv_state_on_packet(&stream->rs, flags, data, size) == RECV_STATE_CONTINUE)
+                return 0;
+            pthread_mutex_lock(&session->lock);
+            queue_control(session, stream_id, ABORT_TRANSFER, NULL, 0);
+            if (stream) {
+                stream_unlink(session, stream);
+                stream_free(stream);
+            }
+            pthread_mutex_unlock(&session->lock);
+            return 0;
+        }
+        if (flags & RECEIVE_OPERATION) {
+            stream = stream_create(session, stream_id, STREAM_SEND, 0);
+            pull = (session_pull_t *) malloc(sizeof(session_pull_t));
+            if (!stream || !pull) {
+                ERROR("malloc", "", ERROR_OS);
+                goto pull_error;
+            }
+            /* from SERVE_ROOT only, as on a connection of its own */
+            if (!(pull->path = protocol_served_path(data)))
+                goto pull_error;
+            pull->stream = stream;
+            s = pthread_create(&TID, NULL, &session_pull, pull);
+            if (s != 0) {
+                errno = s;
+                ERROR("pthread_create", "", ERROR_OS);
+                free(pull->path);
+                goto pull_error;
+            }
+            pthread_detach(TID);
+            ++session->senders_cnt;
+            pthread_mutex_unlock(&session->lock);
+            return 0;
+
+         pull_error:
+            free(pull);
+            queue_control(session, stream_id, ABORT_TRANSFER, NULL, 0);
+            if (stream) {
+                stream_unlink(session, stream);
+                stream_free(stream);
+            }
+            pthread_mutex_unlock(&session->lock);
+            return 0;
+        }
+    }
+
+    /* a stream we closed already */
+    if (!stream || stream->done) {
+        pthread_mutex_unlock(&session->lock);
+        return 0;
+    }
+
+    if (stream->direction == STREAM_SEND) {
+        /* the receiver gave up */
+        if (flags & ABORT_TRANSFER)
+            stream_finish(stream, 1);
+        pthread_mutex_unlock(&session->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    /* only the reader feeds a receiving stream, no lock for the disk work */
+    status = recv_state_on_packet(&stream->rs, flags, data, size);
+    if (status == RECV_STATE_CONTINUE)
+        return 0;
+
+    pthread_mutex_lock(&session->lock);
+    if (status == RECV_STATE_ERROR)
+        queue_control(session, stream_id, ABORT_TRANSFER, NULL, 0);
+    stream_finish(stream, status != RECV_STATE_DONE);
+    if (!stream->local) {
+        stream_unlink(session, stream);
+        stream_free(stream);
+    }
+    pthread_mutex_unlock(&session->lock);
+    return 0;
+}
+
+static int32_t on_stream_data(session_t *session, uint32_t stream_id, uint32_t size)
+{
+    session_stream_t    *stream;
+    uint64_t            credit;
+    uint32_t            remaining = size;
+    int64_t             moved;
+
+    pthread_mutex_lock(&session->lock);
+    stream = stream_find(session, stream_id);
+    if (stream && (stream->direction != STREAM_RECV || stream->done))
+        stream = NULL;
+    /* a peer sending past the credit it was given fails the stream, twice the session */
+    if (stream && size > stream->credit) {
+        ERROR("on_stream_data", "a data frame beyond the credit of the stream", ERROR_APP);
+        if (++session->overruns > 1) {
+            pthread_mutex_unlock(&session->lock);
+            return -1;
+        }
+        queue_control(session, stream_id, ABORT_TRANSFER, NULL, 0);
+        stream_finish(stream, 1);
+        if (!stream->local) {
+            stream_unlink(session, stream);
+            stream_free(stream);
+        }
+        stream = NULL;
+    }
+    if (stream)
+        stream->credit -= size;
+    pthread_mutex_unlock(&session->lock);
+
+    while (stream && remaining > 0 && recv_state_wants_data(&stream->rs)) {
+        moved = recv_state_on_data(&stream->rs, session->sock, remaining, 0);
+        if (moved == -1) {
+            /* a disk error fails the stream, the session goes on */
+            pthread_mutex_lock(&session->lock);
+            queue_control(session, stream_id, ABORT_TRANSFER, NULL, 0);
+            stream_finish(stream, 1);
+            if (!stream->local) {
+                stream_unlink(session, stream);
+                stream_free(stream);
+            }
+            pthread_mutex_unlock(&session->lock);
+            stream = NULL;
+            break;
+        }
+        if (moved == 0)
+            return -1;
+        remaining -= moved;
+    }
+    /* the data of a stream that is gone, or more data than the file has */
+    if (remaining > 0 && discard(session->sock, remaining) == -1)
+        return -1;
+    if (!stream)
+        return 0;
+
+    /* the data is on disk, the sender may send more */
+    pthread_mutex_lock(&session->lock);
+    stream->unacked += size;
+    if (stream->unacked >= SESSION_WINDOW_SIZE / 2 || !recv_state_wants_data(&stream->rs)) {
+        credit = stream->unacked;
+        stream->unacked = 0;
+        stream->credit += credit;
+        queue_control(session, stream_id, WINDOW_UPDATE, (char *) &credit, sizeof(credit));
+    }
+    pthread_mutex_unlock(&session->lock);
+    return 0;
+}
+
+static void *session_writer(void *arg)
+{
+    session_t       *session = (session_t *) arg;
+    session_write_t *w;
+    int32_t         s;
+
+    pthread_mutex_lock(&session->lock);
+    while (1) {
+        while (!session->closed && !session->control_head && !session->data_head && !session->closing)
+            pthread_cond_wait(&session->cond, &session->lock);
+        if (session->closed || (session->closing && !session->control_head && !session->data_head))
+            break;
+
+        /* the control frames (credits, aborts) never wait behind the file data */
+        if ( (w = session->control_head) ) {
+            if (!(session->control_head = w->next))
+                session->control_tail = NULL;
+        }
+        else {
+            w = session->data_head;
+            if (!(session->data_head = w->next))
+                session->data_tail = NULL;
+        }
+        pthread_mutex_unlock(&session->lock);
+
+        s = write_frame(session, w);
+
+        pthread_mutex_lock(&session->lock);
+        if (w->owned) {
+            write_free(session, w);
+        }
+        else {
+            w->failed = (s != 0);
+            w->done = 1;
+        }
+        /* a frame cut in the middle breaks the whole session */
+        if (s == -1) {
+            session->closed = 1;
+            shutdown(session->sock, SHUT_RDWR);
+        }
+        pthread_cond_broadcast(&session->cond);
+    }
+
+    /* nobody will send these */
+    while ( (w = session->data_head) ) {
+        session->data_head = w->next;
+        w->failed = w->done = 1;
+    }
+    session->data_tail = NULL;
+    pthread_cond_broadcast(&session->cond);
+    pthread_mutex_unlock(&session->lock);
+    return NULL;
+}
+
+static void *session_pull(void *arg)
+{
+    session_pull_t      *pull = (session_pull_t *) arg;
+    session_stream_t    *stream = pull->stream;
+    session_t           *session = stream->session;
+
+    __send_stream(stream, pull->path, DEFAULT_QOS_CLASS);
+    session_stream_close(stream);
+    free(pull->path);
+    free(pull);
+
+    pthread_mutex_lock(&session->lock);
+    --session->senders_cnt;
+    pthread_cond_broadcast(&session->cond);
+    pthread_mutex_unlock(&session->lock);
+    return NULL;
+}
+
+static session_stream_t *stream_create(session_t *session, uint32_t id, stream_direction_t direction, int8_t local)
+{
+    session_stream_t *stream;
+
+    stream = (session_stream_t *) calloc(1, sizeof(session_stream_t));
+    if (!stream) {
+        ERROR("calloc", "", ERROR_OS);
+        return NULL;
+    }
+    stream->id = id;
+    stream->session = session;
+    stream->direction = direction;
+    stream->local = local;
+    stream->credit = SESSION_WINDOW_SIZE;
+    if (recv_state_init(&stream->rs, RECEIVING_PATH, session->pipes) == -1) {
+        free(stream);
+        return NULL;
+    }
+    stream->next = session->streams;
+    session->streams = stream;
+    return stream;
+}
+
+static session_stream_t *stream_find(session_t *session, uint32_t id)
+{
+    session_stream_t *stream;
+
+    for (stream = session->streams; stream; stream = stream->next)
+        if (stream->id == id)
+            return stream;
+    return NULL;
+}
+
+static void stream_unlink(session_t *session, session_stream_t *stream)
+{
+    session_stream_t **link;
+
+    for (link = &session->streams; *link; link = &(*link)->next)
+        if (*link == stream) {
+            *link = stream->next;
+            return;
+        }
+}
+
+static void stream_free(session_stream_t *stream)
+{
+    recv_state_destroy(&stream->rs);
+    free(stream);
+}
+
+static void stream_finish(session_stream_t *stream, int8_t failed)
+{
+    stream->done = 1;
+    stream->failed = failed;
+    pthread_cond_broadcast(&stream->session->cond);
+}
+
+static int32_t queue_control(session_t *session, uint32_t stream_id, flag_t flags,
+                             char *data, uint32_t size)
+{
+    session_write_t *w;
+
+    if (session->closed || session->closing) {
+        ERROR("session_write", "session closed", ERROR_APP);
+        return -1;
+    }
+    w = (session_write_t *) calloc(1, sizeof(session_write_t));
+    if (!w) {
+        ERROR("calloc", "", ERROR_OS);
+        return -1;
+    }
+#if defined(LINUX) && defined(ZEROCOPY_ENABLED)
+    /* a large packet goes from a pool buffer, sent without a copy to the kernel */
+    if (session->zc && size >= ZEROCOPY_MIN_SIZE) {
+        if (!(w->buffer = zerocopy_buffer(session->zc, size))) {
+            free(w);
+            return -1;
+        }
+        w->data = w->buffer->data;
+        w->buffer->len = size;
+    }
+#endif /* LINUX && ZEROCOPY_ENABLED */
+    if (size && !w->data && !(w->data = (char *) malloc(size))) {
+        ERROR("malloc", "", ERROR_OS);
+        free(w);
+        return -1;
+    }
+    if (size)
+        memcpy(w->data, data, size);
+    w->stream_id = stream_id;
+    w->flags = flags;
+    w->size = size;
+    w->file_desc = -1;
+    w->owned = 1;
+    /* the packets of a transfer stay in order with its file data, the goodbye comes after all */
+    queue_write(session, w, flags & (WINDOW_UPDATE | ABORT_TRANSFER) ? 1 : 0);
+    return 0;
+}
+
+static void queue_write(session_t *session, session_write_t *w, int8_t control)
+{
+    session_write_t **head = control ? &session->control_head : &session->data_head;
+    session_write_t **tail = control ? &session->control_tail : &session->data_tail;
+
+    if (session->closed || session->closing) {
+        w->failed = w->done = 1;
+        return;
+    }
+    w->next = NULL;
+    if (*tail)
+        (*tail)->next = w;
+    else
+        *head = w;
+    *tail = w;
+    pthread_cond_broadcast(&session->cond);
+}
+
+static void write_free(session_t *session, session_write_t *w)
+{
+#if defined(LINUX) && defined(ZEROCOPY_ENABLED)
+    if (w->buffer) {
+        zerocopy_release(session->zc, w->buffer);
+        w->data = NULL;
+    }
+#endif /* LINUX && ZEROCOPY_ENABLED */
+    free(w->data);
+    free(w);
+}
+
+static int32_t write_frame(session_t *session, session_write_t *w)
+{
+    char        header[SESSION_FRAME_HEADER_SIZE];
+    char        zeros[4096];
+    uint32_t    size = w->file_desc == -1 ? w->size : w->length;
+    uint64_t    remaining = w->length;
+    off_t       offset = w->offset;
+    ssize_t     sent;
+
+    memcpy(header, &size, sizeof(size));
+    memcpy(&header[sizeof(size)], &w->flags, sizeof(w->flags));
+    memcpy(&header[NET_PACKET_HEADER_SIZE], &w->stream_id, sizeof(w->stream_id));
+    if (send_full(session->sock, header, sizeof(header), size ? MSG_MORE : 0) == -1)
+        return -1;
+#if defined(LINUX) && defined(ZEROCOPY_ENABLED)
+    if (w->buffer) {
+        /* the pool owns the buffer from now on, until the kernel is done with it */
+        struct zc_buffer *buffer = w->buffer;
+        w->buffer = NULL;
+        w->data = NULL;
+        return zerocopy_send(session->zc, buffer, 0);
+    }
+#endif /* LINUX && ZEROCOPY_ENABLED */
+    if (w->file_desc == -1)
+        return send_full(session->sock, w->data, w->size, 0);
+
+    while (remaining > 0) {
+        sent = sendfile(session->sock, w->file_desc, &offset, remaining);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && errno != EAGAIN) {
+            ERROR("sendfile", "", ERROR_OS);
+            return -1;
+        }
+        if (sent <= 0)
+            break;
+        remaining -= sent;
+    }
+    if (remaining == 0)
+        return 0;
+
+    /* the file shrank: the frame is completed with zeros, only this transfer fails */
+    ERROR("sendfile", "file truncated", ERROR_APP);
+    memset(zeros, 0, sizeof(zeros));
+    while (remaining > 0) {
+        size = remaining > sizeof(zeros) ? sizeof(zeros) : remaining;
+        if (send_full(session->sock, zeros, size, 0) == -1)
+            return -1;
+        remaining -= size;
+    }
+    return 1;
+}
+
+static int32_t send_full(SOCKET sock_desc, char *data, uint32_t size, int flags)
+{
+    ssize_t sent;
+
+    while (size > 0) {
+        if ((sent = send(sock_desc, data, size, flags)) == -1) {
+            if (errno == EINTR)
+                continue;
+            ERROR("send", "", ERROR_OS);
+            return -1;
+        }
+        size -= sent;
+        data += sent;
+    }
+    return 0;
+}
+
+static int32_t recv_full(SOCKET sock_desc, char *data, uint32_t size)
+{
+    ssize_t received;
+
+    while (size > 0) {
+        if ((received = recv(sock_desc, data, size, 0)) <= 0) {
+            if (received == -1 && errno == EINTR)
+                continue;
+            return received;
+        }
+        size -= received;
+        data += received;
+    }
+    return 1;
+}
+
+static int32_t discard(SOCKET sock_desc, uint32_t size)
+{
+    char        buff[4096];
+    uint32_t    len;
+
+    while (size > 0) {
+        len = size > sizeof(buff) ? sizeof(buff) : size;
+        if (recv_full(sock_desc, buff, len) <= 0)
+            return -1;
+        size -= len;
+    }
+    return 0;
+}
+
+#undef SESSION_C
@@ -0,0 +1,102 @@
+/**
+ * @file session.h
+ * @brief The multiplexed sessions header
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "data_types.h"
+#include "recv_state.h"
+#include "protocol.h"
+
+#ifdef SESSION_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* SESSION_C */
+
+/** the largest packet (path, extent map) accepted on a session */
+#define SESSION_MAX_PACKET_SIZE (64 * 1024 * 1024)
+
+typedef enum {
+    STREAM_SEND            = 0x01,      /* we send a transfer on it */
+    STREAM_RECV            = 0x02       /* we receive a transfer on it */
+} stream_direction_t;
+
+struct session;
+struct zc_buffer;
+struct zc_pool;
+struct pipe_pool;
+
+/** one transfer inside a session */
+typedef struct session_stream {
+    uint32_t                id;
+    struct session          *session;
+    stream_direction_t      direction;
+    int8_t                  local;      /* opened by us, closed by session_stream_close() */
+    int64_t                 credit;     /* bytes the peer lets us send, or we let it send (receive streams) */
+    uint64_t                unacked;    /* bytes received and not credited back yet */
+    recv_state_t            rs;         /* receive streams */
+    int8_t                  done;
+    int8_t                  failed;
+    struct session_stream   *next;
+} session_stream_t;
+
+/** a frame waiting for the session writer */
+typedef struct session_write {
+    uint32_t                stream_id;
+    flag_t                  flags;
+    char                    *data;
+    uint32_t                size;
+    struct zc_buffer        *buffer;    /* data is in a zerocopy buffer */
+    int32_t                 file_desc;  /* file data frame when not -1 */
+    off_t                   offset;
+    uint64_t                length;
+    int8_t                  owned;      /* freed by the writer, nobody waits for it */
+    int8_t                  done;
+    int8_t                  failed;
+    struct session_write    *next;
+} session_write_t;
+
+/** a long lived connection, the streams of many transfers interleave on it */
+typedef struct session {
+    SOCKET                  sock;
+    int8_t                  server;
+    protocol_caps_t         caps;       /* negotiated by the hello */
+    int8_t                  closed;     /* no more frames in or out */
+    int8_t                  closing;    /* session_destroy() is waiting for the writer */
+    int8_t                  reader_done;
+    uint32_t                next_stream_id;
+    uint32_t                senders_cnt;
+    uint32_t                overruns;   /* streams failed for data beyond their credit */
+    session_stream_t        *streams;
+    session_write_t         *control_head;
+    session_write_t         *control_tail;
+    session_write_t         *data_head;
+    session_write_t         *data_tail;
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+    pthread_t               reader_TID;
+    pthread_t               writer_TID;
+    struct zc_pool          *zc;        /* the large packets skip the copy to the kernel */
+    struct pipe_pool        *pipes;     /* the splice pipes of the receiving streams */
+} session_t;
+
+/* session functions */
+EXTERN session_t *session_connect(SOCKET sock_desc, protocol_caps_t caps);
+EXTERN int32_t session_serve(SOCKET sock_desc, protocol_caps_t caps);
+EXTERN void session_destroy(session_t *session);
+EXTERN int8_t session_is_closed(session_t *session);
+EXTERN session_stream_t *session_stream_open(session_t *session, stream_direction_t direction);
+EXTERN int32_t session_write_packet(session_stream_t *stream, char *data, uint32_t size, flag_t flags);
+EXTERN int32_t session_write_file(session_stream_t *stream, int32_t file_desc, off_t offset, uint64_t length);
+EXTERN int32_t session_stream_wait(session_stream_t *stream);
+EXTERN void session_stream_close(session_stream_t *stream);
+
+#undef EXTERN
+#endif /* SESSION_H */
@@ -0,0 +1,100 @@
+/**
+ * @file sock_tune_linux.c
+ * @brief The socket autotuner: right after the TCP handshake the kernel has
+ *        an RTT sample (TCP_INFO). With the bottleneck bandwidth it gives the
+ *        bandwidth delay product, the socket buffers of a long link are sized
+ *        from it and the link gets the congestion control made for it. The
+ *        short links keep the kernel buffer autotuning, which does better
+ *        there than any fixed size.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#ifdef UNIX
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#endif /* UNIX */
+
+#define SOCK_TUNE_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "sock_tune_linux.h"
+
+/* internal functions' prototypes */
+static void set_buffer(SOCKET sock_desc, int force_opt, int opt, int32_t size);
+
+int32_t sock_tune_linux(SOCKET sock_desc, const char *peer, sock_tune_t *tune)
+{
+    struct tcp_info info;
+    socklen_t       len = sizeof(info);
+    int32_t         lowat = TUNE_NOTSENT_LOWAT;
+    uint64_t        buffer;
+
+    memset(tune, 0, sizeof(sock_tune_t));
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(sock_desc, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+        ERROR("getsockopt", "TCP_INFO", ERROR_OS);
+        return -1;
+    }
+    tune->rtt = info.tcpi_rtt;
+    /* a handshake delivers too little to measure the link, the configured rate is the floor */
+    tune->rate = TUNE_LINK_RATE;
+    if (len > offsetof(struct tcp_info, tcpi_delivery_rate) && info.tcpi_delivery_rate > tune->rate)
+        tune->rate = info.tcpi_delivery_rate;
+    tune->bdp = tune->rate * tune->rtt / 1000000;
+
+    if (tune->rtt >= TUNE_LONG_RTT) {
+        /* twice the BDP: a window in flight and one being refilled */
+        buffer = 2 * tune->bdp;
+        if (buffer > TUNE_MAX_BUFFER)
+            buffer = TUNE_MAX_BUFFER;
+        set_buffer(sock_desc, SO_SNDBUFFORCE, SO_SNDBUF, buffer);
+        set_buffer(sock_desc, SO_RCVBUFFORCE, SO_RCVBUF, buffer);
+
+        /* the kernel may not have it, the default one stays */
+        if (setsockopt(sock_desc, IPPROTO_TCP, TCP_CONGESTION, TUNE_CONGESTION, strlen(TUNE_CONGESTION)) == -1)
+            errno = 0;
+    }
+    /* little unsent data in the socket: a control packet does not wait behind megabytes */
+    if (setsockopt(sock_desc, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) == -1) {
+        ERROR("setsockopt", "TCP_NOTSENT_LOWAT", ERROR_OS);
+        errno = 0;
+    }
+
+    len = sizeof(tune->sndbuf);
+    getsockopt(sock_desc, SOL_SOCKET, SO_SNDBUF, &tune->sndbuf, &len);
+    len = sizeof(tune->rcvbuf);
+    getsockopt(sock_desc, SOL_SOCKET, SO_RCVBUF, &tune->rcvbuf, &len);
+    len = sizeof(tune->notsent_lowat);
+    getsockopt(sock_desc, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &tune->notsent_lowat, &len);
+    len = sizeof(tune->congestion) - 1;
+    getsockopt(sock_desc, IPPROTO_TCP, TCP_CONGESTION, tune->congestion, &len);
+    errno = 0;
+
+    fprintf(stdout, "%s: rtt %.2f ms, bdp %" PRIu64 " KiB, sndbuf %d KiB%s, rcvbuf %d KiB%s, "
+            "notsent_lowat %d KiB, %s\n", peer, tune->rtt / 1000.0, tune->bdp / 1024,
+            tune->sndbuf / 1024, tune->rtt >= TUNE_LONG_RTT ? "" : " (auto)",
+            tune->rcvbuf / 1024, tune->rtt >= TUNE_LONG_RTT ? "" : " (auto)",
+            tune->notsent_lowat / 1024, tune->congestion);
+    fflush(stdout);
+    return 0;
+}
+
+static void set_buffer(SOCKET sock_desc, int force_opt, int opt, int32_t size)
+{
+    /* over net.core.[wr]mem_max only with CAP_NET_ADMIN, else as much as allowed */
+    if (setsockopt(sock_desc, SOL_SOCKET, force_opt, &size, sizeof(size)) == -1 &&
+        setsockopt(sock_desc, SOL_SOCKET, opt, &size, sizeof(size)) == -1)
+        ERROR("setsockopt", opt == SO_SNDBUF ? "SO_SNDBUF" : "SO_RCVBUF", ERROR_OS);
+    errno = 0;
+}
+
+#undef SOCK_TUNE_C
@@ -0,0 +1,34 @@
+/**
+ * @file sock_tune_linux.h
+ * @brief The socket autotuner header
+ */
+
+#ifndef SOCK_TUNE_H
+#define SOCK_TUNE_H
+
+#include <inttypes.h>
+
+#include "data_types.h"
+
+#ifdef SOCK_TUNE_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* SOCK_TUNE_C */
+
+/** what the autotuner measured and chose for a connection */
+typedef struct {
+    uint32_t    rtt;                /* microseconds */
+    uint64_t    rate;               /* bottleneck bandwidth estimate, bytes per second */
+    uint64_t    bdp;                /* bandwidth delay product, bytes */
+    int32_t     sndbuf;             /* as the kernel reports them */
+    int32_t     rcvbuf;
+    int32_t     notsent_lowat;
+    char        congestion[16];
+} sock_tune_t;
+
+/* sock_tune functions */
+EXTERN int32_t sock_tune_linux(SOCKET sock_desc, const char *peer, sock_tune_t *tune);
+
+#undef EXTERN
+#endif /* SOCK_TUNE_H */
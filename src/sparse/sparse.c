@@ -0,0 +1,163 @@
+/**
+ * @file sparse.c
+ * @brief Data extents of sparse files, enumerated with SEEK_DATA/SEEK_HOLE
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif /* UNIX */
+
+#define SPARSE_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "sparse.h"
+
+/* internal functions' prototypes */
+static int32_t add_extent(file_extent_t **extents, uint32_t *cnt, uint32_t *max_cnt,
+                          uint64_t offset, uint64_t length);
+
+int8_t sparse_is_candidate(struct stat *stat_buf)
+{
+    /* st_blocks is counted in 512 bytes units, whatever the fs block size is */
+    return S_ISREG(stat_buf->st_mode) &&
+           (uint64_t) stat_buf->st_blocks * 512 < (uint64_t) stat_buf->st_size;
+}
+
+int32_t sparse_get_extents(int32_t file_desc, uint64_t filesize,
+                           file_extent_t **extents, uint32_t *cnt)
+{
+    uint32_t    max_cnt = 0;
+    
+    *extents = NULL;
+    *cnt = 0;
+    
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    off_t       data;
+    off_t       hole = 0;
+    
+    while ((uint64_t) hole < filesize) {
+        if ((data = lseek(file_desc, hole, SEEK_DATA)) == -1) {
+            /* ENXIO: no more data until the end of file */
+            if (errno == ENXIO) {
+                errno = 0;
+                break;
+            }
+            /* the file system doesn't know about holes, send all the file */
+            if (errno == EINVAL) {
+                errno = 0;
+                free(*extents);
+                *extents = NULL;
+                *cnt = 0;
+                return add_extent(extents, cnt, &max_cnt, 0, filesize);
+            }
+            ERROR("lseek", "SEEK_DATA", ERROR_OS);
+            goto error;
+        }
+        if ((hole = lseek(file_desc, data, SEEK_HOLE)) == -1) {
+            ERROR("lseek", "SEEK_HOLE", ERROR_OS);
+            goto error;
+        }
+        /* the file may grow while we look at it, stop at the stat size */
+        if ((uint64_t) hole > filesize)
+            hole = filesize;
+        if (add_extent(extents, cnt, &max_cnt, data, hole - data) == -1)
+            goto error;
+    }
+    /* sendfile uses its own offsets, but leave the file as we found it */
+    lseek(file_desc, 0, SEEK_SET);
+    return 0;
+
+ error:
+    free(*extents);
+    *extents = NULL;
+    *cnt = 0;
+    return -1;
+#else
+    return add_extent(extents, cnt, &max_cnt, 0, filesize);
+#endif /* SEEK_DATA && SEEK_HOLE */
+}
+
+int32_t sparse_make_holes(int32_t file_desc, uint64_t filesize,
+                          file_extent_t *extents, uint32_t cnt)
+{
+    uint64_t    offset = 0;
+    uint64_t    end;
+    
+    /* the file gets its final size, the new tail is a hole */
+    if (ftruncate(file_desc, filesize) == -1) {
+        ERROR("ftruncate", "", ERROR_OS);
+        return -1;
+    }
+    /*
+     * The file may already exist with real blocks where the source has holes.
+     * Punch them, so the holes between (and after) the extents are recreated.
+     */
+    for (uint32_t i = 0; i <= cnt; ++i) {
+        end = i < cnt ? extents[i].offset : filesize;
+        if (end > offset) {
+            if (fallocate(file_desc, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          offset, end - offset) == -1) {
+                if (errno != EOPNOTSUPP) {
+                    ERROR("fallocate", "FALLOC_FL_PUNCH_HOLE", ERROR_OS);
+                    return -1;
+                }
+                /* no hole punching here: drop all the old blocks instead */
+                errno = 0;
+                if (ftruncate(file_desc, 0) == -1 || ftruncate(file_desc, filesize) == -1) {
+                    ERROR("ftruncate", "", ERROR_OS);
+                    return -1;
+                }
+                return 0;
+            }
+        }
+        if (i < cnt)
+            offset = extents[i].offset + extents[i].length;
+    }
+    return 0;
+}
+
+int8_t sparse_valid_extents(file_extent_t *extents, uint32_t cnt, uint64_t filesize)
+{
+    uint64_t end = 0;
+    
+    /* the extents must be sorted, disjoint and inside the file */
+    for (uint32_t i = 0; i < cnt; ++i) {
+        if (extents[i].offset < end || extents[i].length > filesize ||
+            extents[i].offset > filesize - extents[i].length)
+            return 0;
+        end = extents[i].offset + extents[i].length;
+    }
+    return 1;
+}
+
+static int32_t add_extent(file_extent_t **extents, uint32_t *cnt, uint32_t *max_cnt,
+                          uint64_t offset, uint64_t length)
+{
+    file_extent_t *new_extents;
+    
+    if (*cnt == *max_cnt) {
+        *max_cnt = *max_cnt ? *max_cnt * 2 : 16;
+        new_extents = (file_extent_t *) realloc(*extents, sizeof(file_extent_t) * *max_cnt);
+        if (!new_extents) {
+            ERROR("realloc", "", ERROR_OS);
+            return -1;
+        }
+        *extents = new_extents;
+    }
+    (*extents)[*cnt].offset = offset;
+    (*extents)[*cnt].length = length;
+    ++*cnt;
+    return 0;
+}
+
+#undef SPARSE_C
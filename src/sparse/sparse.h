@@ -0,0 +1,29 @@
+/**
+ * @file sparse.h
+ * @brief The sparse files header
+ */
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "data_types.h"
+
+#ifdef SPARSE_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* SPARSE_C */
+
+/* sparse functions */
+EXTERN int8_t  sparse_is_candidate(struct stat *stat_buf);
+EXTERN int32_t sparse_get_extents(int32_t file_desc, uint64_t filesize,
+                                  file_extent_t **extents, uint32_t *cnt);
+EXTERN int8_t  sparse_valid_extents(file_extent_t *extents, uint32_t cnt, uint64_t filesize);
+EXTERN int32_t sparse_make_holes(int32_t file_desc, uint64_t filesize,
+                                 file_extent_t *extents, uint32_t cnt);
+
+#undef EXTERN
+#endif /* SPARSE_H */
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #ifdef UNIX
 #include <unistd.h>
@@ -16,15 +18,54 @@
 #include "send.h"
 #include "receive.h"
 #include "error.h"
+#include "pacing.h"
+#include "job_queue.h"
+#include "session.h"
+#include "protocol.h"
+#include "query.h"
+#include "peer.h"
+
+#ifdef LINUX
+#include "watch_linux.h"
+#endif /* LINUX */
 
 #define USER_THREAD_C
 #include "user_thread.h"
 
+/** the most source trees watched at the same time */
+#define MAX_WATCHES 16
+
+#ifdef LINUX
+/** a watched source tree and where its changes go */
+typedef struct {
+    watch_t         *watch;
+    char            path[PATH_SIZE];
+    char            ip[64];
+    qos_class_t     qos;
+} watched_t;
+#endif /* LINUX */
+
 /* INTERNAL FUNCTIONS */
-static int8_t   connect_to_peer(char *ip);
-static int8_t   send_to_peer(char *path, char *ip, TC_t *TC);
+static int8_t   send_to_peer(char *path, char *ip, qos_class_t qos, TC_t *TC);
 static int8_t   receive_from_peer(char *path, char *ip, TC_t *TC);
-static char     **split_string(char *string, int32_t *cnt, char delim);
+static int8_t   query_from_peer(flag_t query, char *path, char *ip, TC_t *TC);
+static void     set_rate(char *class_name, char *rate);
+static void     print_rates(void);
+static void     submit_job(char *path, char *ip, char *class_name);
+static int8_t   run_job(job_t *job);
+#ifdef LINUX
+static void     watch_path(char *path, char *ip, char *class_name);
+static void     unwatch_path(char *path);
+static int8_t   sync_watched(watch_t *watch, char **changed, uint32_t changed_cnt,
+                             char **deleted, uint32_t deleted_cnt);
+#endif /* LINUX */
+
+/* INTERNAL VARIABLES */
+static job_queue_t *job_queue;
+#ifdef LINUX
+static watched_t watched[MAX_WATCHES];
+#endif /* LINUX */
+
 
 void user_thread(void *arg_ptr)
 {
@@ -34,6 +75,9 @@ void user_thread(void *arg_ptr)
     /* free the arguments */
     free(arg_ptr);
     
+    /* the submitted jobs run in the background, the spooled ones restart now */
+    job_queue = job_queue_create(JOB_CONCURRENCY, JOB_SPOOL_PATH, &run_job);
+    
     while (1) {
         while (__sync_lock_test_and_set(&arg_data.TC->lock, 1)) {
             usleep(100);
@@ -41,9 +85,11 @@ void user_thread(void *arg_ptr)
         fprintf(stdout, "\n-> ");
         fflush(stdout);
         __sync_lock_release(&arg_data.TC->lock);
+        arg_data.TC->reading = 1;
         if (!fgets(buf, sizeof(buf), stdin)) {
             break;
         }
+        arg_data.TC->reading = 0;
         
         int32_t cnt;
         buf[strlen(buf) - 1] = '\0';
@@ -54,8 +100,45 @@ void user_thread(void *arg_ptr)
         if (!locked && cnt == 3 && !memcmp(cmd, "receive", strlen(cmd))) {
             receive_from_peer(tokens[1], tokens[2], arg_data.TC);
         }
-        else if (!locked && cnt == 3 && !memcmp(cmd, "send", strlen(cmd))) {
-            send_to_peer(tokens[1], tokens[2], arg_data.TC);
+        else if (!locked && (cnt == 3 || cnt == 4) && !memcmp(cmd, "send", strlen(cmd))) {
+            int32_t qos = cnt == 4 ? pacing_parse_class(tokens[3]) : DEFAULT_QOS_CLASS;
+            if (qos < 0) {
+                fprintf(stdout, "Unknown class %s [interactive/bulk/scavenger]\n", tokens[3]);
+                fflush(stdout);
+            }
+            else {
+                send_to_peer(tokens[1], tokens[2], qos, arg_data.TC);
+            }
+        }
+        else if (!locked && (cnt == 3 || cnt == 4) && !memcmp(cmd, "submit", strlen(cmd))) {
+            submit_job(tokens[1], tokens[2], cnt == 4 ? tokens[3] : NULL);
+        }
+        else if (!locked && cnt == 1 && !memcmp(cmd, "jobs", strlen(cmd))) {
+            if (job_queue)
+                job_queue_print(job_queue, stdout);
+        }
+        else if (!locked && cnt == 3 && !memcmp(cmd, "list", strlen(cmd))) {
+            query_from_peer(LIST_QUERY, tokens[1], tokens[2], arg_data.TC);
+        }
+        else if (!locked && cnt == 3 && !memcmp(cmd, "stat", strlen(cmd))) {
+            query_from_peer(STAT_QUERY, tokens[1], tokens[2], arg_data.TC);
+        }
+        else if (!locked && cnt == 3 && !memcmp(cmd, "du", strlen(cmd))) {
+            query_from_peer(DU_QUERY, tokens[1], tokens[2], arg_data.TC);
+        }
+#ifdef LINUX
+        else if (!locked && (cnt == 3 || cnt == 4) && !memcmp(cmd, "watch", strlen(cmd))) {
+            watch_path(tokens[1], tokens[2], cnt == 4 ? tokens[3] : NULL);
+        }
+        else if (!locked && cnt == 2 && !memcmp(cmd, "unwatch", strlen(cmd))) {
+            unwatch_path(tokens[1]);
+        }
+#endif /* LINUX */
+        else if (!locked && cnt == 3 && !memcmp(cmd, "rate", strlen(cmd))) {
+            set_rate(tokens[1], tokens[2]);
+        }
+        else if (!locked && cnt == 1 && !memcmp(cmd, "rate", strlen(cmd))) {
+            print_rates();
         }
         else if (cnt == 1 && !memcmp(cmd, "stop", strlen(cmd))) {
             break;
@@ -83,80 +166,91 @@ void user_thread(void *arg_ptr)
         
         free(tokens);
     }
+#ifdef LINUX
+    for (uint32_t i = 0; i < MAX_WATCHES; ++i) {
+        watch_stop(watched[i].watch);
+        watched[i].watch = NULL;
+    }
+#endif /* LINUX */
+    peer_close_sessions();
 }
 
-static int8_t connect_to_peer(char *ip)
+char **split_string(char *string, int32_t *cnt, char delim)
 {
-    int                 sock_desc;
-    struct sockaddr_in  remote_addr;
-    char                buf[128];
-    
-    /* Zeroing remote_addr struct */
-    memset(&remote_addr, 0, sizeof(remote_addr));
-    
-    /* Construct remote_addr struct */
-    remote_addr.sin_family = AF_INET;
-    inet_pton(AF_INET, ip, &(remote_addr.sin_addr));
-    remote_addr.sin_port = htons(PORT);
-    
-    /* Create client socket */
-    sock_desc = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_desc == -1) {
-        ERROR("socket", "client", ERROR_OS);
-        return -1;
-    }
+    int32_t tokens_cnt = 0;
+    int32_t str_size = strlen(string);
     
-    /* Connect to the other peer */
-    if (connect(sock_desc, (struct sockaddr *)&remote_addr, sizeof(struct sockaddr)) == -1) {
-        snprintf(buf, sizeof(buf), "to peer %s", ip);
-        ERROR("connect", buf, ERROR_OS);
-        return -1;
+    if (!str_size) {
+        *cnt = 0;
+        return NULL;
     }
+    for (uint32_t i = 0; i < str_size; ++i)
+        if (string[i] == delim)
+            ++tokens_cnt;
+    tokens_cnt += 2;
     
-    return sock_desc;
+    char **tokens = (char **) malloc(sizeof(char *) * tokens_cnt);
+    tokens[0] = string;
+    for (uint32_t i = 0, j = 1; i < str_size; ++i)
+        if (string[i] == delim) {
+            string[i] = '\0';
+            tokens[j++] = &string[i + 1];
+        }
+    
+    tokens[tokens_cnt - 1] = NULL;
+    *cnt = tokens_cnt - 1;
+    return tokens;
 }
 
-static int8_t send_to_peer(char *path, char *ip, TC_t *TC)
+static int8_t send_to_peer(char *path, char *ip, qos_class_t qos, TC_t *TC)
 {
-    int32_t s;
-    int32_t peer_sock = connect_to_peer(ip);
+    int8_t s;
     
-    if (peer_sock == -1) {
-        return -1;
-    }
     while (__sync_lock_test_and_set(&TC->lock, 1)) {
         usleep(100);
     }
-    s = __send(peer_sock, path);
-    close(peer_sock);
+    s = peer_send(path, ip, qos);
     __sync_lock_release(&TC->lock);
-    
     return s;
 }
 
 static int8_t receive_from_peer(char *path, char *ip, TC_t *TC)
 {
-    int32_t s;
-    int32_t peer_sock = connect_to_peer(ip);
+    int8_t s;
     
-    if (peer_sock == -1) {
+    while (__sync_lock_test_and_set(&TC->lock, 1)) {
+        usleep(100);
+    }
+    s = peer_receive(path, ip);
+    __sync_lock_release(&TC->lock);
+    return s;
+}
+
+/**
+ * Ask a peer what it has, on a connection of its own: the answer is a few
+ * packets, the session streams would cost more than they save
+ */
+static int8_t query_from_peer(flag_t query, char *path, char *ip, TC_t *TC)
+{
+    int32_t         s = -1;
+    SOCKET          peer_sock;
+    peer_t          *peer;
+    protocol_caps_t caps;
+    
+    peer = peer_lookup(ip);
+    if ((peer_sock = peer_connect(ip, peer, &caps)) == -1) {
         return -1;
     }
     
     while (__sync_lock_test_and_set(&TC->lock, 1)) {
         usleep(100);
     }
-    send_packet(peer_sock, path, strlen(path), START_TRANSFER|RECEIVE_OPERATION);
-    net_packet_t *packet = recv_packet(peer_sock, 0);
-    
-    if (packet) {
-        if (packet->flags.val & START_TRANSFER) {
-            s = __recv(peer_sock, packet->flags.val, RECEIVING_PATH);
-        }
-        destroy_packet(packet);
+    if (!(caps & CAP_QUERIES)) {
+        fprintf(stdout, "The peer %s can't answer queries...\n", ip);
+        fflush(stdout);
     }
     else {
-        s = -1;
+        s = query_peer(peer_sock, query, path);
     }
     close(peer_sock);
     __sync_lock_release(&TC->lock);
@@ -164,31 +258,140 @@ static int8_t receive_from_peer(char *path, char *ip, TC_t *TC)
     return s;
 }
 
-static char **split_string(char *string, int32_t *cnt, char delim)
+static void submit_job(char *path, char *ip, char *class_name)
 {
-    int32_t tokens_cnt = 0;
-    int32_t str_size = strlen(string);
+    int32_t qos = class_name ? pacing_parse_class(class_name) : DEFAULT_QOS_CLASS;
+    int32_t id;
     
-    if (!str_size) {
-        *cnt = 0;
-        return NULL;
+    if (!job_queue) {
+        fprintf(stdout, "The job queue is not available...\n");
     }
-    for (uint32_t i = 0; i < str_size; ++i)
-        if (string[i] == delim)
-            ++tokens_cnt;
-    tokens_cnt += 2;
+    else if (qos < 0) {
+        fprintf(stdout, "Unknown class %s [interactive/bulk/scavenger]\n", class_name);
+    }
+    else if ((id = job_queue_submit(job_queue, path, ip, qos)) != -1) {
+        fprintf(stdout, "Job #%d submitted\n", id);
+    }
+    fflush(stdout);
+}
+
+static int8_t run_job(job_t *job)
+{
+    /* unlike send_to_peer(), a job doesn't own the console */
+    return peer_send(job->path, job->ip, job->qos);
+}
+
+#ifdef LINUX
+/** sends path to ip now, then what changes in it every WATCH_INTERVAL seconds */
+static void watch_path(char *path, char *ip, char *class_name)
+{
+    int32_t     qos = class_name ? pacing_parse_class(class_name) : DEFAULT_QOS_CLASS;
+    watched_t   *entry = NULL;
     
-    char **tokens = (char **) malloc(sizeof(char *) * tokens_cnt);
-    tokens[0] = string;
-    for (uint32_t i = 0, j = 1; i < str_size; ++i)
-        if (string[i] == delim) {
-            string[i] = '\0';
-            tokens[j++] = &string[i + 1];
+    for (uint32_t i = 0; i < MAX_WATCHES; ++i) {
+        if (watched[i].watch && !strcmp(watched[i].path, path)) {
+            fprintf(stdout, "%s is already watched...\n", path);
+            fflush(stdout);
+            return;
+        }
+        if (!watched[i].watch && !entry) {
+            entry = &watched[i];
+        }
+    }
+    if (qos < 0) {
+        fprintf(stdout, "Unknown class %s [interactive/bulk/scavenger]\n", class_name);
+    }
+    else if (!entry || strlen(path) >= sizeof(entry->path) || strlen(ip) >= sizeof(entry->ip)) {
+        fprintf(stdout, "Can't watch %s...\n", path);
+    }
+    else {
+        strcpy(entry->path, path);
+        strcpy(entry->ip, ip);
+        entry->qos = qos;
+        if ((entry->watch = watch_start(path, &sync_watched, entry))) {
+            fprintf(stdout, "Watching %s for %s\n", path, ip);
+        }
+    }
+    fflush(stdout);
+}
+
+static void unwatch_path(char *path)
+{
+    for (uint32_t i = 0; i < MAX_WATCHES; ++i) {
+        if (watched[i].watch && !strcmp(watched[i].path, path)) {
+            watch_stop(watched[i].watch);
+            watched[i].watch = NULL;
+            fprintf(stdout, "%s is not watched anymore\n", path);
+            fflush(stdout);
+            return;
         }
+    }
+    fprintf(stdout, "%s is not watched...\n", path);
+    fflush(stdout);
+}
+
+/** a sync of a watched tree, like a job it doesn't own the console */
+static int8_t sync_watched(watch_t *watch, char **changed, uint32_t changed_cnt,
+                           char **deleted, uint32_t deleted_cnt)
+{
+    watched_t           *entry = (watched_t *) watch->arg;
+    session_stream_t    *stream;
+    int32_t             s;
+    int32_t             peer_sock;
+    peer_t              *peer;
+    protocol_caps_t     caps;
     
-    tokens[tokens_cnt - 1] = NULL;
-    *cnt = tokens_cnt - 1;
-    return tokens;
+    if ((s = peer_open_transfer(entry->ip, &peer, &peer_sock, &caps)) == -1) {
+        return -1;
+    }
+    if (s == 1) {
+        if (!(stream = session_stream_open(peer->session, STREAM_SEND))) {
+            s = -1;
+        }
+        else {
+            s = changed ? __send_changes_stream(stream, watch->root, changed, changed_cnt,
+                                                deleted, deleted_cnt, entry->qos)
+                        : __send_stream(stream, watch->root, entry->qos);
+            session_stream_close(stream);
+        }
+        peer_put_session(peer);
+        return s;
+    }
+    
+    s = changed ? __send_changes(peer_sock, watch->root, changed, changed_cnt,
+                                 deleted, deleted_cnt, entry->qos, caps)
+                : __send(peer_sock, watch->root, entry->qos, caps);
+    close(peer_sock);
+    return s;
+}
+#endif /* LINUX */
+
+static void set_rate(char *class_name, char *rate)
+{
+    int32_t     qos = pacing_parse_class(class_name);
+    char        *end;
+    uint64_t    value = strtoull(rate, &end, 10);
+    
+    if (qos == QOS_UNKNOWN || *end != '\0') {
+        fprintf(stdout, "Usage: rate [global/interactive/bulk/scavenger] [bytes per second, 0 = unlimited]\n");
+        fflush(stdout);
+        return;
+    }
+    /* the running transfers read the limits on their next chunk */
+    pacing_set_rate(qos, value);
+    print_rates();
+}
+
+static void print_rates(void)
+{
+    for (int32_t qos = QOS_GLOBAL; qos < QOS_CLASSES; ++qos) {
+        uint64_t rate = pacing_get_rate(qos);
+        if (rate)
+            fprintf(stdout, "%-12s %" PRIu64 " B/s\n", pacing_class_name(qos), rate);
+        else
+            fprintf(stdout, "%-12s unlimited\n", pacing_class_name(qos));
+    }
+    fflush(stdout);
 }
 
 #undef USER_THREAD_C
@@ -12,6 +12,7 @@ typedef struct {
 } user_thread_arg_t;
 
 EXTERN void user_thread(void *arg_ptr);
+EXTERN char **split_string(char *string, int32_t *cnt, char delim);
 
 #undef EXTERN
 #endif /* USER_THREAD_H */
\ No newline at end of file
@@ -0,0 +1,549 @@
+/**
+ * @file watch_linux.c
+ * @brief The watch mode: a source tree is sent once, then every directory of
+ *        it has an inotify watch and the changed, created and deleted paths
+ *        are gathered in two sets. Every WATCH_INTERVAL seconds only these
+ *        paths are sent (a created directory with all it has), so the cost
+ *        of a sync follows the changes and not the size of the tree. When
+ *        the kernel lost events (IN_Q_OVERFLOW), or more than
+ *        WATCH_MAX_CHANGES paths changed, the whole tree is sent again.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef UNIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#endif /* UNIX */
+
+#define WATCH_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "filter.h"
+#include "watch_linux.h"
+
+/* internal constants */
+#define WATCH_DIRS_BUCKETS  4096
+/* what is sent again: a change of the content, a new or a removed entry */
+#define WATCH_MASK          (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | \
+                             IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | \
+                             IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+/* internal functions' prototypes */
+static void         *watch_thread(void *arg);
+static void         sync_changes(watch_t *watch);
+static void         read_events(watch_t *watch);
+static void         overflow(watch_t *watch);
+static int32_t      add_tree(watch_t *watch, const char *path);
+static void         unwatch_tree(watch_t *watch, const char *path);
+static void         unwatch_all(watch_t *watch);
+static void         dir_remove(watch_t *watch, watch_dir_t *dir);
+static watch_dir_t  *dir_find(watch_t *watch, int32_t wd);
+static int32_t      set_init(watch_set_t *set);
+static int32_t      set_add(watch_set_t *set, const char *path);
+static int8_t       set_find(watch_set_t *set, const char *path, uint32_t len);
+static char         **set_list(watch_set_t *set, uint32_t *cnt);
+static void         set_clear(watch_set_t *set);
+static char         *path_concat(const char *dir, const char *name);
+static uint32_t     hash_path(const char *path, uint32_t len);
+static time_t       now(void);
+
+watch_t *watch_start(const char *path, watch_sync_t sync, void *arg)
+{
+    watch_t *watch;
+    int32_t s;
+
+    watch = (watch_t *) calloc(1, sizeof(watch_t));
+    if (!watch) {
+        ERROR("calloc", "", ERROR_OS);
+        return NULL;
+    }
+    watch->inotify_desc = watch->stop_desc = -1;
+    if (!(watch->root = realpath(path, NULL))) {
+        ERROR("realpath", path, ERROR_OS);
+        goto error;
+    }
+    watch->dirs_buckets_cnt = WATCH_DIRS_BUCKETS;
+    if (!(watch->dirs = (watch_dir_t **) calloc(watch->dirs_buckets_cnt, sizeof(watch_dir_t *))) ||
+        set_init(&watch->changed) == -1 || set_init(&watch->deleted) == -1) {
+        ERROR("calloc", "", ERROR_OS);
+        goto error;
+    }
+    if ( (watch->inotify_desc = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) == -1) {
+        ERROR("inotify_init1", "", ERROR_OS);
+        goto error;
+    }
+    if ( (watch->stop_desc = eventfd(0, EFD_CLOEXEC)) == -1) {
+        ERROR("eventfd", "", ERROR_OS);
+        goto error;
+    }
+    watch->sync = sync;
+    watch->arg = arg;
+    watch->filter = filter_default();
+    /* watched before the first full send, nothing changed meanwhile is lost */
+    if (add_tree(watch, "") == -1 && !watch->degraded)
+        goto error;
+    watch->rescan = 1;
+
+    s = pthread_create(&watch->TID, NULL, &watch_thread, watch);
+    if (s != 0) {
+        errno = s;
+        ERROR("pthread_create", "", ERROR_OS);
+        goto error;
+    }
+    return watch;
+
+ error:
+    watch->TID = 0;
+    watch_stop(watch);
+    return NULL;
+}
+
+void watch_stop(watch_t *watch)
+{
+    uint64_t one = 1;
+
+    if (!watch)
+        return;
+    /* a sync in progress ends first */
+    if (watch->TID) {
+        if (write(watch->stop_desc, &one, sizeof(one)) != sizeof(one))
+            ERROR("write", "eventfd", ERROR_OS);
+        pthread_join(watch->TID, NULL);
+    }
+    if (watch->dirs)
+        unwatch_all(watch);
+    set_clear(&watch->changed);
+    set_clear(&watch->deleted);
+    free(watch->changed.buckets);
+    free(watch->deleted.buckets);
+    if (watch->inotify_desc != -1)
+        close(watch->inotify_desc);
+    if (watch->stop_desc != -1)
+        close(watch->stop_desc);
+    free(watch->dirs);
+    free(watch->root);
+    free(watch);
+}
+
+static void *watch_thread(void *arg)
+{
+    watch_t         *watch = (watch_t *) arg;
+    struct pollfd   fds[2];
+    time_t          next = now();
+    time_t          current;
+
+    while (1) {
+        fds[0].fd = watch->inotify_desc;
+        fds[0].events = POLLIN;
+        fds[1].fd = watch->stop_desc;
+        fds[1].events = POLLIN;
+        current = now();
+        if (poll(fds, 2, next > current ? (next - current) * 1000 : 0) == -1 && errno != EINTR) {
+            ERROR("poll", watch->root, ERROR_OS);
+            break;
+        }
+        if (fds[1].revents & POLLIN)
+            break;
+        if (fds[0].revents & POLLIN)
+            read_events(watch);
+        /* the root itself is gone, nothing to send anymore */
+        if (watch->dirs_cnt == 0 && !watch->degraded) {
+            fprintf(stdout, "The watched %s is gone...\n", watch->root);
+            fflush(stdout);
+            break;
+        }
+        if (now() >= next) {
+            sync_changes(watch);
+            next = now() + WATCH_INTERVAL;
+        }
+    }
+    return NULL;
+}
+
+static void sync_changes(watch_t *watch)
+{
+    char        **changed = NULL;
+    char        **deleted = NULL;
+    uint32_t    changed_cnt = 0;
+    uint32_t    deleted_cnt = 0;
+
+    if (watch->rescan || watch->degraded) {
+        /* the changes are in it, the removals are not */
+        if (watch->sync(watch, NULL, 0, NULL, 0) != -1) {
+            watch->rescan = 0;
+            ++watch->rescans;
+            set_clear(&watch->changed);
+        }
+        return;
+    }
+    if (watch->changed.cnt == 0 && watch->deleted.cnt == 0)
+        return;
+    /* not NULL even when empty, NULL is the whole tree */
+    if (!(changed = set_list(&watch->changed, &changed_cnt)) ||
+        !(deleted = set_list(&watch->deleted, &deleted_cnt))) {
+        free(changed);
+        return;
+    }
+    /* kept for the next time when the peer is not there */
+    if (watch->sync(watch, changed, changed_cnt, deleted, deleted_cnt) != -1) {
+        ++watch->syncs;
+        set_clear(&watch->changed);
+        set_clear(&watch->deleted);
+    }
+    free(changed);
+    free(deleted);
+}
+
+static void read_events(watch_t *watch)
+{
+    char                        buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event  *event;
+    watch_dir_t                 *dir;
+    char                        *path;
+    ssize_t                     len;
+
+    while ( (len = read(watch->inotify_desc, buf, sizeof(buf))) > 0) {
+        for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *) ptr;
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflow(watch);
+                /* the watches were replaced, the rest of the events is stale */
+                return;
+            }
+            if (!(dir = dir_find(watch, event->wd)))
+                continue;
+            if (event->mask & IN_IGNORED) {
+                dir_remove(watch, dir);
+                continue;
+            }
+            /* the root moved or removed: nothing is watched anymore */
+            if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) && dir->path[0] == '\0') {
+                for (uint32_t i = 0; i < watch->dirs_buckets_cnt; ++i)
+                    for (dir = watch->dirs[i]; dir; dir = dir->next)
+                        inotify_rm_watch(watch->inotify_desc, dir->wd);
+                unwatch_all(watch);
+                return;
+            }
+            /* the parent reports it, with its name */
+            if (!event->len)
+                continue;
+            if (!(path = path_concat(dir->path, event->name))) {
+                overflow(watch);
+                return;
+            }
+            /* never sent, nor watched */
+            if (watch->filter && filter_excluded(watch->filter, event->name, path, !!(event->mask & IN_ISDIR))) {
+                free(path);
+                continue;
+            }
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                if (event->mask & IN_ISDIR)
+                    unwatch_tree(watch, path);
+                if (set_add(&watch->deleted, path) == -1)
+                    watch->rescan = 1;
+            }
+            /* a new directory is sent with all it has, its watches come first */
+            if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && (event->mask & IN_ISDIR))
+                add_tree(watch, path);
+            if ((event->mask & (IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE)) &&
+                set_add(&watch->changed, path) == -1)
+                watch->rescan = 1;
+            free(path);
+            if (watch->changed.cnt + watch->deleted.cnt > WATCH_MAX_CHANGES)
+                watch->rescan = 1;
+            /* the whole tree goes anyway */
+            if (watch->rescan)
+                set_clear(&watch->changed);
+        }
+    }
+    if (len == -1 && errno != EAGAIN)
+        ERROR("read", "inotify", ERROR_OS);
+}
+
+static void overflow(watch_t *watch)
+{
+    fprintf(stdout, "Too many changes in %s, sending it all again...\n", watch->root);
+    fflush(stdout);
+    /* the directories created meanwhile may have no watch, all of them again */
+    close(watch->inotify_desc);
+    unwatch_all(watch);
+    if ( (watch->inotify_desc = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) == -1) {
+        ERROR("inotify_init1", "", ERROR_OS);
+        watch->degraded = 1;
+    }
+    else {
+        add_tree(watch, "");
+    }
+    set_clear(&watch->changed);
+    watch->rescan = 1;
+}
+
+/** watches a directory and everything below it */
+static int32_t add_tree(watch_t *watch, const char *path)
+{
+    char            *full = *path ? path_concat(watch->root, path) : watch->root;
+    char            *sub;
+    watch_dir_t     *dir;
+    watch_dir_t     **bucket;
+    DIR             *dir_stream;
+    struct dirent   *entry;
+    int32_t         wd;
+    int32_t         s = 0;
+
+    if (!full)
+        return -1;
+    if ( (wd = inotify_add_watch(watch->inotify_desc, full, WATCH_MASK)) == -1) {
+        /* removed since, its removal is reported */
+        if (errno != ENOENT && errno != ENOTDIR) {
+            ERROR("inotify_add_watch", full, ERROR_OS);
+            /* out of watches (fs.inotify.max_user_watches): the whole tree every time */
+            if (!watch->degraded)
+                fprintf(stdout, "Can't watch all of %s, sending it all every time...\n", watch->root);
+            watch->degraded = 1;
+            s = -1;
+        }
+        goto out;
+    }
+    /* the same directory under another name (moved), the new name is kept */
+    if ( (dir = dir_find(watch, wd)) ) {
+        free(dir->path);
+        dir->path = NULL;
+    }
+    else {
+        if (!(dir = (watch_dir_t *) calloc(1, sizeof(watch_dir_t)))) {
+            ERROR("calloc", "", ERROR_OS);
+            s = -1;
+            goto out;
+        }
+        dir->wd = wd;
+        bucket = &watch->dirs[wd % watch->dirs_buckets_cnt];
+        dir->next = *bucket;
+        *bucket = dir;
+        ++watch->dirs_cnt;
+    }
+    if (!(dir->path = strdup(path))) {
+        ERROR("strdup", "", ERROR_OS);
+        dir_remove(watch, dir);
+        s = -1;
+        goto out;
+    }
+
+    if (!(dir_stream = opendir(full)))
+        goto out;
+    while ( (entry = readdir(dir_stream)) ) {
+        if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
+            continue;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (!(sub = path_concat(path, entry->d_name))) {
+            s = -1;
+            break;
+        }
+        /* a left out directory costs no watch */
+        if (watch->filter && entry->d_type == DT_DIR && filter_excluded(watch->filter, entry->d_name, sub, 1)) {
+            free(sub);
+            continue;
+        }
+        /* a DT_UNKNOWN file fails the IN_ONLYDIR watch */
+        if (add_tree(watch, sub) == -1)
+            s = -1;
+        free(sub);
+    }
+    closedir(dir_stream);
+
+ out:
+    if (full != watch->root)
+        free(full);
+    return s;
+}
+
+/** a directory moved out or deleted, and everything below it */
+static void unwatch_tree(watch_t *watch, const char *path)
+{
+    watch_dir_t *dir;
+    watch_dir_t *next;
+    uint32_t    len = strlen(path);
+
+    for (uint32_t i = 0; i < watch->dirs_buckets_cnt; ++i) {
+        for (dir = watch->dirs[i]; dir; dir = next) {
+            next = dir->next;
+            if (strncmp(dir->path, path, len) == 0 && (dir->path[len] == '\0' || dir->path[len] == '/')) {
+                inotify_rm_watch(watch->inotify_desc, dir->wd);
+                dir_remove(watch, dir);
+            }
+        }
+    }
+}
+
+/** forgets the watched directories, the caller removes the watches */
+static void unwatch_all(watch_t *watch)
+{
+    watch_dir_t *dir;
+
+    for (uint32_t i = 0; i < watch->dirs_buckets_cnt; ++i) {
+        while ( (dir = watch->dirs[i]) ) {
+            watch->dirs[i] = dir->next;
+            free(dir->path);
+            free(dir);
+        }
+    }
+    watch->dirs_cnt = 0;
+}
+
+static void dir_remove(watch_t *watch, watch_dir_t *dir)
+{
+    watch_dir_t **link;
+
+    for (link = &watch->dirs[dir->wd % watch->dirs_buckets_cnt]; *link != dir; link = &(*link)->next)
+        ;
+    *link = dir->next;
+    --watch->dirs_cnt;
+    free(dir->path);
+    free(dir);
+}
+
+static watch_dir_t *dir_find(watch_t *watch, int32_t wd)
+{
+    watch_dir_t *dir;
+
+    if (wd < 0)
+        return NULL;
+    for (dir = watch->dirs[wd % watch->dirs_buckets_cnt]; dir && dir->wd != wd; dir = dir->next)
+        ;
+    return dir;
+}
+
+static int32_t set_init(watch_set_t *set)
+{
+    set->buckets_cnt = WATCH_MAX_CHANGES / 4 + 1;
+    set->cnt = 0;
+    if (!(set->buckets = (watch_path_t **) calloc(set->buckets_cnt, sizeof(watch_path_t *))))
+        return -1;
+    return 0;
+}
+
+static int32_t set_add(watch_set_t *set, const char *path)
+{
+    watch_path_t    *entry;
+    uint32_t        len = strlen(path);
+
+    if (set_find(set, path, len))
+        return 0;
+    if (!(entry = (watch_path_t *) malloc(sizeof(watch_path_t))) || !(entry->path = strdup(path))) {
+        ERROR("malloc", "", ERROR_OS);
+        free(entry);
+        return -1;
+    }
+    entry->hash = hash_path(path, len);
+    entry->next = set->buckets[entry->hash % set->buckets_cnt];
+    set->buckets[entry->hash % set->buckets_cnt] = entry;
+    ++set->cnt;
+    return 0;
+}
+
+static int8_t set_find(watch_set_t *set, const char *path, uint32_t len)
+{
+    watch_path_t    *entry;
+    uint32_t        hash = hash_path(path, len);
+
+    for (entry = set->buckets[hash % set->buckets_cnt]; entry; entry = entry->next)
+        if (entry->hash == hash && strncmp(entry->path, path, len) == 0 && entry->path[len] == '\0')
+            return 1;
+    return 0;
+}
+
+/** the paths of a set, but those below another one of it (sent, or removed, with it) */
+static char **set_list(watch_set_t *set, uint32_t *cnt)
+{
+    watch_path_t    *entry;
+    char            **list;
+    const char      *slash;
+    int8_t          covered;
+
+    if (!(list = (char **) malloc((set->cnt + 1) * sizeof(char *)))) {
+        ERROR("malloc", "", ERROR_OS);
+        return NULL;
+    }
+    *cnt = 0;
+    for (uint32_t i = 0; i < set->buckets_cnt; ++i) {
+        for (entry = set->buckets[i]; entry; entry = entry->next) {
+            covered = 0;
+            for (uint32_t len = strlen(entry->path); !covered && len; len = slash - entry->path) {
+                if (!(slash = (const char *) memrchr(entry->path, '/', len)))
+                    break;
+                covered = set_find(set, entry->path, slash - entry->path);
+            }
+            if (!covered)
+                list[(*cnt)++] = entry->path;
+        }
+    }
+    return list;
+}
+
+static void set_clear(watch_set_t *set)
+{
+    watch_path_t *entry;
+
+    for (uint32_t i = 0; set->buckets && i < set->buckets_cnt; ++i) {
+        while ( (entry = set->buckets[i]) ) {
+            set->buckets[i] = entry->next;
+            free(entry->path);
+            free(entry);
+        }
+    }
+    set->cnt = 0;
+}
+
+static char *path_concat(const char *dir, const char *name)
+{
+    char        *path;
+    uint32_t    dir_len = strlen(dir);
+    uint32_t    name_len = strlen(name);
+
+    if (!(path = (char *) malloc(dir_len + name_len + 2))) {
+        ERROR("malloc", "", ERROR_OS);
+        return NULL;
+    }
+    memcpy(path, dir, dir_len);
+    /* the paths of the root's entries have no leading '/' */
+    if (dir_len)
+        path[dir_len++] = '/';
+    memcpy(&path[dir_len], name, name_len + 1);
+    return path;
+}
+
+static uint32_t hash_path(const char *path, uint32_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    /* FNV-1a */
+    for (uint32_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char) path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static time_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+#undef WATCH_C
@@ -0,0 +1,77 @@
+/**
+ * @file watch_linux.h
+ * @brief The watched source trees header
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "data_types.h"
+#include "filter.h"
+
+#ifdef WATCH_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* WATCH_C */
+
+struct watch;
+
+/**
+ * Sends what changed below the root: the changed paths and the deleted ones,
+ * relative to the root, or the whole tree when changed is NULL. The sets are
+ * kept for the next time when it returns -1
+ */
+typedef int8_t (*watch_sync_t)(struct watch *watch, char **changed, uint32_t changed_cnt,
+                               char **deleted, uint32_t deleted_cnt);
+
+/** a path of a set, relative to the root */
+typedef struct watch_path {
+    char                *path;
+    uint32_t            hash;
+    struct watch_path   *next;          /* same bucket */
+} watch_path_t;
+
+/** the changed (or deleted) paths since the last sync */
+typedef struct {
+    watch_path_t        **buckets;
+    uint32_t            buckets_cnt;
+    uint32_t            cnt;
+} watch_set_t;
+
+/** a watched directory of the tree */
+typedef struct watch_dir {
+    int32_t             wd;
+    char                *path;          /* relative to the root, "" for the root */
+    struct watch_dir    *next;          /* same bucket */
+} watch_dir_t;
+
+/** a source tree sent again, in part, every WATCH_INTERVAL seconds */
+typedef struct watch {
+    char                *root;
+    int32_t             inotify_desc;
+    int32_t             stop_desc;      /* an eventfd waking up the thread */
+    watch_dir_t         **dirs;
+    uint32_t            dirs_buckets_cnt;
+    uint32_t            dirs_cnt;
+    watch_set_t         changed;
+    watch_set_t         deleted;
+    int8_t              rescan;         /* events were lost: the whole tree again */
+    int8_t              degraded;       /* out of watches: the whole tree every time */
+    const filter_t      *filter;        /* what is left out, not watched either */
+    uint64_t            syncs;
+    uint64_t            rescans;
+    watch_sync_t        sync;
+    void                *arg;
+    pthread_t           TID;
+} watch_t;
+
+/* watch functions */
+EXTERN watch_t *watch_start(const char *path, watch_sync_t sync, void *arg);
+EXTERN void    watch_stop(watch_t *watch);
+
+#undef EXTERN
+#endif /* WATCH_H */
@@ -0,0 +1,284 @@
+/**
+ * @file zerocopy_linux.c
+ * @brief The MSG_ZEROCOPY send path for the buffers built in user space: the
+ *        kernel sends from the pages of the buffer instead of copying them,
+ *        and tells on the socket error queue when it is done with them. Only
+ *        then the buffer goes back to the pool. The session packets and the
+ *        small files batches of the plain connections are sent from it. The
+ *        small payloads are copied, the page pinning and the notification
+ *        cost more than the copy there.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef UNIX
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif /* UNIX */
+
+#define ZEROCOPY_C
+#include "config.h"
+#include "data_types.h"
+#include "error.h"
+#include "zerocopy_linux.h"
+
+/* internal constants */
+#define ZEROCOPY_DRAIN_TIMEOUT  1000    /* ms waited for the completions of a pool destroyed */
+
+/* internal functions' prototypes */
+static void reap(zc_pool_t *zc, int timeout);
+static void complete(zc_pool_t *zc, uint32_t lo, uint32_t hi, int8_t copied);
+static void put_free(zc_pool_t *zc, zc_buffer_t *buffer);
+
+zc_pool_t *zerocopy_create(SOCKET sock_desc)
+{
+    zc_pool_t   *zc;
+    int         on = 1;
+
+    zc = (zc_pool_t *) calloc(1, sizeof(zc_pool_t));
+    if (!zc) {
+        ERROR("calloc", "", ERROR_OS);
+        return NULL;
+    }
+    zc->sock = sock_desc;
+    /* an older kernel has no SO_ZEROCOPY, every send is copied then */
+    zc->enabled = setsockopt(sock_desc, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+    errno = 0;
+    pthread_mutex_init(&zc->lock, NULL);
+    return zc;
+}
+
+zc_buffer_t *zerocopy_buffer(zc_pool_t *zc, uint32_t size)
+{
+    zc_buffer_t **link, **best = NULL;
+    zc_buffer_t *buffer = NULL;
+
+    pthread_mutex_lock(&zc->lock);
+    reap(zc, 0);
+    /* the smallest free buffer large enough */
+    for (link = &zc->free_list; *link; link = &(*link)->next)
+        if ((*link)->size >= size && (!best || (*link)->size < (*best)->size))
+            best = link;
+    if (best) {
+        buffer = *best;
+        *best = buffer->next;
+        zc->free_bytes -= buffer->size;
+    }
+    pthread_mutex_unlock(&zc->lock);
+
+    if (!buffer) {
+        if (!(buffer = (zc_buffer_t *) malloc(sizeof(zc_buffer_t))) ||
+            !(buffer->data = (char *) malloc(size ? size : 1))) {
+            ERROR("malloc", "", ERROR_OS);
+            free(buffer);
+            return NULL;
+        }
+        buffer->size = size;
+    }
+    buffer->len = 0;
+    buffer->pending = 0;
+    buffer->next = NULL;
+    return buffer;
+}
+
+int32_t zerocopy_send(zc_pool_t *zc, zc_buffer_t *buffer, int flags)
+{
+    struct iovec iov = { buffer->data, buffer->len };
+
+    return zerocopy_sendv(zc, buffer, &iov, 1, flags);
+}
+
+/**
+ * The iovecs sent at once, in the buffer or in pages the kernel pins (a
+ * mapped file): the buffer is held until the kernel is done with all of them
+ */
+int32_t zerocopy_sendv(zc_pool_t *zc, zc_buffer_t *buffer, struct iovec *iov, uint32_t iov_cnt, int flags)
+{
+    struct msghdr   msg;
+    uint64_t        total = 0;
+    ssize_t         sent;
+    int32_t         s = 0;
+    int8_t          zerocopy;
+
+    for (uint32_t i = 0; i < iov_cnt; ++i)
+        total += iov[i].iov_len;
+    zerocopy = zc->enabled && total >= ZEROCOPY_MIN_SIZE;
+
+    /* one sender per socket, the sequence numbers need no lock */
+    buffer->first_seq = zc->next_seq;
+    while (iov_cnt) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_cnt;
+        sent = sendmsg(zc->sock, &msg, flags | (zerocopy ? MSG_ZEROCOPY : 0));
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            /* no option memory left for one more notification, this one is copied */
+            if (errno == ENOBUFS && zerocopy) {
+                zerocopy = 0;
+                continue;
+            }
+            /* kernel TLS encrypts into its own pages, it takes no MSG_ZEROCOPY */
+            if (errno == EOPNOTSUPP && zerocopy) {
+                zerocopy = zc->enabled = 0;
+                continue;
+            }
+            ERROR("sendmsg", "", ERROR_OS);
+            s = -1;
+            break;
+        }
+        /* every successful zerocopy send gets the next number, partial ones too */
+        if (zerocopy) {
+            buffer->last_seq = zc->next_seq++;
+            ++buffer->pending;
+        }
+        /* skip what was sent, the rest goes with the next call */
+        for (; iov_cnt && (size_t) sent >= iov->iov_len; --iov_cnt, ++iov)
+            sent -= iov->iov_len;
+        if (iov_cnt) {
+            iov->iov_base = (char *) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+
+    pthread_mutex_lock(&zc->lock);
+    if (buffer->pending) {
+        ++zc->zerocopy_sends;
+        buffer->next = zc->pending;
+        zc->pending = buffer;
+    }
+    else {
+        ++zc->copy_sends;
+        put_free(zc, buffer);
+    }
+    pthread_mutex_unlock(&zc->lock);
+    return s;
+}
+
+void zerocopy_release(zc_pool_t *zc, zc_buffer_t *buffer)
+{
+    pthread_mutex_lock(&zc->lock);
+    put_free(zc, buffer);
+    pthread_mutex_unlock(&zc->lock);
+}
+
+void zerocopy_destroy(zc_pool_t *zc)
+{
+    zc_buffer_t *buffer;
+    uint32_t    leaked = 0;
+
+    if (!zc) return;
+
+    /* the kernel reads the pending buffers until it reports them, for a while */
+    pthread_mutex_lock(&zc->lock);
+    for (int32_t i = 0; zc->pending && i < ZEROCOPY_DRAIN_TIMEOUT / 10; ++i)
+        reap(zc, 10);
+    /* still not reported: left to the kernel, their pages must not be reused */
+    for (buffer = zc->pending; buffer; buffer = buffer->next)
+        ++leaked;
+    if (leaked)
+        ERROR("zerocopy_destroy", "buffers still sent by the kernel, not freed", ERROR_APP);
+    while ( (buffer = zc->free_list) ) {
+        zc->free_list = buffer->next;
+        free(buffer->data);
+        free(buffer);
+    }
+    pthread_mutex_unlock(&zc->lock);
+
+    if (zc->zerocopy_sends) {
+        fprintf(stdout, "zerocopy: %" PRIu64 " sends (%" PRIu64 " copied by the kernel), %" PRIu64 " copied sends\n",
+                zc->zerocopy_sends, zc->kernel_copies, zc->copy_sends);
+        fflush(stdout);
+    }
+    pthread_mutex_destroy(&zc->lock);
+    free(zc);
+}
+
+static void reap(zc_pool_t *zc, int timeout)
+{
+    char                        control[256];
+    struct msghdr               msg;
+    struct cmsghdr              *cmsg;
+    struct sock_extended_err    *serr;
+    struct pollfd               pfd;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(zc->sock, &msg, MSG_ERRQUEUE) == -1) {
+            /* the error queue signals itself with POLLERR */
+            if (errno == EAGAIN && timeout) {
+                pfd.fd = zc->sock;
+                pfd.events = 0;
+                if (poll(&pfd, 1, timeout) == 1 && (pfd.revents & POLLERR)) {
+                    timeout = 0;
+                    continue;
+                }
+            }
+            errno = 0;
+            return;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+                continue;
+            serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+            if (serr->ee_errno == 0 && serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+                complete(zc, serr->ee_info, serr->ee_data, serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+        }
+    }
+}
+
+static void complete(zc_pool_t *zc, uint32_t lo, uint32_t hi, int8_t copied)
+{
+    zc_buffer_t **link = &zc->pending;
+    zc_buffer_t *buffer;
+    uint32_t    from, to;
+
+    /* the completed sends [lo, hi], in any order, once each */
+    while ( (buffer = *link) ) {
+        from = lo > buffer->first_seq ? lo : buffer->first_seq;
+        to = hi < buffer->last_seq ? hi : buffer->last_seq;
+        if (from <= to)
+            buffer->pending -= to - from + 1;
+        if (buffer->pending == 0) {
+            *link = buffer->next;
+            put_free(zc, buffer);
+        }
+        else {
+            link = &buffer->next;
+        }
+    }
+    /* the device can not send from user pages (loopback...): the copy is ours then, it is cheaper */
+    zc->completions += hi - lo + 1;
+    if (copied)
+        zc->kernel_copies += hi - lo + 1;
+    if (zc->completions >= 32 && zc->kernel_copies * 2 > zc->completions)
+        zc->enabled = 0;
+}
+
+static void put_free(zc_pool_t *zc, zc_buffer_t *buffer)
+{
+    /* the pool keeps ZEROCOPY_POOL_SIZE bytes at most */
+    if (zc->free_bytes + buffer->size > ZEROCOPY_POOL_SIZE) {
+        free(buffer->data);
+        free(buffer);
+        return;
+    }
+    zc->free_bytes += buffer->size;
+    buffer->next = zc->free_list;
+    zc->free_list = buffer;
+}
+
+#undef ZEROCOPY_C
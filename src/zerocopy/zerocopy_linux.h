@@ -0,0 +1,57 @@
+/**
+ * @file zerocopy_linux.h
+ * @brief The MSG_ZEROCOPY send path header
+ */
+
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "data_types.h"
+
+#ifdef ZEROCOPY_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* ZEROCOPY_C */
+
+/** a buffer of the pool, the kernel may read it until its sends complete */
+typedef struct zc_buffer {
+    char                *data;
+    uint32_t            size;           /* capacity */
+    uint32_t            len;            /* bytes to send */
+    uint32_t            first_seq;      /* the zerocopy sends of the buffer */
+    uint32_t            last_seq;
+    uint32_t            pending;        /* of them not completed yet */
+    struct zc_buffer    *next;
+} zc_buffer_t;
+
+/** the zerocopy state of a socket and its buffer pool */
+typedef struct zc_pool {
+    SOCKET              sock;
+    int8_t              enabled;        /* SO_ZEROCOPY accepted, and worth it */
+    uint32_t            next_seq;       /* the kernel counts the zerocopy sends */
+    zc_buffer_t         *free_list;
+    zc_buffer_t         *pending;       /* sent, waiting for their completion */
+    uint64_t            free_bytes;
+    uint64_t            zerocopy_sends;
+    uint64_t            copy_sends;
+    uint64_t            completions;
+    uint64_t            kernel_copies;  /* completions the kernel had to copy anyway */
+    pthread_mutex_t     lock;
+} zc_pool_t;
+
+/* zerocopy functions */
+EXTERN zc_pool_t   *zerocopy_create(SOCKET sock_desc);
+EXTERN zc_buffer_t *zerocopy_buffer(zc_pool_t *zc, uint32_t size);
+EXTERN int32_t     zerocopy_send(zc_pool_t *zc, zc_buffer_t *buffer, int flags);
+EXTERN int32_t     zerocopy_sendv(zc_pool_t *zc, zc_buffer_t *buffer, struct iovec *iov, uint32_t iov_cnt,
+                                  int flags);
+EXTERN void        zerocopy_release(zc_pool_t *zc, zc_buffer_t *buffer);
+EXTERN void        zerocopy_destroy(zc_pool_t *zc);
+
+#undef EXTERN
+#endif /* ZEROCOPY_H */
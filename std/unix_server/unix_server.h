@@ -0,0 +1,42 @@
+/**
+ * @file unix_server.h
+ * @brief The Unix domain socket server header
+ */
+
+#ifndef UNIX_SERVER_H
+#define UNIX_SERVER_H
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#ifdef UNIX_SERVER_C
+#define EXTERN
+#else
+#define EXTERN extern
+#endif /* UNIX_SERVER_C */
+
+/** who connected, as the kernel tells it (-1 where it can't) */
+typedef struct {
+    pid_t               pid;
+    uid_t               uid;
+    gid_t               gid;
+} unix_server_client_t;
+
+typedef struct {
+    int32_t             socket;
+    void                *callback_on_accept;
+    int8_t              listening;
+    char                path[108];      /* sizeof(sun_path) */
+    pthread_t           listen_TID;
+} unix_server_t;
+
+/* functions */
+EXTERN unix_server_t* unix_server_create(const char *path);
+EXTERN int32_t unix_server_listen(unix_server_t* server, void* callback);
+EXTERN int32_t unix_server_destroy(unix_server_t* server);
+
+#undef EXTERN
+#endif /* UNIX_SERVER_H */
@@ -0,0 +1,156 @@
+/**
+ * @file unix_server_unix.c
+ * @brief The implementation file of the Unix domain socket server: the
+ *        processes of this host connect to a path instead of a port, and
+ *        the callback learns who they are
+ */
+
+#define _GNU_SOURCE
+#define UNIX_SERVER_C
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "unix_server.h"
+#include "error.h"
+
+/* internal functions prototypes */
+static void    thread_accept_connections(unix_server_t* server);
+
+unix_server_t* unix_server_create(const char *path)
+{
+    unix_server_t       *ret_server = NULL;
+    struct sockaddr_un  addr;
+    struct stat         stat_buf;
+    int32_t             socketfd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        ERROR("unix_server_create", path, ERROR_OS);
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    /* the socket left by a previous run, nothing else is removed */
+    if (lstat(path, &stat_buf) == 0 && S_ISSOCK(stat_buf.st_mode) && unlink(path) == -1) {
+        ERROR("unlink", path, ERROR_OS);
+        return NULL;
+    }
+    socketfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (socketfd == -1) {
+        ERROR("socket", path, ERROR_OS);
+        return NULL;
+    }
+    if (bind(socketfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        ERROR("bind", path, ERROR_OS);
+        close(socketfd);
+        return NULL;
+    }
+    ret_server = (unix_server_t*) malloc(sizeof(unix_server_t));
+    if (!ret_server) {
+        ERROR("malloc", "", ERROR_OS);
+        close(socketfd);
+        unlink(path);
+        return NULL;
+    }
+
+    ret_server->socket = socketfd;
+    ret_server->callback_on_accept = NULL;
+    ret_server->listening = 0;
+    strcpy(ret_server->path, path);
+
+    return ret_server;
+}
+
+/** The callback gets a malloc()ed socket and client, both freed by it */
+int32_t unix_server_listen(unix_server_t* server, void* callback)
+{
+    int32_t s;
+
+    if (server->listening)
+        return 0;
+    if (listen(server->socket, SOMAXCONN) == -1) {
+        ERROR("listen", server->path, ERROR_OS);
+        return -1;
+    }
+    server->callback_on_accept = callback;
+    s = pthread_create(&(server->listen_TID), NULL, (void*)&thread_accept_connections, server);
+    if (s != 0) {
+        errno = s;
+        ERROR("pthread_create", "", ERROR_OS);
+        return -1;
+    }
+    server->listening = 1;
+    return 0;
+}
+
+int32_t unix_server_destroy(unix_server_t* server)
+{
+    if (server->listening) {
+        pthread_cancel(server->listen_TID);
+        pthread_join(server->listen_TID, NULL);
+    }
+    close(server->socket);
+    unlink(server->path);
+    free(server);
+    return 0;
+}
+
+static void thread_accept_connections(unix_server_t* server)
+{
+    int32_t s;
+
+    /* Enable a cancelation request */
+    s = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    if (s != 0) {
+        errno = s;
+        ERROR("pthread_setcancelstate", "", ERROR_OS);
+        pthread_exit(NULL);
+    }
+    while (1) {
+        int32_t sock;
+        /* accept(3) is a cancelation point */
+        sock = accept4(server->socket, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0) {
+            ERROR("accept", server->path, ERROR_OS);
+            pthread_exit(NULL);
+        }
+        int32_t *client_socket = (int32_t*) malloc(sizeof(int32_t));
+        unix_server_client_t *client = (unix_server_client_t *) malloc(sizeof(unix_server_client_t));
+        if (!client_socket || !client) {
+            ERROR("malloc", "", ERROR_OS);
+            close(sock);
+            free(client_socket);
+            free(client);
+            pthread_exit(NULL);
+        }
+        client->pid = -1;
+        client->uid = -1;
+        client->gid = -1;
+#ifdef LINUX
+        {
+            struct ucred    cred;
+            socklen_t       len = sizeof(cred);
+
+            if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+                client->pid = cred.pid;
+                client->uid = cred.uid;
+                client->gid = cred.gid;
+            }
+        }
+#endif /* LINUX */
+        *client_socket = sock;
+        /* call the server's callback */
+        ((void(*)())server->callback_on_accept)(client_socket, client);
+    }
+}
+
+#undef UNIX_SERVER_C
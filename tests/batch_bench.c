@@ -0,0 +1,281 @@
+/**
+ * @file batch_bench.c
+ * @brief The cost of sending a tree of small files, one engine per file size:
+ *        the sendfile() sequence of send_file() (open, fstat, packets, cork,
+ *        sendfile, uncork, close) against the batches of send_batch.c, with
+ *        the data read by pread() or mapped, several files per writev(). It
+ *        gives the SEND_BATCH_MAX_FILE and SEND_BATCH_MMAP_MIN thresholds.
+ *
+ *        gcc -O2 -pthread batch_bench.c -o batch_bench
+ *        ./batch_bench [directory] [total MiB]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define HEADER_SIZE     8               /* size and flags, as send_packet() */
+#define BATCH_SIZE      (1024 * 1024)
+#define BATCH_IOV       64
+#define MAX_FILES       4096
+#define MAX_FILE_SIZE   (4 * 1024 * 1024)
+
+typedef enum {
+    ENGINE_SENDFILE,
+    ENGINE_PREAD,
+    ENGINE_MMAP
+} engine_t;
+
+static const char *engine_names[] = { "sendfile", "pread+writev", "mmap+writev" };
+
+typedef struct {
+    char            buf[BATCH_SIZE + MAX_FILE_SIZE + 8192];   /* a batch, and a file past it */
+    uint32_t        buf_len;
+    struct iovec    iov[BATCH_IOV];
+    uint32_t        iov_cnt;
+    void            *maps[BATCH_IOV];
+    size_t          maps_len[BATCH_IOV];
+    uint32_t        maps_cnt;
+    uint64_t        bytes;
+} batch_t;
+
+static int send_tree(int sock, const char *dir, int files, size_t size, engine_t engine);
+static int send_one(int sock, const char *path, engine_t engine, batch_t *batch);
+static int flush(int sock, batch_t *batch);
+static void add_buf(batch_t *batch, const void *data, size_t len);
+static void *drain(void *arg);
+static int make_files(const char *dir, int files, size_t size);
+static int connect_pair(int *tx_sock, int *rx_sock);
+static double now(void);
+
+int main(int argc, char *argv[])
+{
+    const char  *dir = argc > 1 ? argv[1] : "/tmp/batch_bench";
+    uint64_t    total = (argc > 2 ? atoi(argv[2]) : 64) * 1024ULL * 1024;
+    size_t      sizes[] = { 1024, 4096, 16384, 32768, 65536, 262144, 1048576, MAX_FILE_SIZE };
+
+    mkdir(dir, 0777);
+    fprintf(stdout, "%10s %8s", "file size", "files");
+    for (engine_t engine = ENGINE_SENDFILE; engine <= ENGINE_MMAP; ++engine)
+        fprintf(stdout, " %22s", engine_names[engine]);
+    fprintf(stdout, "\n");
+
+    for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        int files = total / sizes[i] < MAX_FILES ? total / sizes[i] : MAX_FILES;
+
+        if (make_files(dir, files, sizes[i]) == -1)
+            return 1;
+        fprintf(stdout, "%10zu %8d", sizes[i], files);
+        for (engine_t engine = ENGINE_SENDFILE; engine <= ENGINE_MMAP; ++engine) {
+            int         tx_sock, rx_sock;
+            pthread_t   thread;
+            double      start, elapsed;
+
+            if (connect_pair(&tx_sock, &rx_sock) == -1)
+                return 1;
+            pthread_create(&thread, NULL, &drain, &rx_sock);
+            /* once to warm the caches, then measured */
+            send_tree(tx_sock, dir, files, sizes[i], engine);
+            start = now();
+            if (send_tree(tx_sock, dir, files, sizes[i], engine) == -1)
+                return 1;
+            elapsed = now() - start;
+            shutdown(tx_sock, SHUT_WR);
+            pthread_join(thread, NULL);
+            fprintf(stdout, " %9.0f f/s %7.0f MB/s", files / elapsed, files * sizes[i] / elapsed / 1e6);
+            close(tx_sock);
+            close(rx_sock);
+        }
+        fprintf(stdout, "\n");
+        fflush(stdout);
+    }
+    return 0;
+}
+
+static int send_tree(int sock, const char *dir, int files, size_t size, engine_t engine)
+{
+    static batch_t  batch;
+    char            path[4096];
+
+    for (int i = 0; i < files; ++i) {
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        if (send_one(sock, path, engine, &batch) == -1)
+            return -1;
+    }
+    return engine == ENGINE_SENDFILE ? 0 : flush(sock, &batch);
+}
+
+static int send_one(int sock, const char *path, engine_t engine, batch_t *batch)
+{
+    char        header[HEADER_SIZE] = { 0 };
+    struct stat st;
+    int         file;
+    int         on = 1, off = 0;
+    off_t       offset = 0;
+    void        *map;
+
+    if ((file = open(path, O_RDONLY|O_CLOEXEC)) == -1 || fstat(file, &st) == -1) {
+        perror(path);
+        return -1;
+    }
+    if (engine == ENGINE_SENDFILE) {
+        /* the path packet, the size packet, then the data corked */
+        send(sock, header, sizeof(header), 0);
+        send(sock, path, strlen(path), 0);
+        send(sock, header, sizeof(header), 0);
+        send(sock, &st.st_size, sizeof(st.st_size), 0);
+        setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+        while (offset < st.st_size)
+            if (sendfile(sock, file, &offset, st.st_size - offset) <= 0)
+                return -1;
+        setsockopt(sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        close(file);
+        return 0;
+    }
+
+    if (batch->bytes + HEADER_SIZE * 2 + strlen(path) + st.st_size > BATCH_SIZE ||
+        batch->iov_cnt + 2 > BATCH_IOV)
+        if (flush(sock, batch) == -1)
+            return -1;
+    add_buf(batch, header, sizeof(header));
+    add_buf(batch, path, strlen(path));
+    add_buf(batch, header, sizeof(header));
+    add_buf(batch, &st.st_size, sizeof(st.st_size));
+    if (engine == ENGINE_PREAD) {
+        if (pread(file, &batch->buf[batch->buf_len], st.st_size, 0) != st.st_size)
+            return -1;
+        batch->buf_len += st.st_size;
+        batch->iov[batch->iov_cnt - 1].iov_len += st.st_size;
+    }
+    else {
+        if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, file, 0)) == MAP_FAILED)
+            return -1;
+        batch->maps[batch->maps_cnt] = map;
+        batch->maps_len[batch->maps_cnt++] = st.st_size;
+        batch->iov[batch->iov_cnt].iov_base = map;
+        batch->iov[batch->iov_cnt++].iov_len = st.st_size;
+    }
+    batch->bytes += st.st_size;
+    close(file);
+    return 0;
+}
+
+static void add_buf(batch_t *batch, const void *data, size_t len)
+{
+    struct iovec *last = batch->iov_cnt ? &batch->iov[batch->iov_cnt - 1] : NULL;
+
+    memcpy(&batch->buf[batch->buf_len], data, len);
+    if (last && (char *) last->iov_base + last->iov_len == &batch->buf[batch->buf_len]) {
+        last->iov_len += len;
+    }
+    else {
+        batch->iov[batch->iov_cnt].iov_base = &batch->buf[batch->buf_len];
+        batch->iov[batch->iov_cnt++].iov_len = len;
+    }
+    batch->buf_len += len;
+    batch->bytes += len;
+}
+
+static int flush(int sock, batch_t *batch)
+{
+    struct iovec    *iov = batch->iov;
+    uint32_t        cnt = batch->iov_cnt;
+    ssize_t         sent;
+
+    while (cnt) {
+        if ((sent = writev(sock, iov, cnt)) == -1) {
+            perror("writev");
+            return -1;
+        }
+        for (; cnt && (size_t) sent >= iov->iov_len; --cnt, ++iov)
+            sent -= iov->iov_len;
+        if (cnt) {
+            iov->iov_base = (char *) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    for (uint32_t i = 0; i < batch->maps_cnt; ++i)
+        munmap(batch->maps[i], batch->maps_len[i]);
+    batch->maps_cnt = batch->iov_cnt = batch->buf_len = 0;
+    batch->bytes = 0;
+    return 0;
+}
+
+static void *drain(void *arg)
+{
+    int     sock = *(int *) arg;
+    char    *buf = malloc(1024 * 1024);
+
+    while (read(sock, buf, 1024 * 1024) > 0)
+        ;
+    free(buf);
+    return NULL;
+}
+
+static int make_files(const char *dir, int files, size_t size)
+{
+    char    path[4096];
+    char    *data = malloc(size);
+    int     file;
+
+    memset(data, 'x', size);
+    for (int i = 0; i < files; ++i) {
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        if ((file = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1 ||
+            write(file, data, size) != (ssize_t) size) {
+            perror(path);
+            free(data);
+            return -1;
+        }
+        close(file);
+    }
+    free(data);
+    return 0;
+}
+
+static int connect_pair(int *tx_sock, int *rx_sock)
+{
+    struct sockaddr_in  addr;
+    socklen_t           len = sizeof(addr);
+    int                 listener;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+        bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(listener, 1) == -1 ||
+        getsockname(listener, (struct sockaddr *) &addr, &len) == -1 ||
+        (*tx_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+        connect(*tx_sock, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        (*rx_sock = accept(listener, NULL, NULL)) == -1) {
+        perror("loopback connection");
+        return -1;
+    }
+    close(listener);
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,412 @@
+/**
+ * @file micro_bench.c
+ * @brief The building blocks measured alone, against the objects of the
+ *        library: send_packet()/recv_packet() round trips over a socketpair,
+ *        a file chunk to a loopback socket by read()/write(), sendfile() and
+ *        splice() through a pipe of the pipe pool, and the split_string()
+ *        parsing of the commands of user_thread.o. Each case is warmed up,
+ *        then run several times with as many operations as fill a run; the
+ *        ns/op (min, median, max of the runs) and the allocations/op go out
+ *        as JSON.
+ *
+ *        make bench
+ *        bin/linux/micro_bench [-w warm-up ms] [-t run ms] [-r runs] [case prefix...]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "data_types.h"
+#include "pipe_pool_linux.h"
+#include "user_thread.h"
+
+#define MAX_RUNS        64
+#define FILE_SIZE       (64 * 1024 * 1024)
+#define DRAIN_SIZE      (1024 * 1024)
+#define COMMAND         "send /home/dpredusel/projects/file_transfer/src 192.168.100.12 bulk"
+
+typedef enum {
+    COPY_READ_WRITE,
+    COPY_SENDFILE,
+    COPY_SPLICE
+} copy_t;
+
+typedef struct bench {
+    char        name[64];
+    int         (*setup)(struct bench *bench);
+    void        (*run)(struct bench *bench, uint64_t ops);
+    void        (*teardown)(struct bench *bench);
+    uint32_t    size;                   /* the packet or the chunk size */
+    copy_t      copy;
+    uint64_t    bytes_per_op;
+} bench_t;
+
+/* the allocations of the measured code, the linker sends malloc() & co here */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t cnt, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t cnt, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+static int      packet_setup(bench_t *bench);
+static void     packet_run(bench_t *bench, uint64_t ops);
+static void     packet_teardown(bench_t *bench);
+static int      copy_setup(bench_t *bench);
+static void     copy_run(bench_t *bench, uint64_t ops);
+static void     copy_teardown(bench_t *bench);
+static void     split_run(bench_t *bench, uint64_t ops);
+static int      measure(bench_t *bench, uint32_t warmup_ms, uint32_t run_ms, uint32_t runs, int first);
+static void     *drain(void *arg);
+static int      connect_pair(int *tx_sock, int *rx_sock);
+static uint64_t now_ns(void);
+static int      compare_u64(const void *a, const void *b);
+
+static volatile uint64_t allocs;
+static int          socks[2] = { -1, -1 };
+static int          file_desc = -1;
+static off_t        file_off;
+static char         *buf;
+static pthread_t    drainer;
+static pipe_pool_t  *pool;
+static splice_pipe_t *pipe_;
+
+int main(int argc, char *argv[])
+{
+    static const uint32_t   packet_sizes[] = { 0, 64, 1024, 16384, 65536 };
+    static const uint32_t   chunk_sizes[] = { 4096, 65536, 1048576 };
+    static const char       *copy_names[] = { "read_write", "sendfile", "splice" };
+    bench_t                 benches[32];
+    uint32_t                cnt = 0;
+    uint32_t                warmup_ms = 200, run_ms = 200, runs = 5;
+    int                     opt, first = 1;
+
+    while ((opt = getopt(argc, argv, "w:t:r:")) != -1) {
+        switch (opt) {
+        case 'w': warmup_ms = atoi(optarg); break;
+        case 't': run_ms = atoi(optarg) ? atoi(optarg) : 1; break;
+        case 'r': runs = atoi(optarg) < 1 ? 1 : atoi(optarg) > MAX_RUNS ? MAX_RUNS : atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-w warm-up ms] [-t run ms] [-r runs] [case prefix...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    memset(benches, 0, sizeof(benches));
+    for (uint32_t i = 0; i < sizeof(packet_sizes) / sizeof(packet_sizes[0]); ++i, ++cnt) {
+        snprintf(benches[cnt].name, sizeof(benches[cnt].name), "packet_roundtrip/%u", packet_sizes[i]);
+        benches[cnt].setup = &packet_setup;
+        benches[cnt].run = &packet_run;
+        benches[cnt].teardown = &packet_teardown;
+        benches[cnt].size = packet_sizes[i];
+        benches[cnt].bytes_per_op = NET_PACKET_HEADER_SIZE + packet_sizes[i];
+    }
+    for (copy_t copy = COPY_READ_WRITE; copy <= COPY_SPLICE; ++copy) {
+        for (uint32_t i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); ++i, ++cnt) {
+            snprintf(benches[cnt].name, sizeof(benches[cnt].name), "copy/%s/%u", copy_names[copy], chunk_sizes[i]);
+            benches[cnt].setup = &copy_setup;
+            benches[cnt].run = &copy_run;
+            benches[cnt].teardown = &copy_teardown;
+            benches[cnt].size = chunk_sizes[i];
+            benches[cnt].copy = copy;
+            benches[cnt].bytes_per_op = chunk_sizes[i];
+        }
+    }
+    snprintf(benches[cnt].name, sizeof(benches[cnt].name), "split_string");
+    benches[cnt].run = &split_run;
+    benches[cnt].bytes_per_op = strlen(COMMAND);
+    ++cnt;
+
+    fprintf(stdout, "{\n  \"warmup_ms\": %u,\n  \"run_ms\": %u,\n  \"runs\": %u,\n  \"benchmarks\": [",
+            warmup_ms, run_ms, runs);
+    for (uint32_t i = 0; i < cnt; ++i) {
+        int selected = optind == argc;
+
+        for (int j = optind; j < argc; ++j)
+            if (strncmp(benches[i].name, argv[j], strlen(argv[j])) == 0)
+                selected = 1;
+        if (!selected)
+            continue;
+        if (benches[i].setup && benches[i].setup(&benches[i]) == -1)
+            return 1;
+        measure(&benches[i], warmup_ms, run_ms, runs, first);
+        first = 0;
+        if (benches[i].teardown)
+            benches[i].teardown(&benches[i]);
+    }
+    fprintf(stdout, "\n  ]\n}\n");
+    return 0;
+}
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t cnt, size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(cnt, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+/** the warm-up gives the ops of a run, the runs are then timed one by one */
+static int measure(bench_t *bench, uint32_t warmup_ms, uint32_t run_ms, uint32_t runs, int first)
+{
+    uint64_t    ns[MAX_RUNS];
+    uint64_t    ops = 1;
+    uint64_t    warmed_ops;
+    uint64_t    start, elapsed, total = 0;
+    uint64_t    allocs_cnt;
+
+    start = now_ns();
+    do {
+        uint64_t batch_start = now_ns();
+
+        bench->run(bench, ops);
+        elapsed = now_ns() - batch_start;
+        warmed_ops = ops;
+        ops *= 2;
+    } while (now_ns() - start < warmup_ms * 1000000ULL);
+    ops = (uint64_t) ((double) run_ms * 1000000.0 * warmed_ops / (elapsed ? elapsed : 1));
+    if (!ops)
+        ops = 1;
+
+    allocs_cnt = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < runs; ++i) {
+        start = now_ns();
+        bench->run(bench, ops);
+        ns[i] = now_ns() - start;
+        total += ns[i];
+    }
+    allocs_cnt = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - allocs_cnt;
+    qsort(ns, runs, sizeof(ns[0]), &compare_u64);
+
+    fprintf(stdout, "%s\n    {\"name\": \"%s\", \"ops_per_run\": %" PRIu64 ", "
+            "\"ns_per_op\": {\"min\": %.1f, \"median\": %.1f, \"max\": %.1f}, "
+            "\"allocs_per_op\": %.2f, \"bytes_per_op\": %" PRIu64 ", \"mb_per_s\": %.1f}",
+            first ? "" : ",", bench->name, ops,
+            (double) ns[0] / ops, (double) ns[runs / 2] / ops, (double) ns[runs - 1] / ops,
+            (double) allocs_cnt / ((double) ops * runs), bench->bytes_per_op,
+            (double) bench->bytes_per_op * ops * runs * 1000.0 / total);
+    fflush(stdout);
+    return 0;
+}
+
+static int packet_setup(bench_t *bench)
+{
+    int size = 4 * 1024 * 1024;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    /* a whole packet fits, the round trip does not need another thread */
+    setsockopt(socks[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(socks[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    buf = (char *) __real_calloc(1, bench->size + 1);
+    return 0;
+}
+
+static void packet_run(bench_t *bench, uint64_t ops)
+{
+    net_packet_t *packet;
+
+    for (uint64_t i = 0; i < ops; ++i) {
+        if (send_packet(socks[0], buf, bench->size, START_TRANSFER) == -1 ||
+            !(packet = recv_packet(socks[1], 0))) {
+            exit(1);
+        }
+        destroy_packet(packet);
+    }
+}
+
+static void packet_teardown(bench_t *bench)
+{
+    close(socks[0]);
+    close(socks[1]);
+    free(buf);
+}
+
+static int copy_setup(bench_t *bench)
+{
+    char path[] = "/tmp/micro_bench.XXXXXX";
+
+    if ((file_desc = mkstemp(path)) == -1) {
+        perror(path);
+        return -1;
+    }
+    unlink(path);
+    buf = (char *) __real_malloc(DRAIN_SIZE);
+    memset(buf, 'x', DRAIN_SIZE);
+    /* written once, read from the page cache afterwards */
+    for (uint32_t i = 0; i < FILE_SIZE / DRAIN_SIZE; ++i)
+        if (write(file_desc, buf, DRAIN_SIZE) != DRAIN_SIZE) {
+            perror("write");
+            return -1;
+        }
+    file_off = 0;
+    if (connect_pair(&socks[0], &socks[1]) == -1)
+        return -1;
+    pthread_create(&drainer, NULL, &drain, &socks[1]);
+    if (bench->copy == COPY_SPLICE) {
+        pool = pipe_pool_create(1);
+        if (!pool || !(pipe_ = pipe_pool_get(pool)))
+            return -1;
+    }
+    return 0;
+}
+
+static void copy_run(bench_t *bench, uint64_t ops)
+{
+    ssize_t s = 0;
+    size_t  done;
+    loff_t  off;
+
+    for (uint64_t i = 0; i < ops; ++i) {
+        if (file_off + bench->size > FILE_SIZE)
+            file_off = 0;
+        switch (bench->copy) {
+        case COPY_READ_WRITE:
+            s = pread(file_desc, buf, bench->size, file_off);
+            for (done = 0; s > 0 && done < (size_t) s;) {
+                ssize_t written = write(socks[0], &buf[done], s - done);
+
+                if (written == -1) {
+                    s = -1;
+                    break;
+                }
+                done += written;
+            }
+            break;
+        case COPY_SENDFILE:
+            off = file_off;
+            for (done = 0; done < bench->size; done += s)
+                if ((s = sendfile(socks[0], file_desc, &off, bench->size - done)) <= 0)
+                    break;
+            break;
+        case COPY_SPLICE:
+            /* through the pipe at most its capacity at a time, as the receiving side does */
+            off = file_off;
+            for (done = 0; done < bench->size;) {
+                size_t want = bench->size - done < pipe_->size ? bench->size - done : pipe_->size;
+                ssize_t in = splice(file_desc, &off, pipe_->fd[1], NULL, want, SPLICE_F_MOVE);
+
+                if ((s = in) <= 0)
+                    break;
+                while (in > 0) {
+                    if ((s = splice(pipe_->fd[0], NULL, socks[0], NULL, in, SPLICE_F_MOVE|SPLICE_F_MORE)) <= 0)
+                        break;
+                    in -= s;
+                    done += s;
+                }
+                if (s <= 0)
+                    break;
+            }
+            break;
+        }
+        if (s <= 0) {
+            perror(bench->name);
+            exit(1);
+        }
+        file_off += bench->size;
+    }
+}
+
+static void copy_teardown(bench_t *bench)
+{
+    shutdown(socks[0], SHUT_WR);
+    pthread_join(drainer, NULL);
+    close(socks[0]);
+    close(socks[1]);
+    close(file_desc);
+    if (pool) {
+        pipe_pool_put(pool, pipe_, 1);
+        pipe_pool_destroy(pool);
+        pool = NULL;
+    }
+    free(buf);
+}
+
+static void split_run(bench_t *bench, uint64_t ops)
+{
+    char    command[sizeof(COMMAND)];
+    char    **tokens;
+    int32_t cnt;
+
+    for (uint64_t i = 0; i < ops; ++i) {
+        memcpy(command, COMMAND, sizeof(command));
+        tokens = split_string(command, &cnt, ' ');
+        if (cnt != 4)
+            exit(1);
+        free(tokens);
+    }
+}
+
+static void *drain(void *arg)
+{
+    int     sock = *(int *) arg;
+    char    *data = __real_malloc(DRAIN_SIZE);
+
+    while (read(sock, data, DRAIN_SIZE) > 0)
+        ;
+    free(data);
+    return NULL;
+}
+
+static int connect_pair(int *tx_sock, int *rx_sock)
+{
+    struct sockaddr_in  addr;
+    socklen_t           len = sizeof(addr);
+    int                 listener;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+        bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(listener, 1) == -1 ||
+        getsockname(listener, (struct sockaddr *) &addr, &len) == -1 ||
+        (*tx_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+        connect(*tx_sock, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        (*rx_sock = accept(listener, NULL, NULL)) == -1) {
+        perror("loopback connection");
+        return -1;
+    }
+    close(listener);
+    return 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}